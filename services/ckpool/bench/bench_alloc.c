@@ -0,0 +1,499 @@
+/*
+ * bench_alloc.c — Allocator benchmark: memory_pool vs malloc implementations
+ * THE BITCOIN GAME — GPLv3
+ *
+ * Compares memory_pool_t (plain and POOL_F_HARDENED) against glibc malloc
+ * and, when their shared libraries are installed, jemalloc and tcmalloc
+ * (loaded with dlopen, so nothing extra is needed at build time).
+ *
+ * Each run is one allocator x pattern x item size x thread count:
+ *
+ *   lifo   Allocate a batch, free it in reverse (stack-like reuse).
+ *   fifo   Keep a window of live items and free the oldest (queue-like,
+ *          the way shares and events age out).
+ *   cross  Every item is freed by the next thread over (items handed
+ *          between the stratifier and the event flusher).
+ *
+ * Item sizes default to share_pool (256 B) and event_pool (4096 B). Each
+ * run executes in a forked child so RSS growth is measured from a clean
+ * heap and one allocator cannot warm up another.
+ *
+ * Build and run:
+ *   make && ./bench_alloc
+ *   ./bench_alloc -a pool,glibc -p cross -s 256 -t 1,8,64 -n 4000000
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <getopt.h>
+#include <sys/wait.h>
+
+/* memory_pool.c only needs ckpool's LOG* macros (see ../test/shim/) and
+ * the canary seed from tbg_clock.c */
+#include "../src/memory_pool.c"
+#include "../src/tbg_clock.c"
+
+#define BENCH_MAX_THREADS   64
+#define BENCH_BATCH         64      /* lifo batch, fifo window */
+#define BENCH_RING_SIZE     1024    /* cross-thread handoff ring (power of 2) */
+#define BENCH_DEFAULT_OPS   2000000 /* alloc/free pairs per run, all threads */
+
+/* ── Allocators ──────────────────────────────────────────────────── */
+
+typedef struct allocator {
+	const char *name;
+	const char *const *libs;    /* dlopen candidates, NULL = built in */
+	unsigned int pool_flags;    /* memory_pool only */
+	bool is_pool;
+	void *(*malloc_fn)(size_t);
+	void (*free_fn)(void *);
+} allocator_t;
+
+static const char *const jemalloc_libs[] = {
+	"libjemalloc.so.2", "libjemalloc.so", NULL
+};
+static const char *const tcmalloc_libs[] = {
+	"libtcmalloc_minimal.so.4", "libtcmalloc.so.4",
+	"libtcmalloc_minimal.so", "libtcmalloc.so", NULL
+};
+
+static allocator_t allocators[] = {
+	{ .name = "pool", .is_pool = true },
+	{ .name = "pool_hardened", .is_pool = true, .pool_flags = POOL_F_HARDENED },
+	{ .name = "glibc", .malloc_fn = malloc, .free_fn = free },
+	{ .name = "jemalloc", .libs = jemalloc_libs },
+	{ .name = "tcmalloc", .libs = tcmalloc_libs },
+};
+
+#define NUM_ALLOCATORS (int)(sizeof(allocators) / sizeof(allocators[0]))
+
+/*
+ * Resolve malloc/free from a dlopen'd allocator. dlsym on the handle
+ * searches that library first, so this gets its own entry points even
+ * though glibc's are already bound in the process.
+ */
+static bool allocator_load(allocator_t *a)
+{
+	int i;
+
+	if (!a->libs || a->malloc_fn)
+		return true;
+
+	for (i = 0; a->libs[i]; i++) {
+		void *h = dlopen(a->libs[i], RTLD_NOW | RTLD_LOCAL);
+
+		if (!h)
+			continue;
+		a->malloc_fn = (void *(*)(size_t))dlsym(h, "malloc");
+		a->free_fn = (void (*)(void *))dlsym(h, "free");
+		if (a->malloc_fn && a->free_fn)
+			return true;
+		a->malloc_fn = NULL;
+		a->free_fn = NULL;
+		dlclose(h);
+	}
+	return false;
+}
+
+/* Shared by the worker threads of one run */
+static const allocator_t *cur;
+static memory_pool_t bench_pool;
+static size_t item_size;
+
+static void *bench_alloc(void)
+{
+	void *p = cur->is_pool ? tbg_pool_alloc(&bench_pool)
+	                       : cur->malloc_fn(item_size);
+
+	/* Touch the first line, as a caller initializing the struct would */
+	if (p)
+		memset(p, 0x5a, item_size < 64 ? item_size : 64);
+	return p;
+}
+
+static void bench_free(void *p)
+{
+	if (cur->is_pool)
+		tbg_pool_free(&bench_pool, p);
+	else
+		cur->free_fn(p);
+}
+
+/* ── Patterns ────────────────────────────────────────────────────── */
+
+typedef enum { PAT_LIFO, PAT_FIFO, PAT_CROSS, PAT_COUNT } pattern_t;
+
+static const char *const pattern_names[PAT_COUNT] = { "lifo", "fifo", "cross" };
+
+/* Single-producer single-consumer ring from thread i to thread i + 1 */
+typedef struct handoff {
+	void *slots[BENCH_RING_SIZE];
+	_Atomic unsigned int head __attribute__((aligned(64)));
+	_Atomic unsigned int tail __attribute__((aligned(64)));
+	_Atomic bool producer_done;
+} handoff_t;
+
+typedef struct worker {
+	pthread_t thread;
+	long ops;
+	pattern_t pattern;
+	handoff_t *out;             /* Items this thread hands on */
+	handoff_t *in;              /* Items this thread frees for its neighbour */
+} worker_t;
+
+static pthread_barrier_t start_barrier;
+
+static bool ring_push(handoff_t *r, void *p)
+{
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+	if (head - atomic_load_explicit(&r->tail, memory_order_acquire) >=
+	    BENCH_RING_SIZE)
+		return false;
+	r->slots[head & (BENCH_RING_SIZE - 1)] = p;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return true;
+}
+
+static void *ring_pop(handoff_t *r)
+{
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	void *p;
+
+	if (tail == atomic_load_explicit(&r->head, memory_order_acquire))
+		return NULL;
+	p = r->slots[tail & (BENCH_RING_SIZE - 1)];
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	return p;
+}
+
+static void run_lifo(worker_t *w)
+{
+	void *batch[BENCH_BATCH];
+	long done = 0;
+	int i;
+
+	while (done < w->ops) {
+		int n = w->ops - done < BENCH_BATCH ? (int)(w->ops - done)
+		                                    : BENCH_BATCH;
+
+		for (i = 0; i < n; i++)
+			batch[i] = bench_alloc();
+		for (i = n - 1; i >= 0; i--)
+			bench_free(batch[i]);
+		done += n;
+	}
+}
+
+static void run_fifo(worker_t *w)
+{
+	void *window[BENCH_BATCH] = {0};
+	long i;
+
+	for (i = 0; i < w->ops; i++) {
+		int slot = (int)(i % BENCH_BATCH);
+
+		if (window[slot])
+			bench_free(window[slot]);
+		window[slot] = bench_alloc();
+	}
+	for (i = 0; i < BENCH_BATCH; i++) {
+		if (window[i])
+			bench_free(window[i]);
+	}
+}
+
+/* Free whatever the previous thread has handed over so far */
+static void drain(handoff_t *in)
+{
+	void *p;
+
+	while ((p = ring_pop(in)))
+		bench_free(p);
+}
+
+static void run_cross(worker_t *w)
+{
+	long i;
+
+	for (i = 0; i < w->ops; i++) {
+		void *p = bench_alloc();
+
+		while (!ring_push(w->out, p)) {
+			drain(w->in);
+			sched_yield();
+		}
+		drain(w->in);
+	}
+	atomic_store(&w->out->producer_done, true);
+
+	/* Keep freeing until the neighbour has stopped producing */
+	while (!atomic_load(&w->in->producer_done)) {
+		drain(w->in);
+		sched_yield();
+	}
+	drain(w->in);
+}
+
+static void *worker_main(void *arg)
+{
+	worker_t *w = arg;
+
+	pthread_barrier_wait(&start_barrier);
+	switch (w->pattern) {
+	case PAT_LIFO:
+		run_lifo(w);
+		break;
+	case PAT_FIFO:
+		run_fifo(w);
+		break;
+	default:
+		run_cross(w);
+		break;
+	}
+	return NULL;
+}
+
+/* ── Measurement ─────────────────────────────────────────────────── */
+
+typedef struct result {
+	double ns_per_op;           /* Wall time per alloc/free pair */
+	long rss_growth_kb;         /* Resident set growth over the run */
+} result_t;
+
+static long rss_kb(void)
+{
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (!f)
+		return 0;
+	if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* One run, in the calling process */
+static result_t run_one(pattern_t pattern, int nthreads, long total_ops)
+{
+	worker_t workers[BENCH_MAX_THREADS];
+	handoff_t *rings = NULL;
+	result_t res = {0};
+	long rss_before;
+	double t0;
+	int i;
+
+	/* Before pool init: pre-allocated slabs are part of the pool's cost.
+	 * Thread stacks count too, equally for every allocator. */
+	rss_before = rss_kb();
+	if (cur->is_pool) {
+		memory_pool_opts_t opts = {
+			.item_size = item_size,
+			.initial_count = POOL_INITIAL_SLABS,
+			.name = "bench",
+			.flags = cur->pool_flags,
+		};
+
+		tbg_pool_init_opts(&bench_pool, &opts);
+	}
+	if (pattern == PAT_CROSS)
+		rings = calloc((size_t)nthreads, sizeof(handoff_t));
+
+	pthread_barrier_init(&start_barrier, NULL, (unsigned int)nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		workers[i] = (worker_t){
+			.ops = total_ops / nthreads,
+			.pattern = pattern,
+			.out = rings ? &rings[i] : NULL,
+			.in = rings ? &rings[(i + nthreads - 1) % nthreads] : NULL,
+		};
+		pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+	}
+
+	/* Workers are parked on the barrier; read the clock before releasing
+	 * them, since on few CPUs they may run before this thread resumes */
+	t0 = now_ns();
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(workers[i].thread, NULL);
+	res.ns_per_op = (now_ns() - t0) / (double)(total_ops / nthreads * nthreads);
+	res.rss_growth_kb = rss_kb() - rss_before;
+
+	pthread_barrier_destroy(&start_barrier);
+	free(rings);
+	if (cur->is_pool)
+		tbg_pool_destroy(&bench_pool);
+	return res;
+}
+
+/* Run in a forked child so every allocator starts from a fresh heap */
+static bool run_isolated(pattern_t pattern, int nthreads, long total_ops,
+                         result_t *res)
+{
+	int fds[2], status;
+	pid_t pid;
+	bool ok;
+
+	if (pipe(fds) != 0)
+		return false;
+
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+	if (pid == 0) {
+		result_t r;
+
+		close(fds[0]);
+		r = run_one(pattern, nthreads, total_ops);
+		_exit(write(fds[1], &r, sizeof(r)) == (ssize_t)sizeof(r) ? 0 : 1);
+	}
+
+	close(fds[1]);
+	ok = read(fds[0], res, sizeof(*res)) == (ssize_t)sizeof(*res);
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+	return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* ── Command line ────────────────────────────────────────────────── */
+
+/* Parse a comma-separated list of integers, returns the count */
+static int parse_ints(const char *arg, long *out, int max)
+{
+	char *copy = strdup(arg), *tok, *save = NULL;
+	int n = 0;
+
+	for (tok = strtok_r(copy, ",", &save); tok && n < max;
+	     tok = strtok_r(NULL, ",", &save))
+		out[n++] = strtol(tok, NULL, 10);
+	free(copy);
+	return n;
+}
+
+static bool list_has(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p = list;
+
+	while ((p = strstr(p, name))) {
+		if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+			return true;
+		p += len;
+	}
+	return false;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "Usage: %s [-a allocators] [-p patterns] [-s sizes] [-t threads] [-n ops] [-c]\n"
+	        "  -a  pool,pool_hardened,glibc,jemalloc,tcmalloc (default: all found)\n"
+	        "  -p  lifo,fifo,cross (default: all)\n"
+	        "  -s  item sizes in bytes (default: 256,4096)\n"
+	        "  -t  thread counts, 1-%d (default: 1,2,4,8,16,32,64)\n"
+	        "  -n  alloc/free pairs per run across all threads (default: %d)\n"
+	        "  -c  CSV output\n",
+	        prog, BENCH_MAX_THREADS, BENCH_DEFAULT_OPS);
+}
+
+int main(int argc, char **argv)
+{
+	const char *alloc_list = NULL, *pattern_list = NULL;
+	long sizes[8] = { 256, 4096 }, threads[16] = { 1, 2, 4, 8, 16, 32, 64 };
+	int nsizes = 2, nthreads = 7;
+	long total_ops = BENCH_DEFAULT_OPS;
+	bool csv = false;
+	int opt, a, p, s, t;
+
+	while ((opt = getopt(argc, argv, "a:p:s:t:n:ch")) != -1) {
+		switch (opt) {
+		case 'a':
+			alloc_list = optarg;
+			break;
+		case 'p':
+			pattern_list = optarg;
+			break;
+		case 's':
+			nsizes = parse_ints(optarg, sizes, 8);
+			break;
+		case 't':
+			nthreads = parse_ints(optarg, threads, 16);
+			break;
+		case 'n':
+			total_ops = strtol(optarg, NULL, 10);
+			break;
+		case 'c':
+			csv = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	for (t = 0; t < nthreads; t++) {
+		if (threads[t] < 1 || threads[t] > BENCH_MAX_THREADS) {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (total_ops <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (csv)
+		printf("allocator,pattern,size,threads,ns_per_op,rss_growth_kb\n");
+	else
+		printf("%-14s %-6s %6s %7s %10s %14s\n", "allocator", "pattern",
+		       "size", "threads", "ns/op", "rss_growth_kb");
+
+	for (a = 0; a < NUM_ALLOCATORS; a++) {
+		if (alloc_list && !list_has(alloc_list, allocators[a].name))
+			continue;
+		if (!allocator_load(&allocators[a])) {
+			if (!csv)
+				printf("%-14s (not installed, skipped)\n", allocators[a].name);
+			continue;
+		}
+		cur = &allocators[a];
+
+		for (p = 0; p < PAT_COUNT; p++) {
+			if (pattern_list && !list_has(pattern_list, pattern_names[p]))
+				continue;
+			for (s = 0; s < nsizes; s++) {
+				item_size = (size_t)sizes[s];
+				for (t = 0; t < nthreads; t++) {
+					result_t r;
+
+					if (!run_isolated((pattern_t)p, (int)threads[t],
+					                  total_ops, &r)) {
+						fprintf(stderr, "%s/%s/%ld/%ld: run failed\n",
+						        cur->name, pattern_names[p],
+						        sizes[s], threads[t]);
+						continue;
+					}
+					printf(csv ? "%s,%s,%ld,%ld,%.1f,%ld\n"
+					           : "%-14s %-6s %6ld %7ld %10.1f %14ld\n",
+					       cur->name, pattern_names[p], sizes[s],
+					       threads[t], r.ns_per_op, r.rss_growth_kb);
+					fflush(stdout);
+				}
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * bench_clock.c — Clock read benchmark: direct syscalls vs tbg_clock
+ * THE BITCOIN GAME — GPLv3
+ *
+ * Measures the cost of each way TBG code reads the time, then the cost
+ * per accepted share: one share runs the rate-limit bucket (monotonic ms),
+ * the vardiff update (time(NULL)) and tbg_emit_share_submitted
+ * (gettimeofday). "direct" is what those paths did before tbg_clock,
+ * "cached" is what they do now with the ticker running.
+ *
+ * Every source is read from -t threads at once: the vDSO clock calls scale
+ * per thread, but a cached load from a line one thread keeps rewriting
+ * shows its sharing cost only under contention.
+ *
+ * Build and run:
+ *   make && ./bench_clock
+ *   ./bench_clock -n 50000000 -t 1,8
+ */
+
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <stdbool.h>
+
+/* tbg_clock.c only needs ckpool's LOG* macros (see ../test/shim/) */
+#include "../src/tbg_clock.c"
+
+#define BENCH_MAX_THREADS   64
+#define BENCH_DEFAULT_OPS   20000000  /* reads per thread per source */
+
+/* ── Clock sources ───────────────────────────────────────────────── */
+
+static uint64_t read_gettimeofday(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_usec;
+}
+
+static uint64_t read_clock(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t read_realtime(void) { return read_clock(CLOCK_REALTIME); }
+static uint64_t read_monotonic(void) { return read_clock(CLOCK_MONOTONIC); }
+static uint64_t read_mono_coarse(void) { return tbg_clock_read_mono_ms(); }
+static uint64_t read_time(void) { return (uint64_t)time(NULL); }
+
+static uint64_t read_cached_mono(void) { return tbg_clock_mono_ms(); }
+static uint64_t read_cached_now(void) { return (uint64_t)tbg_clock_now(); }
+
+static uint64_t read_cached_timeval(void)
+{
+	struct timeval tv;
+
+	tbg_clock_timeval(&tv);
+	return (uint64_t)tv.tv_usec;
+}
+
+/* The clock reads behind one accepted share */
+static uint64_t share_direct(void)
+{
+	return read_mono_coarse() + read_time() + read_gettimeofday();
+}
+
+static uint64_t share_cached(void)
+{
+	return read_cached_mono() + read_cached_now() + read_cached_timeval();
+}
+
+typedef struct source {
+	const char *name;
+	uint64_t (*read)(void);
+	bool cached;                /* Needs the ticker running */
+} source_t;
+
+static const source_t sources[] = {
+	{ "gettimeofday", read_gettimeofday, false },
+	{ "clock_realtime", read_realtime, false },
+	{ "clock_monotonic", read_monotonic, false },
+	{ "clock_mono_coarse", read_mono_coarse, false },
+	{ "time", read_time, false },
+	{ "tbg_clock_mono_ms", read_cached_mono, true },
+	{ "tbg_clock_now", read_cached_now, true },
+	{ "tbg_clock_timeval", read_cached_timeval, true },
+	{ "share_direct", share_direct, false },
+	{ "share_cached", share_cached, true },
+};
+
+#define NUM_SOURCES (int)(sizeof(sources) / sizeof(sources[0]))
+
+/* ── Runner ──────────────────────────────────────────────────────── */
+
+typedef struct worker {
+	pthread_t thread;
+	const source_t *src;
+	long ops;
+	uint64_t sink;              /* Keeps the reads from being optimised out */
+	double ns;
+} worker_t;
+
+static pthread_barrier_t start_barrier;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void *worker_main(void *arg)
+{
+	worker_t *w = arg;
+	uint64_t sink = 0;
+	double t0;
+	long i;
+
+	pthread_barrier_wait(&start_barrier);
+	t0 = now_ns();
+	for (i = 0; i < w->ops; i++)
+		sink += w->src->read();
+	w->ns = now_ns() - t0;
+	w->sink = sink;
+	return NULL;
+}
+
+/* Mean ns per read across nthreads concurrent readers */
+static double run_one(const source_t *src, int nthreads, long ops)
+{
+	worker_t workers[BENCH_MAX_THREADS];
+	double total = 0;
+	int i;
+
+	pthread_barrier_init(&start_barrier, NULL, nthreads);
+	for (i = 0; i < nthreads; i++) {
+		workers[i] = (worker_t){ .src = src, .ops = ops };
+		pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		total += workers[i].ns;
+	}
+	pthread_barrier_destroy(&start_barrier);
+
+	return total / ((double)ops * nthreads);
+}
+
+static int parse_ints(const char *arg, long *out, int max)
+{
+	char *copy = strdup(arg), *tok, *save = NULL;
+	int n = 0;
+
+	for (tok = strtok_r(copy, ",", &save); tok && n < max;
+	     tok = strtok_r(NULL, ",", &save))
+		out[n++] = strtol(tok, NULL, 10);
+	free(copy);
+	return n;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "Usage: %s [-t threads] [-n ops] [-c]\n"
+	        "  -t  thread counts, 1-%d (default: 1,4)\n"
+	        "  -n  reads per thread per source (default: %d)\n"
+	        "  -c  CSV output\n",
+	        prog, BENCH_MAX_THREADS, BENCH_DEFAULT_OPS);
+}
+
+int main(int argc, char **argv)
+{
+	long threads[16] = { 1, 4 };
+	int nthreads = 2;
+	long ops = BENCH_DEFAULT_OPS;
+	bool csv = false;
+	int opt, s, t;
+
+	while ((opt = getopt(argc, argv, "t:n:ch")) != -1) {
+		switch (opt) {
+		case 't':
+			nthreads = parse_ints(optarg, threads, 16);
+			break;
+		case 'n':
+			ops = strtol(optarg, NULL, 10);
+			break;
+		case 'c':
+			csv = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	for (t = 0; t < nthreads; t++) {
+		if (threads[t] < 1 || threads[t] > BENCH_MAX_THREADS) {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (ops <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	tbg_clock_init();
+
+	if (csv)
+		printf("source,threads,ns_per_read\n");
+	else
+		printf("%-18s %7s %12s\n", "source", "threads", "ns/read");
+
+	for (t = 0; t < nthreads; t++) {
+		double direct = 0, cached = 0;
+
+		for (s = 0; s < NUM_SOURCES; s++) {
+			double ns = run_one(&sources[s], (int)threads[t], ops);
+
+			if (sources[s].read == share_direct)
+				direct = ns;
+			else if (sources[s].read == share_cached)
+				cached = ns;
+
+			if (csv)
+				printf("%s,%ld,%.2f\n", sources[s].name, threads[t], ns);
+			else
+				printf("%-18s %7ld %12.2f\n", sources[s].name, threads[t], ns);
+		}
+		if (!csv && cached > 0)
+			printf("%-18s %7ld %11.1fx  (%.1f ns saved per share)\n",
+			       "share_speedup", threads[t], direct / cached,
+			       direct - cached);
+	}
+
+	tbg_clock_shutdown();
+	return 0;
+}
@@ -2,8 +2,10 @@
 # 12-security-modules.sh — Add Phase 5 security and performance modules to build
 # GPLv3 — Copyright (C) 2026 TheBitcoinGame Contributors
 #
-# Adds input_validation, rate_limit, event_ring, and memory_pool to
-# ckpool_SOURCES and links pthreads (needed by rate_limit and memory_pool).
+# Adds input_validation, rate_limit, event_ring, memory_pool, the
+# tbg_memgov memory governor, the tbg_clock shared clock and the tbg_admit
+# admission queue to ckpool_SOURCES and links pthreads (needed by
+# rate_limit, memory_pool, tbg_memgov, tbg_clock and tbg_admit).
 
 echo "=== Patch 12: Security & Performance Modules (Phase 5) ==="
 
@@ -23,13 +25,19 @@ if ! grep -q "input_validation" "${MAKEFILE_AM}"; then
 \t\t input_validation.c input_validation.h \\\
 \t\t rate_limit.c rate_limit.h \\\
 \t\t event_ring.c event_ring.h \\\
-\t\t memory_pool.c memory_pool.h/' "${MAKEFILE_AM}"
+\t\t memory_pool.c memory_pool.h \\\
+\t\t tbg_memgov.c tbg_memgov.h \\\
+\t\t tbg_clock.c tbg_clock.h \\\
+\t\t tbg_admit.c tbg_admit.h/' "${MAKEFILE_AM}"
     else
         sedi 's/tbg_vardiff\.c tbg_vardiff\.h$/tbg_vardiff.c tbg_vardiff.h \\\
 \t\t input_validation.c input_validation.h \\\
 \t\t rate_limit.c rate_limit.h \\\
 \t\t event_ring.c event_ring.h \\\
-\t\t memory_pool.c memory_pool.h/' "${MAKEFILE_AM}"
+\t\t memory_pool.c memory_pool.h \\\
+\t\t tbg_memgov.c tbg_memgov.h \\\
+\t\t tbg_clock.c tbg_clock.h \\\
+\t\t tbg_admit.c tbg_admit.h/' "${MAKEFILE_AM}"
     fi
     echo "    Phase 5 source files added to ckpool_SOURCES"
     apply_hook
@@ -46,7 +54,10 @@ DEST="${CKPOOL_DIR}/src"
 for f in input_validation.c input_validation.h \
          rate_limit.c rate_limit.h \
          event_ring.c event_ring.h \
-         memory_pool.c memory_pool.h; do
+         memory_pool.c memory_pool.h \
+         tbg_memgov.c tbg_memgov.h \
+         tbg_clock.c tbg_clock.h \
+         tbg_admit.c tbg_admit.h; do
     if [ -f "${TBG_SRC}/${f}" ]; then
         cp "${TBG_SRC}/${f}" "${DEST}/${f}"
         echo "    Copied ${f}"
@@ -3,8 +3,16 @@
 # GPLv3 — Copyright (C) 2026 TheBitcoinGame Contributors
 #
 # Hooks input_validation and rate_limit into stratifier.c at the connection,
-# authorization, and share submission points. Also wires event_ring and
-# memory_pool initialization into ckpool.c startup/shutdown.
+# authorization, and share submission points, charges each client's
+# subscribes, authorizes and shares to its own budgets, feeds
+# share-processing latency and queue depth to the rate limiter's load
+# control, paces
+# authorizes through the tbg_admit admission queue, and moves the event
+# emission timestamps onto the tbg_clock shared clock. Also wires
+# event_ring, memory_pool, the tbg_memgov memory governor and the
+# tbg_clock ticker into ckpool.c startup/shutdown, and loads the rate
+# limiter's settings from the config file's rate_limit block, reloading
+# them on SIGHUP.
 #
 # IMPORTANT: This patch runs AFTER patches 01-11, so TBG event emission
 # functions and variables (tbg_active, tbg_init_events, tbg_emit_*) already
@@ -21,7 +29,13 @@ if ! grep -q "rate_limit.h" "${MAIN}"; then
     LINE=$(getline '#include "ckpool.h"' "${MAIN}")
     if [ -n "${LINE}" ]; then
         sedi "${LINE}a\\
-#include \"rate_limit.h\" /* TBG_P5 */" "${MAIN}"
+#include \"rate_limit.h\" /* TBG_P5 */\\
+#include \"memory_pool.h\" /* TBG_P5 */\\
+#include \"tbg_memgov.h\" /* TBG_P5 */\\
+#include \"tbg_clock.h\" /* TBG_P5 */\\
+#include \"tbg_admit.h\" /* TBG_P5 */\\
+#include \"tbg_vardiff.h\" /* TBG_P5 */\\
+#include \"tbg_coinbase_sig.h\" /* TBG_P5 */" "${MAIN}"
         echo "    rate_limit.h include added to ckpool.c"
     else
         echo "    WARNING: ckpool.h include not found in ckpool.c"
@@ -41,7 +55,9 @@ if ! grep -q "input_validation.h" "${STRAT}"; then
 #include \"input_validation.h\"\\
 #include \"rate_limit.h\"\\
 #include \"event_ring.h\"\\
-#include \"memory_pool.h\"" "${STRAT}"
+#include \"memory_pool.h\"\\
+#include \"tbg_clock.h\"\\
+#include \"tbg_admit.h\"" "${STRAT}"
         echo "    Phase 5 includes added"
         apply_hook
     else
@@ -98,6 +114,42 @@ else
     apply_hook
 fi
 
+# ─── Embed per-connection rate state in the client ───────────────────
+# Each client carries its own subscribe, authorize, submit and invalid-share
+# buckets, set up as the client is added. tbg_msg_len is the serialized size
+# of the message being parsed, recorded by the JSON payload check below, so
+# a large message costs more than a small one.
+echo "  Adding per-connection rate state to stratum_instance..."
+if ! grep -q "tbg_rate;.*TBG_P5" "${STRAT}"; then
+    LINE=$(getline "Best share found by this instance" "${STRAT}")
+    if [ -n "${LINE}" ]; then
+        sedi "${LINE}a\\
+\\
+\tconn_rate_state_t tbg_rate;\t/* TBG_P5: Per-connection message budgets */\\
+\tsize_t tbg_msg_len;\t\t/* TBG_P5: Size of the message being parsed */" "${STRAT}"
+        echo "    Rate state fields added to stratum_instance"
+    else
+        echo "    FATAL: Could not find insertion point in stratum_instance"; exit 1
+    fi
+else
+    echo "    Already patched"
+fi
+if ! grep -q "tbg_rate_limit_conn_init.*TBG_P5" "${STRAT}"; then
+    LINE=$(getline 'strcpy(client->address, address);' "${STRAT}")
+    if [ -n "${LINE}" ]; then
+        sedi "${LINE}a\\
+\ttbg_rate_limit_conn_init(\&client->tbg_rate); /* TBG_P5 */" "${STRAT}"
+        echo "    Rate state init hook added"
+        apply_hook
+    else
+        echo "    INFO: client address copy not found, messages are not charged"
+        apply_hook
+    fi
+else
+    echo "    Already patched"
+    apply_hook
+fi
+
 # ─── Add input validation on mining.authorize ────────────────────────
 echo "  Adding input validation on authorize..."
 if ! grep -q "tbg_validate_btc_address.*TBG_P5" "${STRAT}"; then
@@ -172,10 +224,248 @@ else
     apply_hook
 fi
 
+# ─── Feed share-processing load to the rate limiter ──────────────────
+# Shares are queued on sdata->sshareq by parse_method() and processed by
+# sshare_process(), which calls parse_submit(). The queue depth is counted
+# at both ends; the latency is that of parse_submit() alone, read from the
+# clock directly since the shared clock only ticks each millisecond.
+echo "  Adding share load tracking..."
+if ! grep -q "tbg_rate_limit_note_latency.*TBG_P5" "${STRAT}"; then
+    LINE=$(getline 'ckmsgq_add(sdata->sshareq' "${STRAT}")
+    FUNC=$(getline '^static void sshare_process' "${STRAT}")
+    CALL=$(getline 'result_val = parse_submit(client' "${STRAT}")
+    if [ -n "${LINE}" ] && [ -n "${FUNC}" ] && [ -n "${CALL}" ]; then
+        BRACE=$(awk -v start="${FUNC}" 'NR > start && /^{/ { print NR; exit }' "${STRAT}")
+        DECLS=$(awk -v start="${BRACE}" 'NR > start && /^$/ { print NR; exit }' "${STRAT}")
+        # Bottom up within sshare_process so the line numbers stay valid
+        sedi "${CALL}a\\
+\ttbg_rate_limit_note_latency(tbg_clock_read_real_us() - tbg_submit_us); /* TBG_P5 */" "${STRAT}"
+        sedi "${CALL}i\\
+\ttbg_submit_us = tbg_clock_read_real_us(); /* TBG_P5 */" "${STRAT}"
+        sedi "${DECLS}a\\
+\ttbg_rate_limit_note_queue(-1); /* TBG_P5: Dequeued */" "${STRAT}"
+        sedi "${BRACE}a\\
+\tuint64_t tbg_submit_us; /* TBG_P5 */" "${STRAT}"
+        # Count before queueing: the share may be processed at once
+        LINE=$(getline 'ckmsgq_add(sdata->sshareq' "${STRAT}")
+        sedi "${LINE}i\\
+\t\ttbg_rate_limit_note_queue(1); /* TBG_P5 */" "${STRAT}"
+        echo "    Share latency and queue depth hooks added"
+        apply_hook
+    else
+        echo "    INFO: sshareq/sshare_process/parse_submit not found, load control sees no shares"
+        apply_hook
+    fi
+else
+    echo "    Already patched"
+    apply_hook
+fi
+
+# ─── Pace authorizes through the admission queue ─────────────────────
+# parse_method() hands mining.authorize to sdata->sauthq. It now submits
+# it to tbg_admit first: admitted at once, it goes to sauthq as before;
+# queued, the pacer thread moves it to sauthq later (or drops it once it
+# has waited too long); with the queue full it is dropped, and the miner
+# retries as it would after any unanswered authorize.
+echo "  Adding authorize admission queue..."
+if ! grep -q "tbg_admit_submit.*TBG_P5" "${STRAT}"; then
+    FUNC=$(getline '^void \*stratifier(void \*arg)' "${STRAT}")
+    AUTHQ=$(getline 'sdata->sauthq = create_ckmsgq' "${STRAT}")
+    CALL=$(getline 'ckmsgq_add(sdata->sauthq, jp);' "${STRAT}")
+    if [ -n "${FUNC}" ] && [ -n "${AUTHQ}" ] && [ -n "${CALL}" ]; then
+        # Bottom up: stratifier() holds the init and comes last
+        sedi "${AUTHQ}a\\
+\ttbg_admit_init(0, 0, tbg_admit_release, sdata); /* TBG_P5 */" "${STRAT}"
+        cat > /tmp/tbg_admit_release.c << 'ADMITEOF'
+/* TBG_P5: Hand a paced authorize on to the authoriser, or drop it */
+static void tbg_admit_release(void *item, void *ctx, bool admitted)
+{
+	sdata_t *sdata = ctx;
+
+	if (admitted)
+		ckmsgq_add(sdata->sauthq, item);
+	else
+		discard_json_params(item);
+}
+
+ADMITEOF
+        sedi "$((FUNC - 1))r /tmp/tbg_admit_release.c" "${STRAT}"
+        rm -f /tmp/tbg_admit_release.c
+        sedi "${CALL}c\\
+\t\tswitch (tbg_admit_submit(client->address, jp)) { /* TBG_P5 */\\
+\t\tcase ADMIT_NOW:\\
+\t\t\tckmsgq_add(sdata->sauthq, jp);\\
+\t\t\tbreak;\\
+\t\tcase ADMIT_FULL:\\
+\t\t\tdiscard_json_params(jp);\\
+\t\t\tbreak;\\
+\t\tdefault:\\
+\t\t\tbreak;\\
+\t\t}" "${STRAT}"
+        echo "    Authorize admission hooks added"
+        apply_hook
+    else
+        echo "    INFO: sauthq or stratifier() not found, authorizes are not paced"
+        apply_hook
+    fi
+else
+    echo "    Already patched"
+    apply_hook
+fi
+
+# ─── Charge messages to the client's budgets ─────────────────────────
+# parse_method() charges a subscribe, authorize or share to the client's
+# bucket for it before acting on it, at one token plus one per
+# RATE_COST_MSG_BYTES of the message. ckpool sends a username to bitcoind
+# for address validation only the first time it sees it, so an authorize
+# for a user not in sdata->user_instances costs RATE_COST_AUTH_VALIDATE and
+# one for a known user (a proxy's next worker, say) RATE_COST_DEFAULT.
+# Over budget, the message is answered with a "Rate limited" error, so the
+# miner backs off rather than waiting out its timeout and reconnecting; a
+# refused share still counts as rejected. sshare_process() charges
+# an invalid share the rest of RATE_COST_INVALID_SHARE and a token of the
+# invalid-share bucket; a client out of invalid shares is dropped. Subscribe
+# and authorize costs scale with the share-processing load level. Needs the
+# rate state init above: an unset bucket would refuse everything.
+echo "  Adding per-connection message charges..."
+if ! grep -q "tbg_rate_limit_check_conn.*TBG_P5" "${STRAT}"; then
+    SUB=$(getline 'if (cmdmatch(method, "mining.subscribe"))' "${STRAT}")
+    SHARE=$(getline 'tbg_rate_limit_note_queue(1); /\* TBG_P5' "${STRAT}")
+    AUTH=$(getline 'switch (tbg_admit_submit(client->address, jp))' "${STRAT}")
+    CALL=$(getline 'tbg_rate_limit_note_latency.*TBG_P5' "${STRAT}")
+    FUNC=$(getline '^static void parse_method(ckpool_t' "${STRAT}")
+    if grep -q "tbg_rate_limit_conn_init.*TBG_P5" "${STRAT}" &&
+       [ -n "${SUB}" ] && [ -n "${SHARE}" ] && [ -n "${AUTH}" ] && [ -n "${CALL}" ] &&
+       [ -n "${FUNC}" ]; then
+        sedi "${CALL}a\\
+\tif (!json_is_true(result_val)) { /* TBG_P5: Invalid shares cost more */\\
+\t\ttbg_rate_limit_check_conn(\&client->tbg_rate, RATE_SUBMIT,\\
+\t\t\t\t\t  RATE_COST_INVALID_SHARE - RATE_COST_DEFAULT);\\
+\t\tif (!tbg_rate_limit_check_conn(\&client->tbg_rate, RATE_INVALID_SHARE, RATE_COST_DEFAULT)) {\\
+\t\t\tLOGNOTICE(\"Dropping client %\"PRId64\" %s over its invalid share limit\",\\
+\t\t\t\t  client->id, client->address);\\
+\t\t\tconnector_drop_client(ckp, client->id);\\
+\t\t}\\
+\t}" "${STRAT}"
+        # parse_method(): each anchor is looked up again as lines move
+        AUTH=$(getline 'switch (tbg_admit_submit(client->address, jp))' "${STRAT}")
+        sedi "${AUTH}i\\
+\t\tif (!tbg_rate_limit_check_conn(\&client->tbg_rate, RATE_AUTHORIZE, /* TBG_P5 */\\
+\t\t\t\ttbg_rate_limit_msg_cost(tbg_auth_cost(ckp, sdata, params_val),\\
+\t\t\t\t\t\t\tclient->tbg_msg_len))) {\\
+\t\t\tLOGINFO(\"Rate limited authorize from %s\", client->address);\\
+\t\t\ttbg_send_rate_limited(sdata, client_id, id_val, json_false(), SM_AUTHRESULT);\\
+\t\t\tdiscard_json_params(jp);\\
+\t\t\treturn;\\
+\t\t}" "${STRAT}"
+        SHARE=$(getline 'tbg_rate_limit_note_queue(1); /\* TBG_P5' "${STRAT}")
+        sedi "${SHARE}i\\
+\t\tif (!tbg_rate_limit_check_conn(\&client->tbg_rate, RATE_SUBMIT, /* TBG_P5 */\\
+\t\t\t\ttbg_rate_limit_msg_cost(RATE_COST_DEFAULT, client->tbg_msg_len))) {\\
+\t\t\tLOGINFO(\"Rate limited share from %s\", client->address);\\
+\t\t\tMETRIC_INC(shares_invalid);\\
+\t\t\ttbg_emit_share(client->user_instance->username, client->workername,\\
+\t\t\t\t       client->diff, 0, 0);\\
+\t\t\ttbg_send_rate_limited(sdata, client_id, id_val, json_false(), SM_SHARERESULT);\\
+\t\t\tdiscard_json_params(jp);\\
+\t\t\treturn;\\
+\t\t}" "${STRAT}"
+        # After the subscribe block's declarations
+        SUB=$(getline 'if (cmdmatch(method, "mining.subscribe"))' "${STRAT}")
+        DECLS=$(awk -v start="${SUB}" 'NR > start && /^$/ { print NR; exit }' "${STRAT}")
+        sedi "${DECLS}a\\
+\t\tif (!tbg_rate_limit_check_conn(\&client->tbg_rate, RATE_SUBSCRIBE, /* TBG_P5 */\\
+\t\t\t\ttbg_rate_limit_msg_cost(RATE_COST_DEFAULT, client->tbg_msg_len))) {\\
+\t\t\tLOGINFO(\"Rate limited subscribe from %s\", client->address);\\
+\t\t\ttbg_send_rate_limited(sdata, client_id, id_val, json_null(), SM_SUBSCRIBERESULT);\\
+\t\t\treturn;\\
+\t\t}\\
+" "${STRAT}"
+        # The helpers go just above parse_method()
+        cat > /tmp/tbg_auth_cost.c << 'AUTHEOF'
+/* TBG_P5: Refuse a message over the client's budget with an error reply,
+ * which the miner sees at once instead of after its stratum timeout */
+static void tbg_send_rate_limited(sdata_t *sdata, const int64_t client_id, json_t *id_val,
+				  json_t *result_val, const int msg_type)
+{
+	json_t *val = json_object();
+
+	json_object_set_new_nocheck(val, "result", result_val);
+	json_object_set_nocheck(val, "id", id_val);
+	json_object_set_new_nocheck(val, "error", json_string("Rate limited"));
+	stratum_add_send(sdata, val, client_id, msg_type);
+}
+
+/* TBG_P5: Authorize cost. generate_user() validates a username against
+ * bitcoind only when it creates the user, so only an authorize for a user
+ * not seen yet pays for the validation. The username is split from the
+ * worker name as generate_user() splits it. */
+static int tbg_auth_cost(ckpool_t *ckp, sdata_t *sdata, json_t *params_val)
+{
+	const char *workername = json_string_value(json_array_get(params_val, 0));
+	char *base_username, *username;
+	user_instance_t *user;
+
+	if (ckp->proxy)
+		return RATE_COST_DEFAULT;
+	if (!workername || !strlen(workername))
+		return RATE_COST_AUTH_VALIDATE;
+	base_username = strdupa(workername);
+	username = strsep(&base_username, "._");
+	if (!username || !strlen(username))
+		username = base_username;
+	if (!username)
+		return RATE_COST_AUTH_VALIDATE;
+	if (unlikely(strlen(username) > 127))
+		username[127] = '\0';
+
+	ck_rlock(&sdata->instance_lock);
+	HASH_FIND_STR(sdata->user_instances, username, user);
+	ck_runlock(&sdata->instance_lock);
+	return user ? RATE_COST_DEFAULT : RATE_COST_AUTH_VALIDATE;
+}
+
+AUTHEOF
+        FUNC=$(getline '^static void parse_method(ckpool_t' "${STRAT}")
+        sedi "$((FUNC - 1))r /tmp/tbg_auth_cost.c" "${STRAT}"
+        rm -f /tmp/tbg_auth_cost.c
+        echo "    Subscribe, authorize and share charges added"
+        apply_hook
+    else
+        echo "    INFO: rate state or parse_method anchors not found, messages are not charged"
+        apply_hook
+    fi
+else
+    echo "    Already patched"
+    apply_hook
+fi
+
+# ─── Read event timestamps from the shared clock ─────────────────────
+# Every tbg_emit_* from patch 01 takes its timestamp with gettimeofday().
+# Only calls inside the event emission block are rewritten; the rest of
+# stratifier.c keeps its own clock reads.
+echo "  Moving event timestamps onto tbg_clock..."
+if ! grep -q "tbg_clock_timeval.*TBG_P5" "${STRAT}"; then
+    if grep -q "End of event emission" "${STRAT}"; then
+        sedi '/THE BITCOIN GAME: Event Emission System/,/THE BITCOIN GAME: End of event emission/s/gettimeofday(&tv, NULL);/tbg_clock_timeval(\&tv); \/\* TBG_P5 \*\//' "${STRAT}"
+        echo "    $(grep -c 'tbg_clock_timeval.*TBG_P5' "${STRAT}") event timestamps moved"
+        apply_hook
+    else
+        echo "    INFO: event emission block not found"
+        apply_hook
+    fi
+else
+    echo "    Already patched"
+    apply_hook
+fi
+
 # ─── Add JSON payload size validation ─────────────────────────────────
 # Note: In vanilla ckpool, smsg_t contains json_t *json_msg (already parsed
 # by jansson) and int64_t client_id — there is no raw buffer field.
 # We validate the serialized size of the JSON object as a safety measure.
+# The serialization goes into the thread's message arena (memory_pool.h)
+# instead of a json_dumps() malloc/free per message; the arena is reset at
+# the start of each message, dropping the previous message's temporaries.
 echo "  Adding JSON payload size validation..."
 if ! grep -q "tbg_validate_json_payload.*TBG_P5" "${STRAT}"; then
     LINE=$(getline 'parse_instance_msg' "${STRAT}")
@@ -188,15 +478,30 @@ if ! grep -q "tbg_validate_json_payload.*TBG_P5" "${STRAT}"; then
 
 	/* TBG_P5: Validate JSON payload size */
 	{
-		char *json_str = json_dumps(msg->json_msg, JSON_COMPACT);
-		if (json_str) {
-			size_t jlen = strlen(json_str);
+		tbg_arena_t *arena = tbg_arena_thread();
+		char *json_str = NULL;
+		size_t cap = 4096, jlen = 0;
+
+		client->tbg_msg_len = 0;
+		if (arena) {
+			tbg_arena_reset(arena); /* New message: drop the last one's temporaries */
+			json_str = tbg_arena_alloc(arena, cap);
+			if (json_str)
+				jlen = json_dumpb(msg->json_msg, json_str, cap, JSON_COMPACT);
+			/* Rare large message: retry once with the exact size */
+			if (json_str && jlen > cap && jlen <= 65536) {
+				cap = jlen;
+				json_str = tbg_arena_alloc(arena, cap);
+				if (json_str)
+					jlen = json_dumpb(msg->json_msg, json_str, cap, JSON_COMPACT);
+			}
+		}
+		if (json_str && jlen > 0) {
 			if (!tbg_validate_json_payload(json_str, jlen, 65536)) { /* TBG_P5 */
 				tbg_log_validation_failure(client->address, "json_payload", "(oversized)", "exceeds max size or nesting");
-				free(json_str);
 				return;
 			}
-			free(json_str);
+			client->tbg_msg_len = jlen; /* Sizes the message's rate charge */
 		}
 	}
 JSONEOF
@@ -217,6 +522,68 @@ else
     apply_hook
 fi
 
+# ─── Rate limit config loader and SIGHUP reload in ckpool.c ─────────
+# The rate_limit block is read with its own json_load_file() rather than in
+# parse_config(), so the same function serves startup and SIGHUP reloads.
+# The signal handler only raises a flag; the rate limiter's cleanup thread
+# calls the loader and publishes the new settings.
+echo "  Adding rate limit config loader to ckpool.c..."
+if ! grep -q "tbg_rate_limit_conf" "${MAIN}"; then
+    LINE=$(getline '^int main(' "${MAIN}")
+    if [ -n "${LINE}" ]; then
+        cat > /tmp/tbg_rate_limit_conf.c << 'CONFEOF'
+/* TBG_P5: Rate limits from the "rate_limit" block of the config file */
+static bool tbg_rate_limit_conf(rate_limit_config_t *config, void *ctx)
+{
+	ckpool_t *ckp = ctx;
+	json_error_t err_val;
+	json_t *json_conf, *block, *val;
+	const char *key;
+
+	tbg_rate_limit_config_defaults(config);
+	json_conf = json_load_file(ckp->config, JSON_DISABLE_EOF_CHECK, &err_val);
+	if (!json_conf) {
+		LOGWARNING("Rate limit: failed to read %s: %s (line %d)",
+			   ckp->config, err_val.text, err_val.line);
+		return false;
+	}
+	block = json_object_get(json_conf, "rate_limit");
+	if (json_is_object(block)) {
+		json_object_foreach(block, key, val) {
+			bool ok = false;
+
+			if (json_is_integer(val))
+				ok = tbg_rate_limit_config_set(config, key, json_integer_value(val));
+			else if (json_is_string(val))
+				ok = tbg_rate_limit_config_set_str(config, key, json_string_value(val));
+			if (!ok)
+				LOGWARNING("Rate limit: ignoring rate_limit.%s in %s", key, ckp->config);
+		}
+	}
+	json_decref(json_conf);
+	return true;
+}
+
+/* TBG_P5: Reload rate limits; the cleanup thread does the work */
+static void tbg_rate_limit_sighup(int sig)
+{
+	(void)sig;
+	tbg_rate_limit_request_reload();
+}
+
+CONFEOF
+        sedi "$((LINE-1))r /tmp/tbg_rate_limit_conf.c" "${MAIN}"
+        rm -f /tmp/tbg_rate_limit_conf.c
+        echo "    Rate limit config loader added to ckpool.c"
+        apply_hook
+    else
+        echo "    WARNING: main() not found in ckpool.c"
+    fi
+else
+    echo "    Already patched"
+    apply_hook
+fi
+
 # ─── Add initialization calls to ckpool.c ────────────────────────────
 # IMPORTANT: Must insert AFTER launch_logger() and config parsing, otherwise
 # LOGNOTICE/LOGWARNING calls in tbg_rate_limit_init will segfault because
@@ -229,7 +596,18 @@ if ! grep -q "tbg_rate_limit_init.*TBG_P5" "${MAIN}"; then
         sedi "${LINE}i\\
 \\
 \t/* TBG_P5: Initialize security and performance modules */\\
-\ttbg_rate_limit_init(NULL); /* TBG_P5: Use default rate limits */\\
+\ttbg_clock_init(); /* TBG_P5: Start first, the modules below read it */\\
+\t{ /* TBG_P5: Rate limits from the config file, reloaded on SIGHUP */\\
+\t\trate_limit_config_t tbg_rl_conf;\\
+\t\ttbg_rate_limit_init(tbg_rate_limit_conf(\&tbg_rl_conf, \&ckp) ? \&tbg_rl_conf : NULL); /* TBG_P5 */\\
+\t\ttbg_rate_limit_set_loader(tbg_rate_limit_conf, \&ckp);\\
+\t\tsignal(SIGHUP, tbg_rate_limit_sighup);\\
+\t}\\
+\ttbg_memgov_init(0); /* TBG_P5: Default budget for TBG-owned memory */\\
+\ttbg_memgov_register(\"memory_pool\", tbg_pool_mem_usage, tbg_pool_mem_pressure, NULL); /* TBG_P5 */\\
+\ttbg_memgov_register(\"rate_limit\", tbg_rate_limit_mem_usage, tbg_rate_limit_mem_pressure, NULL); /* TBG_P5 */\\
+\ttbg_memgov_register(\"vardiff\", tbg_vardiff_mem_usage, tbg_vardiff_mem_pressure, NULL); /* TBG_P5 */\\
+\ttbg_memgov_register(\"sig_cache\", tbg_sig_cache_mem_usage, tbg_sig_cache_mem_pressure, NULL); /* TBG_P5 */\\
 \tLOGNOTICE(\"TBG Phase 5: Security modules initialized\"); /* TBG_P5 */" "${MAIN}"
         echo "    Initialization hooks added to ckpool.c (before prepare_child at ${LINE})"
         apply_hook
@@ -250,7 +628,10 @@ if ! grep -q "tbg_rate_limit_shutdown.*TBG_P5" "${MAIN}"; then
     LINE=$(getline 'clean_up(&ckp)' "${MAIN}")
     if [ -n "${LINE}" ]; then
         sedi "${LINE}i\\
-\ttbg_rate_limit_shutdown(); /* TBG_P5: Cleanup rate limiter */" "${MAIN}"
+\ttbg_memgov_shutdown(); /* TBG_P5: Stop memory governor */\\
+\ttbg_admit_shutdown(); /* TBG_P5: Drop queued authorizes */\\
+\ttbg_rate_limit_shutdown(); /* TBG_P5: Cleanup rate limiter */\\
+\ttbg_clock_shutdown(); /* TBG_P5: Stop clock ticker */" "${MAIN}"
         echo "    Shutdown hooks added to ckpool.c"
         apply_hook
     else
@@ -259,7 +640,10 @@ if ! grep -q "tbg_rate_limit_shutdown.*TBG_P5" "${MAIN}"; then
         LINE=$(grep -n 'return 0;' "${MAIN}" | tail -1 | cut -d: -f1)
         if [ -n "${LINE}" ]; then
             sedi "${LINE}i\\
-\ttbg_rate_limit_shutdown(); /* TBG_P5: Cleanup rate limiter */" "${MAIN}"
+\ttbg_memgov_shutdown(); /* TBG_P5: Stop memory governor */\\
+\ttbg_admit_shutdown(); /* TBG_P5: Drop queued authorizes */\\
+\ttbg_rate_limit_shutdown(); /* TBG_P5: Cleanup rate limiter */\\
+\ttbg_clock_shutdown(); /* TBG_P5: Stop clock ticker */" "${MAIN}"
             echo "    Shutdown hooks added (via return 0 fallback)"
             apply_hook
         else
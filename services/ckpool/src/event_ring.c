@@ -6,8 +6,16 @@
  * A background flush thread drains the ring using writev() for
  * batched sends, targeting <1ms latency from share validation
  * to event appearing on the Unix domain socket.
+ *
+ * Under memory pressure the ring switches to aggregated mode: share
+ * events are folded into a per-user table and the flusher sends one
+ * summary per user per interval.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  /* memmem() */
+#endif
+
 #include "config.h"
 
 #include <stdio.h>
@@ -19,8 +27,10 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <errno.h>
+#include <time.h>
 
 #include "event_ring.h"
+#include "tbg_memgov.h"
 #include "libckpool.h"
 
 /* ── Flush thread state ──────────────────────────────────────────── */
@@ -29,6 +39,19 @@ static volatile int flusher_running = 0;
 static pthread_t flusher_thread;
 static int flusher_socket_fd = -1;
 
+/* ── Aggregation state ───────────────────────────────────────────── */
+
+typedef struct agg_entry {
+	char user[EVENT_AGG_USER_MAX];  /* Empty = unused slot */
+	uint64_t shares;
+	uint64_t accepted;
+	double diff_sum;
+} agg_entry_t;
+
+static agg_entry_t agg_table[EVENT_AGG_SLOTS];
+static _Atomic int agg_used;       /* Read unlocked by the flusher */
+static pthread_mutex_t agg_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* ── Ring buffer operations ──────────────────────────────────────── */
 
 void tbg_event_ring_init(event_ring_t *ring)
@@ -47,16 +70,169 @@ void tbg_event_ring_init(event_ring_t *ring)
 		atomic_store(&ring->slots[i].state, SLOT_EMPTY);
 }
 
+static bool ring_push_slot(event_ring_t *ring, const char *json, size_t len);
+
+/* ── Aggregated mode ─────────────────────────────────────────────── */
+
+/* Find key in json[0..len) and return the text after it, or NULL */
+static const char *json_after(const char *json, size_t len, const char *key)
+{
+	const char *p = memmem(json, len, key, strlen(key));
+
+	return p ? p + strlen(key) : NULL;
+}
+
+static uint32_t user_hash(const char *user)
+{
+	uint32_t h = 2166136261u;   /* FNV-1a */
+
+	while (*user)
+		h = (h ^ (uint8_t)*user++) * 16777619u;
+	return h;
+}
+
+/*
+ * Fold a share event into the per-user table. Returns false for events
+ * that are not EVENT_AGG_TYPE, which take the normal path.
+ */
+static bool agg_fold(const char *json, size_t len)
+{
+	char user[EVENT_AGG_USER_MAX] = "*";
+	const char *p, *end = json + len;
+	agg_entry_t *e = NULL;
+	double diff = 0;
+	uint32_t i, h;
+
+	if (!json_after(json, len, "\"event\":\"" EVENT_AGG_TYPE "\""))
+		return false;
+
+	p = json_after(json, len, "\"user\":\"");
+	if (p) {
+		size_t n = 0;
+
+		while (p + n < end && p[n] != '"' && n < sizeof(user) - 1)
+			n++;
+		memcpy(user, p, n);
+		user[n] = '\0';
+	}
+	p = json_after(json, len, "\"diff\":");
+	if (p)
+		diff = strtod(p, NULL);
+
+	pthread_mutex_lock(&agg_lock);
+
+	/* Linear probe; a full table folds everyone else into "*" */
+	h = user_hash(user);
+	for (i = 0; i < EVENT_AGG_SLOTS; i++) {
+		agg_entry_t *slot = &agg_table[(h + i) & (EVENT_AGG_SLOTS - 1)];
+
+		if (!slot->user[0]) {
+			if (agg_used >= EVENT_AGG_SLOTS - 1 && strcmp(user, "*")) {
+				strcpy(user, "*");
+				h = user_hash(user);
+				i = (uint32_t)-1;
+				continue;
+			}
+			strcpy(slot->user, user);
+			agg_used++;
+			e = slot;
+			break;
+		}
+		if (!strcmp(slot->user, user)) {
+			e = slot;
+			break;
+		}
+	}
+	if (e) {
+		e->shares++;
+		if (json_after(json, len, "\"accepted\":true"))
+			e->accepted++;
+		e->diff_sum += diff;
+	}
+
+	pthread_mutex_unlock(&agg_lock);
+	return e != NULL;
+}
+
+/* Send one summary per user and clear the table (flusher thread) */
+static void agg_flush(event_ring_t *ring)
+{
+	struct timespec ts;
+	char buf[512];
+	int i;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	pthread_mutex_lock(&agg_lock);
+	for (i = 0; i < EVENT_AGG_SLOTS && agg_used > 0; i++) {
+		agg_entry_t *e = &agg_table[i];
+		int n;
+
+		if (!e->user[0])
+			continue;
+		n = snprintf(buf, sizeof(buf),
+			"{\"event\":\"share_summary\",\"ts\":%ld.%06ld,"
+			"\"source\":\"hosted\",\"data\":{"
+			"\"user\":\"%s\",\"shares\":%lu,\"accepted\":%lu,"
+			"\"diff_sum\":%.8f,\"interval_ms\":%d}}",
+			(long)ts.tv_sec, ts.tv_nsec / 1000, e->user,
+			(unsigned long)e->shares, (unsigned long)e->accepted,
+			e->diff_sum, EVENT_AGG_INTERVAL_US / 1000);
+		if (n > 0 && n < (int)sizeof(buf))
+			ring_push_slot(ring, buf, (size_t)n);
+		memset(e, 0, sizeof(*e));
+		agg_used--;
+	}
+	pthread_mutex_unlock(&agg_lock);
+}
+
+void tbg_event_ring_set_aggregate(event_ring_t *ring, bool on)
+{
+	if (!ring || atomic_exchange(&ring->aggregate, on) == on)
+		return;
+	if (on)
+		LOGWARNING("Event ring: aggregated mode on, share events are "
+		           "summarized per user every %d ms",
+		           EVENT_AGG_INTERVAL_US / 1000);
+	else
+		LOGNOTICE("Event ring: aggregated mode off");
+}
+
+size_t tbg_event_ring_mem_usage(void *arg)
+{
+	(void)arg;
+	return sizeof(event_ring_t) + sizeof(agg_table);
+}
+
+size_t tbg_event_ring_mem_pressure(int level, void *arg)
+{
+	tbg_event_ring_set_aggregate((event_ring_t *)arg, level >= MEMGOV_HIGH);
+	return 0;
+}
+
+/* ── Ring push ───────────────────────────────────────────────────── */
+
 bool tbg_event_ring_push(event_ring_t *ring, const char *json, size_t len)
+{
+	if (!ring || !json || len == 0)
+		return false;
+
+	if (atomic_load_explicit(&ring->aggregate, memory_order_relaxed) &&
+	    agg_fold(json, len)) {
+		atomic_fetch_add(&ring->events_aggregated, 1);
+		return true;
+	}
+
+	return ring_push_slot(ring, json, len);
+}
+
+static bool ring_push_slot(event_ring_t *ring, const char *json, size_t len)
 {
 	uint64_t pos;
 	uint64_t idx;
 	event_slot_t *slot;
 	uint8_t expected;
 
-	if (!ring || !json || len == 0)
-		return false;
-
 	if (len >= EVENT_MAX_SIZE)
 		len = EVENT_MAX_SIZE - 1;
 
@@ -142,11 +318,29 @@ static void flush_batch(event_ring_t *ring, int sock_fd)
 	atomic_fetch_add(&ring->batch_count, 1);
 }
 
+static uint64_t monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
 static void *flusher_thread_func(void *arg)
 {
 	event_ring_t *ring = (event_ring_t *)arg;
+	uint64_t last_agg = monotonic_us();
 
 	while (flusher_running) {
+		/* Summaries go out every interval, and at once when
+		 * aggregated mode has been switched off */
+		if (agg_used > 0 &&
+		    (!atomic_load(&ring->aggregate) ||
+		     monotonic_us() - last_agg >= EVENT_AGG_INTERVAL_US)) {
+			agg_flush(ring);
+			last_agg = monotonic_us();
+		}
+
 		flush_batch(ring, flusher_socket_fd);
 
 		/* Sleep briefly if no events were pending */
@@ -156,6 +350,7 @@ static void *flusher_thread_func(void *arg)
 	}
 
 	/* Final drain on shutdown */
+	agg_flush(ring);
 	flush_batch(ring, flusher_socket_fd);
 
 	return NULL;
@@ -207,3 +402,8 @@ uint64_t tbg_event_ring_dropped(const event_ring_t *ring)
 {
 	return atomic_load(&ring->events_dropped);
 }
+
+uint64_t tbg_event_ring_aggregated(const event_ring_t *ring)
+{
+	return atomic_load(&ring->events_aggregated);
+}
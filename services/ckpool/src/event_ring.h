@@ -31,6 +31,16 @@
 /* Polling interval for the flush thread (microseconds) */
 #define EVENT_FLUSH_INTERVAL_US  100   /* 0.1ms */
 
+/*
+ * Aggregated mode (memory pressure): EVENT_AGG_TYPE events are folded
+ * into one summary per user every EVENT_AGG_INTERVAL_US instead of
+ * taking a slot each. Users beyond EVENT_AGG_SLOTS share one "*" entry.
+ */
+#define EVENT_AGG_TYPE        "share_submitted"
+#define EVENT_AGG_SLOTS       1024   /* Power of 2 */
+#define EVENT_AGG_USER_MAX    64
+#define EVENT_AGG_INTERVAL_US 1000000
+
 /* Ring buffer slot states */
 #define SLOT_EMPTY   0
 #define SLOT_WRITING 1
@@ -50,6 +60,8 @@ typedef struct event_ring {
 	_Atomic uint64_t events_sent;
 	_Atomic uint64_t events_dropped;  /* Ring full drops */
 	_Atomic uint64_t batch_count;     /* Number of writev calls */
+	_Atomic bool aggregate;           /* Fold share events into summaries */
+	_Atomic uint64_t events_aggregated;  /* Events folded into summaries */
 } event_ring_t;
 
 /*
@@ -77,11 +89,27 @@ void tbg_event_ring_start_flusher(event_ring_t *ring, int socket_fd);
  */
 void tbg_event_ring_stop_flusher(event_ring_t *ring);
 
+/*
+ * Switch aggregated mode on or off. Summaries pending when it is turned
+ * off are sent by the flusher on its next pass.
+ */
+void tbg_event_ring_set_aggregate(event_ring_t *ring, bool on);
+
+/*
+ * Memory governor callbacks (see tbg_memgov.h); arg is the ring.
+ * The ring itself is fixed-size: pressure from MEMGOV_HIGH up switches
+ * to aggregated mode, which keeps the ring and the downstream pipeline
+ * from backing up with per-share events.
+ */
+size_t tbg_event_ring_mem_usage(void *arg);
+size_t tbg_event_ring_mem_pressure(int level, void *arg);
+
 /*
  * Get ring buffer statistics.
  */
 uint64_t tbg_event_ring_queued(const event_ring_t *ring);
 uint64_t tbg_event_ring_sent(const event_ring_t *ring);
 uint64_t tbg_event_ring_dropped(const event_ring_t *ring);
+uint64_t tbg_event_ring_aggregated(const event_ring_t *ring);
 
 #endif /* TBG_EVENT_RING_H */
@@ -5,16 +5,47 @@
  * Pre-allocates cache-line aligned memory slabs and manages them via
  * an intrusive free list. The first sizeof(void*) bytes of each free
  * item are used as a next pointer.
+ *
+ * With POOL_F_HUGEPAGES, slabs are rounded up to whole 2 MB pages and
+ * mapped with MAP_HUGETLB, falling back to madvise(MADV_HUGEPAGE) and
+ * finally to the heap. The backing obtained is recorded per slab.
+ *
+ * With POOL_F_NUMA, the pool is a thin dispatcher over one sub-pool per
+ * node. It keeps every node's slabs in one table sorted by address, so a
+ * freed item is routed back to the node that owns it with a binary
+ * search that takes no lock.
+ *
+ * With POOL_F_HARDENED, each slot carries a canary after the item, freed
+ * items are poisoned, and every slab has a bitmap of live slots. Checks
+ * run under the pool lock next to the free-list update they guard.
+ *
+ * With a constructor (object cache mode), the link moves past the object
+ * so freed objects keep their constructed state; ctor runs as a slab is
+ * carved and dtor as it is released.
+ *
+ * The bump arena at the end of this file shares the slab idea at message
+ * scope: temporaries are carved from retained chunks and dropped together.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  /* getcpu() */
+#endif
+
 #include "config.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include "memory_pool.h"
+#include "tbg_clock.h"
+#include "tbg_memgov.h"
 #include "libckpool.h"
 
 /* Round up to cache-line alignment */
@@ -23,9 +54,487 @@ static size_t align_up(size_t size, size_t alignment)
 	return (size + alignment - 1) & ~(alignment - 1);
 }
 
+/* Free-list link of an item: its first word, or the word after the
+ * object in object caches */
+static inline void **item_link(const memory_pool_t *pool, void *item)
+{
+	return (void **)((char *)item + pool->link_off);
+}
+
+/*
+ * Map an anonymous region aligned to a huge page boundary and advise
+ * the kernel to back it with transparent huge pages. Over-maps by one
+ * huge page and trims both ends so the region starts on a 2 MB boundary.
+ */
+static void *map_thp(size_t bytes, pool_backing_t *backing)
+{
+	size_t span = bytes + POOL_HUGE_PAGE_SIZE;
+	char *raw, *base;
+	size_t head, tail;
+
+	raw = mmap(NULL, span, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED)
+		return NULL;
+
+	base = (char *)align_up((size_t)raw, POOL_HUGE_PAGE_SIZE);
+	head = (size_t)(base - raw);
+	tail = span - head - bytes;
+	if (head)
+		munmap(raw, head);
+	if (tail)
+		munmap(base + bytes, tail);
+
+	*backing = POOL_BACKING_PAGES;
+#ifdef MADV_HUGEPAGE
+	if (madvise(base, bytes, MADV_HUGEPAGE) == 0)
+		*backing = POOL_BACKING_THP;
+#endif
+	return base;
+}
+
+/* ── NUMA helpers ────────────────────────────────────────────────── */
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+/* Number of possible NUMA nodes, from /sys (1 if unknown) */
+static int numa_node_count(void)
+{
+	FILE *fp = fopen("/sys/devices/system/node/possible", "r");
+	int lo = 0, hi = 0;
+
+	if (!fp)
+		return 1;
+	/* Format is "0" or "0-N" */
+	if (fscanf(fp, "%d-%d", &lo, &hi) < 2)
+		hi = lo;
+	fclose(fp);
+	return hi >= 0 ? hi + 1 : 1;
+}
+
+/* NUMA node of the calling CPU (0 if unknown) */
+static int current_numa_node(void)
+{
+	unsigned int cpu = 0, node = 0;
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+	if (getcpu(&cpu, &node) != 0)
+		return 0;
+#elif defined(SYS_getcpu)
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+		return 0;
+#endif
+	(void)cpu;
+	return (int)node;
+}
+
+/*
+ * Prefer pages of [addr, addr + bytes) on the given node. Must run
+ * before the first touch. MPOL_PREFERRED rather than MPOL_BIND so a
+ * full node spills over instead of OOMing.
+ */
+static void bind_to_node(void *addr, size_t bytes, int node)
+{
+#ifdef SYS_mbind
+	unsigned long mask[4] = {0};
+	const int bits = (int)(sizeof(unsigned long) * 8);
+
+	if (node < 0 || node >= bits * 4)
+		return;
+	mask[node / bits] = 1UL << (node % bits);
+	syscall(SYS_mbind, addr, bytes, MPOL_PREFERRED, mask,
+	        (unsigned long)(bits * 4), 0);
+#else
+	(void)addr;
+	(void)bytes;
+	(void)node;
+#endif
+}
+
+/* Allocate the memory for one slab, honouring POOL_F_HUGEPAGES and
+ * the sub-pool's NUMA node */
+static void *slab_map(const memory_pool_t *pool, size_t bytes,
+                      pool_backing_t *backing)
+{
+	void *slab;
+
+	if (pool->flags & POOL_F_HUGEPAGES) {
+#ifdef MAP_HUGETLB
+		slab = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+		            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (slab != MAP_FAILED) {
+			*backing = POOL_BACKING_HUGETLB;
+			bind_to_node(slab, bytes, pool->numa_node);
+			return slab;
+		}
+#endif
+		slab = map_thp(bytes, backing);
+		if (slab) {
+			bind_to_node(slab, bytes, pool->numa_node);
+			return slab;
+		}
+	} else if (pool->numa_node >= 0) {
+		/* Node binding is per page, so node slabs must own theirs */
+		slab = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+		            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slab != MAP_FAILED) {
+			*backing = POOL_BACKING_PAGES;
+			bind_to_node(slab, bytes, pool->numa_node);
+			return slab;
+		}
+	}
+
+	/* Packed slots need not fill whole lines; aligned_alloc wants a
+	 * multiple of the alignment */
+	*backing = POOL_BACKING_HEAP;
+	return aligned_alloc(POOL_CACHE_LINE_SIZE,
+	                     align_up(bytes, POOL_CACHE_LINE_SIZE));
+}
+
+static void slab_unmap(const pool_slab_t *slab)
+{
+	if (slab->backing == POOL_BACKING_HEAP)
+		free(slab->base);
+	else
+		munmap(slab->base, slab->bytes);
+	free(slab->live);
+}
+
+/* ── Hardening (POOL_F_HARDENED) ─────────────────────────────────── */
+
+/* Log the first few faults per pool; the counter carries the rest */
+#define POOL_FAULT_LOG_LIMIT  16
+
+/* Keyed by address so a canary copied from a neighbour does not match */
+static void canary_write(const memory_pool_t *pool, void *item)
+{
+	uint64_t c = pool->canary ^ (uint64_t)(uintptr_t)item;
+
+	memcpy((char *)item + pool->item_size, &c, sizeof(c));
+}
+
+static bool canary_ok(const memory_pool_t *pool, const void *item)
+{
+	uint64_t c;
+
+	memcpy(&c, (const char *)item + pool->item_size, sizeof(c));
+	return c == (pool->canary ^ (uint64_t)(uintptr_t)item);
+}
+
+/* Poison all but the free-list link. Constructed objects keep their
+ * state, so object caches are never poisoned. */
+static void poison(const memory_pool_t *pool, void *item)
+{
+	if (pool->ctor)
+		return;
+	memset((char *)item + sizeof(void *), POOL_POISON_BYTE,
+	       pool->item_size - sizeof(void *));
+}
+
+/* Only the first cache line is verified, to bound the cost on alloc */
+static bool poison_ok(const memory_pool_t *pool, const void *item)
+{
+	const unsigned char *p = (const unsigned char *)item + sizeof(void *);
+	size_t len = pool->item_size < POOL_CACHE_LINE_SIZE
+	             ? pool->item_size : POOL_CACHE_LINE_SIZE;
+	size_t i;
+
+	if (pool->ctor)
+		return true;
+	for (i = 0; i < len - sizeof(void *); i++) {
+		if (p[i] != POOL_POISON_BYTE)
+			return false;
+	}
+	return true;
+}
+
+static void pool_fault(memory_pool_t *pool, const char *what, const void *item)
+{
+	if (atomic_fetch_add(&pool->corruptions, 1) < POOL_FAULT_LOG_LIMIT)
+		LOGERR("Memory pool '%s': %s at %p", pool->name, what, item);
+}
+
+static bool live_test(const pool_slab_t *slab, size_t slot)
+{
+	return (slab->live[slot / 64] >> (slot % 64)) & 1;
+}
+
+static void live_set(pool_slab_t *slab, size_t slot, bool on)
+{
+	if (on)
+		slab->live[slot / 64] |= 1ULL << (slot % 64);
+	else
+		slab->live[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+/* ── Slab owners (POOL_F_NUMA) ───────────────────────────────────── */
+
+/*
+ * The parent of a NUMA pool records each node's slabs in one table sorted
+ * by address. Readers take no lock: they retry while range_seq is odd or
+ * changed under them. Writers hold the parent's lock, taken after the
+ * node's. A full table is copied to one twice the size; the old copy
+ * stays readable until tbg_pool_destroy(), and the retired copies add up
+ * to less than the live one.
+ */
+#define POOL_RANGES_INITIAL  16
+
+typedef struct pool_range {
+	_Atomic uintptr_t lo;       /* Slab start */
+	_Atomic uintptr_t hi;       /* Slab end, exclusive */
+	_Atomic int node;           /* Index into node_pools */
+} pool_range_t;
+
+struct pool_range_table {
+	struct pool_range_table *retired;  /* The smaller copy before this one */
+	int capacity;
+	pool_range_t r[];
+};
+
+static void range_set(pool_range_t *r, uintptr_t lo, uintptr_t hi, int node)
+{
+	atomic_store_explicit(&r->lo, lo, memory_order_relaxed);
+	atomic_store_explicit(&r->hi, hi, memory_order_relaxed);
+	atomic_store_explicit(&r->node, node, memory_order_relaxed);
+}
+
+static void range_copy(pool_range_t *dst, const pool_range_t *src)
+{
+	range_set(dst, atomic_load_explicit(&src->lo, memory_order_relaxed),
+	          atomic_load_explicit(&src->hi, memory_order_relaxed),
+	          atomic_load_explicit(&src->node, memory_order_relaxed));
+}
+
+/* Index of the last of t's first n ranges starting at or below addr,
+ * or -1 */
+static int range_floor(const struct pool_range_table *t, int n,
+                       uintptr_t addr)
+{
+	int lo = 0, hi = n;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (atomic_load_explicit(&t->r[mid].lo, memory_order_relaxed) <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+/* Node whose slab holds item, or -1 if none does */
+static int range_owner(memory_pool_t *pool, const void *item)
+{
+	uintptr_t addr = (uintptr_t)item;
+
+	for (;;) {
+		unsigned int seq = atomic_load_explicit(&pool->range_seq,
+		                                        memory_order_acquire);
+		struct pool_range_table *t;
+		int n, i, node = -1;
+
+		if (seq & 1)
+			continue;
+		t = atomic_load_explicit(&pool->ranges, memory_order_acquire);
+		n = atomic_load_explicit(&pool->range_count, memory_order_acquire);
+		/* A count past a stale copy's end means a writer got in */
+		if (t && n <= t->capacity) {
+			i = range_floor(t, n, addr);
+			if (i >= 0 && addr < atomic_load_explicit(&t->r[i].hi,
+			                                          memory_order_relaxed))
+				node = atomic_load_explicit(&t->r[i].node,
+				                            memory_order_relaxed);
+		}
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&pool->range_seq, memory_order_relaxed) == seq)
+			return node;
+	}
+}
+
+/* Open a change to the table. Caller holds pool->lock. */
+static unsigned int range_write_begin(memory_pool_t *pool)
+{
+	unsigned int seq = atomic_load_explicit(&pool->range_seq,
+	                                        memory_order_relaxed);
+
+	atomic_store_explicit(&pool->range_seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	return seq;
+}
+
+static void range_write_end(memory_pool_t *pool, unsigned int seq)
+{
+	atomic_store_explicit(&pool->range_seq, seq + 2, memory_order_release);
+}
+
+/*
+ * Record node's new slab [base, base + bytes) with its parent. False if
+ * the table could not grow. Caller holds node->lock.
+ */
+static bool range_insert(memory_pool_t *node, const void *base, size_t bytes)
+{
+	memory_pool_t *pool = node->parent;
+	struct pool_range_table *t;
+	uintptr_t lo = (uintptr_t)base;
+	unsigned int seq;
+	int n, i;
+
+	if (!pool)
+		return true;
+
+	pthread_mutex_lock(&pool->lock);
+	t = atomic_load_explicit(&pool->ranges, memory_order_relaxed);
+	n = atomic_load_explicit(&pool->range_count, memory_order_relaxed);
+	if (!t || n == t->capacity) {
+		int cap = t ? t->capacity * 2 : POOL_RANGES_INITIAL;
+		struct pool_range_table *bigger;
+
+		bigger = malloc(sizeof(*bigger) + (size_t)cap * sizeof(pool_range_t));
+		if (!bigger) {
+			pthread_mutex_unlock(&pool->lock);
+			return false;
+		}
+		bigger->retired = t;
+		bigger->capacity = cap;
+		for (i = 0; i < n; i++)
+			range_copy(&bigger->r[i], &t->r[i]);
+		atomic_store_explicit(&pool->ranges, bigger, memory_order_release);
+		t = bigger;
+	}
+
+	seq = range_write_begin(pool);
+	for (i = n; i > 0 &&
+	     atomic_load_explicit(&t->r[i - 1].lo, memory_order_relaxed) > lo; i--)
+		range_copy(&t->r[i], &t->r[i - 1]);
+	range_set(&t->r[i], lo, lo + bytes, node->numa_node);
+	atomic_store_explicit(&pool->range_count, n + 1, memory_order_release);
+	range_write_end(pool, seq);
+	pthread_mutex_unlock(&pool->lock);
+	return true;
+}
+
+/* Forget node's slab at base. Caller holds node->lock. */
+static void range_remove(memory_pool_t *node, const void *base)
+{
+	memory_pool_t *pool = node->parent;
+	struct pool_range_table *t;
+	unsigned int seq;
+	int n, i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	t = atomic_load_explicit(&pool->ranges, memory_order_relaxed);
+	n = atomic_load_explicit(&pool->range_count, memory_order_relaxed);
+	i = t ? range_floor(t, n, (uintptr_t)base) : -1;
+	if (i >= 0 &&
+	    atomic_load_explicit(&t->r[i].lo, memory_order_relaxed) == (uintptr_t)base) {
+		seq = range_write_begin(pool);
+		for (; i < n - 1; i++)
+			range_copy(&t->r[i], &t->r[i + 1]);
+		atomic_store_explicit(&pool->range_count, n - 1,
+		                      memory_order_release);
+		range_write_end(pool, seq);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Free the table and its retired copies. No reader may remain. */
+static void range_free_all(memory_pool_t *pool)
+{
+	struct pool_range_table *t = atomic_load(&pool->ranges);
+
+	while (t) {
+		struct pool_range_table *older = t->retired;
+
+		free(t);
+		t = older;
+	}
+	atomic_store(&pool->ranges, NULL);
+	atomic_store(&pool->range_count, 0);
+}
+
+/* ── Slabs ───────────────────────────────────────────────────────── */
+
+/*
+ * Record a mapped slab, keeping the array sorted by address for
+ * pool_find_slab(), and a node's slab in its parent's owner table.
+ * Hardened pools get a live bitmap for it. Returns the descriptor, or
+ * NULL if bookkeeping memory ran out. Caller holds pool->lock.
+ */
+static pool_slab_t *pool_add_slab(memory_pool_t *pool, void *base,
+                                  size_t bytes, pool_backing_t backing)
+{
+	uint64_t *live = NULL;
+	int i;
+
+	if (pool->slab_count >= pool->slabs_capacity) {
+		int new_cap = pool->slabs_capacity * 2;
+		pool_slab_t *new_slabs;
+
+		if (new_cap == 0)
+			new_cap = 16;
+
+		new_slabs = realloc(pool->slabs,
+		                     (size_t)new_cap * sizeof(pool_slab_t));
+		if (!new_slabs)
+			return NULL;
+		pool->slabs = new_slabs;
+		pool->slabs_capacity = new_cap;
+	}
+
+	if (pool->flags & POOL_F_HARDENED) {
+		size_t slots = bytes / pool->aligned_size;
+
+		live = calloc((slots + 63) / 64, sizeof(uint64_t));
+		if (!live)
+			return NULL;
+	}
+	if (!range_insert(pool, base, bytes)) {
+		free(live);
+		return NULL;
+	}
+
+	for (i = pool->slab_count; i > 0; i--) {
+		if ((char *)pool->slabs[i - 1].base < (char *)base)
+			break;
+		pool->slabs[i] = pool->slabs[i - 1];
+	}
+	pool->slabs[i].base = base;
+	pool->slabs[i].bytes = bytes;
+	pool->slabs[i].backing = backing;
+	pool->slabs[i].items = 0;
+	pool->slabs[i].live = live;
+	pool->slab_count++;
+	if (backing == POOL_BACKING_HUGETLB)
+		pool->hugetlb_slabs++;
+	else if (backing == POOL_BACKING_THP)
+		pool->thp_slabs++;
+
+	return &pool->slabs[i];
+}
+
+/* Unmap a slab, destroying cached objects first */
+static void slab_release(const memory_pool_t *pool, const pool_slab_t *slab)
+{
+	int j;
+
+	for (j = 0; pool->dtor && j < slab->items; j++)
+		pool->dtor((char *)slab->base + (size_t)j * pool->aligned_size,
+		           pool->ctor_arg);
+	slab_unmap(slab);
+}
+
 /* Allocate a new slab of items and add them to the free list */
 static bool pool_grow(memory_pool_t *pool, int count)
 {
+	pool_backing_t backing;
+	pool_slab_t *desc;
+	size_t bytes;
 	void *slab;
 	char *ptr;
 	int i;
@@ -36,163 +545,1218 @@ static bool pool_grow(memory_pool_t *pool, int count)
 			return false;
 	}
 
+	/* Huge page slabs are whole pages; fill the tail with items */
+	bytes = (size_t)count * pool->aligned_size;
+	if (pool->flags & POOL_F_HUGEPAGES) {
+		int room = pool->max_items - pool->total_allocated;
+
+		bytes = align_up(bytes, POOL_HUGE_PAGE_SIZE);
+		count = (int)(bytes / pool->aligned_size);
+		if (count > room)
+			count = room;
+	}
+
 	/* Allocate the slab as a contiguous block */
-	slab = aligned_alloc(POOL_CACHE_LINE_SIZE,
-	                     (size_t)count * pool->aligned_size);
+	slab = slab_map(pool, bytes, &backing);
 	if (!slab)
 		return false;
 
-	/* Track the slab pointer for cleanup */
-	if (pool->slab_count >= pool->slabs_capacity) {
-		int new_cap = pool->slabs_capacity * 2;
-		void **new_slabs;
+	/* Log each downgrade once rather than on every slab */
+	if ((pool->flags & POOL_F_HUGEPAGES) && backing != POOL_BACKING_HUGETLB &&
+	    (pool->slab_count == 0 || backing > tbg_pool_backing(pool)))
+		LOGNOTICE("Memory pool '%s': huge page slab unavailable, "
+		          "falling back to %s", pool->name,
+		          tbg_pool_backing_name(backing));
 
-		if (new_cap == 0)
-			new_cap = 16;
+	desc = pool_add_slab(pool, slab, bytes, backing);
+	if (!desc) {
+		pool_slab_t tmp = { .base = slab, .bytes = bytes, .backing = backing };
 
-		new_slabs = realloc(pool->slabs,
-		                     (size_t)new_cap * sizeof(void *));
-		if (!new_slabs) {
-			free(slab);
-			return false;
-		}
-		pool->slabs = new_slabs;
-		pool->slabs_capacity = new_cap;
+		slab_unmap(&tmp);
+		return false;
 	}
-	pool->slabs[pool->slab_count++] = slab;
+	desc->items = count;
 
 	/* Add all items in this slab to the free list */
 	ptr = (char *)slab;
 	for (i = 0; i < count; i++) {
 		void *item = ptr + (size_t)i * pool->aligned_size;
+
+		if (pool->flags & POOL_F_HARDENED) {
+			poison(pool, item);
+			canary_write(pool, item);
+		}
+		if (pool->ctor)
+			pool->ctor(item, pool->ctor_arg);
 		/* Intrusive free list: store next pointer at item start */
-		*(void **)item = pool->free_list;
+		*item_link(pool, item) = pool->free_list;
 		pool->free_list = item;
 	}
 
 	pool->total_allocated += count;
 	pool->total_free += count;
+	pool->grow_events++;
 
 	return true;
 }
 
-void tbg_pool_init(memory_pool_t *pool, size_t item_size,
-                   int initial_count, int max_items, const char *name)
+/* Index of the slab containing item, or -1. Caller holds pool->lock. */
+static int pool_find_slab(const memory_pool_t *pool, const void *item)
 {
-	memset(pool, 0, sizeof(*pool));
-
-	/* Ensure item is large enough to hold a next pointer */
-	if (item_size < sizeof(void *))
-		item_size = sizeof(void *);
-
-	pool->item_size = item_size;
-	pool->aligned_size = align_up(item_size, POOL_CACHE_LINE_SIZE);
-	pool->max_items = max_items > 0 ? max_items : POOL_MAX_ITEMS;
-	pool->name = name ? name : "unnamed";
+	const char *p = item;
+	int lo = 0, hi = pool->slab_count - 1;
 
-	pthread_mutex_init(&pool->lock, NULL);
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		const char *base = pool->slabs[mid].base;
 
-	/* Pre-allocate initial slabs */
-	if (initial_count > 0) {
-		pool_grow(pool, initial_count);
+		if (p < base)
+			hi = mid - 1;
+		else if (p >= base + pool->slabs[mid].bytes)
+			lo = mid + 1;
+		else
+			return mid;
 	}
-
-	LOGNOTICE("Memory pool '%s': initialized (item=%zu, aligned=%zu, "
-	          "initial=%d, max=%d)",
-	          pool->name, pool->item_size, pool->aligned_size,
-	          initial_count, pool->max_items);
+	return -1;
 }
 
-void *tbg_pool_alloc(memory_pool_t *pool)
+/*
+ * Slab and slot of item in a hardened pool. False unless item is the
+ * start of a slot. Caller holds pool->lock.
+ */
+static bool pool_find_slot(const memory_pool_t *pool, const void *item,
+                           pool_slab_t **slab, size_t *slot)
 {
-	void *item = NULL;
+	int idx = pool_find_slab(pool, item);
+	size_t off;
 
-	if (!pool)
-		return NULL;
+	if (idx < 0)
+		return false;
+	off = (size_t)((const char *)item - (const char *)pool->slabs[idx].base);
+	if (off % pool->aligned_size != 0)
+		return false;
+	*slab = &pool->slabs[idx];
+	*slot = off / pool->aligned_size;
+	return true;
+}
 
-	pthread_mutex_lock(&pool->lock);
+/*
+ * Hardened pop: each head must be a free slot of this pool whose poison
+ * is intact. A broken link truncates the free list (the rest cannot be
+ * trusted); a written-to item is quarantined. Caller holds pool->lock.
+ */
+static int pool_pop_hardened(memory_pool_t *pool, int n, void **out)
+{
+	int got = 0;
 
-	if (pool->free_list) {
-		/* Fast path: pop from free list */
-		item = pool->free_list;
-		pool->free_list = *(void **)item;
-		pool->total_free--;
-	} else {
-		/* Slow path: grow the pool */
-		int grow_count = pool->total_allocated > 0
-		                 ? pool->total_allocated / 2 : POOL_INITIAL_SLABS;
-		if (grow_count < 64)
-			grow_count = 64;
-		if (grow_count > 4096)
-			grow_count = 4096;
-
-		if (pool_grow(pool, grow_count)) {
-			item = pool->free_list;
-			pool->free_list = *(void **)item;
+	while (got < n && pool->free_list) {
+		void *item = pool->free_list;
+		pool_slab_t *slab;
+		size_t slot;
+
+		if (!pool_find_slot(pool, item, &slab, &slot) ||
+		    live_test(slab, slot)) {
+			pool_fault(pool, "free list corrupted", item);
+			pool->free_list = NULL;
+			pool->total_free = got;
+			break;
+		}
+		pool->free_list = *item_link(pool, item);
+		live_set(slab, slot, true);
+		if (!poison_ok(pool, item)) {
+			pool_fault(pool, "write after free", item);
 			pool->total_free--;
+			continue;
 		}
+		out[got++] = item;
 	}
-
-	pthread_mutex_unlock(&pool->lock);
-
-	/* Last resort: direct allocation */
-	if (!item)
-		item = aligned_alloc(POOL_CACHE_LINE_SIZE, pool->aligned_size);
-
-	return item;
+	return got;
 }
 
-void tbg_pool_free(memory_pool_t *pool, void *item)
+/*
+ * Validate a batch before it touches the free list, dropping rejected
+ * items from the array. Returns the number kept. Takes pool->lock.
+ */
+static int pool_check_free(memory_pool_t *pool, int n, void **items)
 {
-	if (!pool || !item)
-		return;
+	int i, kept = 0;
 
 	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < n; i++) {
+		pool_slab_t *slab;
+		size_t slot;
 
-	/* Push onto free list */
-	*(void **)item = pool->free_list;
-	pool->free_list = item;
-	pool->total_free++;
-
+		if (!pool_find_slot(pool, items[i], &slab, &slot)) {
+			pool_fault(pool, "foreign free", items[i]);
+			continue;
+		}
+		if (!live_test(slab, slot)) {
+			pool_fault(pool, "double free", items[i]);
+			continue;
+		}
+		/* Overflowed items stay live: never reused, never re-freed */
+		if (!canary_ok(pool, items[i])) {
+			pool_fault(pool, "canary overwritten", items[i]);
+			continue;
+		}
+		live_set(slab, slot, false);
+		items[kept++] = items[i];
+	}
 	pthread_mutex_unlock(&pool->lock);
-}
 
-void tbg_pool_destroy(memory_pool_t *pool)
-{
-	int i;
+	return kept;
+}
 
-	if (!pool)
-		return;
+/* ── Instrumentation ─────────────────────────────────────────────── */
 
-	pthread_mutex_lock(&pool->lock);
+static memory_pool_t *pool_registry;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	/* Free all slabs */
-	for (i = 0; i < pool->slab_count; i++)
-		free(pool->slabs[i]);
+/* Per-thread ticks so sampling costs no shared cache line. Alloc and
+ * free count separately: a shared tick would land every sample on the
+ * same side of a strict alloc/free alternation. */
+static __thread unsigned int alloc_tick, free_tick;
 
-	free(pool->slabs);
-	pool->slabs = NULL;
-	pool->slab_count = 0;
-	pool->slabs_capacity = 0;
-	pool->free_list = NULL;
-	pool->total_free = 0;
-	pool->total_allocated = 0;
+/* Start time if this call is sampled, else 0 */
+static uint64_t sample_start(unsigned int *tick)
+{
+	struct timespec ts;
 
-	pthread_mutex_unlock(&pool->lock);
-	pthread_mutex_destroy(&pool->lock);
+	if ((++*tick & (POOL_LATENCY_SAMPLE - 1)) != 0)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
 }
 
-int tbg_pool_total_allocated(const memory_pool_t *pool)
+/* Record a sampled call covering items items */
+static void sample_end(uint64_t start, _Atomic uint64_t *ns_sum,
+                       _Atomic uint64_t *samples, int items)
 {
-	return pool ? pool->total_allocated : 0;
-}
+	struct timespec ts;
+	uint64_t now;
+
+	if (!start)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+	atomic_fetch_add(ns_sum, now - start);
+	atomic_fetch_add(samples, (uint64_t)items);
+}
+
+static void pool_register(memory_pool_t *pool)
+{
+	pthread_mutex_lock(&registry_lock);
+	pool->next_registered = pool_registry;
+	pool_registry = pool;
+	pthread_mutex_unlock(&registry_lock);
+}
+
+static void pool_unregister(memory_pool_t *pool)
+{
+	memory_pool_t **pp;
+
+	pthread_mutex_lock(&registry_lock);
+	for (pp = &pool_registry; *pp; pp = &(*pp)->next_registered) {
+		if (*pp == pool) {
+			*pp = pool->next_registered;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&registry_lock);
+}
+
+/* Items to add when the free list runs dry */
+static int grow_size(const memory_pool_t *pool)
+{
+	int grow_count = pool->total_allocated > 0
+	                 ? pool->total_allocated / 2 : POOL_INITIAL_SLABS;
+	if (grow_count < 64)
+		grow_count = 64;
+	if (grow_count > 4096)
+		grow_count = 4096;
+	return grow_count;
+}
+
+/*
+ * Pop up to n items under one lock acquisition, growing the pool at most
+ * once. Returns the number popped; fewer than n only at max_items.
+ */
+static int pool_take_bulk(memory_pool_t *pool, int n, void **out)
+{
+	int got = 0;
+
+	pthread_mutex_lock(&pool->lock);
+
+	/* Slow path: grow the pool enough for the whole batch */
+	if (pool->total_free < n) {
+		int grow_count = grow_size(pool);
+
+		if (grow_count < n - pool->total_free)
+			grow_count = n - pool->total_free;
+		pool_grow(pool, grow_count);
+	}
+
+	/* Fast path: pop from free list */
+	if (pool->flags & POOL_F_HARDENED) {
+		got = pool_pop_hardened(pool, n, out);
+	} else {
+		while (got < n && pool->free_list) {
+			out[got] = pool->free_list;
+			pool->free_list = *item_link(pool, out[got]);
+			got++;
+		}
+	}
+	pool->total_free -= got;
+	if (pool->total_allocated - pool->total_free > pool->high_water)
+		pool->high_water = pool->total_allocated - pool->total_free;
+
+	pthread_mutex_unlock(&pool->lock);
+	return got;
+}
+
+/* Pop an item, growing the pool if needed. NULL once max_items is hit. */
+static void *pool_take(memory_pool_t *pool)
+{
+	void *item = NULL;
+
+	pool_take_bulk(pool, 1, &item);
+	return item;
+}
+
+/*
+ * Push n items onto the free list. The items are chained together
+ * before taking the lock, so the critical section is a single splice.
+ */
+static void pool_put_bulk(memory_pool_t *pool, int n, void **items)
+{
+	int i;
+
+	if ((pool->flags & POOL_F_HARDENED) && n > 0) {
+		n = pool_check_free(pool, n, items);
+		for (i = 0; i < n; i++)
+			poison(pool, items[i]);
+	}
+	if (n <= 0)
+		return;
+
+	for (i = 0; i < n - 1; i++)
+		*item_link(pool, items[i]) = items[i + 1];
+
+	pthread_mutex_lock(&pool->lock);
+
+	*item_link(pool, items[n - 1]) = pool->free_list;
+	pool->free_list = items[0];
+	pool->total_free += n;
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Push an item onto the pool's free list */
+static void pool_put(memory_pool_t *pool, void *item)
+{
+	pool_put_bulk(pool, 1, &item);
+}
+
+/* Sub-pool owning item's slab; the caller's node for foreign items */
+static memory_pool_t *node_pool_for(memory_pool_t *pool, void *item)
+{
+	int node = range_owner(pool, item);
+
+	if (node < 0)
+		node = current_numa_node() % pool->node_count;
+	return &pool->node_pools[node];
+}
+
+/*
+ * Return a batch to the nodes that own it. Items are partitioned in place
+ * by owning node (looked up without locks, then one lock acquisition per
+ * node for the splice); items no node owns go to the caller's node.
+ */
+static void node_free_bulk(memory_pool_t *pool, int n, void **items)
+{
+	int start = 0, k;
+
+	for (k = 0; k < pool->node_count && start < n; k++) {
+		memory_pool_t *node = &pool->node_pools[k];
+		int end = start, i;
+
+		for (i = start; i < n; i++) {
+			if (range_owner(pool, items[i]) == k) {
+				void *tmp = items[end];
+
+				items[end++] = items[i];
+				items[i] = tmp;
+			}
+		}
+
+		pool_put_bulk(node, end - start, items + start);
+		start = end;
+	}
+
+	pool_put_bulk(&pool->node_pools[current_numa_node() % pool->node_count],
+	              n - start, items + start);
+}
+
+/* Slot alignment for a new pool: explicit align, else packed, else a
+ * full cache line */
+static size_t pool_pick_align(const memory_pool_opts_t *opts)
+{
+	size_t align = opts->align;
+
+	if (!align)
+		return (opts->flags & POOL_F_PACKED) ? POOL_MIN_ALIGN
+		                                     : POOL_CACHE_LINE_SIZE;
+	if (align < POOL_MIN_ALIGN || align > POOL_CACHE_LINE_SIZE ||
+	    (align & (align - 1)) != 0) {
+		LOGWARNING("Memory pool '%s': invalid align %zu, using %d",
+		           opts->name ? opts->name : "unnamed", align,
+		           POOL_CACHE_LINE_SIZE);
+		return POOL_CACHE_LINE_SIZE;
+	}
+	return align;
+}
+
+static void pool_setup(memory_pool_t *pool, const memory_pool_opts_t *opts,
+                       int numa_node)
+{
+	size_t item_size = opts->item_size;
+	size_t slot;
+
+	memset(pool, 0, sizeof(*pool));
+
+	/* Ensure item is large enough to hold a next pointer */
+	if (item_size < sizeof(void *))
+		item_size = sizeof(void *);
+
+	pool->item_size = item_size;
+	pool->align = pool_pick_align(opts);
+	pool->ctor = opts->ctor;
+	pool->dtor = opts->dtor;
+	pool->ctor_arg = opts->ctor_arg;
+
+	/* Slot: object, then the canary, then (object caches) the link */
+	slot = item_size;
+	if (opts->flags & POOL_F_HARDENED) {
+		slot += POOL_CANARY_SIZE;
+		pool->canary = tbg_clock_random_seed();
+	}
+	if (opts->ctor) {
+		pool->link_off = align_up(slot, sizeof(void *));
+		slot = pool->link_off + sizeof(void *);
+	}
+	pool->aligned_size = align_up(slot, pool->align);
+	pool->max_items = opts->max_items > 0 ? opts->max_items : POOL_MAX_ITEMS;
+	pool->flags = opts->flags & ~POOL_F_NUMA;
+	pool->numa_node = numa_node;
+	pool->name = opts->name ? opts->name : "unnamed";
+
+	pthread_mutex_init(&pool->lock, NULL);
+
+	/* Pre-allocate initial slabs */
+	if (opts->initial_count > 0) {
+		pool_grow(pool, opts->initial_count);
+	}
+}
+
+/* Set up pool's sub-pool for node, recording its slabs in pool's owner
+ * table from the first */
+static void pool_setup_node(memory_pool_t *pool, int node,
+                            const memory_pool_opts_t *opts)
+{
+	memory_pool_opts_t local = *opts;
+	memory_pool_t *sub = &pool->node_pools[node];
+
+	local.initial_count = 0;
+	pool_setup(sub, &local, node);
+	sub->parent = pool;
+	if (opts->initial_count > 0)
+		pool_grow(sub, opts->initial_count);
+}
+
+/* Split the pool into per-node sub-pools. False on single-node hosts. */
+static bool pool_setup_numa(memory_pool_t *pool,
+                            const memory_pool_opts_t *opts)
+{
+	memory_pool_opts_t node_opts = *opts;
+	int nodes = numa_node_count();
+	int max_items, i;
+
+	if (nodes <= 1)
+		return false;
+
+	pool->node_pools = calloc((size_t)nodes, sizeof(memory_pool_t));
+	if (!pool->node_pools)
+		return false;
+	pool->node_count = nodes;
+
+	max_items = opts->max_items > 0 ? opts->max_items : POOL_MAX_ITEMS;
+	node_opts.max_items = max_items / nodes > 0 ? max_items / nodes : 1;
+	node_opts.initial_count = opts->initial_count > 0
+	                          ? (opts->initial_count + nodes - 1) / nodes : 0;
+	for (i = 0; i < nodes; i++)
+		pool_setup_node(pool, i, &node_opts);
+
+	return true;
+}
+
+void tbg_pool_init(memory_pool_t *pool, size_t item_size,
+                   int initial_count, int max_items, const char *name)
+{
+	memory_pool_opts_t opts = {
+		.item_size = item_size,
+		.initial_count = initial_count,
+		.max_items = max_items,
+		.name = name,
+		.flags = 0,
+	};
+
+	tbg_pool_init_opts(pool, &opts);
+}
+
+void tbg_pool_init_opts(memory_pool_t *pool, const memory_pool_opts_t *opts)
+{
+	memory_pool_opts_t local = *opts;
+
+	/* The parent of a NUMA pool only dispatches; it owns no slabs */
+	if (opts->flags & POOL_F_NUMA) {
+		local.initial_count = 0;
+		pool_setup(pool, &local, -1);
+		if (pool_setup_numa(pool, opts)) {
+			LOGNOTICE("Memory pool '%s': initialized (item=%zu, "
+			          "aligned=%zu, initial=%d, max=%d, nodes=%d, "
+			          "backing=%s)",
+			          pool->name, pool->item_size, pool->aligned_size,
+			          opts->initial_count, pool->max_items,
+			          pool->node_count,
+			          tbg_pool_backing_name(tbg_pool_backing(pool)));
+			pool_register(pool);
+			return;
+		}
+		pthread_mutex_destroy(&pool->lock);
+		local.initial_count = opts->initial_count;
+	}
+
+	pool_setup(pool, &local, -1);
+	pool_register(pool);
+
+	LOGNOTICE("Memory pool '%s': initialized (item=%zu, aligned=%zu, "
+	          "initial=%d, max=%d, backing=%s)",
+	          pool->name, pool->item_size, pool->aligned_size,
+	          opts->initial_count, pool->max_items,
+	          tbg_pool_backing_name(tbg_pool_backing(pool)));
+}
+
+/*
+ * Direct allocation once the pool is at max_items, constructed like a
+ * slab item in object caches. The item counts as allocated (and in use)
+ * on the caller's node, so the gauges see it like any other. Hardened
+ * pools track it as a one-slot slab so it is checked like any other
+ * when freed; other pools adopt it into the free list when it is freed.
+ */
+static void *pool_fallback(memory_pool_t *pool)
+{
+	memory_pool_t *owner = pool;
+	pool_slab_t *slab = NULL;
+	void *item;
+
+	atomic_fetch_add(&pool->fallback_allocs, 1);
+	item = aligned_alloc(pool->align, pool->aligned_size);
+	if (!item)
+		return NULL;
+	if (pool->ctor)
+		pool->ctor(item, pool->ctor_arg);
+
+	if (pool->node_count > 0)
+		owner = &pool->node_pools[current_numa_node() % pool->node_count];
+
+	pthread_mutex_lock(&owner->lock);
+	if (pool->flags & POOL_F_HARDENED) {
+		slab = pool_add_slab(owner, item, pool->aligned_size,
+		                     POOL_BACKING_HEAP);
+		if (slab) {
+			slab->items = 1;
+			live_set(slab, 0, true);
+			canary_write(owner, item);
+		}
+	}
+	if (slab || !(pool->flags & POOL_F_HARDENED)) {
+		owner->total_allocated++;
+		if (owner->total_allocated - owner->total_free > owner->high_water)
+			owner->high_water = owner->total_allocated - owner->total_free;
+	}
+	pthread_mutex_unlock(&owner->lock);
+
+	if (!(pool->flags & POOL_F_HARDENED))
+		return item;
+
+	if (!slab) {
+		if (pool->dtor)
+			pool->dtor(item, pool->ctor_arg);
+		free(item);
+		return NULL;
+	}
+	return item;
+}
+
+void *tbg_pool_alloc(memory_pool_t *pool)
+{
+	void *item = NULL;
+	uint64_t t0;
+
+	if (!pool)
+		return NULL;
+
+	t0 = sample_start(&alloc_tick);
+
+	if (pool->node_count > 0) {
+		int local = current_numa_node() % pool->node_count;
+		int i;
+
+		/* Local node first; borrow from the others when it is full */
+		for (i = 0; i < pool->node_count && !item; i++)
+			item = pool_take(&pool->node_pools[(local + i) % pool->node_count]);
+	} else {
+		item = pool_take(pool);
+	}
+
+	/* Last resort: direct allocation */
+	if (!item)
+		item = pool_fallback(pool);
+
+	sample_end(t0, &pool->alloc_ns_sum, &pool->alloc_samples, 1);
+	return item;
+}
+
+void tbg_pool_free(memory_pool_t *pool, void *item)
+{
+	uint64_t t0;
+
+	if (!pool || !item)
+		return;
+
+	t0 = sample_start(&free_tick);
+
+	/* Push onto the owning node's free list, not the freeing CPU's */
+	if (pool->node_count > 0)
+		pool_put(node_pool_for(pool, item), item);
+	else
+		pool_put(pool, item);
+
+	sample_end(t0, &pool->free_ns_sum, &pool->free_samples, 1);
+}
+
+int tbg_pool_alloc_bulk(memory_pool_t *pool, int n, void **out)
+{
+	int got = 0;
+	uint64_t t0;
+
+	if (!pool || !out || n <= 0)
+		return 0;
+
+	t0 = sample_start(&alloc_tick);
+
+	if (pool->node_count > 0) {
+		int local = current_numa_node() % pool->node_count;
+		int i;
+
+		for (i = 0; i < pool->node_count && got < n; i++) {
+			memory_pool_t *node =
+				&pool->node_pools[(local + i) % pool->node_count];
+
+			got += pool_take_bulk(node, n - got, out + got);
+		}
+	} else {
+		got = pool_take_bulk(pool, n, out);
+	}
+
+	/* Last resort: direct allocation */
+	while (got < n) {
+		out[got] = pool_fallback(pool);
+		if (!out[got])
+			break;
+		got++;
+	}
+
+	/* Amortized per item, so batches compare directly with single calls */
+	sample_end(t0, &pool->alloc_ns_sum, &pool->alloc_samples, got);
+	return got;
+}
+
+void tbg_pool_free_bulk(memory_pool_t *pool, int n, void **items)
+{
+	int i, kept = 0;
+	uint64_t t0;
+
+	if (!pool || !items || n <= 0)
+		return;
+
+	t0 = sample_start(&free_tick);
+
+	/* Drop NULL entries so callers can pass sparse arrays */
+	for (i = 0; i < n; i++) {
+		if (items[i])
+			items[kept++] = items[i];
+	}
+
+	if (pool->node_count > 0)
+		node_free_bulk(pool, kept, items);
+	else
+		pool_put_bulk(pool, kept, items);
+
+	sample_end(t0, &pool->free_ns_sum, &pool->free_samples, kept);
+}
+
+void tbg_pool_destroy(memory_pool_t *pool)
+{
+	void *item, *next;
+	int i;
+
+	if (!pool)
+		return;
+
+	pool_unregister(pool);
+
+	for (i = 0; i < pool->node_count; i++)
+		tbg_pool_destroy(&pool->node_pools[i]);
+	free(pool->node_pools);
+	pool->node_pools = NULL;
+	pool->node_count = 0;
+	range_free_all(pool);
+
+	pthread_mutex_lock(&pool->lock);
+
+	/* Free the fallback items adopted by plain pools (hardened ones are
+	 * one-slot slabs, and their free list is not walked blind), then
+	 * all slabs */
+	for (item = (pool->flags & POOL_F_HARDENED) ? NULL : pool->free_list;
+	     item; item = next) {
+		next = *item_link(pool, item);
+		if (pool_find_slab(pool, item) >= 0)
+			continue;
+		if (pool->dtor)
+			pool->dtor(item, pool->ctor_arg);
+		free(item);
+	}
+	for (i = 0; i < pool->slab_count; i++)
+		slab_release(pool, &pool->slabs[i]);
+
+	free(pool->slabs);
+	pool->slabs = NULL;
+	pool->slab_count = 0;
+	pool->slabs_capacity = 0;
+	pool->free_list = NULL;
+	pool->total_free = 0;
+	pool->total_allocated = 0;
+	pool->hugetlb_slabs = 0;
+	pool->thp_slabs = 0;
+
+	pthread_mutex_unlock(&pool->lock);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+int tbg_pool_total_allocated(const memory_pool_t *pool)
+{
+	int total, i;
+
+	if (!pool)
+		return 0;
+	total = pool->total_allocated;
+	for (i = 0; i < pool->node_count; i++)
+		total += pool->node_pools[i].total_allocated;
+	return total;
+}
 
 int tbg_pool_total_free(const memory_pool_t *pool)
 {
-	return pool ? pool->total_free : 0;
+	int total, i;
+
+	if (!pool)
+		return 0;
+	total = pool->total_free;
+	for (i = 0; i < pool->node_count; i++)
+		total += pool->node_pools[i].total_free;
+	return total;
 }
 
 int tbg_pool_in_use(const memory_pool_t *pool)
 {
-	return pool ? pool->total_allocated - pool->total_free : 0;
+	return tbg_pool_total_allocated(pool) - tbg_pool_total_free(pool);
+}
+
+/* Slab-level counters summed over NUMA sub-pools */
+typedef struct pool_stats {
+	int allocated;
+	int free;
+	int high_water;             /* Sum of node peaks: an upper bound */
+	int slabs;
+	uint64_t grows;
+	uint64_t corruptions;
+} pool_stats_t;
+
+static void pool_collect(const memory_pool_t *pool, pool_stats_t *st)
+{
+	int i;
+
+	pthread_mutex_lock((pthread_mutex_t *)&pool->lock);
+	st->allocated += pool->total_allocated;
+	st->free += pool->total_free;
+	st->high_water += pool->high_water;
+	st->slabs += pool->slab_count;
+	st->grows += pool->grow_events;
+	st->corruptions += atomic_load(&pool->corruptions);
+	pthread_mutex_unlock((pthread_mutex_t *)&pool->lock);
+
+	for (i = 0; i < pool->node_count; i++)
+		pool_collect(&pool->node_pools[i], st);
+}
+
+enum pool_metric {
+	PM_ALLOCATED,
+	PM_FREE,
+	PM_IN_USE,
+	PM_HIGH_WATER,
+	PM_SLABS,
+	PM_GROWS,
+	PM_FALLBACK,
+	PM_CORRUPTIONS,
+	PM_ALLOC_LATENCY,
+	PM_FREE_LATENCY,
+	PM_COUNT
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+	const char *type;
+} pool_metrics[PM_COUNT] = {
+	[PM_ALLOCATED] = { "tbg_pool_total_allocated", "Items carved from pool slabs or allocated past max_items", "gauge" },
+	[PM_FREE] = { "tbg_pool_total_free", "Items on the pool free list", "gauge" },
+	[PM_IN_USE] = { "tbg_pool_in_use", "Items currently handed out", "gauge" },
+	[PM_HIGH_WATER] = { "tbg_pool_high_water", "Peak items in use since start", "gauge" },
+	[PM_SLABS] = { "tbg_pool_slabs", "Slabs backing the pool", "gauge" },
+	[PM_GROWS] = { "tbg_pool_grow_events_total", "Times the pool grew by a slab", "counter" },
+	[PM_FALLBACK] = { "tbg_pool_fallback_allocs_total", "Allocations served by aligned_alloc past max_items", "counter" },
+	[PM_CORRUPTIONS] = { "tbg_pool_corruptions_total", "Hardened pool checks that failed (double/foreign free, overflow, write after free)", "counter" },
+	[PM_ALLOC_LATENCY] = { "tbg_pool_alloc_latency_seconds", "Sampled allocation latency per item", "summary" },
+	[PM_FREE_LATENCY] = { "tbg_pool_free_latency_seconds", "Sampled free latency per item", "summary" },
+};
+
+static long long pool_metric_value(int metric, const memory_pool_t *pool,
+                                   const pool_stats_t *st)
+{
+	switch (metric) {
+	case PM_ALLOCATED:
+		return st->allocated;
+	case PM_FREE:
+		return st->free;
+	case PM_IN_USE:
+		return st->allocated - st->free;
+	case PM_HIGH_WATER:
+		return st->high_water;
+	case PM_SLABS:
+		return st->slabs;
+	case PM_GROWS:
+		return (long long)st->grows;
+	case PM_FALLBACK:
+		return (long long)atomic_load(&pool->fallback_allocs);
+	case PM_CORRUPTIONS:
+		return (long long)st->corruptions;
+	default:
+		return 0;
+	}
+}
+
+int tbg_pool_format_metrics(char *buf, int buflen)
+{
+	memory_pool_t *pool;
+	int n = 0, m;
+
+	if (!buf || buflen <= 0)
+		return 0;
+	buf[0] = '\0';
+
+	pthread_mutex_lock(&registry_lock);
+
+	for (m = 0; m < PM_COUNT && n < buflen; m++) {
+		n += snprintf(buf + n, buflen - n, "# HELP %s %s\n# TYPE %s %s\n",
+		              pool_metrics[m].name, pool_metrics[m].help,
+		              pool_metrics[m].name, pool_metrics[m].type);
+
+		for (pool = pool_registry; pool && n < buflen;
+		     pool = pool->next_registered) {
+			pool_stats_t st = {0};
+
+			if (m == PM_ALLOC_LATENCY || m == PM_FREE_LATENCY) {
+				bool is_alloc = m == PM_ALLOC_LATENCY;
+				uint64_t sum = atomic_load(is_alloc ? &pool->alloc_ns_sum
+				                                    : &pool->free_ns_sum);
+				uint64_t cnt = atomic_load(is_alloc ? &pool->alloc_samples
+				                                    : &pool->free_samples);
+
+				n += snprintf(buf + n, buflen - n,
+				              "%s_sum{pool=\"%s\"} %.9f\n"
+				              "%s_count{pool=\"%s\"} %lu\n",
+				              pool_metrics[m].name, pool->name,
+				              (double)sum / 1e9,
+				              pool_metrics[m].name, pool->name,
+				              (unsigned long)cnt);
+				continue;
+			}
+
+			pool_collect(pool, &st);
+			n += snprintf(buf + n, buflen - n, "%s{pool=\"%s\"} %lld\n",
+			              pool_metrics[m].name, pool->name,
+			              pool_metric_value(m, pool, &st));
+		}
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+
+	/* snprintf reports the untruncated length; clamp to what fit */
+	return n < buflen ? n : buflen - 1;
+}
+
+/* ── Memory governor hooks ───────────────────────────────────────── */
+
+/* Bytes mapped for slabs and their bookkeeping. Caller holds pool->lock. */
+static size_t pool_bytes(const memory_pool_t *pool)
+{
+	size_t bytes = (size_t)pool->slabs_capacity * sizeof(pool_slab_t);
+	int i;
+
+	for (i = 0; i < pool->slab_count; i++) {
+		bytes += pool->slabs[i].bytes;
+		if (pool->slabs[i].live)
+			bytes += (pool->slabs[i].bytes / pool->aligned_size + 63) / 64 *
+			         sizeof(uint64_t);
+	}
+	return bytes;
+}
+
+/*
+ * Release every slab whose items are all on the free list. One pass over
+ * the free list counts free items per slab, a second drops the items of
+ * the slabs being released. Returns the bytes unmapped.
+ */
+static size_t pool_trim(memory_pool_t *pool)
+{
+	size_t released = 0;
+	void *head, *item, *next, **tail;
+	int *free_in;
+	int i, kept;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (pool->slab_count == 0 ||
+	    !(free_in = calloc((size_t)pool->slab_count, sizeof(int)))) {
+		pthread_mutex_unlock(&pool->lock);
+		return 0;
+	}
+
+	for (item = pool->free_list; item; item = *item_link(pool, item)) {
+		int idx = pool_find_slab(pool, item);
+
+		if (idx >= 0)
+			free_in[idx]++;
+	}
+
+	/* Mark empty slabs with -1 and unlink their items */
+	for (i = 0; i < pool->slab_count; i++)
+		free_in[i] = free_in[i] == pool->slabs[i].items ? -1 : 0;
+	head = NULL;
+	tail = &head;
+	for (item = pool->free_list; item; item = next) {
+		int idx = pool_find_slab(pool, item);
+
+		next = *item_link(pool, item);
+		if (idx >= 0 && free_in[idx] < 0) {
+			pool->total_free--;
+			continue;
+		}
+		*tail = item;
+		tail = item_link(pool, item);
+	}
+	*tail = NULL;
+	pool->free_list = head;
+
+	/* Unmap them, compacting the (still sorted) slab array */
+	for (i = 0, kept = 0; i < pool->slab_count; i++) {
+		pool_slab_t *slab = &pool->slabs[i];
+
+		if (free_in[i] >= 0) {
+			pool->slabs[kept++] = *slab;
+			continue;
+		}
+		pool->total_allocated -= slab->items;
+		if (slab->backing == POOL_BACKING_HUGETLB)
+			pool->hugetlb_slabs--;
+		else if (slab->backing == POOL_BACKING_THP)
+			pool->thp_slabs--;
+		released += slab->bytes;
+		range_remove(pool, slab->base);
+		slab_release(pool, slab);
+	}
+	pool->slab_count = kept;
+
+	pthread_mutex_unlock(&pool->lock);
+	free(free_in);
+
+	if (released)
+		LOGNOTICE("Memory pool '%s': trimmed %zu KB of empty slabs",
+		          pool->name, released >> 10);
+	return released;
+}
+
+size_t tbg_pool_trim(memory_pool_t *pool)
+{
+	size_t released = 0;
+	int i;
+
+	if (!pool)
+		return 0;
+	for (i = 0; i < pool->node_count; i++)
+		released += pool_trim(&pool->node_pools[i]);
+	return released + pool_trim(pool);
+}
+
+size_t tbg_pool_mem_usage(void *arg)
+{
+	memory_pool_t *pool;
+	size_t bytes = 0;
+	int i;
+
+	(void)arg;
+	pthread_mutex_lock(&registry_lock);
+	for (pool = pool_registry; pool; pool = pool->next_registered) {
+		pthread_mutex_lock(&pool->lock);
+		bytes += pool_bytes(pool);
+		pthread_mutex_unlock(&pool->lock);
+		for (i = 0; i < pool->node_count; i++) {
+			memory_pool_t *node = &pool->node_pools[i];
+
+			pthread_mutex_lock(&node->lock);
+			bytes += pool_bytes(node);
+			pthread_mutex_unlock(&node->lock);
+		}
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	return bytes;
+}
+
+size_t tbg_pool_mem_pressure(int level, void *arg)
+{
+	memory_pool_t *pool;
+	size_t released = 0;
+
+	(void)arg;
+	if (level < MEMGOV_ELEVATED)
+		return 0;
+
+	pthread_mutex_lock(&registry_lock);
+	for (pool = pool_registry; pool; pool = pool->next_registered)
+		released += tbg_pool_trim(pool);
+	pthread_mutex_unlock(&registry_lock);
+
+	return released;
+}
+
+pool_backing_t tbg_pool_backing(const memory_pool_t *pool)
+{
+	pool_backing_t weakest = POOL_BACKING_HUGETLB;
+	bool any = false;
+	int i;
+
+	if (!pool)
+		return POOL_BACKING_HEAP;
+
+	for (i = 0; i < pool->slab_count; i++) {
+		any = true;
+		if (pool->slabs[i].backing > weakest)
+			weakest = pool->slabs[i].backing;
+	}
+	for (i = 0; i < pool->node_count; i++) {
+		const memory_pool_t *node = &pool->node_pools[i];
+		pool_backing_t b;
+
+		if (node->slab_count == 0)
+			continue;
+		any = true;
+		b = tbg_pool_backing(node);
+		if (b > weakest)
+			weakest = b;
+	}
+	return any ? weakest : POOL_BACKING_HEAP;
+}
+
+const char *tbg_pool_backing_name(pool_backing_t backing)
+{
+	switch (backing) {
+	case POOL_BACKING_HUGETLB:
+		return "hugetlb";
+	case POOL_BACKING_THP:
+		return "thp";
+	case POOL_BACKING_PAGES:
+		return "pages";
+	case POOL_BACKING_HEAP:
+	default:
+		return "heap";
+	}
+}
+
+/* ── Request-scoped bump arena ───────────────────────────────────── */
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static arena_chunk_t *arena_chunk_new(size_t size)
+{
+	arena_chunk_t *chunk;
+
+	chunk = aligned_alloc(POOL_CACHE_LINE_SIZE,
+	                      align_up(sizeof(*chunk) + size, POOL_CACHE_LINE_SIZE));
+	if (!chunk)
+		return NULL;
+	chunk->next = NULL;
+	chunk->size = size;
+	return chunk;
+}
+
+void tbg_arena_init(tbg_arena_t *arena, size_t chunk_size)
+{
+	memset(arena, 0, sizeof(*arena));
+	arena->chunk_size = chunk_size ? align_up(chunk_size, ARENA_ALIGN)
+	                               : ARENA_CHUNK_SIZE;
+}
+
+void *tbg_arena_alloc(tbg_arena_t *arena, size_t size)
+{
+	arena_chunk_t *chunk;
+	void *ptr;
+
+	if (!arena)
+		return NULL;
+
+	size = align_up(size ? size : 1, ARENA_ALIGN);
+
+	/* Oversized: dedicated block, released on reset */
+	if (size > arena->chunk_size) {
+		chunk = arena_chunk_new(size);
+		if (!chunk)
+			return NULL;
+		chunk->next = arena->large;
+		arena->large = chunk;
+		arena->in_use += size;
+		return chunk->data;
+	}
+
+	chunk = arena->current;
+	if (!chunk || arena->used + size > chunk->size) {
+		/* Move to the next retained chunk, or add one */
+		if (chunk && chunk->next) {
+			chunk = chunk->next;
+		} else {
+			arena_chunk_t *fresh = arena_chunk_new(arena->chunk_size);
+
+			if (!fresh)
+				return NULL;
+			if (chunk)
+				chunk->next = fresh;
+			else
+				arena->head = fresh;
+			chunk = fresh;
+		}
+		arena->current = chunk;
+		arena->used = 0;
+	}
+
+	ptr = chunk->data + arena->used;
+	arena->used += size;
+	arena->in_use += size;
+	return ptr;
+}
+
+char *tbg_arena_strndup(tbg_arena_t *arena, const char *str, size_t len)
+{
+	char *copy;
+
+	if (!str)
+		return NULL;
+	len = strnlen(str, len);
+	copy = tbg_arena_alloc(arena, len + 1);
+	if (!copy)
+		return NULL;
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+	return copy;
+}
+
+void tbg_arena_reset(tbg_arena_t *arena)
+{
+	if (!arena)
+		return;
+
+	/* Only messages that outgrew a chunk have anything to free */
+	while (arena->large) {
+		arena_chunk_t *next = arena->large->next;
+
+		free(arena->large);
+		arena->large = next;
+	}
+
+	if (arena->in_use > arena->high_water)
+		arena->high_water = arena->in_use;
+	arena->current = arena->head;
+	arena->used = 0;
+	arena->in_use = 0;
+}
+
+void tbg_arena_destroy(tbg_arena_t *arena)
+{
+	arena_chunk_t *chunk;
+
+	if (!arena)
+		return;
+
+	tbg_arena_reset(arena);
+	chunk = arena->head;
+	while (chunk) {
+		arena_chunk_t *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+	arena->head = NULL;
+	arena->current = NULL;
+}
+
+static void arena_thread_free(void *arg)
+{
+	tbg_arena_destroy(arg);
+	free(arg);
+}
+
+static void arena_key_create(void)
+{
+	pthread_key_create(&arena_key, arena_thread_free);
+}
+
+tbg_arena_t *tbg_arena_thread(void)
+{
+	tbg_arena_t *arena;
+
+	pthread_once(&arena_key_once, arena_key_create);
+	arena = pthread_getspecific(arena_key);
+	if (arena)
+		return arena;
+
+	arena = malloc(sizeof(*arena));
+	if (!arena)
+		return NULL;
+	tbg_arena_init(arena, 0);
+	if (pthread_setspecific(arena_key, arena) != 0) {
+		free(arena);
+		return NULL;
+	}
+	return arena;
 }
@@ -2,9 +2,15 @@
  * memory_pool.h — Slab-based pool allocator for hot-path allocations
  * THE BITCOIN GAME — GPLv3
  *
- * Pre-allocates cache-line aligned slabs for share structs and event
+ * Pre-allocates slabs of fixed-size slots (cache-line aligned unless
+ * the pool asks for a tighter packing) for share structs and event
  * buffers, providing O(1) allocation and deallocation without syscalls
  * on the hot path. Falls back to aligned_alloc when the pool is exhausted.
+ * Slabs can optionally be backed by 2 MB huge pages to cut TLB misses
+ * when large pools are walked, and split per NUMA node so items stay
+ * local to the socket that uses them.
+ *
+ * Also provides a per-thread bump arena for per-message temporaries.
  *
  * Target: <300MB total memory at 100k connections (down from ~600MB).
  */
@@ -15,6 +21,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
 /* Cache line size for alignment */
@@ -26,20 +33,101 @@
 /* Maximum items per pool before refusing to grow */
 #define POOL_MAX_ITEMS        1000000
 
+/* Time one in this many alloc/free calls per thread (power of 2) */
+#define POOL_LATENCY_SAMPLE   1024
+
+/* Huge page size used for slab backing (x86_64 / arm64 default) */
+#define POOL_HUGE_PAGE_SIZE   (2 * 1024 * 1024)
+
+/* Pool creation flags */
+#define POOL_F_HUGEPAGES      (1u << 0)  /* Back slabs with 2 MB huge pages */
+#define POOL_F_NUMA           (1u << 1)  /* Per-NUMA-node sub-pools */
+#define POOL_F_PACKED         (1u << 2)  /* Pointer-aligned slots, no padding */
+#define POOL_F_HARDENED       (1u << 3)  /* Canaries, poisoning, live bitmap */
+
+/* POOL_F_HARDENED: byte written over freed items */
+#define POOL_POISON_BYTE      0xdb
+
+/* POOL_F_HARDENED: canary word stored after each item */
+#define POOL_CANARY_SIZE      sizeof(uint64_t)
+
+/* Smallest slot alignment a pool accepts (the free-list link) */
+#define POOL_MIN_ALIGN        sizeof(void *)
+
+/*
+ * Backing actually obtained for a slab, strongest first. With
+ * POOL_F_HUGEPAGES the pool tries MAP_HUGETLB (reserved pages, see
+ * vm.nr_hugepages), then an anonymous mapping with MADV_HUGEPAGE.
+ */
+typedef enum {
+	POOL_BACKING_HUGETLB,       /* mmap(MAP_HUGETLB) */
+	POOL_BACKING_THP,           /* mmap + madvise(MADV_HUGEPAGE) */
+	POOL_BACKING_PAGES,         /* mmap, kernel refused THP advice */
+	POOL_BACKING_HEAP           /* aligned_alloc, regular pages */
+} pool_backing_t;
+
+typedef struct pool_slab {
+	void *base;                 /* Slab start (first item) */
+	size_t bytes;               /* Mapped length */
+	pool_backing_t backing;
+	int items;                  /* Slots carved into items */
+	uint64_t *live;             /* POOL_F_HARDENED: bit per slot, set while allocated */
+} pool_slab_t;
+
 typedef struct memory_pool {
 	void **free_list;           /* Intrusive free list (items point to next) */
 	size_t item_size;           /* Size of each allocated item */
-	size_t aligned_size;        /* item_size rounded up to cache line */
+	size_t aligned_size;        /* item_size rounded up to align */
+	size_t align;               /* Slot alignment (8..64, power of 2) */
+	size_t link_off;            /* Offset of the free-list link in a slot */
 	int total_allocated;        /* Total items ever allocated */
 	int total_free;             /* Items currently in the free list */
 	int max_items;              /* Maximum pool growth limit */
 	int slab_count;             /* Number of slabs allocated */
-	void **slabs;               /* Array of slab base pointers for cleanup */
+	pool_slab_t *slabs;         /* Slab descriptors for cleanup */
 	int slabs_capacity;         /* Capacity of slabs array */
+	unsigned int flags;         /* POOL_F_* creation flags */
+	int hugetlb_slabs;          /* Slabs backed by MAP_HUGETLB */
+	int thp_slabs;              /* Slabs backed by transparent huge pages */
+	int numa_node;              /* Node slabs are bound to, -1 if unbound */
+	struct memory_pool *node_pools; /* POOL_F_NUMA: one sub-pool per node */
+	int node_count;             /* Entries in node_pools (0 if not NUMA) */
+	struct memory_pool *parent; /* Node sub-pools: the pool they belong to */
+	struct pool_range_table *_Atomic ranges; /* POOL_F_NUMA: slab owners by address */
+	_Atomic int range_count;    /* Entries in use in ranges */
+	_Atomic unsigned int range_seq;  /* Odd while ranges is being changed */
 	pthread_mutex_t lock;       /* Protects free list and counters */
 	const char *name;           /* Pool name for logging */
+	uint64_t canary;            /* POOL_F_HARDENED: per-pool canary secret */
+	void (*ctor)(void *obj, void *arg);  /* Object cache constructor */
+	void (*dtor)(void *obj, void *arg);  /* Object cache destructor */
+	void *ctor_arg;
+
+	/* Instrumentation (exported by tbg_pool_format_metrics) */
+	int high_water;             /* Peak items in use */
+	uint64_t grow_events;       /* Successful pool_grow() calls */
+	_Atomic uint64_t fallback_allocs;  /* aligned_alloc past max_items */
+	_Atomic uint64_t alloc_ns_sum;     /* Sampled alloc latency */
+	_Atomic uint64_t alloc_samples;
+	_Atomic uint64_t free_ns_sum;      /* Sampled free latency */
+	_Atomic uint64_t free_samples;
+	_Atomic uint64_t corruptions;      /* Failed POOL_F_HARDENED checks */
+	struct memory_pool *next_registered; /* Metrics registry link */
 } memory_pool_t;
 
+/* Extended pool options for tbg_pool_init_opts() */
+typedef struct memory_pool_opts {
+	size_t item_size;
+	int initial_count;
+	int max_items;              /* 0 = POOL_MAX_ITEMS */
+	const char *name;
+	unsigned int flags;         /* POOL_F_* */
+	size_t align;               /* 8/16/32/64, 0 = default (see below) */
+	void (*ctor)(void *obj, void *arg);  /* Object cache mode (see below) */
+	void (*dtor)(void *obj, void *arg);
+	void *ctor_arg;             /* Passed to ctor and dtor */
+} memory_pool_opts_t;
+
 /*
  * Initialize a memory pool.
  *
@@ -51,12 +139,62 @@ typedef struct memory_pool {
 void tbg_pool_init(memory_pool_t *pool, size_t item_size,
                    int initial_count, int max_items, const char *name);
 
+/*
+ * Initialize a memory pool with extended options (creation flags).
+ * tbg_pool_init() is equivalent to this with flags = 0.
+ *
+ * Slots are aligned to opts->align. By default that is a full cache
+ * line, so two items never share a line: keep it for objects written
+ * by more than one thread (share structs, per-worker counters). Small
+ * read-mostly objects should pass POOL_F_PACKED, which defaults the
+ * alignment to POOL_MIN_ALIGN and rounds slots only to that, or an
+ * explicit 16/32 where the type needs it. An invalid align falls back
+ * to the cache line with a warning.
+ *
+ * POOL_F_NUMA splits the pool into one sub-pool per NUMA node, each with
+ * slabs bound to its node and max_items / nodes capacity. Allocation
+ * picks the caller's node via getcpu() (borrowing from another node only
+ * when the local one is full); free returns an item to the node that owns
+ * its slab, whichever CPU frees it. Ignored on single-node hosts.
+ */
+void tbg_pool_init_opts(memory_pool_t *pool, const memory_pool_opts_t *opts);
+
+/*
+ * POOL_F_HARDENED adds three checks that are cheap enough to leave on in
+ * production (a bitmap probe and a canary compare per call, plus a
+ * memset on free):
+ *
+ *   - A canary word after each item, keyed by a random per-pool secret
+ *     and the item address, verified on free (linear overflow).
+ *   - Freed items are poisoned with POOL_POISON_BYTE; the first cache
+ *     line is verified on alloc (write after free).
+ *   - A per-slab bitmap of live slots, checked on free (double free,
+ *     pointers that are not the start of a slot of this pool).
+ *
+ * A failed check is logged, counted in tbg_pool_corruptions_total and
+ * the item is quarantined rather than reused; the process keeps
+ * running. Each slot grows by POOL_CANARY_SIZE, and allocations past
+ * max_items are tracked as one-slot slabs so they are checked too.
+ *
+ * Setting opts->ctor turns the pool into an object cache: ctor runs once
+ * per object when its slab is created (or on a fallback allocation), and
+ * dtor once per object at tbg_pool_destroy(). In between, the free-list
+ * link lives after the object rather than inside it, so an object freed
+ * in its constructed state (mutex initialized, list heads empty, buffers
+ * attached) comes back from tbg_pool_alloc() that way and the caller
+ * skips the memset and re-init. Callers must return objects to that
+ * state before freeing them. Costs one pointer per slot; POOL_F_HARDENED
+ * keeps its canary and bitmap checks but does not poison constructed
+ * objects.
+ */
+
 /*
  * Allocate an item from the pool.
  * O(1) from free list, falls back to aligned_alloc if free list is empty.
  * Returns NULL only on total memory exhaustion.
  *
- * The returned memory is NOT zeroed. Caller must initialize all fields.
+ * The returned memory is NOT zeroed. Caller must initialize all fields
+ * (object caches: only what the constructor does not).
  */
 void *tbg_pool_alloc(memory_pool_t *pool);
 
@@ -66,6 +204,21 @@ void *tbg_pool_alloc(memory_pool_t *pool);
  */
 void tbg_pool_free(memory_pool_t *pool, void *item);
 
+/*
+ * Allocate n items into out[] with one lock acquisition (per NUMA node)
+ * instead of n. The pool grows at most once to cover the batch.
+ * Returns the number of items stored, which is n unless memory is
+ * exhausted. Items are NOT zeroed.
+ */
+int tbg_pool_alloc_bulk(memory_pool_t *pool, int n, void **out);
+
+/*
+ * Return n items to the pool. They are chained outside the lock and
+ * spliced onto the free list in one step. NULL entries are skipped.
+ * items[] is used as scratch space and may be reordered.
+ */
+void tbg_pool_free_bulk(memory_pool_t *pool, int n, void **items);
+
 /*
  * Destroy a memory pool and free all slabs.
  * All items must have been returned before calling this,
@@ -80,4 +233,95 @@ int tbg_pool_total_allocated(const memory_pool_t *pool);
 int tbg_pool_total_free(const memory_pool_t *pool);
 int tbg_pool_in_use(const memory_pool_t *pool);
 
+/*
+ * Format per-pool metrics for every initialized pool in Prometheus
+ * exposition format, labelled by pool name. Covers free/allocated/in-use
+ * items, high-water mark, slab count, grow events, fallback allocations
+ * and sampled alloc/free latency. Returns the number of bytes written.
+ */
+int tbg_pool_format_metrics(char *buf, int buflen);
+
+/*
+ * Release the pool's slabs whose items are all free, running the
+ * destructor of object caches. Returns the bytes unmapped. Items
+ * allocated past max_items on non-hardened pools are never released.
+ */
+size_t tbg_pool_trim(memory_pool_t *pool);
+
+/*
+ * Memory governor callbacks (see tbg_memgov.h), covering every
+ * initialized pool: slab bytes held, and a trim of all pools from
+ * MEMGOV_ELEVATED up. arg is unused.
+ */
+size_t tbg_pool_mem_usage(void *arg);
+size_t tbg_pool_mem_pressure(int level, void *arg);
+
+/*
+ * Weakest backing among the pool's slabs, i.e. what every item is
+ * guaranteed to sit on. A pool without slabs reports POOL_BACKING_HEAP.
+ */
+pool_backing_t tbg_pool_backing(const memory_pool_t *pool);
+const char *tbg_pool_backing_name(pool_backing_t backing);
+
+/* ── Request-scoped bump arena ───────────────────────────────────── */
+
+/*
+ * A bump-pointer arena for short-lived temporaries whose lifetime is a
+ * single Stratum message (recv, parse, validate, hash, respond): decoded
+ * hex, header buffers, response strings. Allocation is a pointer bump;
+ * everything is released at once by tbg_arena_reset(), which is O(1).
+ *
+ * Chunks are kept across resets, so a thread that has seen its largest
+ * message never mallocs again. Requests larger than a chunk get a
+ * dedicated block that is freed on reset.
+ *
+ * Not thread-safe: use one arena per thread (see tbg_arena_thread()).
+ */
+
+/* Default arena chunk size (fits a typical mining.submit round trip) */
+#define ARENA_CHUNK_SIZE      16384
+
+/* Alignment of every arena allocation */
+#define ARENA_ALIGN           16
+
+typedef struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;                /* Usable bytes in data[] */
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+} arena_chunk_t;
+
+typedef struct tbg_arena {
+	arena_chunk_t *head;        /* First chunk, retained across resets */
+	arena_chunk_t *current;     /* Chunk being bumped */
+	size_t used;                /* Bytes used in current chunk */
+	arena_chunk_t *large;       /* Oversized blocks, freed on reset */
+	size_t chunk_size;          /* Size of regular chunks */
+	size_t in_use;              /* Bytes handed out since last reset */
+	size_t high_water;          /* Largest in_use seen at a reset */
+} tbg_arena_t;
+
+/* Initialize an empty arena (chunk_size 0 = ARENA_CHUNK_SIZE) */
+void tbg_arena_init(tbg_arena_t *arena, size_t chunk_size);
+
+/*
+ * Allocate size bytes, aligned to ARENA_ALIGN. The memory is NOT zeroed.
+ * Returns NULL only on memory exhaustion.
+ */
+void *tbg_arena_alloc(tbg_arena_t *arena, size_t size);
+
+/* Copy a string into the arena (NUL-terminated, at most len bytes) */
+char *tbg_arena_strndup(tbg_arena_t *arena, const char *str, size_t len);
+
+/* Release every allocation at once. Chunks are kept for reuse. */
+void tbg_arena_reset(tbg_arena_t *arena);
+
+/* Free all chunks. The arena can be re-initialized afterwards. */
+void tbg_arena_destroy(tbg_arena_t *arena);
+
+/*
+ * The calling thread's message arena, created on first use and freed
+ * when the thread exits.
+ */
+tbg_arena_t *tbg_arena_thread(void);
+
 #endif /* TBG_MEMORY_POOL_H */
@@ -2,10 +2,22 @@
  * rate_limit.c — Token-bucket rate limiter for ckpool
  * THE BITCOIN GAME — GPLv3
  *
- * Implements per-IP and per-connection rate limiting using token buckets
- * with a hash map (uthash) for IP state tracking. A background thread
- * periodically cleans up stale entries to prevent memory leaks from
- * transient connections.
+ * Implements per-IP and per-connection rate limiting using token buckets.
+ * IP state is kept inline in open-addressing hash tables (linear probing,
+ * backward-shift deletion) keyed by 16-byte binary addresses and hashed
+ * with a per-process random seed, so crafted IPv6 addresses cannot force
+ * long probe chains. The table is split into RATE_TABLE_STRIPES stripes,
+ * each with its own lock. Subnet limits and prefix bans live in a
+ * path-compressed longest-prefix-match trie alongside it. A background
+ * thread expires stale entries incrementally, a bounded batch per lock
+ * hold, so cleanup never stalls connects on a large table. A Count-Min
+ * Sketch in front of the table keeps a spray of one-off sources from
+ * filling it. Share-processing latency and queue depth feed a load level
+ * that makes connect, subscribe and authorize cost more tokens.
+ * Rejected connects are counted per source and summarised periodically
+ * rather than logged one by one. Soft-bans and hot connect buckets are
+ * snapshotted to a file and reloaded at init, so a restart does not
+ * hand abusers a clean slate.
  */
 
 #include "config.h"
@@ -16,180 +28,2381 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "rate_limit.h"
-#include "uthash.h"
+#include "tbg_clock.h"
+#include "tbg_memgov.h"
 #include "libckpool.h"
 
-/* ── Internal uthash entry with actual hash handle ───────────────── */
+/* ── IP table ────────────────────────────────────────────────────── */
 
-typedef struct ip_rate_entry {
-	char ip[INET6_ADDRSTRLEN];
-	rate_bucket_t connect_bucket;
+/* Set on every occupied slot's hash so 0 can mean empty */
+#define SLOT_USED  0x80000000u
+
+/* Stripe from hash bits 24-29: above any slot index, below SLOT_USED */
+#define STRIPE_SHIFT      24
+#define STRIPE_INITIAL    (RATE_TABLE_INITIAL / RATE_TABLE_STRIPES)
+
+_Static_assert((RATE_TABLE_STRIPES & (RATE_TABLE_STRIPES - 1)) == 0 &&
+               RATE_TABLE_STRIPES <= 64, "RATE_TABLE_STRIPES");
+_Static_assert(STRIPE_INITIAL >= 2, "RATE_TABLE_INITIAL too small");
+
+typedef struct ip_table {
+	ip_rate_state_t *slots;
+	uint32_t mask;                   /* Capacity - 1 */
+	uint32_t count;
+} ip_table_t;
+
+/* Cache-line aligned so neighbouring stripe locks do not false-share */
+typedef struct ip_stripe {
+	pthread_rwlock_t lock;
+	ip_table_t table;
+	uint32_t sweep_pos;              /* Next slot the cleanup thread visits */
+	uint32_t sweep_bans;             /* Banned entries seen this pass */
+	_Atomic uint32_t bans;           /* Banned entries at the last pass end */
+} __attribute__((aligned(64))) ip_stripe_t;
+
+/* ── Global state ────────────────────────────────────────────────── */
+
+static ip_stripe_t ip_stripes[RATE_TABLE_STRIPES] = {
+	[0 ... RATE_TABLE_STRIPES - 1] = { .lock = PTHREAD_RWLOCK_INITIALIZER }
+};
+static uint64_t hash_seed[2];
+
+/*
+ * The configuration in force. tbg_rate_limit_reload() publishes a new
+ * copy rather than editing this one, so a reader always sees one whole
+ * configuration. Superseded copies stay allocated until shutdown, since
+ * a reader may still hold one; a reload is a rare operator action.
+ */
+typedef struct config_slot {
+	rate_limit_config_t config;
+	struct config_slot *older;
+} config_slot_t;
+
+static config_slot_t config_unset;      /* All zero, before init */
+static _Atomic(config_slot_t *) g_config = ATOMIC_VAR_INIT(&config_unset);
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Reload requested (by a signal handler) and how to read the new one */
+static _Atomic int reload_requested = ATOMIC_VAR_INIT(0);
+static tbg_rate_limit_load_fn reload_fn;
+static void *reload_ctx;
+
+static inline const rate_limit_config_t *config_get(void)
+{
+	return &atomic_load_explicit(&g_config, memory_order_acquire)->config;
+}
+static _Atomic int32_t g_total_connections = ATOMIC_VAR_INIT(0);
+static volatile int cleanup_running = 0;
+static pthread_t cleanup_thread;
+
+/* Memory governor level, applied as tighter admission */
+static _Atomic int g_pressure = ATOMIC_VAR_INIT(MEMGOV_NORMAL);
+
+/* ── Token bucket operations ─────────────────────────────────────── */
+
+/* Monotonic milliseconds, truncated to the bucket's 32-bit field */
+static inline uint32_t now_ms(void)
+{
+	return (uint32_t)tbg_clock_mono_ms();
+}
+
+static inline uint64_t bucket_pack(uint32_t tokens, uint32_t ms)
+{
+	return (uint64_t)tokens << 32 | ms;
+}
+
+static void bucket_init(rate_bucket_t *b, uint32_t max_tokens,
+                        uint32_t refill_per_min)
+{
+	if (max_tokens > RATE_BUCKET_MAX)
+		max_tokens = RATE_BUCKET_MAX;
+	b->max_tokens = max_tokens;
+	b->refill_per_min = refill_per_min;
+	atomic_store(&b->state,
+	             bucket_pack(max_tokens << RATE_TOKEN_SHIFT, now_ms()));
+}
+
+/*
+ * Take cost fixed-point tokens, refilling first for the time since the
+ * last refill. A cost above the bucket's capacity takes a full bucket,
+ * so every bucket still admits one call per refill. Lock-free: the
+ * refill and the take land in one CAS, so concurrent callers never
+ * double-count elapsed time. A rejected call writes nothing.
+ */
+static bool bucket_take(rate_bucket_t *b, uint64_t cost)
+{
+	uint64_t old = atomic_load_explicit(&b->state, memory_order_acquire);
+	uint64_t cap = (uint64_t)b->max_tokens << RATE_TOKEN_SHIFT;
+
+	if (cost > cap)
+		cost = cap;
+	if (cost < RATE_TOKEN_ONE)
+		cost = RATE_TOKEN_ONE;
+
+	for (;;) {
+		/* Read the clock after loading the state, which the acquire
+		 * orders, so a refill committed by another thread is never in
+		 * our future. A stamp at or past now still counts as no time
+		 * elapsed rather than wrapping to a full refill. */
+		uint32_t now = now_ms();
+		uint64_t tokens = old >> 32;
+		uint32_t last = (uint32_t)old;
+		int32_t elapsed = (int32_t)(now - last);
+
+		/* A minute refills any bucket; capping also bounds the math */
+		if (elapsed > 60000)
+			elapsed = 60000;
+		if (elapsed > 0) {
+			uint64_t add = (uint64_t)elapsed * b->refill_per_min *
+			               RATE_TOKEN_ONE / 60000;
+
+			/* Keep accruing until at least one fixed-point unit is due */
+			if (add) {
+				tokens = tokens + add > cap ? cap : tokens + add;
+				last = now;
+			}
+		}
+
+		if (tokens < cost)
+			return false;
+		if (atomic_compare_exchange_weak_explicit(&b->state, &old,
+		        bucket_pack((uint32_t)(tokens - cost), last),
+		        memory_order_acq_rel, memory_order_acquire))
+			return true;
+	}
+}
+
+static inline bool bucket_consume(rate_bucket_t *b)
+{
+	return bucket_take(b, RATE_TOKEN_ONE);
+}
+
+/* Give b a new size and refill rate, trimming its level to the new
+ * size. The caller keeps others from taking while it does. */
+static void bucket_resize(rate_bucket_t *b, uint32_t max_tokens,
+                          uint32_t refill_per_min)
+{
+	uint64_t old = atomic_load(&b->state);
+	uint64_t tokens = old >> 32;
+
+	if (max_tokens > RATE_BUCKET_MAX)
+		max_tokens = RATE_BUCKET_MAX;
+	if (tokens > (uint64_t)max_tokens << RATE_TOKEN_SHIFT)
+		tokens = (uint64_t)max_tokens << RATE_TOKEN_SHIFT;
+	b->max_tokens = max_tokens;
+	b->refill_per_min = refill_per_min;
+	atomic_store(&b->state, bucket_pack((uint32_t)tokens, (uint32_t)old));
+}
+
+/* ── Keys and hashing ────────────────────────────────────────────── */
+
+/* 64x64->128 multiply, folded */
+static inline uint64_t mix64(uint64_t a, uint64_t b)
+{
+	__uint128_t r = (__uint128_t)a * b;
+
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static uint32_t key_hash(const struct in6_addr *key)
+{
+	uint64_t lo, hi, h;
+
+	memcpy(&lo, key->s6_addr, sizeof(lo));
+	memcpy(&hi, key->s6_addr + 8, sizeof(hi));
+	h = mix64(lo ^ hash_seed[0], hi ^ hash_seed[1]);
+	h = mix64(h ^ hash_seed[1], 0x9e3779b97f4a7c15ULL);
+	return (uint32_t)h | SLOT_USED;
+}
+
+static inline bool key_eq(const struct in6_addr *a, const struct in6_addr *b)
+{
+	return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+/* Printable form for log messages (IPv4 for v4-mapped keys) */
+static const char *key_str(const struct in6_addr *key, char *buf)
+{
+	if (IN6_IS_ADDR_V4MAPPED(key))
+		return inet_ntop(AF_INET, key->s6_addr + 12, buf,
+		                 INET6_ADDRSTRLEN);
+	return inet_ntop(AF_INET6, key, buf, INET6_ADDRSTRLEN);
+}
+
+bool tbg_rate_limit_key_from_str(const char *ip, struct in6_addr *key)
+{
+	char buf[INET6_ADDRSTRLEN];
+	struct in_addr v4;
+	const char *zone;
+
+	if (!ip || !key)
+		return false;
+
+	if (inet_pton(AF_INET, ip, &v4) == 1) {
+		memset(key, 0, sizeof(*key));
+		key->s6_addr[10] = 0xff;
+		key->s6_addr[11] = 0xff;
+		memcpy(key->s6_addr + 12, &v4, sizeof(v4));
+		return true;
+	}
+
+	/* Drop a zone suffix, which inet_pton() rejects */
+	zone = strchr(ip, '%');
+	if (zone) {
+		size_t len = (size_t)(zone - ip);
+
+		if (len >= sizeof(buf))
+			return false;
+		memcpy(buf, ip, len);
+		buf[len] = '\0';
+		ip = buf;
+	}
+	return inet_pton(AF_INET6, ip, key) == 1;
+}
+
+bool tbg_rate_limit_key_from_sockaddr(const struct sockaddr *sa,
+                                      struct in6_addr *key)
+{
+	if (!sa || !key)
+		return false;
+
+	if (sa->sa_family == AF_INET) {
+		const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+
+		memset(key, 0, sizeof(*key));
+		key->s6_addr[10] = 0xff;
+		key->s6_addr[11] = 0xff;
+		memcpy(key->s6_addr + 12, &sin->sin_addr, 4);
+		return true;
+	}
+	if (sa->sa_family == AF_INET6) {
+		*key = ((const struct sockaddr_in6 *)sa)->sin6_addr;
+		return true;
+	}
+	return false;
+}
+
+/* ── Heavy-hitter sketch ──────────────────────────────────────────── */
+
+/*
+ * Count-Min Sketch of connect attempts per source, with conservative
+ * update: only the row counters at the current minimum are bumped, which
+ * keeps the overestimate from hash collisions small. Counters are atomic
+ * and lock-free. The RATE_HEAVY_HITTERS largest estimates are kept in a
+ * min-heap under a mutex, which connects only take once their estimate
+ * beats the smallest one held.
+ */
+
+static _Atomic uint32_t sketch[RATE_SKETCH_DEPTH][RATE_SKETCH_WIDTH];
+static uint64_t sketch_seed[RATE_SKETCH_DEPTH];
+
+static struct {
+	pthread_mutex_t lock;
+	rate_limit_hitter_t heap[RATE_HEAVY_HITTERS];   /* Min-heap */
+	int count;
+} hitters = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Smallest count in a full heap, else 0 */
+static _Atomic uint32_t hitters_floor = ATOMIC_VAR_INIT(0);
+
+_Static_assert((RATE_SKETCH_WIDTH & (RATE_SKETCH_WIDTH - 1)) == 0,
+               "RATE_SKETCH_WIDTH");
+
+static void sketch_rows(const struct in6_addr *key, uint32_t *idx)
+{
+	uint64_t lo, hi;
+	int d;
+
+	memcpy(&lo, key->s6_addr, sizeof(lo));
+	memcpy(&hi, key->s6_addr + 8, sizeof(hi));
+	for (d = 0; d < RATE_SKETCH_DEPTH; d++)
+		idx[d] = (uint32_t)mix64(lo ^ sketch_seed[d], hi ^ hash_seed[1]) &
+		         (RATE_SKETCH_WIDTH - 1);
+}
+
+/* Count one attempt from key; returns the new estimate */
+static uint32_t sketch_add(const struct in6_addr *key)
+{
+	uint32_t idx[RATE_SKETCH_DEPTH], min = UINT32_MAX;
+	int d;
+
+	sketch_rows(key, idx);
+	for (d = 0; d < RATE_SKETCH_DEPTH; d++) {
+		uint32_t v = atomic_load_explicit(&sketch[d][idx[d]],
+		                                  memory_order_relaxed);
+
+		if (v < min)
+			min = v;
+	}
+	if (min == UINT32_MAX)
+		return min;
+
+	/* A racing update may bump a row twice; that only overestimates */
+	for (d = 0; d < RATE_SKETCH_DEPTH; d++) {
+		uint32_t v = min;
+
+		atomic_compare_exchange_strong_explicit(&sketch[d][idx[d]], &v,
+		        min + 1, memory_order_relaxed, memory_order_relaxed);
+	}
+	return min + 1;
+}
+
+/* Estimate without counting; only the tests read it */
+static __attribute__((unused)) uint32_t
+sketch_estimate(const struct in6_addr *key)
+{
+	uint32_t idx[RATE_SKETCH_DEPTH], min = UINT32_MAX;
+	int d;
+
+	sketch_rows(key, idx);
+	for (d = 0; d < RATE_SKETCH_DEPTH; d++) {
+		uint32_t v = atomic_load_explicit(&sketch[d][idx[d]],
+		                                  memory_order_relaxed);
+
+		if (v < min)
+			min = v;
+	}
+	return min;
+}
+
+static void hitters_swap(int a, int b)
+{
+	rate_limit_hitter_t tmp = hitters.heap[a];
+
+	hitters.heap[a] = hitters.heap[b];
+	hitters.heap[b] = tmp;
+}
+
+static void hitters_sift_down(int i)
+{
+	for (;;) {
+		int l = 2 * i + 1, r = l + 1, min = i;
+
+		if (l < hitters.count &&
+		    hitters.heap[l].connects < hitters.heap[min].connects)
+			min = l;
+		if (r < hitters.count &&
+		    hitters.heap[r].connects < hitters.heap[min].connects)
+			min = r;
+		if (min == i)
+			return;
+		hitters_swap(i, min);
+		i = min;
+	}
+}
+
+static void hitters_sift_up(int i)
+{
+	while (i > 0 && hitters.heap[i].connects <
+	                hitters.heap[(i - 1) / 2].connects) {
+		hitters_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+/* Caller holds hitters.lock */
+static int hitters_find(const struct in6_addr *key)
+{
+	int i;
+
+	for (i = 0; i < hitters.count; i++) {
+		if (key_eq(&hitters.heap[i].addr, key))
+			return i;
+	}
+	return -1;
+}
+
+/* Offer key's latest estimate to the heavy-hitter heap */
+static void hitters_offer(const struct in6_addr *key, uint32_t connects)
+{
+	int i;
+
+	if (connects <= atomic_load_explicit(&hitters_floor,
+	                                     memory_order_relaxed))
+		return;
+
+	pthread_mutex_lock(&hitters.lock);
+	i = hitters_find(key);
+	if (i >= 0) {
+		/* Estimates only grow between decays */
+		hitters.heap[i].connects = connects;
+		hitters_sift_down(i);
+	} else if (hitters.count < RATE_HEAVY_HITTERS) {
+		i = hitters.count++;
+		hitters.heap[i].addr = *key;
+		hitters.heap[i].connects = connects;
+		hitters_sift_up(i);
+	} else if (connects > hitters.heap[0].connects) {
+		hitters.heap[0].addr = *key;
+		hitters.heap[0].connects = connects;
+		hitters_sift_down(0);
+	}
+	if (hitters.count == RATE_HEAVY_HITTERS)
+		atomic_store(&hitters_floor, hitters.heap[0].connects);
+	pthread_mutex_unlock(&hitters.lock);
+}
+
+static bool hitters_contains(const struct in6_addr *key)
+{
+	bool found;
+
+	pthread_mutex_lock(&hitters.lock);
+	found = hitters_find(key) >= 0;
+	pthread_mutex_unlock(&hitters.lock);
+	return found;
+}
+
+/* Halve every count, sketch and heap, so old bursts fade */
+static void sketch_decay(void)
+{
+	int d, w, i;
+
+	for (d = 0; d < RATE_SKETCH_DEPTH; d++) {
+		for (w = 0; w < RATE_SKETCH_WIDTH; w++) {
+			uint32_t v = atomic_load_explicit(&sketch[d][w],
+			                                  memory_order_relaxed);
+
+			while (v && !atomic_compare_exchange_weak_explicit(
+			        &sketch[d][w], &v, v >> 1,
+			        memory_order_relaxed, memory_order_relaxed))
+				;
+		}
+	}
+
+	/* Halving keeps the heap order */
+	pthread_mutex_lock(&hitters.lock);
+	for (i = 0; i < hitters.count; i++)
+		hitters.heap[i].connects >>= 1;
+	atomic_store(&hitters_floor, hitters.count == RATE_HEAVY_HITTERS ?
+	                             hitters.heap[0].connects : 0);
+	pthread_mutex_unlock(&hitters.lock);
+}
+
+static void sketch_reset(void)
+{
+	int d, w;
+
+	for (d = 0; d < RATE_SKETCH_DEPTH; d++) {
+		for (w = 0; w < RATE_SKETCH_WIDTH; w++)
+			atomic_store_explicit(&sketch[d][w], 0,
+			                      memory_order_relaxed);
+	}
+
+	pthread_mutex_lock(&hitters.lock);
+	hitters.count = 0;
+	atomic_store(&hitters_floor, 0);
+	pthread_mutex_unlock(&hitters.lock);
+}
+
+/*
+ * May a source without an entry get one in table t? Always while the
+ * stripe is under RATE_SKETCH_GATE_PCT of its share of the cap; then
+ * once the sketch has seen it RATE_SKETCH_PROMOTE times; at the cap,
+ * only heavy hitters. Caller holds the stripe lock.
+ */
+static bool sketch_admits_entry(const ip_table_t *t,
+                                const struct in6_addr *key,
+                                uint32_t connects)
+{
+	int max_ips = config_get()->max_tracked_ips;
+	uint32_t cap = (uint32_t)(max_ips > 0 ? max_ips :
+	                          RATE_TABLE_MAX_ENTRIES) / RATE_TABLE_STRIPES;
+
+	if ((uint64_t)t->count * 100 < (uint64_t)cap * RATE_SKETCH_GATE_PCT)
+		return true;
+	if (connects < RATE_SKETCH_PROMOTE)
+		return false;
+	if (t->count < cap)
+		return true;
+	return hitters_contains(key);
+}
+
+int tbg_rate_limit_heavy_hitters(rate_limit_hitter_t *out, int max)
+{
+	rate_limit_hitter_t heap[RATE_HEAVY_HITTERS];
+	int n, i;
+
+	if (!out || max <= 0)
+		return 0;
+
+	pthread_mutex_lock(&hitters.lock);
+	n = hitters.count;
+	memcpy(heap, hitters.heap, sizeof(heap[0]) * (size_t)n);
+	pthread_mutex_unlock(&hitters.lock);
+
+	/* Heaviest first: pop the copy's minimum into the back */
+	for (i = n - 1; i > 0; i--) {
+		rate_limit_hitter_t tmp = heap[0];
+		int j = 0;
+
+		heap[0] = heap[i];
+		heap[i] = tmp;
+		for (;;) {
+			int l = 2 * j + 1, r = l + 1, m = j;
+
+			if (l < i && heap[l].connects < heap[m].connects)
+				m = l;
+			if (r < i && heap[r].connects < heap[m].connects)
+				m = r;
+			if (m == j)
+				break;
+			tmp = heap[j];
+			heap[j] = heap[m];
+			heap[m] = tmp;
+			j = m;
+		}
+	}
+	/* heap is now sorted heaviest first */
+	if (n > max)
+		n = max;
+	memcpy(out, heap, sizeof(out[0]) * (size_t)n);
+	return n;
+}
+
+/* ── Load-adaptive admission ─────────────────────────────────────── */
+
+/*
+ * Latency histogram with four buckets per power of two, so the p99 read
+ * from it is within 25% of the true value. Buckets 0-3 hold 0-3 us; from
+ * there, [2^e, 2^(e+1)) us spans buckets 4(e-1) to 4(e-1)+3.
+ */
+#define LOAD_HIST_BUCKETS  128
+
+static _Atomic uint32_t load_hist[LOAD_HIST_BUCKETS];
+static _Atomic int32_t load_queue;          /* Shares queued now */
+static _Atomic int32_t load_queue_peak;     /* Since the last check */
+static _Atomic int g_load = ATOMIC_VAR_INIT(0);
+static int load_healthy;                    /* Healthy checks in a row */
+
+static int load_bucket(uint64_t us)
+{
+	int e;
+
+	if (us < 4)
+		return (int)us;
+	if (us > UINT32_MAX)
+		us = UINT32_MAX;
+	e = 63 - __builtin_clzll(us);
+	return (e - 1) * 4 + (int)((us >> (e - 2)) & 3);
+}
+
+/* Largest latency counted in bucket i */
+static uint64_t load_bucket_max(int i)
+{
+	int e = i / 4 + 1;
+
+	if (i < 4)
+		return (uint64_t)i;
+	return ((uint64_t)(5 + i % 4) << (e - 2)) - 1;
+}
+
+static bool load_tracking(void)
+{
+	const rate_limit_config_t *cfg = config_get();
+
+	return cfg->load_target_p99_us > 0 || cfg->load_max_queue_depth > 0;
+}
+
+/* A load-adaptive call's cost at the current level */
+static inline uint64_t load_cost(uint64_t cost)
+{
+	return cost << atomic_load_explicit(&g_load, memory_order_relaxed);
+}
+
+/* Drain the histogram; returns its p99 and the sample count */
+static uint64_t load_take_p99(uint32_t *samples)
+{
+	uint32_t counts[LOAD_HIST_BUCKETS], n = 0, rank, seen = 0;
+	int i;
+
+	for (i = 0; i < LOAD_HIST_BUCKETS; i++) {
+		counts[i] = atomic_exchange_explicit(&load_hist[i], 0,
+		                                     memory_order_relaxed);
+		n += counts[i];
+	}
+	*samples = n;
+	if (!n)
+		return 0;
+
+	rank = (uint32_t)(((uint64_t)n * 99 + 99) / 100);
+	for (i = 0; i < LOAD_HIST_BUCKETS - 1; i++) {
+		seen += counts[i];
+		if (seen >= rank)
+			break;
+	}
+	return load_bucket_max(i);
+}
+
+/* Raise, hold or lower the load level from the last second's samples */
+static void load_evaluate(void)
+{
+	int32_t depth = atomic_load(&load_queue);
+	int32_t peak = atomic_exchange(&load_queue_peak, depth);
+	const rate_limit_config_t *cfg = config_get();
+	int64_t target = cfg->load_target_p99_us;
+	int64_t max_depth = cfg->load_max_queue_depth;
+	int level = atomic_load(&g_load), next = level;
+	bool over = false, healthy = true;
+	uint32_t samples;
+	uint64_t p99;
+
+	p99 = load_take_p99(&samples);
+	if (target > 0 && samples >= RATE_LOAD_MIN_SAMPLES) {
+		over |= p99 > (uint64_t)target;
+		healthy &= p99 * 100 <= (uint64_t)target * RATE_LOAD_RELAX_PCT;
+	}
+	if (max_depth > 0) {
+		over |= peak > max_depth;
+		healthy &= (int64_t)peak * 100 <= max_depth * RATE_LOAD_RELAX_PCT;
+	}
+
+	if (over) {
+		load_healthy = 0;
+		if (level < RATE_LOAD_MAX_LEVEL)
+			next = level + 1;
+	} else if (healthy && level > 0) {
+		if (++load_healthy >= RATE_LOAD_RELAX_WINDOWS) {
+			load_healthy = 0;
+			next = level - 1;
+		}
+	} else {
+		load_healthy = 0;
+	}
+
+	if (next == level)
+		return;
+	atomic_store(&g_load, next);
+	if (next > level)
+		LOGWARNING("Rate limit: load level %d (share p99 %lu us over %u "
+		           "shares, queue peak %d), connect/subscribe/authorize "
+		           "at 1/%d rate", next, (unsigned long)p99, samples,
+		           peak, 1 << next);
+	else
+		LOGNOTICE("Rate limit: load eased to level %d (share p99 %lu us, "
+		          "queue peak %d)", next, (unsigned long)p99, peak);
+}
+
+static void load_reset(void)
+{
+	int i;
+
+	for (i = 0; i < LOAD_HIST_BUCKETS; i++)
+		atomic_store_explicit(&load_hist[i], 0, memory_order_relaxed);
+	atomic_store(&load_queue, 0);
+	atomic_store(&load_queue_peak, 0);
+	atomic_store(&g_load, 0);
+	load_healthy = 0;
+}
+
+void tbg_rate_limit_note_latency(uint64_t us)
+{
+	atomic_fetch_add_explicit(&load_hist[load_bucket(us)], 1,
+	                          memory_order_relaxed);
+}
+
+void tbg_rate_limit_note_queue(int delta)
+{
+	int32_t depth = atomic_fetch_add(&load_queue, delta) + delta;
+	int32_t peak = atomic_load_explicit(&load_queue_peak,
+	                                    memory_order_relaxed);
+
+	while (depth > peak &&
+	       !atomic_compare_exchange_weak(&load_queue_peak, &peak, depth))
+		;
+}
+
+int tbg_rate_limit_load_level(void)
+{
+	return atomic_load_explicit(&g_load, memory_order_relaxed);
+}
+
+/* ── IP state management ─────────────────────────────────────────── */
+
+/* Rehash every entry into a table of new_cap slots. Caller holds the
+ * write lock. */
+static bool table_resize(ip_table_t *t, uint32_t new_cap)
+{
+	ip_rate_state_t *slots;
+	uint32_t i, mask = new_cap - 1;
+
+	slots = calloc(new_cap, sizeof(*slots));
+	if (!slots)
+		return false;
+
+	for (i = 0; t->slots && i <= t->mask; i++) {
+		uint32_t j;
+
+		if (!t->slots[i].hash)
+			continue;
+		for (j = t->slots[i].hash & mask; slots[j].hash; j = (j + 1) & mask)
+			;
+		memcpy(&slots[j], &t->slots[i], sizeof(slots[j]));
+	}
+
+	free(t->slots);
+	t->slots = slots;
+	t->mask = mask;
+	return true;
+}
+
+static inline ip_stripe_t *stripe_for(uint32_t hash)
+{
+	return &ip_stripes[(hash >> STRIPE_SHIFT) & (RATE_TABLE_STRIPES - 1)];
+}
+
+/* Caller holds the stripe lock (read or write) */
+static ip_rate_state_t *find_ip_entry(ip_table_t *t,
+                                      const struct in6_addr *key,
+                                      uint32_t hash)
+{
+	uint32_t i;
+
+	if (!t->slots)
+		return NULL;
+
+	for (i = hash & t->mask; t->slots[i].hash; i = (i + 1) & t->mask) {
+		if (t->slots[i].hash == hash && key_eq(&t->slots[i].addr, key))
+			return &t->slots[i];
+	}
+	return NULL;
+}
+
+/* Caller holds the stripe write lock. The returned entry stays valid
+ * until it is dropped: inserts may resize the table and removals shift
+ * slots */
+static ip_rate_state_t *get_or_create_ip_entry(ip_table_t *t,
+                                               const struct in6_addr *key,
+                                               uint32_t hash)
+{
+	ip_rate_state_t *entry;
+	uint32_t i, rate;
+
+	entry = find_ip_entry(t, key, hash);
+	if (entry) {
+		entry->last_seen = tbg_clock_now();
+		return entry;
+	}
+
+	if (!t->slots || (uint64_t)(t->count + 1) * 100 >
+	                 (uint64_t)(t->mask + 1) * RATE_TABLE_MAX_LOAD) {
+		uint32_t cap = t->slots ? (t->mask + 1) * 2 : STRIPE_INITIAL;
+
+		if (!table_resize(t, cap))
+			return NULL;
+	}
+
+	for (i = hash & t->mask; t->slots[i].hash; i = (i + 1) & t->mask)
+		;
+	entry = &t->slots[i];
+
+	memset(entry, 0, sizeof(*entry));
+	entry->addr = *key;
+	entry->hash = hash;
+	entry->first_seen = tbg_clock_now();
+	entry->last_seen = entry->first_seen;
+	entry->softban_until = 0;
+	atomic_store(&entry->active_connections, 0);
+
+	rate = (uint32_t)config_get()->connections_per_ip_per_minute;
+	bucket_init(&entry->connect_bucket, rate, rate);
+
+	t->count++;
+	return entry;
+}
+
+/*
+ * Remove slot i, shifting later members of its probe run back so no
+ * tombstone is left behind. Caller holds the write lock.
+ */
+static void remove_slot(ip_table_t *t, uint32_t i)
+{
+	uint32_t j = i;
+
+	for (;;) {
+		uint32_t home;
+
+		j = (j + 1) & t->mask;
+		if (!t->slots[j].hash)
+			break;
+
+		/* Slot j may move into the hole only if its home is not in
+		 * the cyclic range (i, j] */
+		home = t->slots[j].hash & t->mask;
+		if (((j - home) & t->mask) >= ((j - i) & t->mask)) {
+			memcpy(&t->slots[i], &t->slots[j], sizeof(t->slots[i]));
+			i = j;
+		}
+	}
+	memset(&t->slots[i], 0, sizeof(t->slots[i]));
+	t->count--;
+}
+
+/* ── Ban outbox ──────────────────────────────────────────────────── */
+
+/*
+ * Bans made here, waiting for the relay link to take them. A ring under
+ * a mutex: bans are rare next to connects, and the link drains it every
+ * heartbeat. When it is full the oldest ban is dropped; the link will
+ * see a newer one for a source that keeps misbehaving.
+ */
+static struct {
+	pthread_mutex_t lock;
+	rate_limit_ban_t ring[RATE_BAN_OUTBOX];
+	uint32_t head;                   /* Oldest */
+	uint32_t count;
+} ban_outbox = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static _Atomic uint64_t ban_outbox_dropped = ATOMIC_VAR_INIT(0);
+
+static void ban_outbox_push(const struct in6_addr *key, int plen,
+                            time_t until)
+{
+	rate_limit_ban_t *b;
+
+	pthread_mutex_lock(&ban_outbox.lock);
+	if (ban_outbox.count == RATE_BAN_OUTBOX) {
+		ban_outbox.head = (ban_outbox.head + 1) % RATE_BAN_OUTBOX;
+		ban_outbox.count--;
+		atomic_fetch_add(&ban_outbox_dropped, 1);
+	}
+	b = &ban_outbox.ring[(ban_outbox.head + ban_outbox.count) %
+	                     RATE_BAN_OUTBOX];
+	b->addr = *key;
+	b->plen = plen;
+	b->until = until;
+	ban_outbox.count++;
+	pthread_mutex_unlock(&ban_outbox.lock);
+}
+
+static void ban_outbox_reset(void)
+{
+	pthread_mutex_lock(&ban_outbox.lock);
+	ban_outbox.head = 0;
+	ban_outbox.count = 0;
+	pthread_mutex_unlock(&ban_outbox.lock);
+	atomic_store(&ban_outbox_dropped, 0);
+}
+
+/* ── Subnet trie ─────────────────────────────────────────────────── */
+
+/*
+ * Path-compressed binary trie over 128-bit keys. Tracked nodes carry the
+ * state of one prefix: the /24, /48 and /64 aggregation levels, plus any
+ * prefix soft-banned with tbg_rate_limit_softban_prefix(). Untracked nodes
+ * only branch. A lookup walks at most one node per prefix bit and sees
+ * every tracked prefix covering the key on the way down.
+ *
+ * The trie has one rwlock. Connects and disconnects take it for reading
+ * (buckets and counters are atomic); only creating a node, banning and
+ * sweeping take it for writing. The lock is always taken before an IP
+ * stripe lock.
+ *
+ * Tracked nodes are also on a sweep list, newest first, which the cleanup
+ * thread walks a batch at a time. Parent links let it unlink an expired
+ * node and collapse the branch above it without walking the trie.
+ */
+
+/* Aggregation levels per key: 1 for IPv4, 2 for IPv6 */
+#define SUBNET_MAX_LEVELS  2
+
+typedef struct subnet_node {
+	struct subnet_node *child[2];
+	struct subnet_node *parent;
+	struct subnet_node *next, *prev; /* Sweep list, tracked nodes only */
+	struct in6_addr prefix;          /* Bits past plen are zero */
+	uint8_t plen;
+	bool tracked;                    /* Carries state; else a branch */
 	_Atomic int32_t active_connections;
-	time_t first_seen;
-	time_t last_seen;
-	time_t softban_until;
-	UT_hash_handle hh;
-} ip_rate_entry_t;
+	int32_t max_connections;         /* 0 = no concurrency limit */
+	rate_bucket_t connect_bucket;    /* refill_per_min 0 = no rate limit */
+	_Atomic int64_t last_seen;
+	time_t softban_until;            /* 0 if not banned */
+	time_t ban_window_start;         /* Start of banned_members' window */
+	int banned_members;
+} subnet_node_t;
+
+static subnet_node_t *subnet_root;
+static uint32_t subnet_count;                /* Nodes, branches included */
+static uint32_t subnet_tracked;              /* Nodes on the sweep list */
+static subnet_node_t *subnet_list;           /* Sweep list head */
+static subnet_node_t *subnet_sweep_next;     /* Sweep cursor, NULL = head */
+static uint32_t subnet_tick_budget;          /* Per second, set each pass */
+static uint32_t subnet_sweep_bans;           /* Banned prefixes this pass */
+static _Atomic uint32_t subnet_bans;         /* ... at the last pass end */
+static pthread_rwlock_t subnet_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Latest expiry of any prefix ban, so ban checks skip the trie while no
+ * prefix is banned */
+static _Atomic int64_t g_subnet_ban_until = ATOMIC_VAR_INIT(0);
+
+static bool subnet_tracking(void)
+{
+	const rate_limit_config_t *cfg = config_get();
+
+	return cfg->subnet_connections_per_minute > 0 ||
+	       cfg->max_connections_per_subnet > 0 ||
+	       cfg->v6_host_connections_per_minute > 0 ||
+	       cfg->max_connections_per_v6_host > 0 ||
+	       cfg->subnet_softban_threshold > 0;
+}
+
+/* Aggregation prefix lengths (in key bits) for key, shortest first */
+static int subnet_levels(const struct in6_addr *key, int *levels)
+{
+	if (IN6_IS_ADDR_V4MAPPED(key)) {
+		levels[0] = 96 + RATE_SUBNET_V4_PREFIX;
+		return 1;
+	}
+	levels[0] = RATE_SUBNET_V6_PREFIX;
+	levels[1] = RATE_V6_HOST_PREFIX;
+	return 2;
+}
+
+static inline int key_bit(const struct in6_addr *key, int bit)
+{
+	return (key->s6_addr[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/* Number of leading bits a and b share, at most max */
+static int common_bits(const struct in6_addr *a, const struct in6_addr *b,
+                       int max)
+{
+	int i;
+
+	for (i = 0; i < 16 && i * 8 < max; i++) {
+		unsigned int x = a->s6_addr[i] ^ b->s6_addr[i];
+
+		if (x) {
+			int n = i * 8 + __builtin_clz(x) - 24;
+
+			return n < max ? n : max;
+		}
+	}
+	return max;
+}
+
+static void prefix_mask(struct in6_addr *dst, const struct in6_addr *src,
+                        int plen)
+{
+	int i;
+
+	*dst = *src;
+	for (i = plen; i < 128; i = (i | 7) + 1) {
+		if (i & 7)
+			dst->s6_addr[i >> 3] &= (uint8_t)(0xff00 >> (i & 7));
+		else
+			dst->s6_addr[i >> 3] = 0;
+	}
+}
+
+/*
+ * May a ban from outside (another region, or the state snapshot) cover
+ * key/plen? Only one address or a prefix at an aggregation level: a
+ * shorter prefix could take out a large part of the address space, and
+ * an IPv6 prefix covering ::ffff:0:0/96 would ban every IPv4 source.
+ */
+static bool ban_prefix_ok(const struct in6_addr *key, int plen)
+{
+	static const struct in6_addr v4mapped = {
+		.s6_addr = { [10] = 0xff, [11] = 0xff }
+	};
+
+	if (plen == 128)
+		return true;
+	if (plen == 96 + RATE_SUBNET_V4_PREFIX)
+		return common_bits(key, &v4mapped, 96) == 96;
+	if (plen != RATE_SUBNET_V6_PREFIX && plen != RATE_V6_HOST_PREFIX)
+		return false;
+	return common_bits(key, &v4mapped, plen) < plen;
+}
+
+/* Printable "prefix/len" (IPv4 form for v4-mapped prefixes) */
+static const char *prefix_str(const subnet_node_t *n, char *buf)
+{
+	char addr[INET6_ADDRSTRLEN];
+	bool v4 = n->plen >= 96 && IN6_IS_ADDR_V4MAPPED(&n->prefix);
+
+	sprintf(buf, "%s/%d", key_str(&n->prefix, addr),
+	        v4 ? n->plen - 96 : n->plen);
+	return buf;
+}
+
+/* Set n's concurrency limit; returns its connect rate. Only aggregation
+ * levels have limits; other prefixes carry bans. */
+static uint32_t subnet_limits(subnet_node_t *n)
+{
+	const rate_limit_config_t *cfg = config_get();
+
+	if (n->plen == 96 + RATE_SUBNET_V4_PREFIX ||
+	    n->plen == RATE_SUBNET_V6_PREFIX) {
+		n->max_connections = cfg->max_connections_per_subnet;
+		return (uint32_t)cfg->subnet_connections_per_minute;
+	}
+	if (n->plen == RATE_V6_HOST_PREFIX) {
+		n->max_connections = cfg->max_connections_per_v6_host;
+		return (uint32_t)cfg->v6_host_connections_per_minute;
+	}
+	n->max_connections = 0;
+	return 0;
+}
+
+static void subnet_track(subnet_node_t *n)
+{
+	uint32_t rate = subnet_limits(n);
+
+	n->tracked = true;
+	n->prev = NULL;
+	n->next = subnet_list;
+	if (subnet_list)
+		subnet_list->prev = n;
+	subnet_list = n;
+	subnet_tracked++;
+
+	atomic_store(&n->active_connections, 0);
+	atomic_store(&n->last_seen, (int64_t)tbg_clock_now());
+	bucket_init(&n->connect_bucket, rate, rate);
+	n->softban_until = 0;
+	n->ban_window_start = 0;
+	n->banned_members = 0;
+}
+
+static subnet_node_t *subnet_node_new(const struct in6_addr *key, int plen,
+                                      bool tracked, subnet_node_t *parent)
+{
+	subnet_node_t *n = calloc(1, sizeof(*n));
+
+	if (!n)
+		return NULL;
+	prefix_mask(&n->prefix, key, plen);
+	n->plen = (uint8_t)plen;
+	n->parent = parent;
+	if (tracked)
+		subnet_track(n);
+	subnet_count++;
+	return n;
+}
+
+/*
+ * Tracked node for key/plen, created (splitting a compressed edge if
+ * needed) when missing. Existing nodes never move, so pointers from an
+ * earlier walk stay valid. Caller holds subnet_lock for writing.
+ */
+static subnet_node_t *subnet_insert(const struct in6_addr *key, int plen)
+{
+	subnet_node_t **pp = &subnet_root, *parent = NULL, *n, *leaf, *branch;
+
+	while ((n = *pp)) {
+		int common = common_bits(&n->prefix, key,
+		                         n->plen < plen ? n->plen : plen);
+
+		if (common == n->plen) {
+			if (n->plen == plen) {
+				if (!n->tracked)
+					subnet_track(n);
+				return n;
+			}
+			parent = n;
+			pp = &n->child[key_bit(key, n->plen)];
+			continue;
+		}
+
+		/* n leaves the key's path at bit common */
+		if (common == plen) {
+			/* The new prefix covers n: it goes above it */
+			leaf = subnet_node_new(key, plen, true, parent);
+			if (!leaf)
+				return NULL;
+			leaf->child[key_bit(&n->prefix, plen)] = n;
+			n->parent = leaf;
+			*pp = leaf;
+			return leaf;
+		}
+		branch = subnet_node_new(key, common, false, parent);
+		if (!branch)
+			return NULL;
+		leaf = subnet_node_new(key, plen, true, branch);
+		if (!leaf) {
+			free(branch);
+			subnet_count--;
+			return NULL;
+		}
+		branch->child[key_bit(key, common)] = leaf;
+		branch->child[key_bit(&n->prefix, common)] = n;
+		n->parent = branch;
+		*pp = branch;
+		return leaf;
+	}
+
+	return *pp = subnet_node_new(key, plen, true, parent);
+}
+
+/*
+ * Walk the prefixes covering key. Level nodes (plen == levels[i]) land in
+ * out[i], NULL where not tracked. Returns the banned prefix with the
+ * longest ban, or NULL. Caller holds subnet_lock.
+ */
+static subnet_node_t *subnet_walk(const struct in6_addr *key,
+                                  const int *levels, int nlev,
+                                  subnet_node_t **out)
+{
+	subnet_node_t *n = subnet_root, *banned = NULL;
+	time_t now = tbg_clock_now();
+	int i;
+
+	for (i = 0; i < nlev; i++)
+		out[i] = NULL;
+
+	while (n && common_bits(&n->prefix, key, n->plen) == n->plen) {
+		if (n->tracked) {
+			if (n->softban_until > now &&
+			    (!banned || n->softban_until > banned->softban_until))
+				banned = n;
+			for (i = 0; i < nlev; i++) {
+				if (n->plen == levels[i])
+					out[i] = n;
+			}
+		}
+		if (n->plen == 128)
+			break;
+		n = n->child[key_bit(key, n->plen)];
+	}
+	return banned;
+}
+
+static void subnet_ban(subnet_node_t *n, time_t until)
+{
+	int64_t cur = atomic_load(&g_subnet_ban_until);
+
+	n->softban_until = until;
+	while (cur < (int64_t)until &&
+	       !atomic_compare_exchange_weak(&g_subnet_ban_until, &cur,
+	                                     (int64_t)until))
+		;
+}
+
+/* Is any prefix covering key banned? Cheap while no prefix is. */
+static bool subnet_is_banned(const struct in6_addr *key)
+{
+	subnet_node_t *levels_out[SUBNET_MAX_LEVELS];
+	bool banned;
+
+	if (atomic_load(&g_subnet_ban_until) <= (int64_t)tbg_clock_now())
+		return false;
+
+	pthread_rwlock_rdlock(&subnet_lock);
+	banned = subnet_walk(key, NULL, 0, levels_out) != NULL;
+	pthread_rwlock_unlock(&subnet_lock);
+	return banned;
+}
+
+/*
+ * Count a new soft-ban of key against its subnets, banning each one that
+ * reaches subnet_softban_threshold banned addresses within a ban
+ * duration.
+ */
+static void subnet_note_ban(const struct in6_addr *key)
+{
+	int levels[SUBNET_MAX_LEVELS], nlev, i;
+	const rate_limit_config_t *cfg = config_get();
+	int threshold = cfg->subnet_softban_threshold;
+	int duration = cfg->softban_duration_seconds;
+	time_t now = tbg_clock_now();
+	char buf[INET6_ADDRSTRLEN + 4];
+
+	if (threshold <= 0)
+		return;
+
+	nlev = subnet_levels(key, levels);
+	pthread_rwlock_wrlock(&subnet_lock);
+	for (i = 0; i < nlev; i++) {
+		subnet_node_t *n = subnet_insert(key, levels[i]);
+
+		if (!n)
+			continue;
+		if (now - n->ban_window_start >= duration) {
+			n->ban_window_start = now;
+			n->banned_members = 0;
+		}
+		if (++n->banned_members >= threshold &&
+		    n->softban_until <= now) {
+			subnet_ban(n, now + duration);
+			ban_outbox_push(&n->prefix, n->plen, now + duration);
+			LOGWARNING("Rate limit: soft-banned subnet %s for %d "
+			           "seconds (%d addresses banned)",
+			           prefix_str(n, buf), duration, n->banned_members);
+		}
+	}
+	pthread_rwlock_unlock(&subnet_lock);
+}
+
+/*
+ * Drop n's state and free it, and any branch above it, that no longer
+ * splits the key space. Returns the bytes released. Caller holds
+ * subnet_lock for writing.
+ */
+static size_t subnet_untrack(subnet_node_t *n)
+{
+	size_t released = 0;
+
+	n->tracked = false;
+	if (subnet_sweep_next == n)
+		subnet_sweep_next = n->next;
+	if (n->prev)
+		n->prev->next = n->next;
+	else
+		subnet_list = n->next;
+	if (n->next)
+		n->next->prev = n->prev;
+	subnet_tracked--;
+
+	while (n && !n->tracked && !(n->child[0] && n->child[1])) {
+		subnet_node_t *child = n->child[0] ? n->child[0] : n->child[1];
+		subnet_node_t *parent = n->parent;
+
+		if (parent)
+			parent->child[key_bit(&n->prefix, parent->plen)] = child;
+		else
+			subnet_root = child;
+		if (child)
+			child->parent = parent;
+		free(n);
+		subnet_count--;
+		released += sizeof(*n);
+		n = parent;
+	}
+	return released;
+}
+
+/*
+ * Visit up to budget (at most RATE_SWEEP_BATCH) nodes from the sweep
+ * cursor, expiring those idle since cutoff with no connections (active
+ * prefix bans are always kept). The cursor wraps to the head of the list
+ * at its end, where the banned prefixes seen on the way are published to
+ * subnet_bans. Returns the number of nodes visited.
+ */
+static uint32_t subnet_sweep_step(time_t cutoff, uint32_t budget,
+                                  size_t *released)
+{
+	time_t now = tbg_clock_now();
+	uint32_t visited = 0;
+	subnet_node_t *n;
+
+	if (budget > RATE_SWEEP_BATCH)
+		budget = RATE_SWEEP_BATCH;
+
+	pthread_rwlock_wrlock(&subnet_lock);
+	n = subnet_sweep_next ? subnet_sweep_next : subnet_list;
+	while (n && visited < budget) {
+		subnet_node_t *next = n->next;
+
+		if (n->softban_until > now)
+			subnet_sweep_bans++;
+		else if (atomic_load(&n->active_connections) <= 0 &&
+		         atomic_load(&n->last_seen) < cutoff)
+			*released += subnet_untrack(n);
+		n = next;
+		visited++;
+	}
+	subnet_sweep_next = n;
+	if (!n) {
+		atomic_store(&subnet_bans, subnet_sweep_bans);
+		subnet_sweep_bans = 0;
+	}
+	pthread_rwlock_unlock(&subnet_lock);
+	return visited;
+}
+
+/* Visit count trie nodes, RATE_SWEEP_BATCH per lock hold */
+static size_t subnet_sweep(time_t cutoff, uint32_t count)
+{
+	size_t released = 0;
+
+	while (count > 0) {
+		uint32_t visited = subnet_sweep_step(cutoff, count, &released);
+
+		if (!visited)
+			break;
+		count -= visited;
+	}
+	return released;
+}
+
+static uint32_t subnet_tracked_count(void)
+{
+	uint32_t n;
+
+	pthread_rwlock_rdlock(&subnet_lock);
+	n = subnet_tracked;
+	pthread_rwlock_unlock(&subnet_lock);
+	return n;
+}
+
+/* Nodes for the cleanup thread to visit this second: sized at the start
+ * of each pass so the pass ends within RATE_CLEANUP_INTERVAL */
+static uint32_t subnet_sweep_budget(void)
+{
+	uint32_t budget;
+
+	pthread_rwlock_wrlock(&subnet_lock);
+	if (!subnet_sweep_next)
+		subnet_tick_budget = subnet_tracked / RATE_CLEANUP_INTERVAL + 1;
+	budget = subnet_tick_budget;
+	pthread_rwlock_unlock(&subnet_lock);
+	return budget;
+}
+
+static void subnet_free_all(subnet_node_t *n)
+{
+	if (!n)
+		return;
+	subnet_free_all(n->child[0]);
+	subnet_free_all(n->child[1]);
+	free(n);
+}
+
+/* ── Rejection log ───────────────────────────────────────────────── */
+
+/* Outcome of a connect check, for logging once the locks are dropped */
+enum admit_verdict {
+	ADMIT_OK,
+	ADMIT_UNKNOWN,             /* Critical pressure, IP not tracked */
+	ADMIT_BANNED,
+	ADMIT_SKETCH_RATE,         /* Untracked IP over its sketch estimate */
+	ADMIT_IP_CONCURRENT,
+	ADMIT_IP_RATE,
+	ADMIT_SUBNET_BANNED,
+	ADMIT_SUBNET_CONCURRENT,
+	ADMIT_SUBNET_RATE,
+	ADMIT_GLOBAL,              /* Global connection limit */
+	ADMIT_VERDICTS
+};
+
+static const char *const admit_reason[ADMIT_VERDICTS] = {
+	[ADMIT_OK]                = "ok",
+	[ADMIT_UNKNOWN]           = "unknown",
+	[ADMIT_BANNED]            = "banned",
+	[ADMIT_SKETCH_RATE]       = "sketch_rate",
+	[ADMIT_IP_CONCURRENT]     = "ip_concurrent",
+	[ADMIT_IP_RATE]           = "ip_rate",
+	[ADMIT_SUBNET_BANNED]     = "subnet_banned",
+	[ADMIT_SUBNET_CONCURRENT] = "subnet_concurrent",
+	[ADMIT_SUBNET_RATE]       = "subnet_rate",
+	[ADMIT_GLOBAL]            = "global",
+};
+
+/*
+ * Sources rejected this interval, in small open-addressing tables that
+ * are wiped at each summary instead of deleted from. Each is under its
+ * own mutex, held only to bump a counter, so a flood from many sources
+ * spreads over the locks. A table keeps a quarter free so probes stay
+ * short; once it is that full, new sources go uncounted per source.
+ */
+#define REJECT_STRIPES     16
+#define REJECT_SLOTS       (RATE_REJECT_LOG_SOURCES / REJECT_STRIPES)
+#define REJECT_MAX_LOAD    (REJECT_SLOTS * 3 / 4)
+
+_Static_assert((REJECT_SLOTS & (REJECT_SLOTS - 1)) == 0 && REJECT_SLOTS >= 4,
+               "RATE_REJECT_LOG_SOURCES");
+
+typedef struct reject_src {
+	struct in6_addr addr;
+	uint32_t hash;                   /* key_hash(), 0 = empty */
+	uint32_t total;
+	uint32_t counts[ADMIT_VERDICTS];
+} reject_src_t;
+
+typedef struct reject_stripe {
+	pthread_mutex_t lock;
+	uint32_t count;
+	reject_src_t slots[REJECT_SLOTS];
+} __attribute__((aligned(64))) reject_stripe_t;
+
+static reject_stripe_t reject_stripes[REJECT_STRIPES] = {
+	[0 ... REJECT_STRIPES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+/* Rejections this interval per reason, and from untracked sources */
+static _Atomic uint32_t reject_interval[ADMIT_VERDICTS];
+static _Atomic uint32_t reject_untracked = ATOMIC_VAR_INIT(0);
+
+/* Rejections since init per reason, and of per-connection actions per
+ * type (connects are the sum of reject_totals) */
+static _Atomic uint64_t reject_totals[ADMIT_VERDICTS];
+static _Atomic uint64_t conn_rejects[RATE_TYPE_COUNT];
+
+/*
+ * Count a rejection of key (whose key_hash() is hash). Returns true for
+ * the source's first rejection this interval, which the caller logs in
+ * full.
+ */
+static bool reject_note(const struct in6_addr *key, uint32_t hash,
+                        int verdict)
+{
+	reject_stripe_t *rs = &reject_stripes[(hash >> STRIPE_SHIFT) &
+	                                      (REJECT_STRIPES - 1)];
+	uint32_t i = hash & (REJECT_SLOTS - 1);
+	bool first = false;
+
+	atomic_fetch_add_explicit(&reject_totals[verdict], 1,
+	                          memory_order_relaxed);
+	atomic_fetch_add_explicit(&reject_interval[verdict], 1,
+	                          memory_order_relaxed);
+
+	pthread_mutex_lock(&rs->lock);
+	for (;;) {
+		reject_src_t *src = &rs->slots[i];
+
+		if (!src->hash) {
+			if (rs->count >= REJECT_MAX_LOAD) {
+				atomic_fetch_add_explicit(&reject_untracked, 1,
+				                          memory_order_relaxed);
+				break;
+			}
+			src->hash = hash;
+			src->addr = *key;
+			rs->count++;
+			first = true;
+		} else if (src->hash != hash || !key_eq(&src->addr, key)) {
+			i = (i + 1) & (REJECT_SLOTS - 1);
+			continue;
+		}
+		src->total++;
+		src->counts[verdict]++;
+		break;
+	}
+	pthread_mutex_unlock(&rs->lock);
+
+	return first;
+}
+
+/* Rejections of key (whose key_hash() is hash) this interval */
+static uint32_t reject_count(const struct in6_addr *key, uint32_t hash)
+{
+	reject_stripe_t *rs = &reject_stripes[(hash >> STRIPE_SHIFT) &
+	                                      (REJECT_STRIPES - 1)];
+	uint32_t i = hash & (REJECT_SLOTS - 1), total = 0;
+
+	pthread_mutex_lock(&rs->lock);
+	for (; rs->slots[i].hash; i = (i + 1) & (REJECT_SLOTS - 1)) {
+		if (rs->slots[i].hash == hash && key_eq(&rs->slots[i].addr, key)) {
+			total = rs->slots[i].total;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&rs->lock);
+	return total;
+}
+
+/* "reason=count ..." for the non-zero counts */
+static void reject_reasons_str(const uint32_t *counts, char *buf,
+                               size_t len)
+{
+	size_t off = 0;
+	int r;
+
+	buf[0] = '\0';
+	for (r = ADMIT_OK + 1; r < ADMIT_VERDICTS && off < len; r++) {
+		if (counts[r])
+			off += snprintf(buf + off, len - off, "%s%s=%u",
+			                off ? " " : "", admit_reason[r], counts[r]);
+	}
+}
+
+/*
+ * End the interval: log the totals and the sources rejected most, then
+ * start counting afresh. Logs nothing for a quiet interval.
+ */
+static void reject_flush(void)
+{
+	reject_src_t top[RATE_REJECT_LOG_TOP];
+	uint32_t counts[ADMIT_VERDICTS], untracked;
+	uint64_t total = 0;
+	int ntop = 0, sources = 0, r, i, j;
+	char reasons[256], ip[INET6_ADDRSTRLEN];
+
+	for (r = 0; r < ADMIT_VERDICTS; r++) {
+		counts[r] = atomic_exchange(&reject_interval[r], 0);
+		total += counts[r];
+	}
+	untracked = atomic_exchange(&reject_untracked, 0);
+
+	for (i = 0; i < REJECT_STRIPES; i++) {
+		reject_stripe_t *rs = &reject_stripes[i];
+		uint32_t s;
+
+		pthread_mutex_lock(&rs->lock);
+		for (s = 0; rs->count && s < REJECT_SLOTS; s++) {
+			reject_src_t *src = &rs->slots[s];
+
+			if (!src->hash)
+				continue;
+			sources++;
+
+			/* Insertion into the top list, heaviest first */
+			for (j = ntop; j > 0 && top[j - 1].total < src->total; j--) {
+				if (j < RATE_REJECT_LOG_TOP)
+					top[j] = top[j - 1];
+			}
+			if (j < RATE_REJECT_LOG_TOP) {
+				top[j] = *src;
+				if (ntop < RATE_REJECT_LOG_TOP)
+					ntop++;
+			}
+			memset(src, 0, sizeof(*src));
+		}
+		rs->count = 0;
+		pthread_mutex_unlock(&rs->lock);
+	}
+
+	if (!total)
+		return;
+
+	reject_reasons_str(counts, reasons, sizeof(reasons));
+	if (untracked)
+		LOGWARNING("Rate limit: rejected %lu connects in %ds from %d "
+		           "sources and %u more untracked: %s",
+		           (unsigned long)total, RATE_REJECT_LOG_INTERVAL,
+		           sources, untracked, reasons);
+	else
+		LOGWARNING("Rate limit: rejected %lu connects in %ds from %d "
+		           "sources: %s", (unsigned long)total,
+		           RATE_REJECT_LOG_INTERVAL, sources, reasons);
+	for (i = 0; i < ntop; i++) {
+		reject_reasons_str(top[i].counts, reasons, sizeof(reasons));
+		LOGNOTICE("Rate limit:   %s rejected %u times: %s",
+		          key_str(&top[i].addr, ip), top[i].total, reasons);
+	}
+}
+
+/* Log what is left and zero the totals */
+static void reject_reset(void)
+{
+	int r;
+
+	reject_flush();
+	for (r = 0; r < ADMIT_VERDICTS; r++)
+		atomic_store(&reject_totals[r], 0);
+	for (r = 0; r < RATE_TYPE_COUNT; r++)
+		atomic_store(&conn_rejects[r], 0);
+}
+
+/* ── State snapshot ──────────────────────────────────────────────── */
+
+/*
+ * The snapshot file is a header and a packed array of entries, written
+ * through a shared mapping to "<state_file>.tmp", synced, and renamed
+ * over the old one, so a crash mid-write leaves the previous snapshot in
+ * place. Times are wall clock, so bans keep their expiry across a
+ * restart; bucket levels are refilled for the downtime on load.
+ */
+#define STATE_MAGIC      "TBGRLS1"
+
+typedef struct state_header {
+	char magic[8];
+	uint32_t entry_size;             /* sizeof(state_entry_t) */
+	uint32_t count;
+	int64_t saved_at;
+	uint64_t reserved;
+} state_header_t;
+
+typedef struct state_entry {
+	struct in6_addr addr;
+	int64_t softban_until;           /* 0 = not banned */
+	uint32_t tokens;                 /* Connect bucket, fixed point */
+	uint8_t plen;                    /* 128 = an IP, else a banned prefix */
+	uint8_t pad[3];
+} state_entry_t;
+
+_Static_assert(sizeof(state_header_t) == 32, "state_header_t");
+_Static_assert(sizeof(state_entry_t) == 32, "state_entry_t");
+
+/* Fixed-point tokens in b as of now, without taking any */
+static uint32_t bucket_level(rate_bucket_t *b)
+{
+	uint64_t old = atomic_load_explicit(&b->state, memory_order_acquire);
+	uint64_t cap = (uint64_t)b->max_tokens << RATE_TOKEN_SHIFT;
+	uint64_t tokens = old >> 32;
+	int32_t elapsed = (int32_t)(now_ms() - (uint32_t)old);
+
+	if (elapsed > 60000)
+		elapsed = 60000;
+	if (elapsed > 0)
+		tokens += (uint64_t)elapsed * b->refill_per_min *
+		          RATE_TOKEN_ONE / 60000;
+	return (uint32_t)(tokens > cap ? cap : tokens);
+}
+
+/*
+ * Copy up to max entries into out: soft-banned IPs and prefixes first,
+ * then IPs with hot connect buckets. Returns the number copied.
+ */
+static uint32_t state_collect(state_entry_t *out, uint32_t max)
+{
+	time_t now = tbg_clock_now();
+	subnet_node_t *n;
+	uint32_t count = 0;
+	int pass, i;
+
+	pthread_rwlock_rdlock(&subnet_lock);
+	for (n = subnet_list; n && count < max; n = n->next) {
+		if (n->softban_until <= now || !ban_prefix_ok(&n->prefix, n->plen))
+			continue;
+		memset(&out[count], 0, sizeof(out[count]));
+		out[count].addr = n->prefix;
+		out[count].plen = n->plen;
+		out[count].softban_until = n->softban_until;
+		count++;
+	}
+	pthread_rwlock_unlock(&subnet_lock);
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < RATE_TABLE_STRIPES && count < max; i++) {
+			ip_table_t *t = &ip_stripes[i].table;
+			uint32_t s;
+
+			pthread_rwlock_rdlock(&ip_stripes[i].lock);
+			for (s = 0; t->slots && s <= t->mask && count < max; s++) {
+				ip_rate_state_t *e = &t->slots[s];
+				bool banned;
+				uint32_t tokens;
+
+				if (!e->hash)
+					continue;
+				banned = e->softban_until > now;
+				tokens = bucket_level(&e->connect_bucket);
+				if (pass == 0 ? !banned :
+				    banned || (uint64_t)tokens * 100 >=
+				    ((uint64_t)e->connect_bucket.max_tokens <<
+				     RATE_TOKEN_SHIFT) * (100 - RATE_STATE_HOT_PCT))
+					continue;
+				memset(&out[count], 0, sizeof(out[count]));
+				out[count].addr = e->addr;
+				out[count].plen = 128;
+				out[count].softban_until = banned ? e->softban_until : 0;
+				out[count].tokens = tokens;
+				count++;
+			}
+			pthread_rwlock_unlock(&ip_stripes[i].lock);
+		}
+	}
+
+	return count;
+}
+
+/* Write the snapshot; returns the entries written, or -1 on error */
+static int state_save(void)
+{
+	const char *path = config_get()->state_file;
+	char tmp[sizeof(((rate_limit_config_t *)0)->state_file) + 4];
+	size_t max_size = sizeof(state_header_t) +
+	                  (size_t)RATE_STATE_MAX_ENTRIES * sizeof(state_entry_t);
+	size_t size;
+	state_header_t *hdr;
+	uint32_t count;
+	void *map;
+	bool synced;
+	int fd;
+
+	if (!path[0])
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		LOGWARNING("Rate limit: cannot write state file %s: %s", tmp,
+		           strerror(errno));
+		return -1;
+	}
+
+	/* Map room for the most we keep, then trim to what was written */
+	if (ftruncate(fd, (off_t)max_size) != 0 ||
+	    (map = mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	                0)) == MAP_FAILED) {
+		LOGWARNING("Rate limit: cannot map state file %s: %s", tmp,
+		           strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+
+	hdr = map;
+	count = state_collect((state_entry_t *)(hdr + 1),
+	                      RATE_STATE_MAX_ENTRIES);
+	memcpy(hdr->magic, STATE_MAGIC, sizeof(hdr->magic));
+	hdr->entry_size = sizeof(state_entry_t);
+	hdr->count = count;
+	hdr->saved_at = (int64_t)tbg_clock_now();
+	hdr->reserved = 0;
+
+	size = sizeof(*hdr) + (size_t)count * sizeof(state_entry_t);
+	synced = msync(map, size, MS_SYNC) == 0;
+	munmap(map, max_size);
+	if (!synced || ftruncate(fd, (off_t)size) != 0 || fsync(fd) != 0) {
+		LOGWARNING("Rate limit: failed writing state file %s: %s", tmp,
+		           strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+	if (rename(tmp, path) != 0) {
+		LOGWARNING("Rate limit: cannot replace state file %s: %s", path,
+		           strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	LOGDEBUG("Rate limit: saved %u entries to %s", count, path);
+	return (int)count;
+}
+
+/* Restore one snapshot entry; false if it no longer carries anything */
+static bool state_restore(const state_entry_t *e, int64_t downtime)
+{
+	time_t now = tbg_clock_now();
+	bool banned = e->softban_until > (int64_t)now;
+	ip_rate_state_t *entry;
+	ip_stripe_t *st;
+	uint32_t hash;
+
+	if (e->plen < 128) {
+		subnet_node_t *n;
+
+		if (!banned || !ban_prefix_ok(&e->addr, e->plen))
+			return false;
+		pthread_rwlock_wrlock(&subnet_lock);
+		n = subnet_insert(&e->addr, e->plen);
+		if (n)
+			subnet_ban(n, (time_t)e->softban_until);
+		pthread_rwlock_unlock(&subnet_lock);
+		return n != NULL;
+	}
+
+	hash = key_hash(&e->addr);
+	st = stripe_for(hash);
+	pthread_rwlock_wrlock(&st->lock);
+	entry = get_or_create_ip_entry(&st->table, &e->addr, hash);
+	if (entry) {
+		rate_bucket_t *b = &entry->connect_bucket;
+		uint64_t cap = (uint64_t)b->max_tokens << RATE_TOKEN_SHIFT;
+		uint64_t tokens = e->tokens;
+
+		if (downtime > 60)
+			downtime = 60;
+		if (downtime > 0)
+			tokens += (uint64_t)downtime * b->refill_per_min *
+			          RATE_TOKEN_ONE / 60;
+		if (tokens > cap)
+			tokens = cap;
+		atomic_store(&b->state, bucket_pack((uint32_t)tokens, now_ms()));
+		if (banned)
+			entry->softban_until = (time_t)e->softban_until;
+	}
+	pthread_rwlock_unlock(&st->lock);
+	return entry != NULL;
+}
+
+/* Load the snapshot, if there is one; returns the entries restored */
+static int state_load(void)
+{
+	const char *path = config_get()->state_file;
+	const state_header_t *hdr;
+	const state_entry_t *e;
+	struct stat sb;
+	int64_t downtime;
+	uint32_t count, i;
+	int restored = 0;
+	void *map;
+	int fd;
+
+	if (!path[0])
+		return 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			LOGWARNING("Rate limit: cannot read state file %s: %s",
+			           path, strerror(errno));
+		return 0;
+	}
+	if (fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(*hdr)) {
+		LOGWARNING("Rate limit: ignoring short state file %s", path);
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		LOGWARNING("Rate limit: cannot map state file %s: %s", path,
+		           strerror(errno));
+		return 0;
+	}
+
+	hdr = map;
+	if (memcmp(hdr->magic, STATE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->entry_size != sizeof(state_entry_t) ||
+	    hdr->count > RATE_STATE_MAX_ENTRIES ||
+	    (size_t)sb.st_size != sizeof(*hdr) +
+	                          (size_t)hdr->count * sizeof(state_entry_t)) {
+		LOGWARNING("Rate limit: ignoring malformed state file %s", path);
+		munmap(map, (size_t)sb.st_size);
+		return 0;
+	}
+
+	count = hdr->count;
+	downtime = (int64_t)tbg_clock_now() - hdr->saved_at;
+	e = (const state_entry_t *)(hdr + 1);
+	for (i = 0; i < count; i++)
+		restored += state_restore(&e[i], downtime);
+	munmap(map, (size_t)sb.st_size);
+
+	LOGNOTICE("Rate limit: restored %d of %u entries from %s (saved %lds "
+	          "ago)", restored, count, path, (long)downtime);
+	return restored;
+}
+
+/* ── Configuration ───────────────────────────────────────────────── */
+
+#define CONFIG_KEY(field) { #field, offsetof(rate_limit_config_t, field) }
+
+/* Integer settings by name, as in the ckpool.conf rate_limit block */
+static const struct {
+	const char *name;
+	size_t offset;
+} config_keys[] = {
+	CONFIG_KEY(connections_per_ip_per_minute),
+	CONFIG_KEY(max_connections_per_ip),
+	CONFIG_KEY(max_subscribes_per_minute),
+	CONFIG_KEY(max_authorizes_per_minute),
+	CONFIG_KEY(max_shares_per_minute),
+	CONFIG_KEY(max_invalid_shares_per_minute),
+	CONFIG_KEY(global_max_connections),
+	CONFIG_KEY(softban_duration_seconds),
+	CONFIG_KEY(subnet_connections_per_minute),
+	CONFIG_KEY(max_connections_per_subnet),
+	CONFIG_KEY(v6_host_connections_per_minute),
+	CONFIG_KEY(max_connections_per_v6_host),
+	CONFIG_KEY(subnet_softban_threshold),
+	CONFIG_KEY(max_tracked_ips),
+	CONFIG_KEY(load_target_p99_us),
+	CONFIG_KEY(load_max_queue_depth),
+};
+
+/* Publish a copy of config as the one in force */
+static bool config_publish(const rate_limit_config_t *config)
+{
+	config_slot_t *slot = malloc(sizeof(*slot));
+	config_slot_t *cur;
+
+	if (!slot)
+		return false;
+	memcpy(&slot->config, config, sizeof(slot->config));
+	slot->config.state_file[sizeof(slot->config.state_file) - 1] = '\0';
+
+	pthread_mutex_lock(&config_lock);
+	cur = atomic_load(&g_config);
+	slot->older = cur == &config_unset ? NULL : cur;
+	atomic_store_explicit(&g_config, slot, memory_order_release);
+	pthread_mutex_unlock(&config_lock);
+	return true;
+}
+
+/* Free every published copy; nothing may read the configuration after */
+static void config_free_all(void)
+{
+	config_slot_t *slot;
 
-/* ── Global state ────────────────────────────────────────────────── */
+	pthread_mutex_lock(&config_lock);
+	slot = atomic_exchange(&g_config, &config_unset);
+	while (slot && slot != &config_unset) {
+		config_slot_t *older = slot->older;
 
-static ip_rate_entry_t *ip_table = NULL;
-static pthread_rwlock_t ip_table_lock = PTHREAD_RWLOCK_INITIALIZER;
+		free(slot);
+		slot = older;
+	}
+	pthread_mutex_unlock(&config_lock);
+}
 
-static rate_limit_config_t g_config;
-static _Atomic int32_t g_total_connections = ATOMIC_VAR_INIT(0);
-static volatile int cleanup_running = 0;
-static pthread_t cleanup_thread;
+/*
+ * Bring existing state in line with a new configuration: IP connect
+ * buckets and subnet limits change in place. Per-connection buckets
+ * pick up the new rates when their connection next initialises them.
+ */
+static void config_apply(void)
+{
+	uint32_t rate = (uint32_t)config_get()->connections_per_ip_per_minute;
+	subnet_node_t *n;
+	int i;
+
+	for (i = 0; i < RATE_TABLE_STRIPES; i++) {
+		ip_table_t *t = &ip_stripes[i].table;
+		uint32_t s;
+
+		pthread_rwlock_wrlock(&ip_stripes[i].lock);
+		for (s = 0; t->slots && s <= t->mask; s++) {
+			if (t->slots[s].hash)
+				bucket_resize(&t->slots[s].connect_bucket, rate,
+				              rate);
+		}
+		pthread_rwlock_unlock(&ip_stripes[i].lock);
+	}
 
-/* ── Token bucket operations ─────────────────────────────────────── */
+	pthread_rwlock_wrlock(&subnet_lock);
+	for (n = subnet_list; n; n = n->next) {
+		uint32_t subnet_rate = subnet_limits(n);
 
-static void bucket_init(rate_bucket_t *b, uint32_t max_tokens,
-                        uint32_t refill_per_min)
+		bucket_resize(&n->connect_bucket, subnet_rate, subnet_rate);
+	}
+	pthread_rwlock_unlock(&subnet_lock);
+}
+
+static void config_log(const char *what)
 {
-	atomic_store(&b->tokens, max_tokens);
-	b->max_tokens = max_tokens;
-	b->refill_per_min = refill_per_min;
-	b->last_refill = time(NULL);
+	const rate_limit_config_t *cfg = config_get();
+
+	LOGNOTICE("Rate limiter %s: %d conn/IP/min, %d max/IP, %d global max",
+	          what, cfg->connections_per_ip_per_minute,
+	          cfg->max_connections_per_ip, cfg->global_max_connections);
+	if (subnet_tracking())
+		LOGNOTICE("Rate limiter subnets: %d conn/min, %d max per /%d and "
+		          "/%d; %d conn/min, %d max per /%d; ban after %d",
+		          cfg->subnet_connections_per_minute,
+		          cfg->max_connections_per_subnet,
+		          RATE_SUBNET_V4_PREFIX, RATE_SUBNET_V6_PREFIX,
+		          cfg->v6_host_connections_per_minute,
+		          cfg->max_connections_per_v6_host,
+		          RATE_V6_HOST_PREFIX, cfg->subnet_softban_threshold);
+	if (load_tracking())
+		LOGNOTICE("Rate limiter load control: share p99 target %d us, "
+		          "queue target %d", cfg->load_target_p99_us,
+		          cfg->load_max_queue_depth);
 }
 
-static void bucket_refill(rate_bucket_t *b)
+/* Run the loader for a requested reload (cleanup thread) */
+static void config_reload_from_loader(void)
 {
-	time_t now = time(NULL);
-	time_t elapsed = now - b->last_refill;
-	uint32_t current, new_tokens, to_add;
+	rate_limit_config_t config;
 
-	if (elapsed <= 0)
+	if (!reload_fn) {
+		LOGWARNING("Rate limit: reload requested, but no loader is set");
 		return;
-
-	/* Calculate tokens to add based on elapsed time */
-	to_add = (uint32_t)((elapsed * b->refill_per_min) / 60);
-	if (to_add == 0)
+	}
+	if (!reload_fn(&config, reload_ctx)) {
+		LOGWARNING("Rate limit: reload failed, keeping current limits");
 		return;
+	}
+	tbg_rate_limit_reload(&config);
+}
+
+/* ── Background cleanup thread ───────────────────────────────────── */
+
+/*
+ * Remove entries not seen since cutoff from the next slots of a stripe,
+ * starting at *pos. Entries with active connections are kept, and so are
+ * soft-banned ones unless keep_banned is false. At most RATE_SWEEP_BATCH
+ * slots are visited per lock hold, and about 1/div of the table in all.
+ * At the end of the table *pos wraps to 0 and the table is halved until
+ * it is at least a quarter full (never below its initial size). The
+ * cleanup thread's own pass (pos is the stripe's sweep_pos) also counts
+ * the banned entries it keeps, into the stripe's bans at the end of the
+ * table. Returns the bytes released.
+ */
+static size_t sweep_stripe(ip_stripe_t *st, uint32_t *pos, uint32_t div,
+                           time_t cutoff, bool keep_banned)
+{
+	ip_table_t *t = &st->table;
+	size_t released = 0;
+	uint64_t left = UINT64_MAX;
+	bool tally = pos == &st->sweep_pos;
+
+	do {
+		time_t now = tbg_clock_now();
+		uint32_t i, end, cap, old_cap;
+
+		pthread_rwlock_wrlock(&st->lock);
+		if (!t->slots) {
+			pthread_rwlock_unlock(&st->lock);
+			break;
+		}
+
+		old_cap = t->mask + 1;
+		if (left == UINT64_MAX)
+			left = old_cap / div + 1;
+		if (*pos > old_cap)
+			*pos = old_cap;
+		end = *pos + (left < RATE_SWEEP_BATCH ? (uint32_t)left :
+		                                        RATE_SWEEP_BATCH);
+		if (end > old_cap)
+			end = old_cap;
+		left -= end - *pos;
+
+		for (i = *pos; i < end; i++) {
+			ip_rate_state_t *entry = &t->slots[i];
+
+			/* Recheck slot i after a removal: a later entry may have
+			 * shifted into it */
+			while (entry->hash) {
+				/* Don't remove entries with active connections */
+				if (atomic_load(&entry->active_connections) > 0)
+					break;
+				if (keep_banned && entry->softban_until > now)
+					break;
+				if (entry->last_seen >= cutoff)
+					break;
+				remove_slot(t, i);
+			}
+			if (tally && entry->hash && entry->softban_until > now)
+				st->sweep_bans++;
+		}
+		*pos = end;
 
-	current = atomic_load(&b->tokens);
-	new_tokens = current + to_add;
-	if (new_tokens > b->max_tokens)
-		new_tokens = b->max_tokens;
+		if (end == old_cap) {
+			if (tally) {
+				atomic_store(&st->bans, st->sweep_bans);
+				st->sweep_bans = 0;
+			}
+			*pos = 0;
+			left = 0;
+			cap = old_cap;
+			while (cap > STRIPE_INITIAL && (uint64_t)t->count * 4 < cap)
+				cap /= 2;
+			if (cap != old_cap && table_resize(t, cap))
+				released += (size_t)(old_cap - cap) *
+				            sizeof(ip_rate_state_t);
+		}
+		pthread_rwlock_unlock(&st->lock);
+	} while (left > 0);
 
-	atomic_store(&b->tokens, new_tokens);
-	b->last_refill = now;
+	return released;
 }
 
-static bool bucket_consume(rate_bucket_t *b)
+/* A full pass over every stripe, then the subnet trie */
+static size_t sweep_stale(time_t cutoff, bool keep_banned)
 {
-	uint32_t current;
+	size_t released = 0;
+	int i;
 
-	bucket_refill(b);
+	for (i = 0; i < RATE_TABLE_STRIPES; i++) {
+		uint32_t pos = 0;
 
-	current = atomic_load(&b->tokens);
-	if (current == 0)
-		return false;
+		released += sweep_stripe(&ip_stripes[i], &pos, 1, cutoff,
+		                         keep_banned);
+	}
+	return released + subnet_sweep(cutoff, subnet_tracked_count());
+}
 
-	/* Attempt to consume a token atomically */
-	while (current > 0) {
-		if (atomic_compare_exchange_weak(&b->tokens, &current,
-		                                  current - 1))
-			return true;
+/*
+ * Each second, sweep the next 1/RATE_CLEANUP_INTERVAL of every stripe
+ * and of the trie, so every entry is still visited once per interval but
+ * no lock is held for more than RATE_SWEEP_BATCH slots at a time.
+ */
+static void *cleanup_thread_func(void *arg)
+{
+	(void)arg;
+
+	int ticks = 0, log_ticks = 0, state_ticks = 0;
+
+	while (cleanup_running) {
+		time_t cutoff;
+		int i;
+
+		sleep(1);
+		if (!cleanup_running)
+			break;
+
+		if (atomic_exchange(&reload_requested, 0))
+			config_reload_from_loader();
+		if (++ticks >= RATE_SKETCH_DECAY) {
+			sketch_decay();
+			ticks = 0;
+		}
+		if (++log_ticks >= RATE_REJECT_LOG_INTERVAL) {
+			reject_flush();
+			log_ticks = 0;
+		}
+		if (++state_ticks >= RATE_STATE_INTERVAL) {
+			state_save();
+			state_ticks = 0;
+		}
+		if (load_tracking())
+			load_evaluate();
+
+		cutoff = tbg_clock_now() - RATE_STALE_THRESHOLD;
+		for (i = 0; i < RATE_TABLE_STRIPES && cleanup_running; i++)
+			sweep_stripe(&ip_stripes[i], &ip_stripes[i].sweep_pos,
+			             RATE_CLEANUP_INTERVAL, cutoff, false);
+		subnet_sweep(cutoff, subnet_sweep_budget());
 	}
-	return false;
+
+	return NULL;
 }
 
-/* ── IP state management ─────────────────────────────────────────── */
+/* ── Memory governor hooks ───────────────────────────────────────── */
 
-static ip_rate_entry_t *find_ip_entry(const char *ip)
+size_t tbg_rate_limit_mem_usage(void *arg)
 {
-	ip_rate_entry_t *entry = NULL;
+	size_t bytes = 0;
+	int i;
 
-	HASH_FIND_STR(ip_table, ip, entry);
-	return entry;
+	(void)arg;
+	for (i = 0; i < RATE_TABLE_STRIPES; i++) {
+		ip_stripe_t *st = &ip_stripes[i];
+
+		pthread_rwlock_rdlock(&st->lock);
+		if (st->table.slots)
+			bytes += (size_t)(st->table.mask + 1) *
+			         sizeof(ip_rate_state_t);
+		pthread_rwlock_unlock(&st->lock);
+	}
+
+	pthread_rwlock_rdlock(&subnet_lock);
+	bytes += (size_t)subnet_count * sizeof(subnet_node_t);
+	pthread_rwlock_unlock(&subnet_lock);
+
+	return bytes + sizeof(sketch) + sizeof(hitters.heap) +
+	       sizeof(reject_stripes);
 }
 
-static ip_rate_entry_t *get_or_create_ip_entry(const char *ip)
+size_t tbg_rate_limit_mem_pressure(int level, void *arg)
 {
-	ip_rate_entry_t *entry;
+	size_t released = 0;
 
-	entry = find_ip_entry(ip);
-	if (entry) {
-		entry->last_seen = time(NULL);
-		return entry;
+	(void)arg;
+	if (atomic_exchange(&g_pressure, level) != level)
+		LOGNOTICE("Rate limit: admission %s under %s memory pressure",
+		          level >= MEMGOV_HIGH ? "tightened" : "normal",
+		          tbg_memgov_level_name(level));
+
+	/* Evict idle IPs early; bans are what the table is for, keep them */
+	if (level >= MEMGOV_ELEVATED) {
+		released = sweep_stale(tbg_clock_now() - RATE_PRESSURE_STALE,
+		                       true);
 	}
 
-	entry = calloc(1, sizeof(*entry));
-	if (!entry)
-		return NULL;
+	return released;
+}
 
-	strncpy(entry->ip, ip, sizeof(entry->ip) - 1);
-	entry->ip[sizeof(entry->ip) - 1] = '\0';
-	entry->first_seen = time(NULL);
-	entry->last_seen = entry->first_seen;
-	entry->softban_until = 0;
-	atomic_store(&entry->active_connections, 0);
+/* ── Metrics ─────────────────────────────────────────────────────── */
 
-	bucket_init(&entry->connect_bucket,
-	            (uint32_t)g_config.connections_per_ip_per_minute,
-	            (uint32_t)g_config.connections_per_ip_per_minute);
+static const char *const rate_type_name[RATE_TYPE_COUNT] = {
+	[RATE_CONNECT]       = "connect",
+	[RATE_SUBSCRIBE]     = "subscribe",
+	[RATE_AUTHORIZE]     = "authorize",
+	[RATE_SUBMIT]        = "submit",
+	[RATE_INVALID_SHARE] = "invalid_share",
+};
 
-	HASH_ADD_STR(ip_table, ip, entry);
-	return entry;
-}
+int tbg_rate_limit_format_metrics(char *buf, int buflen)
+{
+	uint64_t connects = 0;
+	uint32_t ips = 0, ip_bans = 0;
+	int n, i;
 
-/* ── Background cleanup thread ───────────────────────────────────── */
+	if (!buf || buflen <= 0)
+		return 0;
 
-static void *cleanup_thread_func(void *arg)
+	for (i = 0; i < RATE_TABLE_STRIPES; i++) {
+		ip_stripe_t *st = &ip_stripes[i];
+
+		pthread_rwlock_rdlock(&st->lock);
+		ips += st->table.count;
+		pthread_rwlock_unlock(&st->lock);
+		ip_bans += atomic_load(&st->bans);
+	}
+	for (i = ADMIT_OK + 1; i < ADMIT_VERDICTS; i++)
+		connects += atomic_load(&reject_totals[i]);
+
+	n = snprintf(buf, buflen,
+	             "# HELP tbg_rate_limit_connections Connections admitted and still open\n"
+	             "# TYPE tbg_rate_limit_connections gauge\n"
+	             "tbg_rate_limit_connections %d\n"
+	             "# HELP tbg_rate_limit_tracked_ips IPs with an entry in the IP table\n"
+	             "# TYPE tbg_rate_limit_tracked_ips gauge\n"
+	             "tbg_rate_limit_tracked_ips %u\n"
+	             "# HELP tbg_rate_limit_tracked_subnets Prefixes tracked in the subnet trie\n"
+	             "# TYPE tbg_rate_limit_tracked_subnets gauge\n"
+	             "tbg_rate_limit_tracked_subnets %u\n"
+	             "# HELP tbg_rate_limit_softbans Active soft-bans, as of the last cleanup pass\n"
+	             "# TYPE tbg_rate_limit_softbans gauge\n"
+	             "tbg_rate_limit_softbans{scope=\"ip\"} %u\n"
+	             "tbg_rate_limit_softbans{scope=\"prefix\"} %u\n"
+	             "# HELP tbg_rate_limit_load_level Load-adaptive admission level (0 normal)\n"
+	             "# TYPE tbg_rate_limit_load_level gauge\n"
+	             "tbg_rate_limit_load_level %d\n"
+	             "# HELP tbg_rate_limit_ban_outbox_dropped_total Bans dropped before the relay link took them\n"
+	             "# TYPE tbg_rate_limit_ban_outbox_dropped_total counter\n"
+	             "tbg_rate_limit_ban_outbox_dropped_total %lu\n"
+	             "# HELP tbg_rate_limit_rejected_total Actions rejected, by limit type\n"
+	             "# TYPE tbg_rate_limit_rejected_total counter\n"
+	             "tbg_rate_limit_rejected_total{type=\"%s\"} %lu\n",
+	             tbg_rate_limit_global_connections(), ips,
+	             subnet_tracked_count(),
+	             ip_bans, atomic_load(&subnet_bans),
+	             tbg_rate_limit_load_level(),
+	             (unsigned long)atomic_load(&ban_outbox_dropped),
+	             rate_type_name[RATE_CONNECT], (unsigned long)connects);
+
+	for (i = RATE_CONNECT + 1; i < RATE_TYPE_COUNT && n < buflen; i++)
+		n += snprintf(buf + n, buflen - n,
+		              "tbg_rate_limit_rejected_total{type=\"%s\"} %lu\n",
+		              rate_type_name[i],
+		              (unsigned long)atomic_load(&conn_rejects[i]));
+
+	if (n < buflen)
+		n += snprintf(buf + n, buflen - n,
+		              "# HELP tbg_rate_limit_connect_rejected_total Connects rejected, by reason\n"
+		              "# TYPE tbg_rate_limit_connect_rejected_total counter\n");
+	for (i = ADMIT_OK + 1; i < ADMIT_VERDICTS && n < buflen; i++)
+		n += snprintf(buf + n, buflen - n,
+		              "tbg_rate_limit_connect_rejected_total{reason=\"%s\"} %lu\n",
+		              admit_reason[i],
+		              (unsigned long)atomic_load(&reject_totals[i]));
+
+	/* snprintf reports the untruncated length; clamp to what fit */
+	return n < buflen ? n : buflen - 1;
+}
+
+int tbg_rate_limit_format_offenders(char *buf, int buflen, int max)
 {
-	(void)arg;
+	rate_limit_hitter_t top[RATE_HEAVY_HITTERS];
+	char ip[INET6_ADDRSTRLEN], active[16];
+	int n, count, i;
+
+	if (!buf || buflen <= 0)
+		return 0;
+	if (max <= 0 || max > RATE_HEAVY_HITTERS)
+		max = RATE_HEAVY_HITTERS;
+
+	count = tbg_rate_limit_heavy_hitters(top, max);
+	n = snprintf(buf, buflen,
+	             "# Heaviest connecting sources, heaviest first\n"
+	             "# address connects rejected active banned\n"
+	             "#   connects: recent connect attempts (decaying estimate)\n"
+	             "#   rejected: connects rejected this %d s log interval\n"
+	             "#   active:   open connections, - if not in the IP table\n",
+	             RATE_REJECT_LOG_INTERVAL);
+
+	for (i = 0; i < count && n < buflen; i++) {
+		uint32_t hash = key_hash(&top[i].addr);
+		ip_stripe_t *st = stripe_for(hash);
+		ip_rate_state_t *entry;
+
+		pthread_rwlock_rdlock(&st->lock);
+		entry = find_ip_entry(&st->table, &top[i].addr, hash);
+		if (entry)
+			snprintf(active, sizeof(active), "%d",
+			         (int)atomic_load(&entry->active_connections));
+		else
+			strcpy(active, "-");
+		pthread_rwlock_unlock(&st->lock);
+
+		n += snprintf(buf + n, buflen - n, "%s %u %u %s %s\n",
+		              key_str(&top[i].addr, ip), top[i].connects,
+		              reject_count(&top[i].addr, hash), active,
+		              tbg_rate_limit_is_banned_key(&top[i].addr) ?
+		              "yes" : "no");
+	}
 
-	while (cleanup_running) {
-		ip_rate_entry_t *entry, *tmp;
-		time_t now = time(NULL);
-		time_t cutoff = now - RATE_STALE_THRESHOLD;
+	/* snprintf reports the untruncated length; clamp to what fit */
+	return n < buflen ? n : buflen - 1;
+}
 
-		sleep(RATE_CLEANUP_INTERVAL);
+/* ── Public API ──────────────────────────────────────────────────── */
 
-		if (!cleanup_running)
-			break;
+void tbg_rate_limit_config_defaults(rate_limit_config_t *config)
+{
+	if (!config)
+		return;
 
-		pthread_rwlock_wrlock(&ip_table_lock);
+	memset(config, 0, sizeof(*config));
+	config->connections_per_ip_per_minute = RATE_CONNECT_PER_MIN;
+	config->max_connections_per_ip = RATE_CONNECT_MAX_CONCURRENT;
+	config->max_subscribes_per_minute = RATE_SUBSCRIBE_PER_MIN;
+	config->max_authorizes_per_minute = RATE_AUTHORIZE_PER_MIN;
+	config->max_shares_per_minute = RATE_SUBMIT_PER_MIN;
+	config->max_invalid_shares_per_minute = RATE_INVALID_PER_MIN;
+	config->global_max_connections = RATE_GLOBAL_MAX_CONNS;
+	config->softban_duration_seconds = RATE_SOFTBAN_DURATION;
+	config->subnet_connections_per_minute = RATE_SUBNET_CONNECT_PER_MIN;
+	config->max_connections_per_subnet = RATE_SUBNET_MAX_CONCURRENT;
+	config->v6_host_connections_per_minute = RATE_V6_HOST_CONNECT_PER_MIN;
+	config->max_connections_per_v6_host = RATE_V6_HOST_MAX_CONCURRENT;
+	config->subnet_softban_threshold = RATE_SUBNET_BAN_THRESHOLD;
+	config->load_target_p99_us = RATE_LOAD_TARGET_P99_US;
+	config->load_max_queue_depth = RATE_LOAD_MAX_QUEUE;
+}
 
-		HASH_ITER(hh, ip_table, entry, tmp) {
-			/* Don't remove entries with active connections */
-			if (atomic_load(&entry->active_connections) > 0)
-				continue;
+bool tbg_rate_limit_config_set(rate_limit_config_t *config, const char *key,
+                               long long value)
+{
+	size_t i;
 
-			/* Remove stale entries */
-			if (entry->last_seen < cutoff) {
-				HASH_DEL(ip_table, entry);
-				free(entry);
-			}
-		}
+	if (!config || !key || value < 0 || value > INT_MAX)
+		return false;
 
-		pthread_rwlock_unlock(&ip_table_lock);
+	for (i = 0; i < sizeof(config_keys) / sizeof(config_keys[0]); i++) {
+		if (strcmp(key, config_keys[i].name) == 0) {
+			*(int *)((char *)config + config_keys[i].offset) =
+				(int)value;
+			return true;
+		}
 	}
-
-	return NULL;
+	return false;
 }
 
-/* ── Public API ──────────────────────────────────────────────────── */
+bool tbg_rate_limit_config_set_str(rate_limit_config_t *config,
+                                   const char *key, const char *value)
+{
+	if (!config || !key || !value || strcmp(key, "state_file") != 0 ||
+	    strlen(value) >= sizeof(config->state_file))
+		return false;
+
+	strcpy(config->state_file, value);
+	return true;
+}
 
 void tbg_rate_limit_init(const rate_limit_config_t *config)
 {
-	if (config) {
-		memcpy(&g_config, config, sizeof(g_config));
-	} else {
-		/* Use defaults */
-		g_config.connections_per_ip_per_minute = RATE_CONNECT_PER_MIN;
-		g_config.max_connections_per_ip = RATE_CONNECT_MAX_CONCURRENT;
-		g_config.max_subscribes_per_minute = RATE_SUBSCRIBE_PER_MIN;
-		g_config.max_authorizes_per_minute = RATE_AUTHORIZE_PER_MIN;
-		g_config.max_shares_per_minute = RATE_SUBMIT_PER_MIN;
-		g_config.max_invalid_shares_per_minute = RATE_INVALID_PER_MIN;
-		g_config.global_max_connections = RATE_GLOBAL_MAX_CONNS;
-		g_config.softban_duration_seconds = RATE_SOFTBAN_DURATION;
+	rate_limit_config_t defaults;
+	int i;
+
+	if (!config) {
+		tbg_rate_limit_config_defaults(&defaults);
+		config = &defaults;
+	}
+	if (!config_publish(config)) {
+		LOGWARNING("Rate limit: no memory for the configuration");
+		return;
+	}
+
+	/* Reseed only an empty table: existing slots hash with the old seed */
+	for (i = 0; i < RATE_TABLE_STRIPES; i++)
+		pthread_rwlock_wrlock(&ip_stripes[i].lock);
+	for (i = 0; i < RATE_TABLE_STRIPES && !ip_stripes[i].table.slots; i++)
+		;
+	if (i == RATE_TABLE_STRIPES) {
+		hash_seed[0] = tbg_clock_random_seed();
+		hash_seed[1] = tbg_clock_random_seed();
+		for (i = 0; i < RATE_SKETCH_DEPTH; i++)
+			sketch_seed[i] = tbg_clock_random_seed();
+	}
+	for (i = 0; i < RATE_TABLE_STRIPES; i++) {
+		if (!ip_stripes[i].table.slots)
+			table_resize(&ip_stripes[i].table, STRIPE_INITIAL);
+		pthread_rwlock_unlock(&ip_stripes[i].lock);
 	}
 
 	atomic_store(&g_total_connections, 0);
+	state_load();
 	cleanup_running = 1;
 
 	if (pthread_create(&cleanup_thread, NULL, cleanup_thread_func,
@@ -198,170 +2411,598 @@ void tbg_rate_limit_init(const rate_limit_config_t *config)
 		cleanup_running = 0;
 	}
 
-	LOGNOTICE("Rate limiter initialized: %d conn/IP/min, %d max/IP, "
-	          "%d global max",
-	          g_config.connections_per_ip_per_minute,
-	          g_config.max_connections_per_ip,
-	          g_config.global_max_connections);
+	config_log("initialized");
+}
+
+bool tbg_rate_limit_reload(const rate_limit_config_t *config)
+{
+	if (!config || !config_publish(config))
+		return false;
+
+	config_apply();
+	config_log("reloaded");
+	return true;
+}
+
+void tbg_rate_limit_set_loader(tbg_rate_limit_load_fn fn, void *ctx)
+{
+	reload_ctx = ctx;
+	reload_fn = fn;
+}
+
+void tbg_rate_limit_request_reload(void)
+{
+	atomic_store(&reload_requested, 1);
 }
 
 void tbg_rate_limit_shutdown(void)
 {
-	ip_rate_entry_t *entry, *tmp;
+	int i;
 
-	cleanup_running = 0;
-	pthread_join(cleanup_thread, NULL);
+	if (cleanup_running) {
+		cleanup_running = 0;
+		pthread_join(cleanup_thread, NULL);
+	}
 
-	pthread_rwlock_wrlock(&ip_table_lock);
+	state_save();
 
-	HASH_ITER(hh, ip_table, entry, tmp) {
-		HASH_DEL(ip_table, entry);
-		free(entry);
+	for (i = 0; i < RATE_TABLE_STRIPES; i++) {
+		pthread_rwlock_wrlock(&ip_stripes[i].lock);
+		free(ip_stripes[i].table.slots);
+		memset(&ip_stripes[i].table, 0, sizeof(ip_stripes[i].table));
+		ip_stripes[i].sweep_pos = 0;
+		ip_stripes[i].sweep_bans = 0;
+		atomic_store(&ip_stripes[i].bans, 0);
+		pthread_rwlock_unlock(&ip_stripes[i].lock);
 	}
 
-	pthread_rwlock_unlock(&ip_table_lock);
+	pthread_rwlock_wrlock(&subnet_lock);
+	subnet_free_all(subnet_root);
+	subnet_root = NULL;
+	subnet_count = 0;
+	subnet_tracked = 0;
+	subnet_list = NULL;
+	subnet_sweep_next = NULL;
+	subnet_sweep_bans = 0;
+	atomic_store(&subnet_bans, 0);
+	atomic_store(&g_subnet_ban_until, 0);
+	pthread_rwlock_unlock(&subnet_lock);
+
+	sketch_reset();
+	load_reset();
+	reject_reset();
+	ban_outbox_reset();
+	config_free_all();
 }
 
-bool tbg_rate_limit_connect(const char *ip)
+/*
+ * Take subnet_lock and find key's level nodes, creating missing ones if
+ * create is set. Returns the banned prefix covering key, if any. The
+ * lock is held for reading on return either way: creating takes it for
+ * writing only to insert, so a new subnet never holds every other
+ * connect out while its stripe is checked.
+ */
+static subnet_node_t *subnet_enter(const struct in6_addr *key,
+                                   const int *levels, int nlev,
+                                   subnet_node_t **sn, bool create)
+{
+	subnet_node_t *banned;
+	int i;
+
+	pthread_rwlock_rdlock(&subnet_lock);
+	banned = subnet_walk(key, levels, nlev, sn);
+	if (banned || !create)
+		return banned;
+	for (i = 0; i < nlev && sn[i]; i++)
+		;
+	if (i == nlev)
+		return NULL;
+
+	/* Missing level: retake the lock for writing and insert, then walk
+	 * again under the read lock. A sweep may release a node in between;
+	 * its level is then NULL and goes unchecked, as on a failed insert. */
+	pthread_rwlock_unlock(&subnet_lock);
+	pthread_rwlock_wrlock(&subnet_lock);
+	for (i = 0; i < nlev; i++)
+		subnet_insert(key, levels[i]);
+	pthread_rwlock_unlock(&subnet_lock);
+	pthread_rwlock_rdlock(&subnet_lock);
+	return subnet_walk(key, levels, nlev, sn);
+}
+
+/* Concurrency, then rate, for each of key's subnets. Caller holds
+ * subnet_lock. */
+static int subnet_check(subnet_node_t **sn, int nlev,
+                        subnet_node_t **culprit)
 {
-	ip_rate_entry_t *entry;
+	int i;
+
+	for (i = 0; i < nlev; i++) {
+		if (sn[i] && sn[i]->max_connections > 0 &&
+		    atomic_load(&sn[i]->active_connections) >=
+		    sn[i]->max_connections) {
+			*culprit = sn[i];
+			return ADMIT_SUBNET_CONCURRENT;
+		}
+	}
+	for (i = 0; i < nlev; i++) {
+		if (sn[i] && sn[i]->connect_bucket.refill_per_min &&
+		    !bucket_consume(&sn[i]->connect_bucket)) {
+			*culprit = sn[i];
+			return ADMIT_SUBNET_RATE;
+		}
+	}
+	return ADMIT_OK;
+}
+
+bool tbg_rate_limit_connect_key(const struct in6_addr *key)
+{
+	subnet_node_t *sn[SUBNET_MAX_LEVELS] = { NULL }, *culprit = NULL;
+	int levels[SUBNET_MAX_LEVELS], nlev = 0, i;
+	ip_stripe_t *st;
+	ip_rate_state_t *entry;
+	uint32_t hash;
 	int32_t current_total;
-	int32_t active;
+	int32_t active = 0;
+	uint32_t seen;
+	int verdict = ADMIT_OK;
+	bool subnets;
+	int pressure = atomic_load(&g_pressure);
+	int load = tbg_rate_limit_load_level();
+	const rate_limit_config_t *cfg = config_get();
+	int global_max = cfg->global_max_connections;
+	int per_ip_max = cfg->max_connections_per_ip;
+	char ip[INET6_ADDRSTRLEN];
+	char subnet[INET6_ADDRSTRLEN + 4];
 
-	if (!ip)
+	if (!key)
 		return false;
 
+	seen = sketch_add(key);
+	hitters_offer(key, seen);
+
+	/* Memory pressure: halve per-IP concurrency; at critical, halve the
+	 * global limit and admit only IPs already in the table */
+	if (pressure >= MEMGOV_HIGH && per_ip_max > 1)
+		per_ip_max /= 2;
+	if (pressure >= MEMGOV_CRITICAL)
+		global_max /= 2;
+
 	/* Check global connection limit */
+	hash = key_hash(key);
 	current_total = atomic_load(&g_total_connections);
-	if (current_total >= g_config.global_max_connections) {
-		LOGWARNING("Rate limit: global connection limit reached (%d)",
-		           current_total);
+	if (current_total >= global_max) {
+		if (reject_note(key, hash, ADMIT_GLOBAL))
+			LOGWARNING("Rate limit: global connection limit reached "
+			           "(%d), rejected IP %s", current_total,
+			           key_str(key, ip));
 		return false;
 	}
 
-	pthread_rwlock_wrlock(&ip_table_lock);
-
-	entry = get_or_create_ip_entry(ip);
-	if (!entry) {
-		pthread_rwlock_unlock(&ip_table_lock);
-		return false;
+	/* Subnets first: subnet_lock is always taken before a stripe lock */
+	subnets = subnet_tracking() ||
+	          atomic_load(&g_subnet_ban_until) > (int64_t)tbg_clock_now();
+	if (subnets) {
+		nlev = subnet_levels(key, levels);
+		culprit = subnet_enter(key, levels, nlev, sn,
+		                       subnet_tracking() &&
+		                       pressure < MEMGOV_CRITICAL);
+		if (culprit)
+			verdict = ADMIT_SUBNET_BANNED;
 	}
 
-	/* Check soft-ban */
-	if (entry->softban_until > 0 && time(NULL) < entry->softban_until) {
-		pthread_rwlock_unlock(&ip_table_lock);
-		LOGINFO("Rate limit: connection rejected, IP %s is soft-banned", ip);
-		return false;
+	st = stripe_for(hash);
+	if (verdict == ADMIT_OK) {
+		pthread_rwlock_wrlock(&st->lock);
+
+		entry = find_ip_entry(&st->table, key, hash);
+		if (!entry && pressure < MEMGOV_CRITICAL &&
+		    sketch_admits_entry(&st->table, key, seen))
+			entry = get_or_create_ip_entry(&st->table, key, hash);
+
+		if (!entry && pressure >= MEMGOV_CRITICAL) {
+			verdict = ADMIT_UNKNOWN;
+		} else if (!entry) {
+			/* Gated out of the table: the sketch stands in for the
+			 * connect bucket. Decay halves it each minute, so a
+			 * steady source settles at twice its per-minute rate. */
+			if (seen > (2 * (uint32_t)cfg->connections_per_ip_per_minute) >> load)
+				verdict = ADMIT_SKETCH_RATE;
+			else
+				verdict = subnet_check(sn, nlev, &culprit);
+		} else if (entry->softban_until > 0 &&
+		           tbg_clock_now() < entry->softban_until) {
+			verdict = ADMIT_BANNED;
+		} else {
+			/* Clear expired soft-ban */
+			entry->softban_until = 0;
+
+			active = atomic_load(&entry->active_connections);
+			if (active >= per_ip_max)
+				verdict = ADMIT_IP_CONCURRENT;
+			else if (!bucket_take(&entry->connect_bucket,
+			                      RATE_TOKEN_ONE << load))
+				verdict = ADMIT_IP_RATE;
+			else
+				verdict = subnet_check(sn, nlev, &culprit);
+		}
+
+		/* Allow the connection */
+		if (verdict == ADMIT_OK) {
+			if (entry)
+				atomic_fetch_add(&entry->active_connections, 1);
+			atomic_fetch_add(&g_total_connections, 1);
+			for (i = 0; i < nlev; i++) {
+				if (!sn[i])
+					continue;
+				atomic_fetch_add(&sn[i]->active_connections, 1);
+				atomic_store(&sn[i]->last_seen,
+				             (int64_t)tbg_clock_now());
+			}
+		}
+		pthread_rwlock_unlock(&st->lock);
 	}
+	if (culprit)
+		prefix_str(culprit, subnet);
+	if (subnets)
+		pthread_rwlock_unlock(&subnet_lock);
 
-	/* Clear expired soft-ban */
-	if (entry->softban_until > 0 && time(NULL) >= entry->softban_until)
-		entry->softban_until = 0;
+	if (verdict == ADMIT_OK)
+		return true;
 
-	/* Check per-IP concurrent limit */
-	active = atomic_load(&entry->active_connections);
-	if (active >= g_config.max_connections_per_ip) {
-		pthread_rwlock_unlock(&ip_table_lock);
-		LOGINFO("Rate limit: max concurrent connections for IP %s (%d)",
-		        ip, active);
+	/* Only a source's first rejection per interval is logged in full;
+	 * reject_flush() summarises the rest */
+	if (!reject_note(key, hash, verdict))
 		return false;
+	switch (verdict) {
+	case ADMIT_BANNED:
+		LOGINFO("Rate limit: connection rejected, IP %s is soft-banned",
+		        key_str(key, ip));
+		break;
+	case ADMIT_IP_CONCURRENT:
+		LOGINFO("Rate limit: max concurrent connections for IP %s (%d)",
+		        key_str(key, ip), active);
+		break;
+	case ADMIT_IP_RATE:
+		LOGWARNING("Rate limit: connection rate exceeded for IP %s",
+		           key_str(key, ip));
+		break;
+	case ADMIT_SKETCH_RATE:
+		LOGWARNING("Rate limit: connection rate exceeded for untracked "
+		           "IP %s (~%u recent connects)", key_str(key, ip), seen);
+		break;
+	case ADMIT_SUBNET_BANNED:
+		LOGINFO("Rate limit: connection rejected, IP %s is in "
+		        "soft-banned subnet %s", key_str(key, ip), subnet);
+		break;
+	case ADMIT_SUBNET_CONCURRENT:
+		LOGINFO("Rate limit: max concurrent connections for subnet %s",
+		        subnet);
+		break;
+	case ADMIT_SUBNET_RATE:
+		LOGWARNING("Rate limit: connection rate exceeded for subnet %s "
+		           "(IP %s)", subnet, key_str(key, ip));
+		break;
+	default:
+		break;
 	}
+	return false;
+}
 
-	/* Check per-IP rate limit */
-	if (!bucket_consume(&entry->connect_bucket)) {
-		pthread_rwlock_unlock(&ip_table_lock);
-		LOGWARNING("Rate limit: connection rate exceeded for IP %s", ip);
+bool tbg_rate_limit_connect(const char *ip)
+{
+	struct in6_addr key;
+
+	if (!ip)
+		return false;
+	if (!tbg_rate_limit_key_from_str(ip, &key)) {
+		LOGWARNING("Rate limit: connection rejected, bad address '%s'", ip);
 		return false;
 	}
+	return tbg_rate_limit_connect_key(&key);
+}
 
-	/* Allow the connection */
-	atomic_fetch_add(&entry->active_connections, 1);
-	atomic_fetch_add(&g_total_connections, 1);
-
-	pthread_rwlock_unlock(&ip_table_lock);
-	return true;
+/* Drop a connection from key's subnets */
+static void subnet_release(const struct in6_addr *key)
+{
+	subnet_node_t *sn[SUBNET_MAX_LEVELS];
+	int levels[SUBNET_MAX_LEVELS], nlev, i;
+
+	pthread_rwlock_rdlock(&subnet_lock);
+	if (subnet_root) {
+		nlev = subnet_levels(key, levels);
+		subnet_walk(key, levels, nlev, sn);
+		for (i = 0; i < nlev; i++) {
+			/* Guard against underflow: the node may postdate the
+			 * connect */
+			if (sn[i] &&
+			    atomic_fetch_sub(&sn[i]->active_connections, 1) <= 0)
+				atomic_store(&sn[i]->active_connections, 0);
+		}
+	}
+	pthread_rwlock_unlock(&subnet_lock);
 }
 
-void tbg_rate_limit_disconnect(const char *ip)
+void tbg_rate_limit_disconnect_key(const struct in6_addr *key)
 {
-	ip_rate_entry_t *entry;
+	ip_stripe_t *st;
+	ip_rate_state_t *entry;
+	uint32_t hash;
 
-	if (!ip)
+	atomic_fetch_sub(&g_total_connections, 1);
+	if (!key)
 		return;
 
-	atomic_fetch_sub(&g_total_connections, 1);
+	subnet_release(key);
 
-	pthread_rwlock_rdlock(&ip_table_lock);
-	entry = find_ip_entry(ip);
+	hash = key_hash(key);
+	st = stripe_for(hash);
+	pthread_rwlock_rdlock(&st->lock);
+	entry = find_ip_entry(&st->table, key, hash);
 	if (entry) {
 		int32_t active = atomic_fetch_sub(&entry->active_connections, 1);
 		/* Guard against underflow */
 		if (active <= 0)
 			atomic_store(&entry->active_connections, 0);
 	}
-	pthread_rwlock_unlock(&ip_table_lock);
+	pthread_rwlock_unlock(&st->lock);
 }
 
-bool tbg_rate_limit_is_banned(const char *ip)
+void tbg_rate_limit_disconnect(const char *ip)
 {
-	ip_rate_entry_t *entry;
-	bool banned = false;
+	struct in6_addr key;
 
 	if (!ip)
+		return;
+	tbg_rate_limit_disconnect_key(tbg_rate_limit_key_from_str(ip, &key) ?
+	                              &key : NULL);
+}
+
+bool tbg_rate_limit_is_banned_key(const struct in6_addr *key)
+{
+	ip_stripe_t *st;
+	ip_rate_state_t *entry;
+	uint32_t hash;
+	bool banned = false;
+
+	if (!key)
 		return false;
 
-	pthread_rwlock_rdlock(&ip_table_lock);
-	entry = find_ip_entry(ip);
+	hash = key_hash(key);
+	st = stripe_for(hash);
+	pthread_rwlock_rdlock(&st->lock);
+	entry = find_ip_entry(&st->table, key, hash);
 	if (entry && entry->softban_until > 0 &&
-	    time(NULL) < entry->softban_until)
+	    tbg_clock_now() < entry->softban_until)
 		banned = true;
-	pthread_rwlock_unlock(&ip_table_lock);
+	pthread_rwlock_unlock(&st->lock);
 
-	return banned;
+	return banned || subnet_is_banned(key);
+}
+
+bool tbg_rate_limit_is_banned(const char *ip)
+{
+	struct in6_addr key;
+
+	if (!tbg_rate_limit_key_from_str(ip, &key))
+		return false;
+	return tbg_rate_limit_is_banned_key(&key);
+}
+
+/*
+ * Ban key until the given time, unless it is already banned for longer.
+ * Returns -1 if there is no room for the entry, 1 if key was not banned
+ * before, else 0.
+ */
+static int ban_ip(const struct in6_addr *key, time_t until)
+{
+	ip_stripe_t *st;
+	ip_rate_state_t *entry;
+	uint32_t hash = key_hash(key);
+	int ret = -1;
+
+	st = stripe_for(hash);
+	pthread_rwlock_wrlock(&st->lock);
+	entry = get_or_create_ip_entry(&st->table, key, hash);
+	if (entry) {
+		ret = entry->softban_until <= tbg_clock_now();
+		if (entry->softban_until < until)
+			entry->softban_until = until;
+	}
+	pthread_rwlock_unlock(&st->lock);
+	return ret;
+}
+
+void tbg_rate_limit_softban_key(const struct in6_addr *key)
+{
+	time_t until;
+	char ip[INET6_ADDRSTRLEN];
+	int duration, ret;
+
+	if (!key)
+		return;
+
+	duration = config_get()->softban_duration_seconds;
+	until = tbg_clock_now() + duration;
+	ret = ban_ip(key, until);
+	if (ret < 0)
+		return;
+	LOGWARNING("Rate limit: soft-banned IP %s for %d seconds",
+	           key_str(key, ip), duration);
+	ban_outbox_push(key, 128, until);
+
+	/* Extending a ban does not count as another banned address */
+	if (ret > 0)
+		subnet_note_ban(key);
 }
 
 void tbg_rate_limit_softban(const char *ip)
 {
-	ip_rate_entry_t *entry;
+	struct in6_addr key;
 
-	if (!ip)
+	if (!tbg_rate_limit_key_from_str(ip, &key))
 		return;
+	tbg_rate_limit_softban_key(&key);
+}
 
-	pthread_rwlock_wrlock(&ip_table_lock);
-	entry = get_or_create_ip_entry(ip);
-	if (entry) {
-		entry->softban_until = time(NULL) +
-		                       g_config.softban_duration_seconds;
-		LOGWARNING("Rate limit: soft-banned IP %s for %d seconds",
-		           ip, g_config.softban_duration_seconds);
+bool tbg_rate_limit_softban_prefix_key(const struct in6_addr *key, int plen)
+{
+	subnet_node_t *n;
+	int duration = config_get()->softban_duration_seconds;
+	char buf[INET6_ADDRSTRLEN + 4];
+
+	if (!key || plen < 1 || plen > 128)
+		return false;
+
+	pthread_rwlock_wrlock(&subnet_lock);
+	n = subnet_insert(key, plen);
+	if (n) {
+		subnet_ban(n, tbg_clock_now() + duration);
+		/* Other regions only take aggregation-level prefixes */
+		if (ban_prefix_ok(&n->prefix, n->plen))
+			ban_outbox_push(&n->prefix, n->plen, n->softban_until);
+		LOGWARNING("Rate limit: soft-banned subnet %s for %d seconds",
+		           prefix_str(n, buf), duration);
+	}
+	pthread_rwlock_unlock(&subnet_lock);
+	return n != NULL;
+}
+
+bool tbg_rate_limit_softban_prefix(const char *cidr)
+{
+	char buf[INET6_ADDRSTRLEN];
+	struct in6_addr key;
+	const char *slash;
+	char *end;
+	size_t len;
+	long plen;
+
+	if (!cidr || !(slash = strchr(cidr, '/')))
+		return false;
+	len = (size_t)(slash - cidr);
+	if (len == 0 || len >= sizeof(buf))
+		return false;
+	memcpy(buf, cidr, len);
+	buf[len] = '\0';
+
+	plen = strtol(slash + 1, &end, 10);
+	if (end == slash + 1 || *end || !tbg_rate_limit_key_from_str(buf, &key))
+		return false;
+	if (strchr(buf, ':') == NULL) {
+		if (plen < 1 || plen > 32)
+			return false;
+		plen += 96;
+	}
+	return tbg_rate_limit_softban_prefix_key(&key, (int)plen);
+}
+
+int tbg_rate_limit_take_bans(rate_limit_ban_t *out, int max)
+{
+	int n = 0;
+
+	if (!out || max <= 0)
+		return 0;
+
+	pthread_mutex_lock(&ban_outbox.lock);
+	while (n < max && ban_outbox.count) {
+		out[n++] = ban_outbox.ring[ban_outbox.head];
+		ban_outbox.head = (ban_outbox.head + 1) % RATE_BAN_OUTBOX;
+		ban_outbox.count--;
+	}
+	pthread_mutex_unlock(&ban_outbox.lock);
+	return n;
+}
+
+void tbg_rate_limit_return_bans(const rate_limit_ban_t *bans, int n)
+{
+	int dropped = 0;
+
+	if (!bans || n <= 0)
+		return;
+
+	/* Newest first, so the batch ends up in its original order. The
+	 * batch is older than anything in the ring, so it is what gives
+	 * way when the ring is full. */
+	pthread_mutex_lock(&ban_outbox.lock);
+	while (n--) {
+		if (ban_outbox.count == RATE_BAN_OUTBOX) {
+			dropped++;
+			continue;
+		}
+		ban_outbox.head = (ban_outbox.head + RATE_BAN_OUTBOX - 1) %
+		                  RATE_BAN_OUTBOX;
+		ban_outbox.ring[ban_outbox.head] = bans[n];
+		ban_outbox.count++;
 	}
-	pthread_rwlock_unlock(&ip_table_lock);
+	pthread_mutex_unlock(&ban_outbox.lock);
+	if (dropped)
+		atomic_fetch_add(&ban_outbox_dropped, dropped);
+}
+
+bool tbg_rate_limit_apply_ban(const struct in6_addr *key, int plen,
+                              int seconds)
+{
+	subnet_node_t *n;
+	time_t until;
+	int duration;
+
+	if (!key || seconds <= 0 || !ban_prefix_ok(key, plen))
+		return false;
+
+	/* Another region's ban runs no longer than one made here would */
+	duration = config_get()->softban_duration_seconds;
+	if (seconds > duration)
+		seconds = duration;
+	until = tbg_clock_now() + seconds;
+
+	if (plen == 128)
+		return ban_ip(key, until) >= 0;
+
+	pthread_rwlock_wrlock(&subnet_lock);
+	n = subnet_insert(key, plen);
+	if (n && n->softban_until < until)
+		subnet_ban(n, until);
+	pthread_rwlock_unlock(&subnet_lock);
+	return n != NULL;
 }
 
 /* ── Per-connection rate limiting ────────────────────────────────── */
 
+/* Start a load-adaptive bucket at 1/2^level of its capacity. Its calls
+ * already cost 2^level, but a full new bucket would still admit the first
+ * subscribe and authorize of every connection at any level. */
+static void bucket_init_load(rate_bucket_t *b, uint32_t per_min, int load)
+{
+	bucket_init(b, per_min, per_min);
+	atomic_store(&b->state, bucket_pack((b->max_tokens >> load) <<
+	                                    RATE_TOKEN_SHIFT, now_ms()));
+}
+
 void tbg_rate_limit_conn_init(conn_rate_state_t *state)
 {
+	const rate_limit_config_t *cfg = config_get();
+	int load = tbg_rate_limit_load_level();
+
 	if (!state)
 		return;
 
-	bucket_init(&state->subscribe_bucket,
-	            (uint32_t)g_config.max_subscribes_per_minute,
-	            (uint32_t)g_config.max_subscribes_per_minute);
-	bucket_init(&state->authorize_bucket,
-	            (uint32_t)g_config.max_authorizes_per_minute,
-	            (uint32_t)g_config.max_authorizes_per_minute);
+	bucket_init_load(&state->subscribe_bucket,
+	                 (uint32_t)cfg->max_subscribes_per_minute, load);
+	bucket_init_load(&state->authorize_bucket,
+	                 (uint32_t)cfg->max_authorizes_per_minute, load);
 	bucket_init(&state->submit_bucket,
-	            (uint32_t)g_config.max_shares_per_minute,
-	            (uint32_t)g_config.max_shares_per_minute);
+	            (uint32_t)cfg->max_shares_per_minute,
+	            (uint32_t)cfg->max_shares_per_minute);
 	bucket_init(&state->invalid_bucket,
-	            (uint32_t)g_config.max_invalid_shares_per_minute,
-	            (uint32_t)g_config.max_invalid_shares_per_minute);
+	            (uint32_t)cfg->max_invalid_shares_per_minute,
+	            (uint32_t)cfg->max_invalid_shares_per_minute);
 }
 
 bool tbg_rate_limit_check_conn(conn_rate_state_t *state,
-                               rate_limit_type_t type)
+                               rate_limit_type_t type, uint32_t cost)
 {
+	uint64_t tokens = (uint64_t)(cost ? cost : RATE_COST_DEFAULT) <<
+	                  RATE_TOKEN_SHIFT;
 	rate_bucket_t *b;
 
 	if (!state)
@@ -370,9 +3011,11 @@ bool tbg_rate_limit_check_conn(conn_rate_state_t *state,
 	switch (type) {
 	case RATE_SUBSCRIBE:
 		b = &state->subscribe_bucket;
+		tokens = load_cost(tokens);
 		break;
 	case RATE_AUTHORIZE:
 		b = &state->authorize_bucket;
+		tokens = load_cost(tokens);
 		break;
 	case RATE_SUBMIT:
 		b = &state->submit_bucket;
@@ -384,7 +3027,10 @@ bool tbg_rate_limit_check_conn(conn_rate_state_t *state,
 		return true;
 	}
 
-	return bucket_consume(b);
+	if (bucket_take(b, tokens))
+		return true;
+	atomic_fetch_add_explicit(&conn_rejects[type], 1, memory_order_relaxed);
+	return false;
 }
 
 int tbg_rate_limit_global_connections(void)
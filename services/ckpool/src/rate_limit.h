@@ -3,19 +3,25 @@
  * THE BITCOIN GAME — GPLv3
  *
  * Protects against connection flooding, share spam, and resource
- * exhaustion from malicious or misconfigured miners. Uses a hash
- * map (uthash) keyed by IP address with atomic counters for
- * thread safety.
+ * exhaustion from malicious or misconfigured miners. Per-IP state lives
+ * in an open-addressing hash table keyed by the binary IPv6 address
+ * (IPv4 as v4-mapped), with atomic counters for thread safety. Subnet
+ * state (IPv4 /24, IPv6 /48 and /64) lives in a longest-prefix-match
+ * trie, so sources rotating through a subnet share one set of limits.
+ * Connect, subscribe and authorize limits tighten while share processing
+ * is slow or backed up.
  */
 
 #ifndef TBG_RATE_LIMIT_H
 #define TBG_RATE_LIMIT_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdatomic.h>
 #include <time.h>
 #include <pthread.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 
 /* Rate limit types */
@@ -37,32 +43,163 @@ typedef enum {
 #define RATE_INVALID_PER_MIN       100
 #define RATE_GLOBAL_MAX_CONNS      100000
 
+/* Default subnet limits: IPv4 /24 and IPv6 /48 share one tier, IPv6 /64
+ * (usually one host or LAN) has its own */
+#define RATE_SUBNET_CONNECT_PER_MIN   120
+#define RATE_SUBNET_MAX_CONCURRENT    500
+#define RATE_V6_HOST_CONNECT_PER_MIN  30
+#define RATE_V6_HOST_MAX_CONCURRENT   200
+
+/* Soft-banned addresses within one ban duration that ban their subnet */
+#define RATE_SUBNET_BAN_THRESHOLD     3
+
+/* Subnet prefix lengths tracked for limits */
+#define RATE_SUBNET_V4_PREFIX      24
+#define RATE_SUBNET_V6_PREFIX      48
+#define RATE_V6_HOST_PREFIX        64
+
 /* Soft-ban duration for share flooding (seconds) */
 #define RATE_SOFTBAN_DURATION      300   /* 5 minutes */
 
-/* Cleanup interval for stale IP entries (seconds) */
+/* Cleanup interval for stale IP entries (seconds): the cleanup thread
+ * visits every entry once per interval, a slice each second */
 #define RATE_CLEANUP_INTERVAL      60
 
+/* Most slots (or trie nodes) the cleanup visits per lock hold */
+#define RATE_SWEEP_BATCH           256
+
 /* Stale threshold: remove IP entries not seen for this long */
 #define RATE_STALE_THRESHOLD       300   /* 5 minutes */
 
-/* Token bucket for a single limit type */
+/* Stale threshold under memory pressure (soft-banned entries are kept) */
+#define RATE_PRESSURE_STALE        60
+
+/* IP table slots: initial and minimum capacity across all stripes
+ * (power of 2), and the load factor, in percent, at which a stripe
+ * doubles */
+#define RATE_TABLE_INITIAL         1024
+#define RATE_TABLE_MAX_LOAD        75
+
+/* Default cap on IPs with a table entry, across all stripes */
+#define RATE_TABLE_MAX_ENTRIES     (1 << 20)
+
+/*
+ * Heavy-hitter sketch: a Count-Min Sketch counts every connect attempt
+ * per source in fixed memory. Once a stripe is RATE_SKETCH_GATE_PCT full,
+ * only sources the sketch has seen RATE_SKETCH_PROMOTE times get an
+ * entry, and once it is at its share of the cap, only the
+ * RATE_HEAVY_HITTERS heaviest. Counts halve every RATE_SKETCH_DECAY
+ * seconds.
+ */
+#define RATE_SKETCH_DEPTH          4
+#define RATE_SKETCH_WIDTH          16384  /* Power of 2 */
+#define RATE_SKETCH_GATE_PCT       50
+#define RATE_SKETCH_PROMOTE        3
+#define RATE_SKETCH_DECAY          60
+#define RATE_HEAVY_HITTERS         64
+
+/*
+ * Load-adaptive admission: each second the cleanup thread takes the p99
+ * of the share-processing latencies and the peak share queue depth seen
+ * since the last check. Over either target, the load level rises by one,
+ * up to RATE_LOAD_MAX_LEVEL; each level halves the per-IP connect and
+ * the per-connection subscribe and authorize rates, and the tokens a new
+ * connection starts with, so its first calls wait too. The level falls by
+ * one after RATE_LOAD_RELAX_WINDOWS checks in a row under
+ * RATE_LOAD_RELAX_PCT of both targets. Latency is only judged over at
+ * least RATE_LOAD_MIN_SAMPLES shares.
+ */
+#define RATE_LOAD_TARGET_P99_US    20000  /* 20 ms */
+#define RATE_LOAD_MAX_QUEUE        5000
+#define RATE_LOAD_MAX_LEVEL        3
+#define RATE_LOAD_RELAX_PCT        50
+#define RATE_LOAD_RELAX_WINDOWS    5
+#define RATE_LOAD_MIN_SAMPLES      50
+
+/*
+ * Rejection log: rejected connects are counted per source and reason
+ * rather than logged one by one. A source's first rejection in each
+ * RATE_REJECT_LOG_INTERVAL seconds gets a detailed line; later ones are
+ * only counted. At the end of the interval a summary line gives the
+ * totals per reason, followed by one line for each of the
+ * RATE_REJECT_LOG_TOP sources rejected most. Past RATE_REJECT_LOG_SOURCES
+ * sources in an interval, rejections still count in the totals but get
+ * no lines of their own.
+ */
+#define RATE_REJECT_LOG_INTERVAL   10
+#define RATE_REJECT_LOG_SOURCES    4096   /* Power of 2 */
+#define RATE_REJECT_LOG_TOP        5
+
+/*
+ * State snapshot: with state_file set, soft-banned IPs and prefixes, and
+ * the connect buckets of IPs that have used more than
+ * RATE_STATE_HOT_PCT of theirs, are written to it every
+ * RATE_STATE_INTERVAL seconds and at shutdown, and read back at init.
+ * At most RATE_STATE_MAX_ENTRIES are kept, bans first. Prefix bans are
+ * kept only at the aggregation levels, the same ones the relay link
+ * accepts.
+ */
+#define RATE_STATE_INTERVAL        60
+#define RATE_STATE_HOT_PCT         50
+#define RATE_STATE_MAX_ENTRIES     65536
+
+/*
+ * Ban propagation: bans made here, by a caller or by a subnet reaching
+ * its threshold, are queued (up to RATE_BAN_OUTBOX, oldest dropped) for
+ * the relay link to send to the other regions. Bans applied from the
+ * link are not queued again, so they never echo back.
+ */
+#define RATE_BAN_OUTBOX            4096
+
+/*
+ * Token costs for tbg_rate_limit_check_conn(), so a client's budget
+ * reflects the CPU it makes us spend. A valid share costs one token of
+ * the submit bucket; an invalid one (found only after the full check)
+ * costs RATE_COST_INVALID_SHARE of it, on top of its one token of the
+ * invalid-share bucket. An authorize whose username needs full address
+ * validation costs RATE_COST_AUTH_VALIDATE of the authorize bucket. The
+ * stratifier charges that for a username it has not seen yet, the only
+ * kind ckpool validates, and RATE_COST_DEFAULT for a known one.
+ * Any message costs one more token per RATE_COST_MSG_BYTES past the first.
+ */
+#define RATE_COST_DEFAULT          1
+#define RATE_COST_INVALID_SHARE    4
+#define RATE_COST_AUTH_VALIDATE    3
+#define RATE_COST_MSG_BYTES        4096
+
+/* Lock stripes: the IP table is sharded by hash, each shard with its own
+ * lock, so connects from different IPs rarely contend (power of 2, <= 64) */
+#define RATE_TABLE_STRIPES         64
+
+/* Token counts are fixed point with this many fractional bits, so
+ * refill accrues per millisecond instead of per whole token */
+#define RATE_TOKEN_SHIFT           12
+#define RATE_TOKEN_ONE             (1u << RATE_TOKEN_SHIFT)
+
+/* Largest bucket: the token field is 32 bits */
+#define RATE_BUCKET_MAX            (UINT32_MAX >> RATE_TOKEN_SHIFT)
+
+/*
+ * Token bucket for a single limit type. state packs the fixed-point
+ * token count (high 32 bits) with the millisecond timestamp of the last
+ * refill (low 32 bits, monotonic, wraps after 49 days), so a refill and
+ * a consume commit together in one CAS.
+ */
 typedef struct rate_bucket {
-	_Atomic uint32_t tokens;
+	_Atomic uint64_t state;
 	uint32_t max_tokens;
 	uint32_t refill_per_min;
-	time_t last_refill;
 } rate_bucket_t;
 
-/* Per-IP rate state (uthash entry) */
+/* Per-IP rate state (one slot of the open-addressing IP table) */
 typedef struct ip_rate_state {
-	char ip[INET6_ADDRSTRLEN];       /* Hash key */
-	rate_bucket_t connect_bucket;    /* Connection rate bucket */
+	struct in6_addr addr;            /* Hash key; IPv4 as ::ffff:a.b.c.d */
+	uint32_t hash;                   /* Cached key hash; 0 = empty slot */
 	_Atomic int32_t active_connections;  /* Current concurrent connections */
+	rate_bucket_t connect_bucket;    /* Connection rate bucket */
 	time_t first_seen;
 	time_t last_seen;
 	time_t softban_until;            /* 0 if not banned */
-	void *hh_ptr;                    /* UT_hash_handle placeholder - actual handle in .c */
 } ip_rate_state_t;
 
 /* Per-connection rate state (embedded in client struct) */
@@ -83,49 +220,141 @@ typedef struct rate_limit_config {
 	int max_invalid_shares_per_minute;
 	int global_max_connections;
 	int softban_duration_seconds;
+	/* Subnet limits; 0 disables a limit, all four plus the threshold
+	 * at 0 disable subnet tracking */
+	int subnet_connections_per_minute;     /* IPv4 /24, IPv6 /48 */
+	int max_connections_per_subnet;
+	int v6_host_connections_per_minute;    /* IPv6 /64 */
+	int max_connections_per_v6_host;
+	int subnet_softban_threshold;
+	int max_tracked_ips;                   /* 0 = RATE_TABLE_MAX_ENTRIES */
+	/* Load-adaptive admission targets; 0 ignores a signal, both 0
+	 * disable it */
+	int load_target_p99_us;
+	int load_max_queue_depth;
+	/* Snapshot of bans and hot buckets, kept across restarts; "" = none */
+	char state_file[256];
 } rate_limit_config_t;
 
+/* A heavy source and its decayed connect count (see the sketch above) */
+typedef struct rate_limit_hitter {
+	struct in6_addr addr;
+	uint32_t connects;
+} rate_limit_hitter_t;
+
+/* A soft-ban queued for other regions */
+typedef struct rate_limit_ban {
+	struct in6_addr addr;            /* Bits past plen are zero */
+	int plen;                        /* Key bits; 128 = one address */
+	time_t until;
+} rate_limit_ban_t;
+
 /*
- * Initialize the rate limiter subsystem.
+ * Initialize the rate limiter subsystem with config (NULL = the
+ * compiled-in defaults).
  * Must be called once at startup. Starts the background cleanup thread.
  */
 void tbg_rate_limit_init(const rate_limit_config_t *config);
 
+/* Fill config with the compiled-in defaults */
+void tbg_rate_limit_config_defaults(rate_limit_config_t *config);
+
+/*
+ * Set one field of config by its name in rate_limit_config_t, as used for
+ * the keys of the rate_limit block in ckpool.conf. The _str variant takes
+ * "state_file". Returns false for an unknown key or a value out of range
+ * (negative, or a path that does not fit).
+ */
+bool tbg_rate_limit_config_set(rate_limit_config_t *config, const char *key,
+                               long long value);
+bool tbg_rate_limit_config_set_str(rate_limit_config_t *config,
+                                   const char *key, const char *value);
+
+/*
+ * Put config in force at runtime. It is published whole through an
+ * atomic pointer, so no caller ever sees half of it. Tracked IPs and
+ * subnets take the new connect limits at once; per-connection limits
+ * apply from a connection's next tbg_rate_limit_conn_init().
+ * Returns false if config is NULL or could not be copied.
+ */
+bool tbg_rate_limit_reload(const rate_limit_config_t *config);
+
+/*
+ * Reload on request: tbg_rate_limit_request_reload() only sets a flag,
+ * so it is safe to call from a signal handler (SIGHUP). Within a second
+ * the cleanup thread calls the loader to build a fresh configuration and
+ * reloads it if the loader returns true.
+ */
+typedef bool (*tbg_rate_limit_load_fn)(rate_limit_config_t *config,
+                                       void *ctx);
+void tbg_rate_limit_set_loader(tbg_rate_limit_load_fn fn, void *ctx);
+void tbg_rate_limit_request_reload(void);
+
 /*
  * Shut down the rate limiter. Stops the cleanup thread, frees all entries.
  */
 void tbg_rate_limit_shutdown(void);
 
+/*
+ * Build the table key for an address: IPv6 as is, IPv4 as a v4-mapped
+ * IPv6 address. The string form takes anything inet_pton() accepts and
+ * ignores an IPv6 zone suffix ("fe80::1%eth0").
+ * Returns false if the address is neither IPv4 nor IPv6.
+ */
+bool tbg_rate_limit_key_from_str(const char *ip, struct in6_addr *key);
+bool tbg_rate_limit_key_from_sockaddr(const struct sockaddr *sa,
+                                      struct in6_addr *key);
+
 /*
  * Check if a new connection from this IP should be allowed.
- * Returns true if allowed, false if rate limited.
+ * Returns true if allowed, false if rate limited (or ip is unparseable).
  * If allowed, increments the active connection count.
+ * The _key variant takes a key from tbg_rate_limit_key_from_*() and
+ * skips the string parse.
  */
 bool tbg_rate_limit_connect(const char *ip);
+bool tbg_rate_limit_connect_key(const struct in6_addr *key);
 
 /*
  * Notify that a connection from this IP has closed.
  * Decrements the active connection count.
  */
 void tbg_rate_limit_disconnect(const char *ip);
+void tbg_rate_limit_disconnect_key(const struct in6_addr *key);
 
 /*
- * Check if this IP is currently soft-banned.
+ * Check if this IP, or a prefix covering it, is currently soft-banned.
  * Returns true if banned, false otherwise.
  */
 bool tbg_rate_limit_is_banned(const char *ip);
+bool tbg_rate_limit_is_banned_key(const struct in6_addr *key);
 
 /*
- * Check if a per-connection action is allowed.
- * Returns true if allowed, false if rate limited.
+ * Check if a per-connection action is allowed, charging cost tokens
+ * (see RATE_COST_*; 0 counts as RATE_COST_DEFAULT) to its bucket. A
+ * cost above the bucket's size takes the whole bucket.
+ * Returns true if allowed, false if rate limited (nothing is charged).
  * On false, the caller should disconnect or reject.
  */
 bool tbg_rate_limit_check_conn(conn_rate_state_t *state,
-                               rate_limit_type_t type);
+                               rate_limit_type_t type, uint32_t cost);
+
+/* Cost of a message of len bytes: base plus one per RATE_COST_MSG_BYTES
+ * past the first */
+static inline uint32_t tbg_rate_limit_msg_cost(uint32_t base, size_t len)
+{
+	size_t extra = len ? (len - 1) / RATE_COST_MSG_BYTES : 0;
+
+	if (!base)
+		base = RATE_COST_DEFAULT;
+	return extra > RATE_BUCKET_MAX ? RATE_BUCKET_MAX :
+	       base + (uint32_t)extra;
+}
 
 /*
  * Initialize per-connection rate state.
- * Called when a new connection is established.
+ * Called when a new connection is established. Under load the subscribe
+ * and authorize buckets start at 1/2^level of their capacity.
  */
 void tbg_rate_limit_conn_init(conn_rate_state_t *state);
 
@@ -134,10 +363,96 @@ void tbg_rate_limit_conn_init(conn_rate_state_t *state);
  */
 int tbg_rate_limit_global_connections(void);
 
+/*
+ * Copy up to max of the heaviest connecting sources into out, heaviest
+ * first. Returns the number copied.
+ */
+int tbg_rate_limit_heavy_hitters(rate_limit_hitter_t *out, int max);
+
+/*
+ * Append Prometheus text-format rate limiter metrics to buf: rejections
+ * per rate_limit_type_t (connects also per reason), tracked IPs and
+ * subnets, and active soft-bans. The soft-ban gauges are counted by the
+ * cleanup thread, so they lag by up to RATE_CLEANUP_INTERVAL.
+ * Returns the number of bytes written (never more than buflen - 1).
+ */
+int tbg_rate_limit_format_metrics(char *buf, int buflen);
+
+/*
+ * Write a plain-text listing of the max heaviest connecting sources
+ * (0 or over RATE_HEAVY_HITTERS = all of them), one per line, with their
+ * rejections this log interval, open connections and ban state.
+ * Returns the number of bytes written (never more than buflen - 1).
+ */
+int tbg_rate_limit_format_offenders(char *buf, int buflen, int max);
+
+/*
+ * Feed the load-adaptive admission control. note_latency takes the time
+ * one share took to process, in microseconds; note_queue takes +1 when a
+ * share is queued for processing and -1 when it is dequeued.
+ */
+void tbg_rate_limit_note_latency(uint64_t us);
+void tbg_rate_limit_note_queue(int delta);
+
+/*
+ * Current load level, 0 (normal) to RATE_LOAD_MAX_LEVEL. Limits that
+ * adapt to load run at 1/2^level of their configured rate.
+ */
+int tbg_rate_limit_load_level(void);
+
 /*
  * Soft-ban an IP for the configured duration.
- * Called when share flooding is detected.
+ * Called when share flooding is detected. Once subnet_softban_threshold
+ * addresses of one /24, /48 or /64 are banned within a ban duration, the
+ * whole subnet is banned too.
  */
 void tbg_rate_limit_softban(const char *ip);
+void tbg_rate_limit_softban_key(const struct in6_addr *key);
+
+/*
+ * Soft-ban every address in a prefix for the configured duration.
+ * The string form takes CIDR notation ("198.51.100.0/22", "2001:db8::/32");
+ * the _key variant takes the prefix length in key bits, so an IPv4 /22
+ * is 96 + 22. Returns false on a malformed prefix. Only a ban at an
+ * aggregation level (IPv4 /24, IPv6 /48 or /64) is sent to other regions
+ * and kept across restarts.
+ */
+bool tbg_rate_limit_softban_prefix(const char *cidr);
+bool tbg_rate_limit_softban_prefix_key(const struct in6_addr *key, int plen);
+
+/*
+ * Take up to max bans queued for other regions, oldest first. Returns
+ * the number taken.
+ */
+int tbg_rate_limit_take_bans(rate_limit_ban_t *out, int max);
+
+/*
+ * Put n bans taken but not sent back at the front of the outbox, in
+ * order, ahead of any queued since. Bans that no longer fit are dropped
+ * and counted as outbox drops.
+ */
+void tbg_rate_limit_return_bans(const rate_limit_ban_t *bans, int n);
+
+/*
+ * Apply a ban received from another region: key/plen (128 = one
+ * address) for seconds, capped at the local ban duration. A longer ban
+ * already in place is kept. The ban is not queued for propagation.
+ * Only one address or a prefix at an aggregation level (96 +
+ * RATE_SUBNET_V4_PREFIX for a v4-mapped key, RATE_SUBNET_V6_PREFIX or
+ * RATE_V6_HOST_PREFIX outside the v4-mapped range) is accepted.
+ * Returns false on bad arguments or when there is no room for it.
+ */
+bool tbg_rate_limit_apply_ban(const struct in6_addr *key, int plen,
+                              int seconds);
+
+/*
+ * Memory governor callbacks (see tbg_memgov.h); arg is unused.
+ * Pressure from MEMGOV_ELEVATED evicts IPs idle for RATE_PRESSURE_STALE;
+ * from MEMGOV_HIGH the per-IP concurrent limit is halved; at
+ * MEMGOV_CRITICAL the global limit is halved too and connections are
+ * admitted only from IPs already in the table.
+ */
+size_t tbg_rate_limit_mem_usage(void *arg);
+size_t tbg_rate_limit_mem_pressure(int level, void *arg);
 
 #endif /* TBG_RATE_LIMIT_H */
@@ -0,0 +1,401 @@
+/*
+ * tbg_admit.c — Paced admission queue in front of mining.authorize
+ * THE BITCOIN GAME — GPLv3
+ *
+ * Items live in one preallocated pool, linked into per-FIFO lists, so a
+ * reconnect storm never allocates. Non-empty FIFOs sit in a ring that the
+ * pacer walks round-robin. Pacing credit is a token bucket in thousandths
+ * of a release, refilled from the shared clock.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "tbg_admit.h"
+#include "tbg_clock.h"
+#include "libckpool.h"
+
+_Static_assert((ADMIT_QUEUES & (ADMIT_QUEUES - 1)) == 0, "ADMIT_QUEUES");
+
+/* One release, in credit units */
+#define CREDIT_ONE  1000
+
+typedef struct admit_item {
+	void *item;
+	uint64_t queued_ms;
+	int32_t next;                    /* Pool index, -1 = end */
+} admit_item_t;
+
+typedef struct admit_fifo {
+	int32_t head, tail;              /* Pool indices, -1 = empty */
+	int32_t count;
+} admit_fifo_t;
+
+/* A released item on its way back to the owner */
+typedef struct admit_out {
+	void *item;
+	bool admitted;
+} admit_out_t;
+
+/* ── Global state ────────────────────────────────────────────────── */
+
+static pthread_mutex_t admit_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool admit_active;                /* Set up and accepting */
+
+static admit_item_t *pool;
+static int32_t pool_free;                /* Free list head */
+static admit_fifo_t fifos[ADMIT_QUEUES];
+static uint16_t ring[ADMIT_QUEUES];      /* Non-empty FIFOs, in turn */
+static int ring_head, ring_count;
+static int queued;
+
+static int g_rate;
+static int g_wait_ms;
+static uint64_t credit;                  /* CREDIT_ONE per release */
+static uint64_t credit_max;
+static uint64_t credit_ms;               /* Last refill */
+static uint64_t last_full_warn;
+static uint64_t hash_seed;
+static tbg_admit_fn g_release;
+static void *g_ctx;
+
+static _Atomic uint64_t s_immediate;
+static _Atomic uint64_t s_paced;
+static _Atomic uint64_t s_expired;
+static _Atomic uint64_t s_rejected;
+static _Atomic uint64_t s_wait_ms;       /* Summed over paced releases */
+
+static volatile int admit_running = 0;
+static pthread_t admit_thread;
+
+/* ── Fair queuing ────────────────────────────────────────────────── */
+
+/* Seeded FNV-1a over the source, finished with a multiply-xorshift */
+static uint32_t admit_fifo_for(const char *source)
+{
+	uint64_t h = 0xcbf29ce484222325ULL ^ hash_seed;
+
+	while (*source) {
+		h ^= (unsigned char)*source++;
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return (uint32_t)h & (ADMIT_QUEUES - 1);
+}
+
+static void fifo_push(uint32_t q, int32_t idx)
+{
+	admit_fifo_t *f = &fifos[q];
+
+	pool[idx].next = -1;
+	if (f->tail >= 0)
+		pool[f->tail].next = idx;
+	else
+		f->head = idx;
+	f->tail = idx;
+	if (!f->count++)
+		ring[(ring_head + ring_count++) % ADMIT_QUEUES] = (uint16_t)q;
+	queued++;
+}
+
+/* Pop the head of the FIFO whose turn it is; it goes to the back of the
+ * ring if it still has items. Caller checks ring_count. */
+static int32_t fifo_pop_next(void)
+{
+	uint32_t q = ring[ring_head];
+	admit_fifo_t *f = &fifos[q];
+	int32_t idx = f->head;
+
+	f->head = pool[idx].next;
+	if (f->head < 0)
+		f->tail = -1;
+	ring_head = (ring_head + 1) % ADMIT_QUEUES;
+	ring_count--;
+	if (--f->count)
+		ring[(ring_head + ring_count++) % ADMIT_QUEUES] = (uint16_t)q;
+	queued--;
+	return idx;
+}
+
+static void pool_put(int32_t idx)
+{
+	pool[idx].item = NULL;
+	pool[idx].next = pool_free;
+	pool_free = idx;
+}
+
+/* Caller holds admit_lock */
+static void credit_refill(uint64_t now)
+{
+	if (now > credit_ms) {
+		credit += (now - credit_ms) * (uint64_t)g_rate;
+		if (credit > credit_max)
+			credit = credit_max;
+	}
+	credit_ms = now;
+}
+
+/* ── Pacing ──────────────────────────────────────────────────────── */
+
+/*
+ * Take up to ADMIT_BATCH items that are due: expired ones always, live
+ * ones while there is credit. Returns how many were put in out. Caller
+ * holds admit_lock.
+ */
+static int admit_take(admit_out_t *out, uint64_t now)
+{
+	int n = 0;
+
+	while (n < ADMIT_BATCH && ring_count) {
+		admit_item_t *head = &pool[fifos[ring[ring_head]].head];
+		uint64_t waited = now - head->queued_ms;
+		int32_t idx;
+
+		if (waited <= (uint64_t)g_wait_ms && credit < CREDIT_ONE)
+			break;
+
+		idx = fifo_pop_next();
+		out[n].item = pool[idx].item;
+		if (waited > (uint64_t)g_wait_ms) {
+			out[n].admitted = false;
+			atomic_fetch_add(&s_expired, 1);
+		} else {
+			out[n].admitted = true;
+			credit -= CREDIT_ONE;
+			atomic_fetch_add(&s_paced, 1);
+			atomic_fetch_add(&s_wait_ms, waited);
+		}
+		pool_put(idx);
+		n++;
+	}
+	return n;
+}
+
+void tbg_admit_poll(void)
+{
+	admit_out_t out[ADMIT_BATCH];
+	int n, i;
+
+	do {
+		pthread_mutex_lock(&admit_lock);
+		if (!admit_active) {
+			pthread_mutex_unlock(&admit_lock);
+			return;
+		}
+		credit_refill(tbg_clock_mono_ms());
+		n = admit_take(out, credit_ms);
+		pthread_mutex_unlock(&admit_lock);
+
+		for (i = 0; i < n; i++)
+			g_release(out[i].item, g_ctx, out[i].admitted);
+	} while (n == ADMIT_BATCH);
+}
+
+static void *admit_thread_func(void *arg)
+{
+	struct timespec tick = { 0, ADMIT_TICK_MS * 1000000L };
+
+	(void)arg;
+
+	while (admit_running) {
+		nanosleep(&tick, NULL);
+		tbg_admit_poll();
+	}
+
+	return NULL;
+}
+
+/* ── Public API ──────────────────────────────────────────────────── */
+
+/* Allocate and reset the queue without starting the pacer */
+static bool admit_setup(int rate_per_sec, int max_wait_ms,
+                        tbg_admit_fn release, void *ctx)
+{
+	admit_item_t *p = calloc(ADMIT_MAX_QUEUED, sizeof(*p));
+	int i;
+
+	if (!p)
+		return false;
+
+	pthread_mutex_lock(&admit_lock);
+	pool = p;
+	for (i = 0; i < ADMIT_MAX_QUEUED; i++)
+		pool[i].next = i + 1 < ADMIT_MAX_QUEUED ? i + 1 : -1;
+	pool_free = 0;
+	for (i = 0; i < ADMIT_QUEUES; i++) {
+		fifos[i].head = fifos[i].tail = -1;
+		fifos[i].count = 0;
+	}
+	ring_head = ring_count = queued = 0;
+
+	g_rate = rate_per_sec > 0 ? rate_per_sec : ADMIT_DEFAULT_RATE;
+	g_wait_ms = max_wait_ms > 0 ? max_wait_ms : ADMIT_DEFAULT_WAIT_MS;
+	credit_max = (uint64_t)g_rate * ADMIT_BURST_MS;
+	if (credit_max < CREDIT_ONE)
+		credit_max = CREDIT_ONE;
+	credit = credit_max;
+	credit_ms = tbg_clock_mono_ms();
+	last_full_warn = 0;
+	hash_seed = tbg_clock_random_seed();
+	g_release = release;
+	g_ctx = ctx;
+	admit_active = true;
+	pthread_mutex_unlock(&admit_lock);
+	return true;
+}
+
+void tbg_admit_init(int rate_per_sec, int max_wait_ms, tbg_admit_fn release,
+                    void *ctx)
+{
+	if (admit_active || !release)
+		return;
+
+	if (!admit_setup(rate_per_sec, max_wait_ms, release, ctx)) {
+		LOGWARNING("Failed to allocate admission queue, authorizes "
+		           "will not be paced");
+		return;
+	}
+
+	admit_running = 1;
+	if (pthread_create(&admit_thread, NULL, admit_thread_func,
+	                    NULL) != 0) {
+		LOGWARNING("Failed to start admission pacer thread, "
+		           "authorizes will not be paced");
+		admit_running = 0;
+		tbg_admit_shutdown();
+		return;
+	}
+
+	LOGNOTICE("Admission queue initialized: %d authorizes/s, burst %d, "
+	          "max wait %d ms", g_rate, (int)(credit_max / CREDIT_ONE),
+	          g_wait_ms);
+}
+
+void tbg_admit_shutdown(void)
+{
+	admit_out_t out;
+
+	if (admit_running) {
+		admit_running = 0;
+		pthread_join(admit_thread, NULL);
+	}
+
+	pthread_mutex_lock(&admit_lock);
+	if (!admit_active) {
+		pthread_mutex_unlock(&admit_lock);
+		return;
+	}
+	admit_active = false;
+	pthread_mutex_unlock(&admit_lock);
+
+	/* Nothing else touches the queue once it is inactive */
+	while (ring_count) {
+		int32_t idx = fifo_pop_next();
+
+		out.item = pool[idx].item;
+		pool_put(idx);
+		g_release(out.item, g_ctx, false);
+	}
+
+	free(pool);
+	pool = NULL;
+}
+
+tbg_admit_result_t tbg_admit_submit(const char *source, void *item)
+{
+	tbg_admit_result_t ret;
+	uint64_t now;
+	uint32_t q;
+
+	q = admit_fifo_for(source ? source : "");
+
+	pthread_mutex_lock(&admit_lock);
+	if (!admit_active) {
+		pthread_mutex_unlock(&admit_lock);
+		return ADMIT_NOW;
+	}
+
+	now = tbg_clock_mono_ms();
+	credit_refill(now);
+	if (!queued && credit >= CREDIT_ONE) {
+		credit -= CREDIT_ONE;
+		atomic_fetch_add(&s_immediate, 1);
+		ret = ADMIT_NOW;
+	} else if (pool_free < 0 || fifos[q].count >= ADMIT_QUEUE_MAX) {
+		atomic_fetch_add(&s_rejected, 1);
+		ret = ADMIT_FULL;
+		if (now - last_full_warn >= 1000) {
+			last_full_warn = now;
+			LOGWARNING("Admission queue: rejecting authorizes "
+			           "(%d queued, source %s)", queued,
+			           source ? source : "unknown");
+		}
+	} else {
+		int32_t idx = pool_free;
+
+		pool_free = pool[idx].next;
+		pool[idx].item = item;
+		pool[idx].queued_ms = now;
+		fifo_push(q, idx);
+		ret = ADMIT_QUEUED;
+	}
+	pthread_mutex_unlock(&admit_lock);
+
+	return ret;
+}
+
+int tbg_admit_queued(void)
+{
+	int n;
+
+	pthread_mutex_lock(&admit_lock);
+	n = queued;
+	pthread_mutex_unlock(&admit_lock);
+	return n;
+}
+
+/* ── Metrics ─────────────────────────────────────────────────────── */
+
+int tbg_admit_format_metrics(char *buf, int buflen)
+{
+	int n;
+
+	if (!buf || buflen <= 0)
+		return 0;
+
+	n = snprintf(buf, buflen,
+	             "# HELP tbg_admit_queued Authorizes waiting in the admission queue\n"
+	             "# TYPE tbg_admit_queued gauge\n"
+	             "tbg_admit_queued %d\n"
+	             "# HELP tbg_admit_released_total Authorizes admitted, at once or after queuing\n"
+	             "# TYPE tbg_admit_released_total counter\n"
+	             "tbg_admit_released_total{path=\"immediate\"} %lu\n"
+	             "tbg_admit_released_total{path=\"paced\"} %lu\n"
+	             "# HELP tbg_admit_expired_total Authorizes dropped after the maximum wait\n"
+	             "# TYPE tbg_admit_expired_total counter\n"
+	             "tbg_admit_expired_total %lu\n"
+	             "# HELP tbg_admit_rejected_total Authorizes rejected with the queue full\n"
+	             "# TYPE tbg_admit_rejected_total counter\n"
+	             "tbg_admit_rejected_total %lu\n"
+	             "# HELP tbg_admit_wait_seconds_total Time paced authorizes spent queued\n"
+	             "# TYPE tbg_admit_wait_seconds_total counter\n"
+	             "tbg_admit_wait_seconds_total %.3f\n",
+	             tbg_admit_queued(),
+	             (unsigned long)atomic_load(&s_immediate),
+	             (unsigned long)atomic_load(&s_paced),
+	             (unsigned long)atomic_load(&s_expired),
+	             (unsigned long)atomic_load(&s_rejected),
+	             atomic_load(&s_wait_ms) / 1000.0);
+
+	/* snprintf reports the untruncated length; clamp to what fit */
+	return n < buflen ? n : buflen - 1;
+}
@@ -0,0 +1,84 @@
+/*
+ * tbg_admit.h — Paced admission queue in front of mining.authorize
+ * THE BITCOIN GAME — GPLv3
+ *
+ * After a region failover, tens of thousands of miners reconnect within
+ * seconds and every one of them authorizes. Instead of handing those
+ * straight to the authoriser, the stratifier submits them here. A pacer
+ * thread releases them at a configured rate, and a client waits briefly
+ * instead of being rejected.
+ *
+ * Queuing is stochastic fair queuing: each source is hashed (with a
+ * per-process seed) to one of ADMIT_QUEUES FIFOs, and the pacer takes one
+ * item from each non-empty FIFO in turn. A source that floods authorizes
+ * only delays itself and the few sources sharing its FIFO.
+ *
+ * While nothing is queued, a submit within the burst allowance is
+ * admitted at once, so a pool that is not under a storm never waits.
+ */
+
+#ifndef TBG_ADMIT_H
+#define TBG_ADMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Defaults when tbg_admit_init() is given 0 */
+#define ADMIT_DEFAULT_RATE     2000   /* Releases per second */
+#define ADMIT_DEFAULT_WAIT_MS  10000  /* Longest a client waits */
+
+/* Burst: releases that may go without waiting, in ms of the rate */
+#define ADMIT_BURST_MS         100
+
+/* Fair-queuing FIFOs (power of 2), and the items each may hold */
+#define ADMIT_QUEUES           1024
+#define ADMIT_QUEUE_MAX        64
+
+/* Items queued across all FIFOs */
+#define ADMIT_MAX_QUEUED       65536
+
+/* Pacer period (ms), and most items it hands over per lock hold */
+#define ADMIT_TICK_MS          5
+#define ADMIT_BATCH            256
+
+/* Outcome of tbg_admit_submit() */
+typedef enum {
+	ADMIT_NOW,      /* Go ahead now; the item is still the caller's */
+	ADMIT_QUEUED,   /* The release callback gets the item later */
+	ADMIT_FULL,     /* Queue full: reject; the item is still the caller's */
+} tbg_admit_result_t;
+
+/*
+ * Hand a queued item back to its owner. admitted is false for an item
+ * that waited longer than the maximum wait, or that was still queued at
+ * shutdown. Called from the pacer thread, without the queue lock held.
+ */
+typedef void (*tbg_admit_fn)(void *item, void *ctx, bool admitted);
+
+/*
+ * Start pacing at rate_per_sec, dropping items older than max_wait_ms
+ * (0 = ADMIT_DEFAULT_RATE / ADMIT_DEFAULT_WAIT_MS). Until this is called,
+ * every submit returns ADMIT_NOW.
+ */
+void tbg_admit_init(int rate_per_sec, int max_wait_ms, tbg_admit_fn release,
+                    void *ctx);
+
+/* Stop the pacer; items still queued are released as not admitted */
+void tbg_admit_shutdown(void);
+
+/* Submit item from source (any key string, e.g. the client IP) */
+tbg_admit_result_t tbg_admit_submit(const char *source, void *item);
+
+/* Release what the rate allows now (the pacer thread calls this) */
+void tbg_admit_poll(void);
+
+/* Items currently queued */
+int tbg_admit_queued(void);
+
+/*
+ * Append Prometheus text-format admission metrics to buf.
+ * Returns the number of bytes written (never more than buflen - 1).
+ */
+int tbg_admit_format_metrics(char *buf, int buflen);
+
+#endif /* TBG_ADMIT_H */
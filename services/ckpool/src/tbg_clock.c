@@ -0,0 +1,129 @@
+/*
+ * tbg_clock.c — Shared coarse clock for TBG hot paths
+ * THE BITCOIN GAME — GPLv3
+ *
+ * The ticker thread is the only writer of the cached readings; see
+ * tbg_clock.h for the reader side.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "tbg_clock.h"
+#include "libckpool.h"
+
+_Atomic uint64_t tbg_clock_mono_cached;
+_Atomic uint64_t tbg_clock_real_cached;
+
+static volatile int clock_running = 0;
+static pthread_t clock_thread;
+
+/* ── Direct reads ────────────────────────────────────────────────── */
+
+uint64_t tbg_clock_read_mono_ms(void)
+{
+	struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	/* +1 keeps the value non-zero, which readers take as "not cached" */
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000 + 1;
+}
+
+uint64_t tbg_clock_read_real_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+uint64_t tbg_clock_random_seed(void)
+{
+	static _Atomic uint64_t calls;
+	struct timespec ts;
+	uint64_t v = 0;
+
+#ifdef SYS_getrandom
+	if (syscall(SYS_getrandom, &v, sizeof(v), 0) == (long)sizeof(v))
+		return v;
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	v = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^
+	    (uint64_t)(uintptr_t)&ts ^
+	    atomic_fetch_add_explicit(&calls, 1, memory_order_relaxed) *
+	    0x9e3779b97f4a7c15ULL;
+	v ^= v >> 30;
+	v *= 0xbf58476d1ce4e5b9ULL;
+	v ^= v >> 27;
+	v *= 0x94d049bb133111ebULL;
+	return v ^ (v >> 31);
+}
+
+/* ── Ticker thread ───────────────────────────────────────────────── */
+
+static void clock_tick(void)
+{
+	atomic_store_explicit(&tbg_clock_mono_cached, tbg_clock_read_mono_ms(),
+	                      memory_order_relaxed);
+	atomic_store_explicit(&tbg_clock_real_cached, tbg_clock_read_real_us(),
+	                      memory_order_relaxed);
+}
+
+static void *clock_thread_func(void *arg)
+{
+	struct timespec tick = { 0, TBG_CLOCK_TICK_US * 1000L };
+
+	(void)arg;
+
+	while (clock_running) {
+		nanosleep(&tick, NULL);
+		clock_tick();
+	}
+
+	return NULL;
+}
+
+/* ── Public API ──────────────────────────────────────────────────── */
+
+void tbg_clock_init(void)
+{
+	if (clock_running)
+		return;
+
+	/* Publish a reading before the first tick */
+	clock_tick();
+
+	clock_running = 1;
+	if (pthread_create(&clock_thread, NULL, clock_thread_func, NULL) != 0) {
+		LOGWARNING("Failed to start clock ticker thread, TBG modules "
+		           "will read the clock directly");
+		clock_running = 0;
+		atomic_store(&tbg_clock_mono_cached, 0);
+		atomic_store(&tbg_clock_real_cached, 0);
+		return;
+	}
+
+	LOGNOTICE("Clock ticker started (%d us resolution)", TBG_CLOCK_TICK_US);
+}
+
+void tbg_clock_shutdown(void)
+{
+	if (!clock_running)
+		return;
+
+	clock_running = 0;
+	pthread_join(clock_thread, NULL);
+
+	atomic_store(&tbg_clock_mono_cached, 0);
+	atomic_store(&tbg_clock_real_cached, 0);
+}
@@ -0,0 +1,83 @@
+/*
+ * tbg_clock.h — Shared coarse clock for TBG hot paths
+ * THE BITCOIN GAME — GPLv3
+ *
+ * A ticker thread refreshes a cached monotonic and realtime reading every
+ * TBG_CLOCK_TICK_US. Readers get them with one relaxed atomic load instead
+ * of a clock_gettime()/gettimeofday() call per rate-limit check, vardiff
+ * update and emitted event. Cached values lag the real clock by at most a
+ * tick plus the ticker's scheduling delay.
+ *
+ * Before tbg_clock_init() (and after tbg_clock_shutdown()) the readers
+ * fall back to reading the clock directly, so modules and unit tests that
+ * never start the ticker still get correct times.
+ *
+ * Also home to tbg_clock_random_seed(), whose fallback is a clock read.
+ */
+
+#ifndef TBG_CLOCK_H
+#define TBG_CLOCK_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/time.h>
+
+/* Ticker period (microseconds) */
+#define TBG_CLOCK_TICK_US  1000
+
+/* Cached readings, 0 while the ticker is not running */
+extern _Atomic uint64_t tbg_clock_mono_cached;   /* ms, CLOCK_MONOTONIC_COARSE */
+extern _Atomic uint64_t tbg_clock_real_cached;   /* us since the epoch */
+
+/* Start the ticker thread (idempotent) */
+void tbg_clock_init(void);
+
+/* Stop the ticker; readers fall back to direct clock reads */
+void tbg_clock_shutdown(void);
+
+/* Direct reads, used as the fallback */
+uint64_t tbg_clock_read_mono_ms(void);
+uint64_t tbg_clock_read_real_us(void);
+
+/*
+ * 64 random bits for hash seeds and canaries, from getrandom(). Without
+ * it, the clock, a stack address and a call count go through a splitmix64
+ * finaliser: unpredictable enough off-box, and distinct per call.
+ */
+uint64_t tbg_clock_random_seed(void);
+
+/* Monotonic milliseconds (arbitrary epoch) */
+static inline uint64_t tbg_clock_mono_ms(void)
+{
+	uint64_t v = atomic_load_explicit(&tbg_clock_mono_cached,
+	                                  memory_order_relaxed);
+
+	return v ? v : tbg_clock_read_mono_ms();
+}
+
+/* Wall-clock microseconds since the epoch */
+static inline uint64_t tbg_clock_real_us(void)
+{
+	uint64_t v = atomic_load_explicit(&tbg_clock_real_cached,
+	                                  memory_order_relaxed);
+
+	return v ? v : tbg_clock_read_real_us();
+}
+
+/* Wall-clock seconds: a drop-in for time(NULL) */
+static inline time_t tbg_clock_now(void)
+{
+	return (time_t)(tbg_clock_real_us() / 1000000);
+}
+
+/* Wall clock as a timeval: a drop-in for gettimeofday(tv, NULL) */
+static inline void tbg_clock_timeval(struct timeval *tv)
+{
+	uint64_t us = tbg_clock_real_us();
+
+	tv->tv_sec = (time_t)(us / 1000000);
+	tv->tv_usec = (suseconds_t)(us % 1000000);
+}
+
+#endif /* TBG_CLOCK_H */
@@ -12,10 +12,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <unistd.h>
 
 #include "tbg_coinbase_sig.h"
+#include "tbg_memgov.h"
 #include "uthash.h"
+#include "libckpool.h"
 
 /* Optional hiredis support — compiled in only if available */
 #ifdef HAVE_HIREDIS
@@ -37,6 +40,7 @@ static pthread_rwlock_t sig_lock = PTHREAD_RWLOCK_INITIALIZER;
 static pthread_t sig_thread;
 static volatile int sig_running = 0;
 static char *sig_redis_url = NULL;
+static _Atomic bool sig_paused = false;  /* Critical memory pressure */
 
 bool tbg_validate_sig(const char *sig)
 {
@@ -196,7 +200,8 @@ static void *sig_refresh_thread(void *arg)
 
 	while (sig_running) {
 #ifdef HAVE_HIREDIS
-		refresh_from_redis();
+		if (!atomic_load(&sig_paused))
+			refresh_from_redis();
 #endif
 		/* Sleep in 1-second intervals so we can check sig_running */
 		int i;
@@ -207,6 +212,42 @@ static void *sig_refresh_thread(void *arg)
 	return NULL;
 }
 
+size_t tbg_sig_cache_mem_usage(void *arg)
+{
+	size_t bytes;
+
+	(void)arg;
+	pthread_rwlock_rdlock(&sig_lock);
+	bytes = HASH_COUNT(sig_cache) * sizeof(sig_entry_t) +
+	        HASH_OVERHEAD(hh, sig_cache);
+	pthread_rwlock_unlock(&sig_lock);
+
+	return bytes;
+}
+
+/*
+ * The entries are kept whatever the level: they are small, and without
+ * them a block found meanwhile would carry only the pool signature. A
+ * refresh builds a second cache beside the first, so at critical only
+ * the refresh is paused.
+ */
+size_t tbg_sig_cache_mem_pressure(int level, void *arg)
+{
+	bool pause = level >= MEMGOV_CRITICAL;
+
+	(void)arg;
+	if (atomic_exchange(&sig_paused, pause) == pause)
+		return 0;
+
+	if (pause)
+		LOGWARNING("Coinbase sig cache: refresh paused under critical "
+		           "memory pressure, keeping cached signatures");
+	else
+		LOGNOTICE("Coinbase sig cache: refresh resumed");
+
+	return 0;
+}
+
 void tbg_sig_cache_init(const char *redis_url)
 {
 	if (sig_running)
@@ -11,6 +11,7 @@
 #define TBG_COINBASE_SIG_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 /* Maximum length of a user coinbase signature in bytes */
 #define TBG_MAX_USER_SIG_LEN 20
@@ -40,4 +41,10 @@ const char *tbg_get_user_sig(const char *btc_address);
  * Returns false otherwise. */
 bool tbg_validate_sig(const char *sig);
 
+/* Memory governor callbacks (see tbg_memgov.h); arg is unused.
+ * At MEMGOV_CRITICAL the Redis refresh is paused until pressure drops;
+ * cached signatures are kept, so blocks still carry them. */
+size_t tbg_sig_cache_mem_usage(void *arg);
+size_t tbg_sig_cache_mem_pressure(int level, void *arg);
+
 #endif /* TBG_COINBASE_SIG_H */
@@ -0,0 +1,260 @@
+/*
+ * tbg_memgov.c — Global memory-pressure governor for TBG-owned memory
+ * THE BITCOIN GAME — GPLv3
+ *
+ * A background thread sums the registered consumers' usage once per
+ * MEMGOV_INTERVAL, maps it to a pressure level against the budget and
+ * hands the level to each consumer's pressure callback. The level is
+ * published through an atomic so hot paths can consult it for free.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "tbg_memgov.h"
+#include "libckpool.h"
+
+typedef struct memgov_consumer {
+	const char *name;
+	memgov_usage_fn usage;
+	memgov_pressure_fn pressure;
+	void *arg;
+	size_t last_usage;          /* At the last evaluation */
+} memgov_consumer_t;
+
+/* ── Global state ────────────────────────────────────────────────── */
+
+static memgov_consumer_t consumers[MEMGOV_MAX_CONSUMERS];
+static int consumer_count;
+static pthread_mutex_t memgov_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t g_budget = MEMGOV_DEFAULT_BUDGET;
+static _Atomic int g_level = MEMGOV_NORMAL;
+static _Atomic size_t g_usage;
+static _Atomic uint64_t g_reclaimed;
+static _Atomic uint64_t g_level_changes;
+
+static volatile int memgov_running = 0;
+static pthread_t memgov_thread;
+
+static const char *const level_names[MEMGOV_LEVEL_COUNT] = {
+	"normal", "elevated", "high", "critical"
+};
+
+static const int level_pct[MEMGOV_LEVEL_COUNT] = {
+	0, MEMGOV_ELEVATED_PCT, MEMGOV_HIGH_PCT, MEMGOV_CRITICAL_PCT
+};
+
+/* ── Evaluation ──────────────────────────────────────────────────── */
+
+/*
+ * Level for usage given the current level. A level is entered at its
+ * threshold and held until usage drops MEMGOV_HYSTERESIS_PCT below it.
+ */
+static int level_for(size_t usage, size_t budget, int current)
+{
+	int used = (int)(usage * 100 / budget);
+	int level;
+
+	for (level = MEMGOV_CRITICAL; level > MEMGOV_NORMAL; level--) {
+		if (used >= level_pct[level])
+			return level;
+		if (current >= level &&
+		    used >= level_pct[level] - MEMGOV_HYSTERESIS_PCT)
+			return level;
+	}
+	return MEMGOV_NORMAL;
+}
+
+void tbg_memgov_poll(void)
+{
+	size_t usage = 0, reclaimed = 0;
+	int prev, level, i;
+
+	pthread_mutex_lock(&memgov_lock);
+
+	for (i = 0; i < consumer_count; i++) {
+		consumers[i].last_usage = consumers[i].usage(consumers[i].arg);
+		usage += consumers[i].last_usage;
+	}
+	atomic_store(&g_usage, usage);
+
+	prev = atomic_load(&g_level);
+	level = level_for(usage, g_budget, prev);
+	atomic_store(&g_level, level);
+
+	if (level != prev) {
+		atomic_fetch_add(&g_level_changes, 1);
+		if (level > prev)
+			LOGWARNING("Memory governor: %s pressure (%zu of %zu MB)",
+			           level_names[level], usage >> 20, g_budget >> 20);
+		else
+			LOGNOTICE("Memory governor: eased to %s (%zu of %zu MB)",
+			          level_names[level], usage >> 20, g_budget >> 20);
+	}
+
+	/* Keep applying pressure while it lasts; tell consumers once when
+	 * it is over */
+	if (level != MEMGOV_NORMAL || level != prev) {
+		for (i = 0; i < consumer_count; i++) {
+			if (consumers[i].pressure)
+				reclaimed += consumers[i].pressure(level,
+				                                   consumers[i].arg);
+		}
+	}
+	atomic_fetch_add(&g_reclaimed, (uint64_t)reclaimed);
+
+	pthread_mutex_unlock(&memgov_lock);
+}
+
+static void *memgov_thread_func(void *arg)
+{
+	(void)arg;
+
+	while (memgov_running) {
+		int i;
+
+		tbg_memgov_poll();
+
+		/* Sleep in 1-second intervals to check memgov_running */
+		for (i = 0; i < MEMGOV_INTERVAL && memgov_running; i++)
+			sleep(1);
+	}
+
+	return NULL;
+}
+
+/* ── Public API ──────────────────────────────────────────────────── */
+
+void tbg_memgov_init(size_t budget_bytes)
+{
+	if (memgov_running)
+		return;
+
+	g_budget = budget_bytes ? budget_bytes : MEMGOV_DEFAULT_BUDGET;
+	atomic_store(&g_level, MEMGOV_NORMAL);
+
+	memgov_running = 1;
+	if (pthread_create(&memgov_thread, NULL, memgov_thread_func,
+	                    NULL) != 0) {
+		LOGWARNING("Failed to start memory governor thread");
+		memgov_running = 0;
+		return;
+	}
+
+	LOGNOTICE("Memory governor initialized: budget %zu MB "
+	          "(elevated %d%%, high %d%%, critical %d%%)",
+	          g_budget >> 20, MEMGOV_ELEVATED_PCT, MEMGOV_HIGH_PCT,
+	          MEMGOV_CRITICAL_PCT);
+}
+
+void tbg_memgov_shutdown(void)
+{
+	if (memgov_running) {
+		memgov_running = 0;
+		pthread_join(memgov_thread, NULL);
+	}
+
+	pthread_mutex_lock(&memgov_lock);
+	consumer_count = 0;
+	pthread_mutex_unlock(&memgov_lock);
+
+	atomic_store(&g_level, MEMGOV_NORMAL);
+	atomic_store(&g_usage, 0);
+}
+
+int tbg_memgov_register(const char *name, memgov_usage_fn usage,
+                        memgov_pressure_fn pressure, void *arg)
+{
+	int ret = -1;
+
+	if (!usage)
+		return -1;
+
+	pthread_mutex_lock(&memgov_lock);
+	if (consumer_count < MEMGOV_MAX_CONSUMERS) {
+		memgov_consumer_t *c = &consumers[consumer_count++];
+
+		c->name = name ? name : "unnamed";
+		c->usage = usage;
+		c->pressure = pressure;
+		c->arg = arg;
+		c->last_usage = 0;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&memgov_lock);
+
+	if (ret)
+		LOGWARNING("Memory governor: consumer table full, '%s' not "
+		           "accounted", name ? name : "unnamed");
+	return ret;
+}
+
+int tbg_memgov_level(void)
+{
+	return atomic_load_explicit(&g_level, memory_order_relaxed);
+}
+
+size_t tbg_memgov_usage(void)
+{
+	return atomic_load(&g_usage);
+}
+
+size_t tbg_memgov_budget(void)
+{
+	return g_budget;
+}
+
+const char *tbg_memgov_level_name(int level)
+{
+	if (level < 0 || level >= MEMGOV_LEVEL_COUNT)
+		return "unknown";
+	return level_names[level];
+}
+
+/* ── Metrics ─────────────────────────────────────────────────────── */
+
+int tbg_memgov_format_metrics(char *buf, int buflen)
+{
+	int n, i;
+
+	if (!buf || buflen <= 0)
+		return 0;
+
+	pthread_mutex_lock(&memgov_lock);
+
+	n = snprintf(buf, buflen,
+	             "# HELP tbg_memgov_budget_bytes Memory budget for TBG-owned memory\n"
+	             "# TYPE tbg_memgov_budget_bytes gauge\n"
+	             "tbg_memgov_budget_bytes %zu\n"
+	             "# HELP tbg_memgov_level Pressure level (0 normal, 1 elevated, 2 high, 3 critical)\n"
+	             "# TYPE tbg_memgov_level gauge\n"
+	             "tbg_memgov_level %d\n"
+	             "# HELP tbg_memgov_level_changes_total Pressure level transitions\n"
+	             "# TYPE tbg_memgov_level_changes_total counter\n"
+	             "tbg_memgov_level_changes_total %lu\n"
+	             "# HELP tbg_memgov_reclaimed_bytes_total Bytes released by pressure callbacks\n"
+	             "# TYPE tbg_memgov_reclaimed_bytes_total counter\n"
+	             "tbg_memgov_reclaimed_bytes_total %lu\n"
+	             "# HELP tbg_memgov_usage_bytes Memory held per consumer at the last evaluation\n"
+	             "# TYPE tbg_memgov_usage_bytes gauge\n",
+	             g_budget, tbg_memgov_level(),
+	             (unsigned long)atomic_load(&g_level_changes),
+	             (unsigned long)atomic_load(&g_reclaimed));
+
+	for (i = 0; i < consumer_count && n < buflen; i++)
+		n += snprintf(buf + n, buflen - n,
+		              "tbg_memgov_usage_bytes{consumer=\"%s\"} %zu\n",
+		              consumers[i].name, consumers[i].last_usage);
+
+	pthread_mutex_unlock(&memgov_lock);
+
+	/* snprintf reports the untruncated length; clamp to what fit */
+	return n < buflen ? n : buflen - 1;
+}
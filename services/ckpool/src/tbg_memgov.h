@@ -0,0 +1,96 @@
+/*
+ * tbg_memgov.h — Global memory-pressure governor for TBG-owned memory
+ * THE BITCOIN GAME — GPLv3
+ *
+ * One budget covers every TBG cache and buffer (memory pools, event ring,
+ * rate-limit table, vardiff cache, signature cache). Each module registers
+ * a usage callback and a pressure callback; a background thread sums the
+ * usage once per interval and, as it nears the budget, raises the pressure
+ * level so modules degrade in steps instead of growing until the OOM
+ * killer steps in:
+ *
+ *   ELEVATED  Shrink caches (trim free pool slabs, evict idle entries).
+ *   HIGH      Also switch events to aggregated mode.
+ *   CRITICAL  Also tighten admission (fewer new connections and IPs).
+ *
+ * Levels fall back with hysteresis so a module does not flap at a
+ * threshold.
+ */
+
+#ifndef TBG_MEMGOV_H
+#define TBG_MEMGOV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Pressure levels, mildest first */
+#define MEMGOV_NORMAL         0
+#define MEMGOV_ELEVATED       1
+#define MEMGOV_HIGH           2
+#define MEMGOV_CRITICAL       3
+#define MEMGOV_LEVEL_COUNT    4
+
+/* Default budget when tbg_memgov_init() is given 0 */
+#define MEMGOV_DEFAULT_BUDGET (256UL * 1024 * 1024)
+
+/* Usage thresholds for each level, percent of budget */
+#define MEMGOV_ELEVATED_PCT   70
+#define MEMGOV_HIGH_PCT       85
+#define MEMGOV_CRITICAL_PCT   95
+
+/* A level is left only once usage drops this many points below it */
+#define MEMGOV_HYSTERESIS_PCT 5
+
+/* Seconds between evaluations */
+#define MEMGOV_INTERVAL       1
+
+/* Maximum registered consumers */
+#define MEMGOV_MAX_CONSUMERS  16
+
+/* Bytes the consumer currently holds */
+typedef size_t (*memgov_usage_fn)(void *arg);
+
+/*
+ * Apply the degradation steps for level. Called on every evaluation
+ * while the level is above MEMGOV_NORMAL, and once when it returns to
+ * MEMGOV_NORMAL so the consumer can restore normal behaviour. Returns
+ * the bytes released (0 if none).
+ */
+typedef size_t (*memgov_pressure_fn)(int level, void *arg);
+
+/*
+ * Initialize the governor and start its thread.
+ * budget_bytes: total for all consumers (0 = MEMGOV_DEFAULT_BUDGET).
+ */
+void tbg_memgov_init(size_t budget_bytes);
+
+/* Stop the governor thread and drop all consumers */
+void tbg_memgov_shutdown(void);
+
+/*
+ * Register a consumer. pressure may be NULL for memory that is only
+ * accounted (e.g. fixed buffers). Returns 0, or -1 if the table is full.
+ */
+int tbg_memgov_register(const char *name, memgov_usage_fn usage,
+                        memgov_pressure_fn pressure, void *arg);
+
+/* Evaluate usage and apply pressure now (the thread calls this) */
+void tbg_memgov_poll(void);
+
+/* Current pressure level (cheap: one atomic load, for hot paths) */
+int tbg_memgov_level(void);
+
+/* Usage summed at the last evaluation, and the budget */
+size_t tbg_memgov_usage(void);
+size_t tbg_memgov_budget(void);
+
+/* Name of a pressure level ("normal", "elevated", ...) */
+const char *tbg_memgov_level_name(int level);
+
+/*
+ * Append Prometheus text-format governor metrics to buf.
+ * Returns the number of bytes written (never more than buflen - 1).
+ */
+int tbg_memgov_format_metrics(char *buf, int buflen);
+
+#endif /* TBG_MEMGOV_H */
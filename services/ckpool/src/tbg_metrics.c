@@ -4,7 +4,9 @@
  *
  * Runs a lightweight HTTP server on a dedicated thread that serves
  * metrics in Prometheus exposition text format. All counters use
- * C11 _Atomic types for lock-free thread safety.
+ * C11 _Atomic types for lock-free thread safety. GET /offenders[?top=N]
+ * instead lists the rate limiter's heaviest connecting sources, which
+ * would be too many series for Prometheus to scrape.
  */
 
 #include "config.h"
@@ -21,6 +23,10 @@
 #include <signal.h>
 
 #include "tbg_metrics.h"
+#include "memory_pool.h"
+#include "tbg_memgov.h"
+#include "tbg_admit.h"
+#include "rate_limit.h"
 
 /* Global metrics instance */
 ckpool_metrics_t g_metrics = {0};
@@ -94,14 +100,31 @@ int tbg_format_metrics(char *buf, int buflen)
 		"ckpool_uptime_seconds %ld\n",
 		(long)uptime);
 
+	/* Per-pool allocator metrics (tbg_pool_*) */
+	if (n < buflen)
+		n += tbg_pool_format_metrics(buf + n, buflen - n);
+
+	/* Memory governor budget and pressure (tbg_memgov_*) */
+	if (n < buflen)
+		n += tbg_memgov_format_metrics(buf + n, buflen - n);
+
+	/* Authorize admission queue (tbg_admit_*) */
+	if (n < buflen)
+		n += tbg_admit_format_metrics(buf + n, buflen - n);
+
+	/* Rate limiter rejections, table sizes and bans (tbg_rate_limit_*) */
+	if (n < buflen)
+		n += tbg_rate_limit_format_metrics(buf + n, buflen - n);
+
 	return n;
 }
 
 static void handle_metrics_request(int client_fd)
 {
 	char req[1024];
-	char body[8192];
-	char response[10240];
+	char body[32768];
+	char response[34816];
+	const char *path;
 	int body_len, resp_len;
 	ssize_t n;
 
@@ -118,7 +141,17 @@ static void handle_metrics_request(int client_fd)
 		goto out;
 	}
 
-	body_len = tbg_format_metrics(body, sizeof(body));
+	path = req + 4;
+	if (!strncmp(path, "/offenders", 10) &&
+	    (path[10] == ' ' || path[10] == '?')) {
+		int top = 0;
+
+		if (!strncmp(path + 10, "?top=", 5))
+			top = atoi(path + 15);
+		body_len = tbg_rate_limit_format_offenders(body, sizeof(body), top);
+	} else {
+		body_len = tbg_format_metrics(body, sizeof(body));
+	}
 
 	resp_len = snprintf(response, sizeof(response),
 		"HTTP/1.1 200 OK\r\n"
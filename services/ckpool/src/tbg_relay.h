@@ -6,6 +6,9 @@
  * Primary pushes block templates to relays; relays send back block solutions.
  * Heartbeats maintain connection health; relays fail over to independent
  * mode if the primary is unreachable for tbg_failover_timeout seconds.
+ * Soft-bans made in any region are batched every heartbeat and sent over
+ * the same link; the primary applies a relay's batch and forwards it to
+ * the other relays.
  */
 
 #ifndef TBG_RELAY_H
@@ -33,7 +36,8 @@ enum tbg_relay_msg_type {
 	TBG_MSG_HEARTBEAT   = 2,  /* Keepalive (bidirectional) */
 	TBG_MSG_BLOCK_FOUND = 3,  /* Block solution (relay → primary) */
 	TBG_MSG_CONFIG_SYNC = 4,  /* Config/difficulty sync (primary → relay) */
-	TBG_MSG_REGISTER    = 5   /* Relay self-registration (relay → primary) */
+	TBG_MSG_REGISTER    = 5,  /* Relay self-registration (relay → primary) */
+	TBG_MSG_SOFTBAN     = 6   /* Soft-ban batch (bidirectional) */
 };
 
 /* Wire header (packed, network byte order for length) */
@@ -45,6 +49,46 @@ typedef struct __attribute__((packed)) tbg_relay_hdr {
 	uint32_t length;         /* Payload length in bytes (network order) */
 } tbg_relay_hdr_t;
 
+/*
+ * One soft-ban in a TBG_MSG_SOFTBAN payload, which is a packed array of
+ * these. The time left rather than the expiry is sent, so clock skew
+ * between regions does not matter.
+ */
+typedef struct __attribute__((packed)) tbg_relay_softban {
+	uint8_t  addr[16];       /* IPv4 as ::ffff:a.b.c.d; bits past plen zero */
+	uint8_t  plen;           /* Prefix length in address bits; 128 = one IP */
+	uint8_t  reserved[3];    /* Set to 0 */
+	uint32_t seconds;        /* Time left on the ban (network order) */
+} tbg_relay_softban_t;
+
+#define TBG_RELAY_SOFTBAN_LEN    24
+_Static_assert(sizeof(tbg_relay_softban_t) == TBG_RELAY_SOFTBAN_LEN,
+               "tbg_relay_softban_t");
+#define TBG_RELAY_SOFTBAN_BATCH  1024    /* Most bans per message */
+
+/* Soft-ban codec (tbg_relay_softban.c), shared by both ends of the link */
+struct rate_limit_ban;
+
+/* Encode the bans among n still in force at now into out, which has room
+ * for n. Returns the payload length. */
+uint32_t tbg_relay_encode_softbans(const struct rate_limit_ban *bans, int n,
+				   time_t now, tbg_relay_softban_t *out);
+
+/* Take up to TBG_RELAY_SOFTBAN_BATCH bans from the rate limiter's outbox
+ * and encode those still in force into out. Returns the number taken, 0
+ * once the outbox is empty; *len gets the payload length (0 if every ban
+ * taken had expired). */
+int tbg_relay_take_softbans(tbg_relay_softban_t *out, uint32_t *len);
+
+/* Give a batch from tbg_relay_take_softbans() that could not be sent back
+ * to the outbox, to go out with the next batch. */
+void tbg_relay_return_softbans(const tbg_relay_softban_t *bans, uint32_t len);
+
+/* Apply a TBG_MSG_SOFTBAN payload received from from (for the log).
+ * Returns the bans applied, or -1 if the payload is malformed. */
+int tbg_relay_apply_softbans(const char *payload, uint32_t len,
+			     const char *from);
+
 /* Per-relay peer state (used by primary) */
 typedef struct tbg_relay_peer {
 	int       fd;
@@ -52,6 +96,7 @@ typedef struct tbg_relay_peer {
 	time_t    last_heartbeat;
 	pthread_t thread;
 	bool      active;
+	bool      registered;  /* Sent TBG_MSG_REGISTER; only then trusted */
 } tbg_relay_peer_t;
 
 /* Relay client state (used by relay) */
@@ -8,7 +8,8 @@
  *
  * Threads:
  * - Receiver thread: reads messages from primary (templates, heartbeats)
- * - Heartbeat thread: sends heartbeats, monitors primary health, triggers failover
+ * - Heartbeat thread: sends heartbeats and soft-bans made here, monitors
+ *   primary health, triggers failover
  */
 
 #include "config.h"
@@ -237,6 +238,11 @@ static void *receiver_thread(void *arg)
 			}
 			break;
 
+		case TBG_MSG_SOFTBAN:
+			client_state.last_heartbeat = time(NULL);
+			tbg_relay_apply_softbans(payload, len, "primary");
+			break;
+
 		case TBG_MSG_CONFIG_SYNC:
 			client_state.last_heartbeat = time(NULL);
 			LOGNOTICE("TBG: Received config sync from primary");
@@ -256,6 +262,8 @@ static void *receiver_thread(void *arg)
 /* Heartbeat/failover monitor thread */
 static void *heartbeat_monitor(void *arg)
 {
+	tbg_relay_softban_t bans[TBG_RELAY_SOFTBAN_BATCH];
+
 	(void)arg;
 
 	while (client_running) {
@@ -264,9 +272,20 @@ static void *heartbeat_monitor(void *arg)
 		if (!client_running)
 			break;
 
-		/* Send heartbeat if connected */
-		if (client_state.connected && client_state.fd >= 0) {
-			send_msg(client_state.fd, TBG_MSG_HEARTBEAT, NULL, 0);
+		/* Send heartbeat, and bans made here, if connected. While
+		 * disconnected, bans wait in the rate limiter's outbox; so does
+		 * a batch whose send fails on a link not yet seen to be down. */
+		if (client_state.connected && client_state.fd >= 0 &&
+		    send_msg(client_state.fd, TBG_MSG_HEARTBEAT, NULL, 0) == 0) {
+			uint32_t len;
+
+			while (tbg_relay_take_softbans(bans, &len) > 0) {
+				if (len && send_msg(client_state.fd, TBG_MSG_SOFTBAN,
+						    (const char *)bans, len) < 0) {
+					tbg_relay_return_softbans(bans, len);
+					break;
+				}
+			}
 		}
 
 		/* Check for failover */
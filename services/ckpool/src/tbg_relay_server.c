@@ -12,6 +12,8 @@
  * - Per-peer thread: reads messages from relay, handles registration + block found
  * - Heartbeat thread: periodically sends heartbeats, reaps dead peers
  * - Push: tbg_relay_push_template() is called from the stratifier when update_base() fires
+ * - Soft-bans: the heartbeat thread sends bans made here to every relay; a
+ *   relay's batch is applied here and forwarded to the other relays
  */
 
 #include "config.h"
@@ -130,6 +132,7 @@ static int recv_msg(int fd, char **payload, uint32_t *out_len)
 static void *peer_handler(void *arg)
 {
 	tbg_relay_peer_t *peer = (tbg_relay_peer_t *)arg;
+	char from[48];
 	char *payload;
 	uint32_t len;
 
@@ -160,10 +163,34 @@ static void *peer_handler(void *arg)
 				strncpy(peer->region, payload, sizeof(peer->region) - 1);
 				peer->region[sizeof(peer->region) - 1] = '\0';
 				LOGNOTICE("TBG: Relay registered from region '%s'", peer->region);
+				peer->registered = true;
 			}
 			peer->last_heartbeat = time(NULL);
 			break;
 
+		case TBG_MSG_SOFTBAN:
+			/* Bans only from a relay that has registered */
+			if (!peer->registered) {
+				LOGWARNING("TBG: Ignoring soft-bans from unregistered relay (fd=%d)",
+					   peer->fd);
+				break;
+			}
+			snprintf(from, sizeof(from), "relay '%s'", peer->region);
+			if (tbg_relay_apply_softbans(payload, len, from) < 0)
+				break;
+
+			/* Forward to the other relays; the sender already has them */
+			pthread_mutex_lock(&server_state.peers_lock);
+			for (int i = 0; i < server_state.peer_count; i++) {
+				tbg_relay_peer_t *other = &server_state.peers[i];
+
+				if (other == peer || !other->active)
+					continue;
+				send_msg(other->fd, TBG_MSG_SOFTBAN, payload, len);
+			}
+			pthread_mutex_unlock(&server_state.peers_lock);
+			break;
+
 		case TBG_MSG_BLOCK_FOUND:
 			if (payload) {
 				LOGNOTICE("TBG: Block found by relay '%s': %.*s",
@@ -192,6 +219,8 @@ static void *peer_handler(void *arg)
 /* Heartbeat sender thread — sends heartbeats to all peers, reaps dead ones */
 static void *heartbeat_sender(void *arg)
 {
+	tbg_relay_softban_t bans[TBG_RELAY_SOFTBAN_BATCH];
+
 	(void)arg;
 
 	signal(SIGPIPE, SIG_IGN);
@@ -203,8 +232,33 @@ static void *heartbeat_sender(void *arg)
 			break;
 
 		time_t now = time(NULL);
+		bool any_active = false;
+		uint32_t len;
 
 		pthread_mutex_lock(&server_state.peers_lock);
+
+		/* Send bans made here since the last heartbeat. With no relay
+		 * connected they wait in the rate limiter's outbox, as does a
+		 * batch no relay took. */
+		for (int i = 0; i < server_state.peer_count; i++)
+			any_active |= server_state.peers[i].active;
+		while (any_active && tbg_relay_take_softbans(bans, &len) > 0) {
+			bool sent = false;
+
+			for (int i = 0; len && i < server_state.peer_count; i++) {
+				tbg_relay_peer_t *peer = &server_state.peers[i];
+
+				if (peer->active &&
+				    send_msg(peer->fd, TBG_MSG_SOFTBAN,
+					     (const char *)bans, len) == 0)
+					sent = true;
+			}
+			if (len && !sent) {
+				tbg_relay_return_softbans(bans, len);
+				break;
+			}
+		}
+
 		for (int i = 0; i < server_state.peer_count; i++) {
 			tbg_relay_peer_t *peer = &server_state.peers[i];
 
@@ -0,0 +1,116 @@
+/*
+ * tbg_relay_softban.c — Soft-ban codec for the relay link
+ * THE BITCOIN GAME — GPLv3
+ *
+ * Both ends of the link send the bans made locally and apply the bans
+ * they receive; the framing is in tbg_relay.h. The link threads call
+ * these, and the rate limiter does the banning.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "tbg_relay.h"
+#include "rate_limit.h"
+
+#ifndef LOGNOTICE
+#define LOGNOTICE(fmt, ...) fprintf(stderr, "TBG-RELAY NOTICE: " fmt "\n", ##__VA_ARGS__)
+#endif
+#ifndef LOGWARNING
+#define LOGWARNING(fmt, ...) fprintf(stderr, "TBG-RELAY WARNING: " fmt "\n", ##__VA_ARGS__)
+#endif
+
+/* Bans taken from the outbox per call to tbg_rate_limit_take_bans() */
+#define SOFTBAN_CHUNK  64
+
+uint32_t tbg_relay_encode_softbans(const struct rate_limit_ban *bans, int n,
+				   time_t now, tbg_relay_softban_t *out)
+{
+	int i, m = 0;
+
+	for (i = 0; i < n; i++) {
+		if (bans[i].until <= now)
+			continue;
+		memcpy(out[m].addr, &bans[i].addr, sizeof(out[m].addr));
+		out[m].plen = (uint8_t)bans[i].plen;
+		memset(out[m].reserved, 0, sizeof(out[m].reserved));
+		out[m].seconds = htonl((uint32_t)(bans[i].until - now));
+		m++;
+	}
+
+	return (uint32_t)m * TBG_RELAY_SOFTBAN_LEN;
+}
+
+int tbg_relay_take_softbans(tbg_relay_softban_t *out, uint32_t *len)
+{
+	rate_limit_ban_t chunk[SOFTBAN_CHUNK];
+	time_t now = time(NULL);
+	uint32_t bytes = 0;
+	int taken = 0, n;
+
+	while (taken < TBG_RELAY_SOFTBAN_BATCH) {
+		int max = TBG_RELAY_SOFTBAN_BATCH - taken;
+
+		n = tbg_rate_limit_take_bans(chunk, max < SOFTBAN_CHUNK ? max : SOFTBAN_CHUNK);
+		if (n <= 0)
+			break;
+		bytes += tbg_relay_encode_softbans(chunk, n, now,
+						   out + bytes / TBG_RELAY_SOFTBAN_LEN);
+		taken += n;
+	}
+
+	*len = bytes;
+	return taken;
+}
+
+void tbg_relay_return_softbans(const tbg_relay_softban_t *bans, uint32_t len)
+{
+	rate_limit_ban_t chunk[SOFTBAN_CHUNK];
+	time_t now = time(NULL);
+	uint32_t n = len / TBG_RELAY_SOFTBAN_LEN, end, i;
+
+	/* Last chunk first: each goes in ahead of the one returned before */
+	for (end = n; end > 0; end -= i) {
+		uint32_t start = end > SOFTBAN_CHUNK ? end - SOFTBAN_CHUNK : 0;
+
+		for (i = 0; i < end - start; i++) {
+			const tbg_relay_softban_t *ban = &bans[start + i];
+
+			memcpy(&chunk[i].addr, ban->addr, sizeof(chunk[i].addr));
+			chunk[i].plen = ban->plen;
+			chunk[i].until = now + ntohl(ban->seconds);
+		}
+		tbg_rate_limit_return_bans(chunk, (int)i);
+	}
+}
+
+int tbg_relay_apply_softbans(const char *payload, uint32_t len, const char *from)
+{
+	const tbg_relay_softban_t *ban = (const tbg_relay_softban_t *)payload;
+	uint32_t i, n = len / TBG_RELAY_SOFTBAN_LEN;
+	int applied = 0;
+
+	if (!payload || !len || len % TBG_RELAY_SOFTBAN_LEN ||
+	    n > TBG_RELAY_SOFTBAN_BATCH) {
+		LOGWARNING("TBG: Malformed soft-ban batch (%u bytes) from %s",
+			   len, from);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct in6_addr addr;
+		uint32_t seconds = ntohl(ban[i].seconds);
+
+		memcpy(&addr, ban[i].addr, sizeof(addr));
+		if (seconds > INT32_MAX)
+			seconds = INT32_MAX;
+		applied += tbg_rate_limit_apply_ban(&addr, ban[i].plen, (int)seconds);
+	}
+
+	if (applied)
+		LOGNOTICE("TBG: Applied %d soft-bans from %s", applied, from);
+	return applied;
+}
@@ -17,6 +17,8 @@
 #include <time.h>
 
 #include "tbg_vardiff.h"
+#include "tbg_clock.h"
+#include "tbg_memgov.h"
 #include "uthash.h"
 
 #ifdef HAVE_HIREDIS
@@ -27,6 +29,7 @@
 #define REDIS_KEY_PREFIX "vardiff:"
 #define REDIS_KEY_PREFIX_LEN 8
 #define MAX_WORKER_LEN 256
+#define PRESSURE_TTL 3600        /* in-memory TTL under memory pressure */
 
 typedef struct diff_entry {
 	UT_hash_handle hh;
@@ -70,13 +73,13 @@ void tbg_save_reconnect_diff(const char *worker_name, int64_t diff)
 	HASH_FIND_STR(diff_cache, worker_name, entry);
 	if (entry) {
 		entry->diff = diff;
-		entry->last_seen = time(NULL);
+		entry->last_seen = tbg_clock_now();
 	} else {
 		entry = calloc(1, sizeof(diff_entry_t));
 		if (entry) {
 			strncpy(entry->worker, worker_name, MAX_WORKER_LEN - 1);
 			entry->diff = diff;
-			entry->last_seen = time(NULL);
+			entry->last_seen = tbg_clock_now();
 			HASH_ADD_STR(diff_cache, worker, entry);
 		}
 	}
@@ -139,7 +142,7 @@ static void persist_to_redis(void)
 {
 	redisContext *ctx;
 	diff_entry_t *entry, *tmp;
-	time_t now = time(NULL);
+	time_t now = tbg_clock_now();
 
 	ctx = connect_redis();
 	if (!ctx)
@@ -231,20 +234,50 @@ static void *vardiff_persist_thread(void *arg)
 	return NULL;
 }
 
-/* Evict stale entries from the in-memory cache */
-static void evict_stale(void)
+/* Evict entries idle for longer than ttl from the in-memory cache.
+ * Returns the number evicted. */
+static int evict_stale(int ttl)
 {
 	diff_entry_t *entry, *tmp;
-	time_t now = time(NULL);
+	time_t now = tbg_clock_now();
+	int evicted = 0;
 
 	pthread_rwlock_wrlock(&diff_lock);
 	HASH_ITER(hh, diff_cache, entry, tmp) {
-		if (now - entry->last_seen > vd_ttl) {
+		if (now - entry->last_seen > ttl) {
 			HASH_DEL(diff_cache, entry);
 			free(entry);
+			evicted++;
 		}
 	}
 	pthread_rwlock_unlock(&diff_lock);
+
+	return evicted;
+}
+
+size_t tbg_vardiff_mem_usage(void *arg)
+{
+	size_t bytes;
+
+	(void)arg;
+	pthread_rwlock_rdlock(&diff_lock);
+	bytes = HASH_COUNT(diff_cache) * sizeof(diff_entry_t) +
+	        HASH_OVERHEAD(hh, diff_cache);
+	pthread_rwlock_unlock(&diff_lock);
+
+	return bytes;
+}
+
+size_t tbg_vardiff_mem_pressure(int level, void *arg)
+{
+	(void)arg;
+
+	/* An evicted worker restarts vardiff from the default on its next
+	 * connect: lookups only read this table, and Redis is loaded only
+	 * at startup. One ramp-up for a worker idle an hour is the cost. */
+	if (level < MEMGOV_ELEVATED)
+		return 0;
+	return (size_t)evict_stale(PRESSURE_TTL) * sizeof(diff_entry_t);
 }
 
 void tbg_vardiff_init(const char *redis_url)
@@ -10,6 +10,7 @@
 #ifndef TBG_VARDIFF_H
 #define TBG_VARDIFF_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* Initialize the VarDiff reconnect memory system.
@@ -28,4 +29,12 @@ int64_t tbg_get_reconnect_diff(const char *worker_name);
  * Thread-safe (uses write lock). */
 void tbg_save_reconnect_diff(const char *worker_name, int64_t diff);
 
+/* Memory governor callbacks (see tbg_memgov.h); arg is unused.
+ * From MEMGOV_ELEVATED, entries idle for an hour are dropped from
+ * memory. Lookups never read Redis, so such a worker reconnects at the
+ * default difficulty until the next restart reloads its Redis copy (when
+ * built with hiredis). */
+size_t tbg_vardiff_mem_usage(void *arg);
+size_t tbg_vardiff_mem_pressure(int level, void *arg);
+
 #endif /* TBG_VARDIFF_H */
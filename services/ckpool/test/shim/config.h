@@ -0,0 +1,7 @@
+/*
+ * config.h — Empty stand-in for ckpool's autoconf header
+ * GPLv3 — Copyright (C) 2026 TheBitcoinGame Contributors
+ *
+ * Lets unit tests compile TBG source files directly without running
+ * ckpool's configure.
+ */
@@ -0,0 +1,30 @@
+/*
+ * libckpool.h — Minimal stand-in for ckpool's libckpool.h
+ * GPLv3 — Copyright (C) 2026 TheBitcoinGame Contributors
+ *
+ * TBG modules only use libckpool for its LOG* macros. Tests that compile
+ * a module's .c file directly get these instead of the full library.
+ * Define TBG_TEST_VERBOSE to see log output.
+ */
+
+#ifndef TBG_TEST_LIBCKPOOL_H
+#define TBG_TEST_LIBCKPOOL_H
+
+#include <stdio.h>
+
+#ifdef TBG_TEST_VERBOSE
+#define TBG_TEST_LOG(level, fmt, ...) \
+	fprintf(stderr, "[" level "] " fmt "\n", ##__VA_ARGS__)
+#else
+#define TBG_TEST_LOG(level, fmt, ...) \
+	do { if (0) fprintf(stderr, fmt, ##__VA_ARGS__); } while (0)
+#endif
+
+#define LOGEMERG(fmt, ...)   TBG_TEST_LOG("EMERG", fmt, ##__VA_ARGS__)
+#define LOGERR(fmt, ...)     TBG_TEST_LOG("ERR", fmt, ##__VA_ARGS__)
+#define LOGWARNING(fmt, ...) TBG_TEST_LOG("WARNING", fmt, ##__VA_ARGS__)
+#define LOGNOTICE(fmt, ...)  TBG_TEST_LOG("NOTICE", fmt, ##__VA_ARGS__)
+#define LOGINFO(fmt, ...)    TBG_TEST_LOG("INFO", fmt, ##__VA_ARGS__)
+#define LOGDEBUG(fmt, ...)   TBG_TEST_LOG("DEBUG", fmt, ##__VA_ARGS__)
+
+#endif /* TBG_TEST_LIBCKPOOL_H */
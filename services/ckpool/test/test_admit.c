@@ -0,0 +1,249 @@
+/*
+ * test_admit.c — Unit tests for the paced admission queue
+ * GPLv3 — Copyright (C) 2026 TheBitcoinGame Contributors
+ */
+
+#define _GNU_SOURCE
+#include "test_harness.h"
+
+/* tbg_admit.c only needs ckpool's LOG* macros (see shim/) and the clock */
+#include "../src/tbg_admit.c"
+#include "../src/tbg_clock.c"
+
+/* ─── Fake owner ────────────────────────────────────────────────── */
+
+#define MAX_RELEASED 4096
+
+typedef struct owner {
+	intptr_t items[MAX_RELEASED];
+	bool admitted[MAX_RELEASED];
+	_Atomic int count;
+} owner_t;
+
+static owner_t owner;
+
+static void fake_release(void *item, void *ctx, bool admitted)
+{
+	owner_t *o = ctx;
+	int i = atomic_fetch_add(&o->count, 1);
+
+	if (i < MAX_RELEASED) {
+		o->items[i] = (intptr_t)item;
+		o->admitted[i] = admitted;
+	}
+}
+
+/* Set the queue up without its pacer thread, so tests drive
+ * tbg_admit_poll() and the credit themselves */
+static void reset(int rate, int wait_ms)
+{
+	tbg_admit_shutdown();
+	memset(&owner, 0, sizeof(owner));
+	atomic_store(&s_immediate, 0);
+	atomic_store(&s_paced, 0);
+	atomic_store(&s_expired, 0);
+	atomic_store(&s_rejected, 0);
+	admit_setup(rate, wait_ms, fake_release, &owner);
+}
+
+/* Stop credit from accruing until set_credit() */
+static void drain_credit(void)
+{
+	pthread_mutex_lock(&admit_lock);
+	credit = 0;
+	g_rate = 0;
+	pthread_mutex_unlock(&admit_lock);
+}
+
+static void set_credit(int releases)
+{
+	pthread_mutex_lock(&admit_lock);
+	credit = (uint64_t)releases * CREDIT_ONE;
+	if (credit_max < credit)
+		credit_max = credit;
+	pthread_mutex_unlock(&admit_lock);
+}
+
+/* Three sources in different FIFOs */
+static void distinct_sources(char src[3][32])
+{
+	int i = 0, n = 0;
+
+	while (n < 3) {
+		int j;
+		bool clash = false;
+
+		snprintf(src[n], sizeof(src[n]), "198.51.100.%d", i++);
+		for (j = 0; j < n; j++)
+			clash |= admit_fifo_for(src[j]) == admit_fifo_for(src[n]);
+		if (!clash)
+			n++;
+	}
+}
+
+/* ─── Tests ─────────────────────────────────────────────────────── */
+
+TEST(passthrough_until_init)
+{
+	tbg_admit_shutdown();
+	ASSERT_EQ(ADMIT_NOW, tbg_admit_submit("198.51.100.1", (void *)1));
+	ASSERT_EQ(0, tbg_admit_queued());
+	tbg_admit_poll();
+}
+
+TEST(burst_then_queue)
+{
+	int i;
+
+	reset(100, 10000);
+
+	/* 100/s with a 100 ms burst: ten go at once */
+	for (i = 0; i < 10; i++)
+		ASSERT_EQ(ADMIT_NOW, tbg_admit_submit("198.51.100.1", (void *)1));
+	drain_credit();
+	ASSERT_EQ(ADMIT_QUEUED, tbg_admit_submit("198.51.100.1", (void *)2));
+	ASSERT_EQ(1, tbg_admit_queued());
+
+	/* Queued items keep later ones from jumping ahead */
+	set_credit(1);
+	ASSERT_EQ(ADMIT_QUEUED, tbg_admit_submit("198.51.100.2", (void *)3));
+	tbg_admit_poll();
+	ASSERT_EQ(1, atomic_load(&owner.count));
+	ASSERT_EQ(2, owner.items[0]);
+	ASSERT_TRUE(owner.admitted[0]);
+	ASSERT_EQ(1, tbg_admit_queued());
+	ASSERT_EQ(10, atomic_load(&s_immediate));
+	ASSERT_EQ(1, atomic_load(&s_paced));
+
+	tbg_admit_shutdown();
+	ASSERT_EQ(2, atomic_load(&owner.count));
+	ASSERT_EQ(3, owner.items[1]);
+	ASSERT_FALSE(owner.admitted[1]);
+}
+
+TEST(round_robin_across_sources)
+{
+	char src[3][32];
+	int per[3] = { 0 }, i;
+
+	reset(100, 10000);
+	drain_credit();
+	distinct_sources(src);
+
+	/* A floods; B and C send five each */
+	for (i = 0; i < 50; i++)
+		ASSERT_EQ(ADMIT_QUEUED, tbg_admit_submit(src[0], (void *)0));
+	for (i = 0; i < 5; i++) {
+		ASSERT_EQ(ADMIT_QUEUED, tbg_admit_submit(src[1], (void *)1));
+		ASSERT_EQ(ADMIT_QUEUED, tbg_admit_submit(src[2], (void *)2));
+	}
+
+	/* The first fifteen releases are shared evenly */
+	set_credit(15);
+	tbg_admit_poll();
+	ASSERT_EQ(15, atomic_load(&owner.count));
+	for (i = 0; i < 15; i++)
+		per[owner.items[i]]++;
+	ASSERT_EQ(5, per[0]);
+	ASSERT_EQ(5, per[1]);
+	ASSERT_EQ(5, per[2]);
+	ASSERT_EQ(45, tbg_admit_queued());
+
+	tbg_admit_shutdown();
+}
+
+TEST(per_fifo_limit)
+{
+	int i;
+
+	reset(100, 10000);
+	drain_credit();
+	for (i = 0; i < ADMIT_QUEUE_MAX; i++)
+		ASSERT_EQ(ADMIT_QUEUED, tbg_admit_submit("198.51.100.1", NULL));
+	ASSERT_EQ(ADMIT_FULL, tbg_admit_submit("198.51.100.1", NULL));
+	ASSERT_EQ(1, atomic_load(&s_rejected));
+	tbg_admit_shutdown();
+	ASSERT_EQ(ADMIT_QUEUE_MAX, atomic_load(&owner.count));
+}
+
+TEST(expired_items_are_dropped)
+{
+	struct timespec ts = { 0, 30 * 1000000L };
+
+	reset(100, 10);
+	drain_credit();
+	ASSERT_EQ(ADMIT_QUEUED, tbg_admit_submit("198.51.100.1", (void *)1));
+	nanosleep(&ts, NULL);
+
+	/* Expired items go even with no credit */
+	tbg_admit_poll();
+	ASSERT_EQ(1, atomic_load(&owner.count));
+	ASSERT_FALSE(owner.admitted[0]);
+	ASSERT_EQ(1, atomic_load(&s_expired));
+	ASSERT_EQ(0, tbg_admit_queued());
+	tbg_admit_shutdown();
+}
+
+TEST(pacer_thread_paces)
+{
+	char ip[32];
+	uint64_t start, elapsed;
+	int i, now = 0;
+
+	tbg_admit_shutdown();
+	memset(&owner, 0, sizeof(owner));
+	tbg_admit_init(200, 10000, fake_release, &owner);
+
+	/* 20 go at once; the other 80 at 200/s take 400 ms */
+	start = tbg_clock_read_mono_ms();
+	for (i = 0; i < 100; i++) {
+		snprintf(ip, sizeof(ip), "10.0.%d.%d", i / 256, i % 256);
+		if (tbg_admit_submit(ip, (void *)(intptr_t)i) == ADMIT_NOW)
+			now++;
+	}
+	ASSERT_EQ(20, now);
+	for (i = 0; i < 300 && atomic_load(&owner.count) < 80; i++)
+		usleep(10000);
+	elapsed = tbg_clock_read_mono_ms() - start;
+
+	ASSERT_EQ(80, atomic_load(&owner.count));
+	ASSERT_TRUE(elapsed >= 350);
+	for (i = 0; i < 80; i++)
+		ASSERT_TRUE(owner.admitted[i]);
+	tbg_admit_shutdown();
+	ASSERT_EQ(0, admit_running);
+}
+
+TEST(format_metrics)
+{
+	char buf[4096], small[64];
+	int n;
+
+	reset(100, 10000);
+	tbg_admit_submit("198.51.100.1", NULL);
+
+	n = tbg_admit_format_metrics(buf, sizeof(buf));
+	ASSERT_EQ((int)strlen(buf), n);
+	ASSERT_TRUE(strstr(buf, "tbg_admit_queued 0\n") != NULL);
+	ASSERT_TRUE(strstr(buf, "tbg_admit_released_total{path=\"immediate\"} 1\n") != NULL);
+
+	n = tbg_admit_format_metrics(small, sizeof(small));
+	ASSERT_EQ(sizeof(small) - 1, n);
+	ASSERT_EQ(0, tbg_admit_format_metrics(NULL, 100));
+	tbg_admit_shutdown();
+}
+
+int main(void)
+{
+	TEST_SUITE("Admission Queue");
+
+	RUN_TEST(passthrough_until_init);
+	RUN_TEST(burst_then_queue);
+	RUN_TEST(round_robin_across_sources);
+	RUN_TEST(per_fifo_limit);
+	RUN_TEST(expired_items_are_dropped);
+	RUN_TEST(pacer_thread_paces);
+	RUN_TEST(format_metrics);
+
+	PRINT_RESULTS();
+}
@@ -0,0 +1,66 @@
+/*
+ * test_clock.c — Unit tests for the shared coarse clock
+ * GPLv3 — Copyright (C) 2026 TheBitcoinGame Contributors
+ */
+
+#define _GNU_SOURCE
+#include "test_harness.h"
+#include <stdint.h>
+
+/* tbg_clock.c only needs ckpool's LOG* macros (see shim/) */
+#include "../src/tbg_clock.c"
+
+/* Allowed lag of a cached reading: a few ticks covers a busy host */
+#define LAG_MS  50
+
+/* ─── Tests ─────────────────────────────────────────────────────── */
+
+TEST(falls_back_before_init)
+{
+	struct timeval tv;
+	time_t t = time(NULL);
+
+	ASSERT_EQ(0, atomic_load(&tbg_clock_mono_cached));
+	ASSERT_TRUE(tbg_clock_mono_ms() > 0);
+	ASSERT_TRUE(tbg_clock_now() >= t && tbg_clock_now() <= t + 1);
+	tbg_clock_timeval(&tv);
+	ASSERT_TRUE(tv.tv_sec >= t && tv.tv_usec >= 0 && tv.tv_usec < 1000000);
+}
+
+TEST(ticker_publishes_and_advances)
+{
+	uint64_t m0, m1, r0;
+	int i;
+
+	tbg_clock_init();
+	m0 = atomic_load(&tbg_clock_mono_cached);
+	r0 = atomic_load(&tbg_clock_real_cached);
+	ASSERT_TRUE(m0 > 0 && r0 > 0);
+
+	/* Cached values track the real clocks within a few ticks */
+	ASSERT_TRUE(tbg_clock_read_mono_ms() - tbg_clock_mono_ms() <= LAG_MS);
+	ASSERT_TRUE(tbg_clock_read_real_us() - tbg_clock_real_us() <=
+	            LAG_MS * 1000);
+
+	/* And move forward on their own */
+	for (i = 0; i < 100 && tbg_clock_mono_ms() < m0 + 20; i++)
+		usleep(5000);
+	m1 = tbg_clock_mono_ms();
+	ASSERT_TRUE(m1 >= m0 + 20);
+	ASSERT_TRUE(tbg_clock_real_us() > r0);
+
+	tbg_clock_shutdown();
+	ASSERT_EQ(0, atomic_load(&tbg_clock_mono_cached));
+	ASSERT_EQ(0, atomic_load(&tbg_clock_real_cached));
+	ASSERT_TRUE(tbg_clock_mono_ms() >= m1);
+}
+
+int main(void)
+{
+	TEST_SUITE("Clock");
+
+	RUN_TEST(falls_back_before_init);
+	RUN_TEST(ticker_publishes_and_advances);
+
+	PRINT_RESULTS();
+}
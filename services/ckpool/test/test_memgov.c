@@ -0,0 +1,208 @@
+/*
+ * test_memgov.c — Unit tests for the memory-pressure governor
+ * GPLv3 — Copyright (C) 2026 TheBitcoinGame Contributors
+ */
+
+#define _GNU_SOURCE
+#include "test_harness.h"
+
+/* tbg_memgov.c only needs ckpool's LOG* macros (see shim/) */
+#include "../src/tbg_memgov.c"
+
+/* ─── Fake consumer ─────────────────────────────────────────────── */
+
+typedef struct fake_consumer {
+	size_t usage;
+	size_t release;         /* Bytes each pressure call frees */
+	int calls;
+	int last_level;
+} fake_consumer_t;
+
+static size_t fake_usage(void *arg)
+{
+	return ((fake_consumer_t *)arg)->usage;
+}
+
+static size_t fake_pressure(int level, void *arg)
+{
+	fake_consumer_t *c = arg;
+	size_t freed = c->release < c->usage ? c->release : c->usage;
+
+	c->calls++;
+	c->last_level = level;
+	c->usage -= freed;
+	return freed;
+}
+
+/* Reset the governor without starting its thread, so tests drive
+ * tbg_memgov_poll() themselves */
+static void reset(size_t budget)
+{
+	tbg_memgov_shutdown();
+	g_budget = budget;
+	atomic_store(&g_reclaimed, 0);
+	atomic_store(&g_level_changes, 0);
+}
+
+/* ─── Tests ─────────────────────────────────────────────────────── */
+
+TEST(levels_follow_thresholds)
+{
+	fake_consumer_t c = {0};
+
+	reset(1000);
+	tbg_memgov_register("fake", fake_usage, NULL, &c);
+
+	c.usage = 699;
+	tbg_memgov_poll();
+	ASSERT_EQ(MEMGOV_NORMAL, tbg_memgov_level());
+	ASSERT_EQ(699, tbg_memgov_usage());
+
+	c.usage = 700;
+	tbg_memgov_poll();
+	ASSERT_EQ(MEMGOV_ELEVATED, tbg_memgov_level());
+
+	c.usage = 850;
+	tbg_memgov_poll();
+	ASSERT_EQ(MEMGOV_HIGH, tbg_memgov_level());
+
+	/* Levels can be skipped on a sudden jump */
+	c.usage = 100;
+	tbg_memgov_poll();
+	c.usage = 960;
+	tbg_memgov_poll();
+	ASSERT_EQ(MEMGOV_CRITICAL, tbg_memgov_level());
+	ASSERT_EQ(4, atomic_load(&g_level_changes));
+	ASSERT_STR_EQ("critical", tbg_memgov_level_name(tbg_memgov_level()));
+	ASSERT_STR_EQ("unknown", tbg_memgov_level_name(MEMGOV_LEVEL_COUNT));
+}
+
+TEST(levels_fall_back_with_hysteresis)
+{
+	fake_consumer_t c = {0};
+
+	reset(1000);
+	tbg_memgov_register("fake", fake_usage, NULL, &c);
+
+	c.usage = 960;
+	tbg_memgov_poll();
+	ASSERT_EQ(MEMGOV_CRITICAL, tbg_memgov_level());
+
+	/* Held until usage is MEMGOV_HYSTERESIS_PCT below the threshold */
+	c.usage = 900;
+	tbg_memgov_poll();
+	ASSERT_EQ(MEMGOV_CRITICAL, tbg_memgov_level());
+	c.usage = 890;
+	tbg_memgov_poll();
+	ASSERT_EQ(MEMGOV_HIGH, tbg_memgov_level());
+
+	/* Rising again to the same usage does not re-enter critical */
+	c.usage = 900;
+	tbg_memgov_poll();
+	ASSERT_EQ(MEMGOV_HIGH, tbg_memgov_level());
+
+	c.usage = 660;
+	tbg_memgov_poll();
+	ASSERT_EQ(MEMGOV_ELEVATED, tbg_memgov_level());
+	c.usage = 640;
+	tbg_memgov_poll();
+	ASSERT_EQ(MEMGOV_NORMAL, tbg_memgov_level());
+}
+
+TEST(pressure_callbacks_and_recovery)
+{
+	fake_consumer_t big = { .usage = 800, .release = 60 };
+	fake_consumer_t small = { .usage = 0 };
+
+	reset(1000);
+	tbg_memgov_register("big", fake_usage, fake_pressure, &big);
+	tbg_memgov_register("small", fake_usage, fake_pressure, &small);
+
+	/* Not called while usage stays normal */
+	big.usage = 500;
+	tbg_memgov_poll();
+	ASSERT_EQ(0, big.calls);
+
+	/* Called on every evaluation while under pressure */
+	big.usage = 800;
+	tbg_memgov_poll();
+	ASSERT_EQ(1, big.calls);
+	ASSERT_EQ(MEMGOV_ELEVATED, big.last_level);
+	ASSERT_EQ(1, small.calls);
+	ASSERT_EQ(740, big.usage);
+
+	tbg_memgov_poll();
+	tbg_memgov_poll();
+	ASSERT_EQ(3, big.calls);
+	ASSERT_EQ(180, atomic_load(&g_reclaimed));
+
+	/* 620 drops below 65%: one final call with MEMGOV_NORMAL, then none */
+	tbg_memgov_poll();
+	ASSERT_EQ(MEMGOV_NORMAL, tbg_memgov_level());
+	ASSERT_EQ(4, big.calls);
+	ASSERT_EQ(MEMGOV_NORMAL, big.last_level);
+	ASSERT_EQ(MEMGOV_NORMAL, small.last_level);
+
+	tbg_memgov_poll();
+	ASSERT_EQ(4, big.calls);
+	ASSERT_EQ(4, small.calls);
+}
+
+TEST(consumer_table_is_bounded)
+{
+	fake_consumer_t c = {0};
+	int i;
+
+	reset(1000);
+	ASSERT_EQ(-1, tbg_memgov_register("none", NULL, NULL, &c));
+	for (i = 0; i < MEMGOV_MAX_CONSUMERS; i++)
+		ASSERT_EQ(0, tbg_memgov_register("fake", fake_usage, NULL, &c));
+	ASSERT_EQ(-1, tbg_memgov_register("extra", fake_usage, NULL, &c));
+}
+
+TEST(format_metrics)
+{
+	fake_consumer_t c = { .usage = 123 };
+	char buf[4096], small[64];
+	int n;
+
+	reset(1000);
+	tbg_memgov_register("fake", fake_usage, NULL, &c);
+	tbg_memgov_poll();
+
+	n = tbg_memgov_format_metrics(buf, sizeof(buf));
+	ASSERT_EQ((int)strlen(buf), n);
+	ASSERT_TRUE(strstr(buf, "tbg_memgov_budget_bytes 1000\n") != NULL);
+	ASSERT_TRUE(strstr(buf, "tbg_memgov_level 0\n") != NULL);
+	ASSERT_TRUE(strstr(buf, "tbg_memgov_usage_bytes{consumer=\"fake\"} 123\n") != NULL);
+
+	/* Truncated output never claims more than was written */
+	n = tbg_memgov_format_metrics(small, sizeof(small));
+	ASSERT_EQ(sizeof(small) - 1, n);
+	ASSERT_EQ(0, tbg_memgov_format_metrics(NULL, 100));
+}
+
+TEST(init_and_shutdown)
+{
+	reset(1000);
+	tbg_memgov_init(0);
+	ASSERT_EQ(MEMGOV_DEFAULT_BUDGET, tbg_memgov_budget());
+	ASSERT_EQ(MEMGOV_NORMAL, tbg_memgov_level());
+	tbg_memgov_shutdown();
+	ASSERT_EQ(0, memgov_running);
+	ASSERT_EQ(0, consumer_count);
+}
+
+int main(void)
+{
+	TEST_SUITE("Memory Governor");
+
+	RUN_TEST(levels_follow_thresholds);
+	RUN_TEST(levels_fall_back_with_hysteresis);
+	RUN_TEST(pressure_callbacks_and_recovery);
+	RUN_TEST(consumer_table_is_bounded);
+	RUN_TEST(format_metrics);
+	RUN_TEST(init_and_shutdown);
+
+	PRINT_RESULTS();
+}
@@ -0,0 +1,823 @@
+/*
+ * test_memory_pool.c — Unit tests for the slab pool allocator
+ * GPLv3 — Copyright (C) 2026 TheBitcoinGame Contributors
+ */
+
+#define _GNU_SOURCE
+#include "test_harness.h"
+#include <stdint.h>
+
+/* memory_pool.c only needs ckpool's LOG* macros (see shim/) and the
+ * canary seed from tbg_clock.c, so the real allocator is compiled straight
+ * into the test binary */
+#include "../src/memory_pool.c"
+#include "../src/tbg_clock.c"
+
+/* ─── Tests ─────────────────────────────────────────────────────── */
+
+TEST(alloc_free_roundtrip)
+{
+	memory_pool_t pool;
+	void *a, *b;
+
+	tbg_pool_init(&pool, 100, 16, 0, "test");
+	ASSERT_EQ(16, tbg_pool_total_allocated(&pool));
+	ASSERT_EQ(16, tbg_pool_total_free(&pool));
+
+	a = tbg_pool_alloc(&pool);
+	b = tbg_pool_alloc(&pool);
+	ASSERT_NOT_NULL(a);
+	ASSERT_NOT_NULL(b);
+	ASSERT_TRUE(a != b);
+	ASSERT_EQ(2, tbg_pool_in_use(&pool));
+	ASSERT_EQ(0, (uintptr_t)a % POOL_CACHE_LINE_SIZE);
+
+	tbg_pool_free(&pool, a);
+	tbg_pool_free(&pool, b);
+	ASSERT_EQ(0, tbg_pool_in_use(&pool));
+	tbg_pool_destroy(&pool);
+}
+
+TEST(grows_when_exhausted)
+{
+	memory_pool_t pool;
+	void *items[40];
+	int i;
+
+	tbg_pool_init(&pool, 64, 8, 0, "test");
+	for (i = 0; i < 40; i++) {
+		items[i] = tbg_pool_alloc(&pool);
+		ASSERT_NOT_NULL(items[i]);
+	}
+	ASSERT_TRUE(tbg_pool_total_allocated(&pool) >= 40);
+	ASSERT_TRUE(pool.slab_count >= 2);
+	for (i = 0; i < 40; i++)
+		tbg_pool_free(&pool, items[i]);
+	ASSERT_EQ(0, tbg_pool_in_use(&pool));
+	tbg_pool_destroy(&pool);
+}
+
+TEST(heap_backing_by_default)
+{
+	memory_pool_t pool;
+
+	tbg_pool_init(&pool, 256, 4, 0, "test");
+	ASSERT_EQ(POOL_BACKING_HEAP, tbg_pool_backing(&pool));
+	ASSERT_STR_EQ("heap", tbg_pool_backing_name(tbg_pool_backing(&pool)));
+	tbg_pool_destroy(&pool);
+}
+
+TEST(default_alignment_is_cache_line)
+{
+	memory_pool_t pool;
+	void *item;
+
+	tbg_pool_init(&pool, 24, 4, 0, "test");
+	ASSERT_EQ(POOL_CACHE_LINE_SIZE, pool.align);
+	ASSERT_EQ(64, pool.aligned_size);
+	item = tbg_pool_alloc(&pool);
+	ASSERT_EQ(0, (uintptr_t)item % POOL_CACHE_LINE_SIZE);
+	tbg_pool_free(&pool, item);
+	tbg_pool_destroy(&pool);
+}
+
+TEST(packed_slots_are_pointer_aligned)
+{
+	memory_pool_opts_t opts = {
+		.item_size = 24, .initial_count = 8, .name = "test_packed",
+		.flags = POOL_F_PACKED,
+	};
+	memory_pool_t pool;
+	char *a, *b;
+
+	tbg_pool_init_opts(&pool, &opts);
+	ASSERT_EQ(POOL_MIN_ALIGN, pool.align);
+	ASSERT_EQ(24, pool.aligned_size);
+	a = tbg_pool_alloc(&pool);
+	b = tbg_pool_alloc(&pool);
+	/* Same slab, adjacent slots */
+	ASSERT_EQ(24, a > b ? a - b : b - a);
+	ASSERT_EQ(0, (uintptr_t)a % POOL_MIN_ALIGN);
+	tbg_pool_free(&pool, a);
+	tbg_pool_free(&pool, b);
+	tbg_pool_destroy(&pool);
+}
+
+TEST(explicit_alignment)
+{
+	memory_pool_opts_t opts = {
+		.item_size = 24, .initial_count = 4, .max_items = 4,
+		.name = "test_align", .align = 16,
+	};
+	memory_pool_t pool;
+	void *items[5];
+	int i;
+
+	tbg_pool_init_opts(&pool, &opts);
+	ASSERT_EQ(16, pool.align);
+	ASSERT_EQ(32, pool.aligned_size);
+	/* Slab items and the fallback past max_items honour the alignment */
+	for (i = 0; i < 5; i++) {
+		items[i] = tbg_pool_alloc(&pool);
+		ASSERT_EQ(0, (uintptr_t)items[i] % 16);
+	}
+	for (i = 0; i < 4; i++)
+		tbg_pool_free(&pool, items[i]);
+	free(items[4]);
+	tbg_pool_destroy(&pool);
+}
+
+TEST(invalid_alignment_falls_back)
+{
+	memory_pool_opts_t opts = {
+		.item_size = 24, .name = "test_bad_align", .align = 48,
+		.flags = POOL_F_PACKED,
+	};
+	memory_pool_t pool;
+
+	tbg_pool_init_opts(&pool, &opts);
+	ASSERT_EQ(POOL_CACHE_LINE_SIZE, pool.align);
+	tbg_pool_destroy(&pool);
+
+	opts.align = 4;
+	tbg_pool_init_opts(&pool, &opts);
+	ASSERT_EQ(POOL_CACHE_LINE_SIZE, pool.align);
+	tbg_pool_destroy(&pool);
+}
+
+TEST(hugepage_slabs_fill_whole_pages)
+{
+	memory_pool_opts_t opts = {
+		.item_size = 256,
+		.initial_count = 10,
+		.name = "test_huge",
+		.flags = POOL_F_HUGEPAGES,
+	};
+	memory_pool_t pool;
+	pool_backing_t backing;
+	char *item;
+
+	tbg_pool_init_opts(&pool, &opts);
+	ASSERT_EQ(1, pool.slab_count);
+
+	/* Whatever the host grants, a huge-page request never lands on the
+	 * heap: hugetlb, THP or (advice refused) plain pages */
+	backing = tbg_pool_backing(&pool);
+	ASSERT_TRUE(backing != POOL_BACKING_HEAP);
+	ASSERT_EQ(0, pool.slabs[0].bytes % POOL_HUGE_PAGE_SIZE);
+	ASSERT_EQ(0, (uintptr_t)pool.slabs[0].base % POOL_HUGE_PAGE_SIZE);
+	ASSERT_EQ(POOL_HUGE_PAGE_SIZE / 256, tbg_pool_total_allocated(&pool));
+	ASSERT_EQ(backing == POOL_BACKING_HUGETLB, pool.hugetlb_slabs);
+	ASSERT_EQ(backing == POOL_BACKING_THP, pool.thp_slabs);
+
+	item = tbg_pool_alloc(&pool);
+	ASSERT_NOT_NULL(item);
+	memset(item, 0xab, 256);
+	tbg_pool_free(&pool, item);
+	tbg_pool_destroy(&pool);
+}
+
+TEST(hugepage_slabs_respect_max_items)
+{
+	memory_pool_opts_t opts = {
+		.item_size = 256,
+		.initial_count = 10,
+		.max_items = 100,
+		.name = "test_huge_cap",
+		.flags = POOL_F_HUGEPAGES,
+	};
+	memory_pool_t pool;
+
+	tbg_pool_init_opts(&pool, &opts);
+	ASSERT_EQ(100, tbg_pool_total_allocated(&pool));
+	tbg_pool_destroy(&pool);
+}
+
+TEST(slab_lookup_is_sorted)
+{
+	memory_pool_t pool;
+	void *items[300];
+	int i;
+
+	tbg_pool_init(&pool, 64, 8, 0, "test");
+	for (i = 0; i < 300; i++)
+		items[i] = tbg_pool_alloc(&pool);
+	for (i = 1; i < pool.slab_count; i++)
+		ASSERT_TRUE((char *)pool.slabs[i - 1].base < (char *)pool.slabs[i].base);
+	for (i = 0; i < 300; i++)
+		ASSERT_TRUE(pool_find_slab(&pool, items[i]) >= 0);
+	ASSERT_EQ(-1, pool_find_slab(&pool, &pool));
+	for (i = 0; i < 300; i++)
+		tbg_pool_free(&pool, items[i]);
+	tbg_pool_destroy(&pool);
+}
+
+TEST(numa_flag_on_single_node_host)
+{
+	memory_pool_opts_t opts = {
+		.item_size = 128,
+		.initial_count = 32,
+		.name = "test_numa",
+		.flags = POOL_F_NUMA,
+	};
+	memory_pool_t pool;
+	void *item;
+
+	tbg_pool_init_opts(&pool, &opts);
+	if (numa_node_count() > 1) {
+		ASSERT_EQ(numa_node_count(), pool.node_count);
+	} else {
+		ASSERT_EQ(0, pool.node_count);
+		ASSERT_EQ(32, tbg_pool_total_allocated(&pool));
+	}
+	item = tbg_pool_alloc(&pool);
+	ASSERT_NOT_NULL(item);
+	tbg_pool_free(&pool, item);
+	ASSERT_EQ(0, tbg_pool_in_use(&pool));
+	tbg_pool_destroy(&pool);
+}
+
+TEST(numa_free_returns_to_owning_node)
+{
+	memory_pool_opts_t parent = { .item_size = 128, .name = "test_node" };
+	memory_pool_opts_t opts = { .item_size = 128, .initial_count = 16,
+	                            .name = "test_node" };
+	memory_pool_t pool;
+	void *item;
+
+	/* Build a two-node pool by hand so the routing is testable anywhere */
+	pool_setup(&pool, &parent, -1);
+	pool.node_pools = calloc(2, sizeof(memory_pool_t));
+	ASSERT_NOT_NULL(pool.node_pools);
+	pool.node_count = 2;
+	pool_setup_node(&pool, 0, &opts);
+	pool_setup_node(&pool, 1, &opts);
+
+	item = pool_take(&pool.node_pools[1]);
+	ASSERT_NOT_NULL(item);
+	ASSERT_EQ(15, pool.node_pools[1].total_free);
+	ASSERT_EQ(31, tbg_pool_total_free(&pool));
+
+	tbg_pool_free(&pool, item);
+	ASSERT_EQ(16, pool.node_pools[0].total_free);
+	ASSERT_EQ(16, pool.node_pools[1].total_free);
+	ASSERT_TRUE(pool.node_pools[1].free_list == item);
+	tbg_pool_destroy(&pool);
+}
+
+TEST(bulk_alloc_and_free)
+{
+	memory_pool_t pool;
+	void *items[100];
+	int i, j;
+
+	tbg_pool_init(&pool, 48, 10, 0, "test_bulk");
+	ASSERT_EQ(100, tbg_pool_alloc_bulk(&pool, 100, items));
+	ASSERT_EQ(100, tbg_pool_in_use(&pool));
+	/* One growth covers the whole batch */
+	ASSERT_EQ(2, pool.slab_count);
+	for (i = 0; i < 100; i++) {
+		ASSERT_NOT_NULL(items[i]);
+		for (j = i + 1; j < 100; j++)
+			ASSERT_TRUE(items[i] != items[j]);
+	}
+
+	items[50] = NULL;
+	tbg_pool_free_bulk(&pool, 100, items);
+	ASSERT_EQ(1, tbg_pool_in_use(&pool));
+	tbg_pool_destroy(&pool);
+}
+
+TEST(bulk_alloc_falls_back_at_max)
+{
+	memory_pool_t pool;
+	void *items[8];
+	int i;
+
+	tbg_pool_init(&pool, 64, 4, 4, "test_bulk_max");
+	ASSERT_EQ(8, tbg_pool_alloc_bulk(&pool, 8, items));
+	/* Fallback items count as allocated and in use */
+	ASSERT_EQ(8, tbg_pool_total_allocated(&pool));
+	ASSERT_EQ(8, tbg_pool_in_use(&pool));
+	ASSERT_EQ(8, pool.high_water);
+	for (i = 0; i < 8; i++)
+		ASSERT_NOT_NULL(items[i]);
+	tbg_pool_free_bulk(&pool, 4, items);
+	ASSERT_EQ(4, tbg_pool_total_free(&pool));
+	ASSERT_EQ(4, tbg_pool_in_use(&pool));
+	/* Fallback items are pool-owned once freed, as with tbg_pool_free;
+	 * destroy frees them */
+	tbg_pool_free_bulk(&pool, 4, items + 4);
+	ASSERT_EQ(0, tbg_pool_in_use(&pool));
+	tbg_pool_destroy(&pool);
+}
+
+TEST(bulk_free_routes_by_node)
+{
+	memory_pool_opts_t parent = { .item_size = 128, .name = "test_node" };
+	memory_pool_opts_t opts = { .item_size = 128, .initial_count = 8,
+	                            .name = "test_node" };
+	memory_pool_t pool;
+	void *items[6];
+
+	pool_setup(&pool, &parent, -1);
+	pool.node_pools = calloc(2, sizeof(memory_pool_t));
+	ASSERT_NOT_NULL(pool.node_pools);
+	pool.node_count = 2;
+	pool_setup_node(&pool, 0, &opts);
+	pool_setup_node(&pool, 1, &opts);
+
+	ASSERT_EQ(3, pool_take_bulk(&pool.node_pools[0], 3, items));
+	ASSERT_EQ(3, pool_take_bulk(&pool.node_pools[1], 3, items + 3));
+	/* Interleave owners */
+	{
+		void *tmp = items[1];
+		items[1] = items[4];
+		items[4] = tmp;
+	}
+	tbg_pool_free_bulk(&pool, 6, items);
+	ASSERT_EQ(8, pool.node_pools[0].total_free);
+	ASSERT_EQ(8, pool.node_pools[1].total_free);
+	tbg_pool_destroy(&pool);
+}
+
+TEST(numa_owner_table_tracks_slabs)
+{
+	memory_pool_opts_t parent = { .item_size = 128, .name = "test_node" };
+	memory_pool_opts_t opts = { .item_size = 128, .initial_count = 4,
+	                            .name = "test_node" };
+	memory_pool_t pool;
+	pool_slab_t gone;
+	int local = 0, i, k;
+
+	pool_setup(&pool, &parent, -1);
+	pool.node_pools = calloc(2, sizeof(memory_pool_t));
+	ASSERT_NOT_NULL(pool.node_pools);
+	pool.node_count = 2;
+	pool_setup_node(&pool, 0, &opts);
+	pool_setup_node(&pool, 1, &opts);
+
+	/* Interleaved slabs, enough to outgrow the first table twice */
+	for (i = 0; i < 40; i++)
+		ASSERT_TRUE(pool_grow(&pool.node_pools[i % 2], 4));
+	ASSERT_EQ(42, atomic_load(&pool.range_count));
+	for (k = 0; k < 2; k++) {
+		memory_pool_t *node = &pool.node_pools[k];
+
+		for (i = 0; i < node->slab_count; i++) {
+			char *base = node->slabs[i].base;
+
+			ASSERT_EQ(k, range_owner(&pool, base));
+			ASSERT_EQ(k, range_owner(&pool, base + node->slabs[i].bytes - 1));
+		}
+	}
+	ASSERT_EQ(-1, range_owner(&pool, &local));
+
+	/* Trimmed slabs leave the table */
+	gone = pool.node_pools[0].slabs[0];
+	pool_trim(&pool.node_pools[0]);
+	ASSERT_EQ(0, pool.node_pools[0].slab_count);
+	ASSERT_EQ(21, atomic_load(&pool.range_count));
+	ASSERT_EQ(-1, range_owner(&pool, gone.base));
+	ASSERT_EQ(1, range_owner(&pool, pool.node_pools[1].slabs[0].base));
+	tbg_pool_destroy(&pool);
+}
+
+TEST(instrumentation_counters)
+{
+	memory_pool_t pool;
+	void *items[6];
+	int i;
+
+	tbg_pool_init(&pool, 64, 2, 4, "test_stats");
+	ASSERT_EQ(1, pool.grow_events);
+	for (i = 0; i < 6; i++)
+		items[i] = tbg_pool_alloc(&pool);
+	/* The fallback allocations count towards the gauges too */
+	ASSERT_EQ(6, pool.high_water);
+	ASSERT_EQ(6, tbg_pool_in_use(&pool));
+	ASSERT_EQ(2, pool.grow_events);
+	ASSERT_EQ(2, atomic_load(&pool.fallback_allocs));
+
+	/* Freed, they are adopted without driving in-use negative */
+	for (i = 0; i < 6; i++)
+		tbg_pool_free(&pool, items[i]);
+	ASSERT_EQ(0, tbg_pool_in_use(&pool));
+	ASSERT_EQ(6, pool.high_water);
+
+	/* ...and serve later allocations before any new fallback */
+	for (i = 0; i < 6; i++)
+		items[i] = tbg_pool_alloc(&pool);
+	ASSERT_EQ(2, atomic_load(&pool.fallback_allocs));
+	ASSERT_EQ(6, tbg_pool_total_allocated(&pool));
+	for (i = 0; i < 6; i++)
+		tbg_pool_free(&pool, items[i]);
+	/* Destroy frees the adopted items along with the slabs */
+	tbg_pool_destroy(&pool);
+}
+
+TEST(latency_sampling)
+{
+	memory_pool_t pool;
+	void *item;
+	int i;
+
+	tbg_pool_init(&pool, 64, 16, 0, "test_latency");
+	for (i = 0; i < POOL_LATENCY_SAMPLE * 2; i++) {
+		item = tbg_pool_alloc(&pool);
+		tbg_pool_free(&pool, item);
+	}
+	ASSERT_EQ(2, atomic_load(&pool.alloc_samples));
+	ASSERT_EQ(2, atomic_load(&pool.free_samples));
+	tbg_pool_destroy(&pool);
+}
+
+TEST(format_metrics_per_pool)
+{
+	memory_pool_t a, b;
+	char buf[8192];
+	void *item;
+	int n;
+
+	tbg_pool_init(&a, 64, 8, 0, "share_pool");
+	tbg_pool_init(&b, 4096, 4, 0, "event_pool");
+	item = tbg_pool_alloc(&a);
+
+	n = tbg_pool_format_metrics(buf, sizeof(buf));
+	ASSERT_TRUE(n > 0);
+	ASSERT_TRUE(strstr(buf, "# TYPE tbg_pool_total_free gauge") != NULL);
+	ASSERT_TRUE(strstr(buf, "tbg_pool_total_free{pool=\"share_pool\"} 7") != NULL);
+	ASSERT_TRUE(strstr(buf, "tbg_pool_in_use{pool=\"share_pool\"} 1") != NULL);
+	ASSERT_TRUE(strstr(buf, "tbg_pool_total_free{pool=\"event_pool\"} 4") != NULL);
+	ASSERT_TRUE(strstr(buf, "tbg_pool_alloc_latency_seconds_count{pool=\"event_pool\"}") != NULL);
+
+	/* Truncation never overruns the buffer */
+	n = tbg_pool_format_metrics(buf, 100);
+	ASSERT_TRUE(n < 100);
+	ASSERT_EQ(n, (int)strlen(buf));
+
+	tbg_pool_free(&a, item);
+	tbg_pool_destroy(&b);
+	tbg_pool_destroy(&a);
+	n = tbg_pool_format_metrics(buf, sizeof(buf));
+	ASSERT_TRUE(strstr(buf, "share_pool") == NULL);
+}
+
+static const memory_pool_opts_t hardened_opts = {
+	.item_size = 40, .initial_count = 8, .max_items = 8,
+	.name = "test_hardened", .flags = POOL_F_HARDENED,
+};
+
+TEST(hardened_roundtrip_and_poison)
+{
+	memory_pool_t pool;
+	unsigned char *item;
+	int i;
+
+	tbg_pool_init_opts(&pool, &hardened_opts);
+	/* 40 + canary rounded to a cache line */
+	ASSERT_EQ(64, pool.aligned_size);
+	item = tbg_pool_alloc(&pool);
+	ASSERT_NOT_NULL(item);
+	memset(item, 0x11, 40);
+	tbg_pool_free(&pool, item);
+	for (i = sizeof(void *); i < 40; i++)
+		ASSERT_EQ(POOL_POISON_BYTE, item[i]);
+	ASSERT_EQ(0, atomic_load(&pool.corruptions));
+	tbg_pool_destroy(&pool);
+}
+
+TEST(hardened_double_and_foreign_free)
+{
+	memory_pool_t pool;
+	char *item, *other;
+	char stack_item[64];
+
+	tbg_pool_init_opts(&pool, &hardened_opts);
+	item = tbg_pool_alloc(&pool);
+	other = tbg_pool_alloc(&pool);
+	tbg_pool_free(&pool, item);
+	tbg_pool_free(&pool, item);
+	ASSERT_EQ(1, atomic_load(&pool.corruptions));
+	ASSERT_EQ(7, pool.total_free);
+
+	tbg_pool_free(&pool, stack_item);
+	tbg_pool_free(&pool, other + 8);
+	ASSERT_EQ(3, atomic_load(&pool.corruptions));
+	ASSERT_EQ(7, pool.total_free);
+
+	/* The free list survived: all eight items come back exactly once */
+	tbg_pool_free(&pool, other);
+	ASSERT_EQ(8, pool.total_free);
+	tbg_pool_destroy(&pool);
+}
+
+TEST(hardened_overflow_quarantines_item)
+{
+	memory_pool_t pool;
+	char *item;
+
+	tbg_pool_init_opts(&pool, &hardened_opts);
+	item = tbg_pool_alloc(&pool);
+	memset(item, 0x22, 41);
+	tbg_pool_free(&pool, item);
+	ASSERT_EQ(1, atomic_load(&pool.corruptions));
+	ASSERT_EQ(7, pool.total_free);
+	tbg_pool_destroy(&pool);
+}
+
+TEST(hardened_write_after_free)
+{
+	memory_pool_t pool;
+	char *item, *again;
+
+	tbg_pool_init_opts(&pool, &hardened_opts);
+	item = tbg_pool_alloc(&pool);
+	tbg_pool_free(&pool, item);
+	item[20] = 0;
+	/* The damaged item is skipped; the next one is handed out */
+	again = tbg_pool_alloc(&pool);
+	ASSERT_NOT_NULL(again);
+	ASSERT_TRUE(again != item);
+	ASSERT_EQ(1, atomic_load(&pool.corruptions));
+	ASSERT_EQ(6, pool.total_free);
+	tbg_pool_free(&pool, again);
+	tbg_pool_destroy(&pool);
+}
+
+TEST(hardened_fallback_is_tracked)
+{
+	memory_pool_t pool;
+	void *items[10];
+	char buf[8192];
+	int i;
+
+	tbg_pool_init_opts(&pool, &hardened_opts);
+	for (i = 0; i < 10; i++)
+		items[i] = tbg_pool_alloc(&pool);
+	ASSERT_EQ(2, atomic_load(&pool.fallback_allocs));
+	ASSERT_EQ(3, pool.slab_count);
+	ASSERT_EQ(10, tbg_pool_in_use(&pool));
+	ASSERT_EQ(10, pool.high_water);
+
+	tbg_pool_free_bulk(&pool, 10, items);
+	tbg_pool_free(&pool, items[9]);
+	ASSERT_EQ(1, atomic_load(&pool.corruptions));
+	ASSERT_EQ(10, pool.total_free);
+	ASSERT_EQ(0, tbg_pool_in_use(&pool));
+
+	tbg_pool_format_metrics(buf, sizeof(buf));
+	ASSERT_TRUE(strstr(buf, "tbg_pool_corruptions_total{pool=\"test_hardened\"} 1") != NULL);
+	/* Destroy releases the one-slot slabs too (checked under ASan) */
+	tbg_pool_destroy(&pool);
+}
+
+/* Object cache fixture: a struct with state worth keeping across frees */
+typedef struct cached_obj {
+	pthread_mutex_t lock;
+	int generation;
+	char buf[40];
+} cached_obj_t;
+
+static int ctor_calls, dtor_calls;
+
+static void cached_obj_ctor(void *obj, void *arg)
+{
+	cached_obj_t *o = obj;
+
+	pthread_mutex_init(&o->lock, NULL);
+	o->generation = *(int *)arg;
+	memset(o->buf, 'c', sizeof(o->buf));
+	ctor_calls++;
+}
+
+static void cached_obj_dtor(void *obj, void *arg)
+{
+	(void)arg;
+	pthread_mutex_destroy(&((cached_obj_t *)obj)->lock);
+	dtor_calls++;
+}
+
+TEST(object_cache_constructs_once)
+{
+	int generation = 7;
+	memory_pool_opts_t opts = {
+		.item_size = sizeof(cached_obj_t), .initial_count = 4,
+		.max_items = 4, .name = "test_cache",
+		.ctor = cached_obj_ctor, .dtor = cached_obj_dtor,
+		.ctor_arg = &generation,
+	};
+	memory_pool_t pool;
+	cached_obj_t *o;
+	int i;
+
+	ctor_calls = dtor_calls = 0;
+	tbg_pool_init_opts(&pool, &opts);
+	ASSERT_EQ(4, ctor_calls);
+	ASSERT_TRUE(pool.link_off >= sizeof(cached_obj_t));
+
+	/* State survives free/alloc cycles, including the first word */
+	for (i = 0; i < 8; i++) {
+		o = tbg_pool_alloc(&pool);
+		ASSERT_EQ(7, o->generation);
+		ASSERT_EQ('c', o->buf[0]);
+		ASSERT_EQ(0, pthread_mutex_trylock(&o->lock));
+		pthread_mutex_unlock(&o->lock);
+		tbg_pool_free(&pool, o);
+	}
+	ASSERT_EQ(4, ctor_calls);
+
+	tbg_pool_destroy(&pool);
+	ASSERT_EQ(4, dtor_calls);
+}
+
+TEST(object_cache_hardened)
+{
+	int generation = 3;
+	memory_pool_opts_t opts = {
+		.item_size = sizeof(cached_obj_t), .initial_count = 2,
+		.max_items = 2, .name = "test_cache_hardened",
+		.flags = POOL_F_HARDENED,
+		.ctor = cached_obj_ctor, .dtor = cached_obj_dtor,
+		.ctor_arg = &generation,
+	};
+	memory_pool_t pool;
+	cached_obj_t *o[3];
+	int i;
+
+	ctor_calls = dtor_calls = 0;
+	tbg_pool_init_opts(&pool, &opts);
+	for (i = 0; i < 3; i++)
+		o[i] = tbg_pool_alloc(&pool);
+	/* The fallback past max_items is constructed too */
+	ASSERT_EQ(3, ctor_calls);
+	ASSERT_EQ(3, o[2]->generation);
+
+	for (i = 0; i < 3; i++)
+		tbg_pool_free(&pool, o[i]);
+	tbg_pool_free(&pool, o[0]);
+	ASSERT_EQ(1, atomic_load(&pool.corruptions));
+
+	/* Not poisoned: constructed state is intact */
+	o[0] = tbg_pool_alloc(&pool);
+	ASSERT_EQ(3, o[0]->generation);
+	ASSERT_EQ(1, atomic_load(&pool.corruptions));
+	tbg_pool_free(&pool, o[0]);
+
+	tbg_pool_destroy(&pool);
+	ASSERT_EQ(3, dtor_calls);
+}
+
+TEST(trim_releases_empty_slabs)
+{
+	memory_pool_t pool;
+	void *items[40];
+	size_t before, released;
+	int i;
+
+	tbg_pool_init(&pool, 64, 8, 0, "test_trim");
+	for (i = 0; i < 40; i++)
+		items[i] = tbg_pool_alloc(&pool);
+	ASSERT_TRUE(pool.slab_count >= 2);
+
+	/* Keep one item live: its slab must survive */
+	for (i = 1; i < 40; i++)
+		tbg_pool_free(&pool, items[i]);
+	before = tbg_pool_mem_usage(NULL);
+	released = tbg_pool_trim(&pool);
+	ASSERT_TRUE(released > 0);
+	ASSERT_EQ(1, pool.slab_count);
+	ASSERT_TRUE(pool_find_slab(&pool, items[0]) == 0);
+	ASSERT_EQ(tbg_pool_total_allocated(&pool) - 1,
+	          tbg_pool_total_free(&pool));
+	ASSERT_TRUE(tbg_pool_mem_usage(NULL) <= before - released);
+
+	/* Nothing left to trim; the pool grows again on demand */
+	ASSERT_EQ(0, tbg_pool_trim(&pool));
+	for (i = 1; i < 40; i++) {
+		items[i] = tbg_pool_alloc(&pool);
+		ASSERT_NOT_NULL(items[i]);
+	}
+	ASSERT_EQ(40, tbg_pool_in_use(&pool));
+	for (i = 0; i < 40; i++)
+		tbg_pool_free(&pool, items[i]);
+
+	/* Pressure below MEMGOV_ELEVATED leaves the pool alone */
+	ASSERT_EQ(0, tbg_pool_mem_pressure(MEMGOV_NORMAL, NULL));
+	ASSERT_TRUE(tbg_pool_mem_pressure(MEMGOV_ELEVATED, NULL) > 0);
+	ASSERT_EQ(0, pool.slab_count);
+	ASSERT_EQ(0, tbg_pool_total_allocated(&pool));
+	tbg_pool_destroy(&pool);
+}
+
+TEST(trim_runs_object_destructors)
+{
+	int generation = 1;
+	memory_pool_opts_t opts = {
+		.item_size = sizeof(cached_obj_t), .initial_count = 4,
+		.name = "test_cache_trim",
+		.ctor = cached_obj_ctor, .dtor = cached_obj_dtor,
+		.ctor_arg = &generation,
+	};
+	memory_pool_t pool;
+
+	ctor_calls = dtor_calls = 0;
+	tbg_pool_init_opts(&pool, &opts);
+	ASSERT_TRUE(tbg_pool_trim(&pool) > 0);
+	ASSERT_EQ(4, dtor_calls);
+	tbg_pool_destroy(&pool);
+	ASSERT_EQ(4, dtor_calls);
+}
+
+TEST(arena_bump_and_reset)
+{
+	tbg_arena_t arena;
+	char *a, *b, *first;
+
+	tbg_arena_init(&arena, 256);
+	first = a = tbg_arena_alloc(&arena, 10);
+	b = tbg_arena_alloc(&arena, 10);
+	ASSERT_NOT_NULL(a);
+	ASSERT_NOT_NULL(b);
+	ASSERT_EQ(0, (uintptr_t)a % ARENA_ALIGN);
+	ASSERT_EQ(0, (uintptr_t)b % ARENA_ALIGN);
+	ASSERT_EQ(ARENA_ALIGN, b - a);
+
+	/* Spill into a second chunk, then reset reuses the first */
+	ASSERT_NOT_NULL(tbg_arena_alloc(&arena, 200));
+	ASSERT_NOT_NULL(tbg_arena_alloc(&arena, 200));
+	ASSERT_NOT_NULL(arena.head->next);
+	tbg_arena_reset(&arena);
+	ASSERT_EQ(0, arena.in_use);
+	ASSERT_TRUE(arena.high_water >= 432);
+	ASSERT_TRUE(tbg_arena_alloc(&arena, 10) == first);
+	tbg_arena_destroy(&arena);
+}
+
+TEST(arena_oversized_and_strndup)
+{
+	tbg_arena_t arena;
+	char *big, *s;
+
+	tbg_arena_init(&arena, 64);
+	big = tbg_arena_alloc(&arena, 1000);
+	ASSERT_NOT_NULL(big);
+	memset(big, 0, 1000);
+	ASSERT_NOT_NULL(arena.large);
+
+	s = tbg_arena_strndup(&arena, "mining.submit", 6);
+	ASSERT_STR_EQ("mining", s);
+
+	tbg_arena_reset(&arena);
+	ASSERT_NULL(arena.large);
+	tbg_arena_destroy(&arena);
+}
+
+TEST(arena_thread_local)
+{
+	tbg_arena_t *arena = tbg_arena_thread();
+
+	ASSERT_NOT_NULL(arena);
+	ASSERT_TRUE(arena == tbg_arena_thread());
+	ASSERT_NOT_NULL(tbg_arena_alloc(arena, 32));
+	tbg_arena_reset(arena);
+}
+
+int main(void)
+{
+	TEST_SUITE("Memory Pool");
+
+	RUN_TEST(alloc_free_roundtrip);
+	RUN_TEST(grows_when_exhausted);
+	RUN_TEST(heap_backing_by_default);
+	RUN_TEST(default_alignment_is_cache_line);
+	RUN_TEST(packed_slots_are_pointer_aligned);
+	RUN_TEST(explicit_alignment);
+	RUN_TEST(invalid_alignment_falls_back);
+	RUN_TEST(hugepage_slabs_fill_whole_pages);
+	RUN_TEST(hugepage_slabs_respect_max_items);
+	RUN_TEST(slab_lookup_is_sorted);
+	RUN_TEST(numa_flag_on_single_node_host);
+	RUN_TEST(numa_free_returns_to_owning_node);
+	RUN_TEST(bulk_alloc_and_free);
+	RUN_TEST(bulk_alloc_falls_back_at_max);
+	RUN_TEST(bulk_free_routes_by_node);
+	RUN_TEST(numa_owner_table_tracks_slabs);
+	RUN_TEST(instrumentation_counters);
+	RUN_TEST(latency_sampling);
+	RUN_TEST(format_metrics_per_pool);
+	RUN_TEST(hardened_roundtrip_and_poison);
+	RUN_TEST(hardened_double_and_foreign_free);
+	RUN_TEST(hardened_overflow_quarantines_item);
+	RUN_TEST(hardened_write_after_free);
+	RUN_TEST(hardened_fallback_is_tracked);
+	RUN_TEST(object_cache_constructs_once);
+	RUN_TEST(object_cache_hardened);
+	RUN_TEST(trim_releases_empty_slabs);
+	RUN_TEST(trim_runs_object_destructors);
+	RUN_TEST(arena_bump_and_reset);
+	RUN_TEST(arena_oversized_and_strndup);
+	RUN_TEST(arena_thread_local);
+
+	PRINT_RESULTS();
+}
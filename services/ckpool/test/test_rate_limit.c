@@ -0,0 +1,1187 @@
+/*
+ * test_rate_limit.c — Unit tests for the per-IP rate limiter
+ * GPLv3 — Copyright (C) 2026 TheBitcoinGame Contributors
+ */
+
+#define _GNU_SOURCE
+#include "test_harness.h"
+#include <stdint.h>
+
+/* rate_limit.c only needs ckpool's LOG* macros (see shim/); the clock
+ * (never started, so reads fall through to clock_gettime) and the memory
+ * governor's level names come along */
+#include "../src/rate_limit.c"
+#include "../src/tbg_clock.c"
+#include "../src/tbg_memgov.c"
+
+static const rate_limit_config_t test_config = {
+	.connections_per_ip_per_minute = 5,
+	.max_connections_per_ip = 3,
+	.max_subscribes_per_minute = 3,
+	.max_authorizes_per_minute = 5,
+	.max_shares_per_minute = 1000,
+	.max_invalid_shares_per_minute = 100,
+	.global_max_connections = 100000,
+	.softban_duration_seconds = 300,
+};
+
+/* Per-IP limits out of the way so only the subnet limits bite */
+static const rate_limit_config_t subnet_config = {
+	.connections_per_ip_per_minute = 100,
+	.max_connections_per_ip = 100,
+	.max_subscribes_per_minute = 3,
+	.max_authorizes_per_minute = 5,
+	.max_shares_per_minute = 1000,
+	.max_invalid_shares_per_minute = 100,
+	.global_max_connections = 100000,
+	.softban_duration_seconds = 300,
+	.subnet_connections_per_minute = 6,
+	.max_connections_per_subnet = 4,
+	.v6_host_connections_per_minute = 3,
+	.max_connections_per_v6_host = 100,
+	.subnet_softban_threshold = 3,
+};
+
+/* Distinct IPv4 address for index i */
+static void test_ip(char *buf, int i)
+{
+	sprintf(buf, "10.%d.%d.%d", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+}
+
+/* Entries across all stripes; capacity into *cap if given */
+static uint32_t table_count(uint32_t *cap)
+{
+	uint32_t n = 0, c = 0;
+	int i;
+
+	for (i = 0; i < RATE_TABLE_STRIPES; i++) {
+		n += ip_stripes[i].table.count;
+		c += ip_stripes[i].table.mask + 1;
+	}
+	if (cap)
+		*cap = c;
+	return n;
+}
+
+static bool table_has(const char *ip)
+{
+	struct in6_addr key;
+	uint32_t hash;
+
+	tbg_rate_limit_key_from_str(ip, &key);
+	hash = key_hash(&key);
+	return find_ip_entry(&stripe_for(hash)->table, &key, hash) != NULL;
+}
+
+/* Tracked prefixes reachable from n; checks every child extends its
+ * parent's prefix and links back to it */
+static int trie_check(const subnet_node_t *n, int parent_plen)
+{
+	int i, tracked;
+
+	if (!n)
+		return 0;
+	if (n->plen <= parent_plen && parent_plen >= 0)
+		return -1000;
+	tracked = n->tracked;
+	for (i = 0; i < 2; i++) {
+		if (n->child[i] &&
+		    (common_bits(&n->child[i]->prefix, &n->prefix, n->plen) !=
+		     n->plen || key_bit(&n->child[i]->prefix, n->plen) != i ||
+		     n->child[i]->parent != n))
+			return -1000;
+		tracked += trie_check(n->child[i], n->plen);
+	}
+	return tracked;
+}
+
+/* ─── Tests ─────────────────────────────────────────────────────── */
+
+TEST(key_from_str_and_sockaddr)
+{
+	struct in6_addr a, b;
+	struct sockaddr_in sin = { .sin_family = AF_INET };
+	struct sockaddr_in6 sin6 = { .sin6_family = AF_INET6 };
+	char buf[INET6_ADDRSTRLEN];
+
+	/* IPv4 is stored v4-mapped, equal to the literal mapped form */
+	ASSERT_TRUE(tbg_rate_limit_key_from_str("192.0.2.7", &a));
+	ASSERT_TRUE(IN6_IS_ADDR_V4MAPPED(&a));
+	ASSERT_TRUE(tbg_rate_limit_key_from_str("::ffff:192.0.2.7", &b));
+	ASSERT_TRUE(key_eq(&a, &b));
+	ASSERT_STR_EQ("192.0.2.7", key_str(&a, buf));
+
+	inet_pton(AF_INET, "192.0.2.7", &sin.sin_addr);
+	ASSERT_TRUE(tbg_rate_limit_key_from_sockaddr((struct sockaddr *)&sin, &b));
+	ASSERT_TRUE(key_eq(&a, &b));
+
+	/* IPv6, with and without a zone */
+	ASSERT_TRUE(tbg_rate_limit_key_from_str("fe80::1%eth0", &a));
+	ASSERT_TRUE(tbg_rate_limit_key_from_str("fe80::1", &b));
+	ASSERT_TRUE(key_eq(&a, &b));
+	inet_pton(AF_INET6, "fe80::1", &sin6.sin6_addr);
+	ASSERT_TRUE(tbg_rate_limit_key_from_sockaddr((struct sockaddr *)&sin6, &b));
+	ASSERT_TRUE(key_eq(&a, &b));
+	ASSERT_STR_EQ("fe80::1", key_str(&a, buf));
+
+	ASSERT_FALSE(tbg_rate_limit_key_from_str("not-an-ip", &a));
+	ASSERT_FALSE(tbg_rate_limit_key_from_str("", &a));
+	ASSERT_FALSE(tbg_rate_limit_key_from_str(NULL, &a));
+}
+
+TEST(connect_limits_per_ip)
+{
+	int i;
+
+	tbg_rate_limit_init(&test_config);
+
+	/* max_connections_per_ip concurrent connections */
+	for (i = 0; i < 3; i++)
+		ASSERT_TRUE(tbg_rate_limit_connect("192.0.2.1"));
+	ASSERT_FALSE(tbg_rate_limit_connect("192.0.2.1"));
+	ASSERT_EQ(3, tbg_rate_limit_global_connections());
+
+	/* Slots free up, but the connect bucket (5/min) runs dry */
+	tbg_rate_limit_disconnect("192.0.2.1");
+	tbg_rate_limit_disconnect("192.0.2.1");
+	ASSERT_TRUE(tbg_rate_limit_connect("192.0.2.1"));
+	ASSERT_TRUE(tbg_rate_limit_connect("192.0.2.1"));
+	tbg_rate_limit_disconnect("192.0.2.1");
+	ASSERT_FALSE(tbg_rate_limit_connect("192.0.2.1"));
+
+	/* Other addresses are unaffected; garbage is refused */
+	ASSERT_TRUE(tbg_rate_limit_connect("2001:db8::1"));
+	ASSERT_FALSE(tbg_rate_limit_connect("bogus"));
+	ASSERT_FALSE(tbg_rate_limit_connect(NULL));
+
+	tbg_rate_limit_shutdown();
+}
+
+TEST(softban)
+{
+	tbg_rate_limit_init(&test_config);
+
+	ASSERT_FALSE(tbg_rate_limit_is_banned("198.51.100.9"));
+	tbg_rate_limit_softban("198.51.100.9");
+	ASSERT_TRUE(tbg_rate_limit_is_banned("198.51.100.9"));
+	ASSERT_TRUE(tbg_rate_limit_is_banned("::ffff:198.51.100.9"));
+	ASSERT_FALSE(tbg_rate_limit_connect("198.51.100.9"));
+	ASSERT_FALSE(tbg_rate_limit_is_banned("198.51.100.10"));
+
+	tbg_rate_limit_shutdown();
+}
+
+TEST(table_grows_and_sweeps)
+{
+	char ip[INET6_ADDRSTRLEN];
+	uint32_t cap;
+	int i, n = RATE_TABLE_INITIAL * 4;
+
+	tbg_rate_limit_init(&test_config);
+
+	for (i = 0; i < n; i++) {
+		test_ip(ip, i);
+		ASSERT_TRUE(tbg_rate_limit_connect(ip));
+	}
+	ASSERT_EQ(n, table_count(NULL));
+	for (i = 0; i < RATE_TABLE_STRIPES; i++) {
+		ip_table_t *t = &ip_stripes[i].table;
+
+		/* Keys spread over the stripes; none is over its load factor */
+		ASSERT_TRUE(t->count > 0);
+		ASSERT_TRUE(t->count * 100 <= (t->mask + 1) * RATE_TABLE_MAX_LOAD);
+	}
+
+	/* Drop every other connection, then sweep everything idle: the
+	 * survivors must still be found after the backward shifts */
+	for (i = 0; i < n; i += 2) {
+		test_ip(ip, i);
+		tbg_rate_limit_disconnect(ip);
+	}
+	sweep_stale(tbg_clock_now() + 1, false);
+	ASSERT_EQ(n / 2, table_count(NULL));
+
+	for (i = 0; i < n; i++) {
+		test_ip(ip, i);
+		ASSERT_EQ(i & 1, table_has(ip));
+	}
+
+	/* Empty again: the table shrinks back to its initial size */
+	for (i = 1; i < n; i += 2) {
+		test_ip(ip, i);
+		tbg_rate_limit_disconnect(ip);
+	}
+	ASSERT_TRUE(sweep_stale(tbg_clock_now() + 1, false) > 0);
+	ASSERT_EQ(0, table_count(&cap));
+	ASSERT_EQ(RATE_TABLE_INITIAL, cap);
+	ASSERT_EQ(0, tbg_rate_limit_global_connections());
+
+	tbg_rate_limit_shutdown();
+}
+
+#define CONC_THREADS  4
+#define CONC_IPS      2000
+
+static void *connector(void *arg)
+{
+	char ip[INET6_ADDRSTRLEN];
+	int base = (int)(intptr_t)arg * CONC_IPS;
+	int i, ok = 0;
+
+	for (i = 0; i < CONC_IPS; i++) {
+		test_ip(ip, base + i);
+		if (tbg_rate_limit_connect(ip)) {
+			tbg_rate_limit_disconnect(ip);
+			ok++;
+		}
+	}
+	return (void *)(intptr_t)ok;
+}
+
+TEST(concurrent_connects)
+{
+	pthread_t th[CONC_THREADS];
+	void *ok;
+	int i;
+
+	tbg_rate_limit_init(&test_config);
+	for (i = 0; i < CONC_THREADS; i++)
+		pthread_create(&th[i], NULL, connector, (void *)(intptr_t)i);
+	for (i = 0; i < CONC_THREADS; i++) {
+		pthread_join(th[i], &ok);
+		ASSERT_EQ(CONC_IPS, (intptr_t)ok);
+	}
+	ASSERT_EQ(CONC_THREADS * CONC_IPS, table_count(NULL));
+	ASSERT_EQ(0, tbg_rate_limit_global_connections());
+	tbg_rate_limit_shutdown();
+}
+
+TEST(memory_pressure_tightens_admission)
+{
+	int i;
+
+	tbg_rate_limit_init(&test_config);
+	ASSERT_EQ(RATE_TABLE_INITIAL * sizeof(ip_rate_state_t) +
+	          sizeof(sketch) + sizeof(hitters.heap) +
+	          sizeof(reject_stripes),
+	          tbg_rate_limit_mem_usage(NULL));
+
+	ASSERT_TRUE(tbg_rate_limit_connect("203.0.113.1"));
+	tbg_rate_limit_disconnect("203.0.113.1");
+
+	/* High: per-IP concurrency halves (3 -> 1) */
+	tbg_rate_limit_mem_pressure(MEMGOV_HIGH, NULL);
+	ASSERT_TRUE(tbg_rate_limit_connect("203.0.113.2"));
+	ASSERT_FALSE(tbg_rate_limit_connect("203.0.113.2"));
+
+	/* Critical: unknown IPs are refused, known ones still admitted */
+	tbg_rate_limit_mem_pressure(MEMGOV_CRITICAL, NULL);
+	ASSERT_FALSE(tbg_rate_limit_connect("203.0.113.3"));
+	ASSERT_TRUE(tbg_rate_limit_connect("203.0.113.1"));
+
+	tbg_rate_limit_mem_pressure(MEMGOV_NORMAL, NULL);
+	for (i = 0; i < 3; i++)
+		ASSERT_TRUE(tbg_rate_limit_connect("203.0.113.4"));
+
+	tbg_rate_limit_shutdown();
+}
+
+TEST(conn_buckets)
+{
+	conn_rate_state_t state;
+	int i;
+
+	tbg_rate_limit_init(&test_config);
+	tbg_rate_limit_conn_init(&state);
+
+	for (i = 0; i < 3; i++)
+		ASSERT_TRUE(tbg_rate_limit_check_conn(&state, RATE_SUBSCRIBE, RATE_COST_DEFAULT));
+	ASSERT_FALSE(tbg_rate_limit_check_conn(&state, RATE_SUBSCRIBE, RATE_COST_DEFAULT));
+	ASSERT_TRUE(tbg_rate_limit_check_conn(&state, RATE_AUTHORIZE, RATE_COST_DEFAULT));
+	ASSERT_FALSE(tbg_rate_limit_check_conn(NULL, RATE_SUBMIT, RATE_COST_DEFAULT));
+
+	tbg_rate_limit_shutdown();
+}
+
+TEST(weighted_costs)
+{
+	conn_rate_state_t state;
+	int i;
+
+	tbg_rate_limit_init(&test_config);
+	tbg_rate_limit_conn_init(&state);
+
+	/* 1000/min submit budget: invalid shares drain it four times as
+	 * fast as valid ones */
+	for (i = 0; i < 200; i++)
+		ASSERT_TRUE(tbg_rate_limit_check_conn(&state, RATE_SUBMIT,
+		                                      RATE_COST_INVALID_SHARE));
+	for (i = 0; i < 197; i++)
+		ASSERT_TRUE(tbg_rate_limit_check_conn(&state, RATE_SUBMIT,
+		                                      RATE_COST_DEFAULT));
+	ASSERT_FALSE(tbg_rate_limit_check_conn(&state, RATE_SUBMIT,
+	                                       RATE_COST_INVALID_SHARE));
+
+	/* The rejected charge took nothing; 0 costs one token */
+	for (i = 0; i < 3; i++)
+		ASSERT_TRUE(tbg_rate_limit_check_conn(&state, RATE_SUBMIT, 0));
+
+	/* 5/min authorize budget: one validating authorize and two plain */
+	ASSERT_TRUE(tbg_rate_limit_check_conn(&state, RATE_AUTHORIZE,
+	                                      RATE_COST_AUTH_VALIDATE));
+	ASSERT_FALSE(tbg_rate_limit_check_conn(&state, RATE_AUTHORIZE,
+	                                       RATE_COST_AUTH_VALIDATE));
+	ASSERT_TRUE(tbg_rate_limit_check_conn(&state, RATE_AUTHORIZE, 1));
+	ASSERT_TRUE(tbg_rate_limit_check_conn(&state, RATE_AUTHORIZE, 1));
+	ASSERT_FALSE(tbg_rate_limit_check_conn(&state, RATE_AUTHORIZE, 1));
+
+	/* A cost over the bucket's size takes a full bucket */
+	ASSERT_TRUE(tbg_rate_limit_check_conn(&state, RATE_SUBSCRIBE,
+	                                      UINT32_MAX));
+	ASSERT_FALSE(tbg_rate_limit_check_conn(&state, RATE_SUBSCRIBE, 1));
+
+	/* Message size */
+	ASSERT_EQ(1, tbg_rate_limit_msg_cost(0, 0));
+	ASSERT_EQ(1, tbg_rate_limit_msg_cost(1, RATE_COST_MSG_BYTES));
+	ASSERT_EQ(2, tbg_rate_limit_msg_cost(1, RATE_COST_MSG_BYTES + 1));
+	ASSERT_EQ(RATE_COST_INVALID_SHARE + 15,
+	          tbg_rate_limit_msg_cost(RATE_COST_INVALID_SHARE, 65536));
+
+	tbg_rate_limit_shutdown();
+}
+
+TEST(bucket_refills_sub_second)
+{
+	rate_bucket_t b;
+	int i, got = 0;
+
+	/* 60000/min = one token per millisecond */
+	bucket_init(&b, 5, 60000);
+	for (i = 0; i < 5; i++)
+		ASSERT_TRUE(bucket_consume(&b));
+	ASSERT_FALSE(bucket_consume(&b));
+
+	usleep(20000);
+	while (bucket_consume(&b))
+		got++;
+	/* Refilled within the second, but never past max_tokens */
+	ASSERT_EQ(5, got);
+
+	/* 600/min: each 20 ms accrues 0.2 tokens, kept as a fraction */
+	bucket_init(&b, 1, 600);
+	ASSERT_TRUE(bucket_consume(&b));
+	for (i = 0; i < 3; i++) {
+		usleep(20000);
+		ASSERT_FALSE(bucket_consume(&b));
+	}
+	usleep(60000);
+	ASSERT_TRUE(bucket_consume(&b));
+
+	bucket_init(&b, 0, 0);
+	ASSERT_FALSE(bucket_consume(&b));
+
+	/* A stamp just ahead of this thread's clock, as another thread's
+	 * refill can leave it, is no time elapsed, not a full refill */
+	bucket_init(&b, 5, 60000);
+	atomic_store(&b.state, bucket_pack(0, now_ms() + 1000));
+	ASSERT_EQ(0, bucket_level(&b));
+	ASSERT_FALSE(bucket_consume(&b));
+}
+
+#define BUCKET_THREADS  4
+#define BUCKET_TOKENS   20000
+
+static void *drainer(void *arg)
+{
+	rate_bucket_t *b = arg;
+	intptr_t got = 0;
+
+	while (bucket_consume(b))
+		got++;
+	return (void *)got;
+}
+
+TEST(bucket_concurrent_consume_is_exact)
+{
+	pthread_t th[BUCKET_THREADS];
+	rate_bucket_t b;
+	void *got;
+	long total = 0;
+	int i;
+
+	/* Refill of 1/min adds nothing measurable while the threads run */
+	bucket_init(&b, BUCKET_TOKENS, 1);
+	for (i = 0; i < BUCKET_THREADS; i++)
+		pthread_create(&th[i], NULL, drainer, &b);
+	for (i = 0; i < BUCKET_THREADS; i++) {
+		pthread_join(th[i], &got);
+		total += (intptr_t)got;
+	}
+	ASSERT_TRUE(total >= BUCKET_TOKENS && total <= BUCKET_TOKENS + 1);
+}
+
+TEST(subnet_limits_rotating_sources)
+{
+	char ip[INET6_ADDRSTRLEN];
+	int i, ok = 0;
+
+	tbg_rate_limit_init(&subnet_config);
+
+	/* One connection each from ten addresses of a /24: the /24 allows
+	 * max_connections_per_subnet concurrent */
+	for (i = 1; i <= 10; i++) {
+		sprintf(ip, "198.51.100.%d", i);
+		ok += tbg_rate_limit_connect(ip);
+	}
+	ASSERT_EQ(4, ok);
+	ASSERT_TRUE(tbg_rate_limit_connect("198.51.101.1"));
+
+	/* Freed slots come back until the /24's 6/min bucket is dry */
+	for (i = 1; i <= 4; i++) {
+		sprintf(ip, "198.51.100.%d", i);
+		tbg_rate_limit_disconnect(ip);
+	}
+	ASSERT_TRUE(tbg_rate_limit_connect("198.51.100.20"));
+	ASSERT_TRUE(tbg_rate_limit_connect("198.51.100.21"));
+	ASSERT_FALSE(tbg_rate_limit_connect("198.51.100.22"));
+
+	/* IPv6 privacy addresses in one /64: the /64 bucket (3/min) bites;
+	 * the next /64 in the same /48 still gets in */
+	ok = 0;
+	for (i = 1; i <= 5; i++) {
+		sprintf(ip, "2001:db8:0:1::%x", i * 0x1111);
+		ok += tbg_rate_limit_connect(ip);
+	}
+	ASSERT_EQ(3, ok);
+	ASSERT_TRUE(tbg_rate_limit_connect("2001:db8:0:2::1"));
+
+	/* And the /48 caps concurrency across its /64s */
+	ASSERT_FALSE(tbg_rate_limit_connect("2001:db8:0:3::1"));
+	ASSERT_TRUE(tbg_rate_limit_connect("2001:db8:1:3::1"));
+
+	tbg_rate_limit_shutdown();
+}
+
+TEST(subnet_softban_escalates)
+{
+	tbg_rate_limit_init(&subnet_config);
+
+	tbg_rate_limit_softban("192.0.2.1");
+	tbg_rate_limit_softban("192.0.2.1");    /* Extension, not a new ban */
+	tbg_rate_limit_softban("192.0.2.2");
+	ASSERT_FALSE(tbg_rate_limit_is_banned("192.0.2.3"));
+
+	tbg_rate_limit_softban("192.0.2.99");
+	ASSERT_TRUE(tbg_rate_limit_is_banned("192.0.2.3"));
+	ASSERT_FALSE(tbg_rate_limit_connect("192.0.2.200"));
+	ASSERT_FALSE(tbg_rate_limit_is_banned("192.0.3.1"));
+	ASSERT_TRUE(tbg_rate_limit_connect("192.0.3.1"));
+
+	/* Bans in one /64 take out the /64 and its /48 */
+	tbg_rate_limit_softban("2001:db8:5:1::1");
+	tbg_rate_limit_softban("2001:db8:5:1::2");
+	tbg_rate_limit_softban("2001:db8:5:1::3");
+	ASSERT_TRUE(tbg_rate_limit_is_banned("2001:db8:5:1::abcd"));
+	ASSERT_TRUE(tbg_rate_limit_is_banned("2001:db8:5:ffff::1"));
+	ASSERT_FALSE(tbg_rate_limit_is_banned("2001:db8:6::1"));
+
+	/* Bans outlive the idle sweep */
+	sweep_stale(tbg_clock_now() + 1, false);
+	ASSERT_TRUE(tbg_rate_limit_is_banned("192.0.2.3"));
+
+	tbg_rate_limit_shutdown();
+}
+
+TEST(softban_prefix_longest_match)
+{
+	tbg_rate_limit_init(&test_config);
+
+	ASSERT_FALSE(tbg_rate_limit_softban_prefix("10.0.0.0"));
+	ASSERT_FALSE(tbg_rate_limit_softban_prefix("10.0.0.0/33"));
+	ASSERT_FALSE(tbg_rate_limit_softban_prefix("bogus/8"));
+	ASSERT_FALSE(tbg_rate_limit_softban_prefix("2001:db8::/129"));
+
+	/* Covering prefixes of any length are found, IPv4 and IPv6 */
+	ASSERT_TRUE(tbg_rate_limit_softban_prefix("203.0.112.0/22"));
+	ASSERT_TRUE(tbg_rate_limit_is_banned("203.0.115.255"));
+	ASSERT_FALSE(tbg_rate_limit_is_banned("203.0.116.0"));
+	ASSERT_FALSE(tbg_rate_limit_connect("203.0.113.7"));
+
+	ASSERT_TRUE(tbg_rate_limit_softban_prefix("2001:db8:8000::/33"));
+	ASSERT_TRUE(tbg_rate_limit_is_banned("2001:db8:ffff::1"));
+	ASSERT_FALSE(tbg_rate_limit_is_banned("2001:db8:7fff::1"));
+
+	/* Subnet tracking off: nothing but the bans is in the trie */
+	ASSERT_TRUE(tbg_rate_limit_connect("198.51.100.1"));
+	ASSERT_EQ(2, trie_check(subnet_root, -1));
+
+	tbg_rate_limit_shutdown();
+}
+
+/* Address i of a scattered set: odd i a /24 of its own, even i its own
+ * /48 and /64 */
+static void scattered_ip(char *buf, int i)
+{
+	uint32_t x = (uint32_t)i * 2654435761u;
+
+	if (i & 1)
+		sprintf(buf, "%u.%u.%u.1", x >> 24, (x >> 16) & 0xff,
+		        (x >> 8) & 0xff);
+	else
+		sprintf(buf, "2001:%x:%x:%x::1", x >> 16, x & 0xffff, i);
+}
+
+TEST(subnet_trie_structure_and_sweep)
+{
+	char ip[INET6_ADDRSTRLEN];
+	int i, n = 3000, left = 0;
+
+	tbg_rate_limit_init(&subnet_config);
+
+	for (i = 0; i < n; i++) {
+		scattered_ip(ip, i);
+		ASSERT_TRUE(tbg_rate_limit_connect(ip));
+	}
+	ASSERT_EQ(n / 2 + n, trie_check(subnet_root, -1));
+	ASSERT_TRUE(subnet_count >= (uint32_t)(n / 2 + n));
+
+	/* Idle prefixes go; connected ones and the branches above them stay */
+	for (i = 0; i < n; i++) {
+		scattered_ip(ip, i);
+		if (i % 3 == 0)
+			tbg_rate_limit_disconnect(ip);
+		else
+			left += i & 1 ? 1 : 2;
+	}
+	sweep_stale(tbg_clock_now() + 1, false);
+	ASSERT_EQ(left, trie_check(subnet_root, -1));
+
+	for (i = 0; i < n; i++) {
+		scattered_ip(ip, i);
+		if (i % 3 != 0)
+			tbg_rate_limit_disconnect(ip);
+	}
+	ASSERT_TRUE(sweep_stale(tbg_clock_now() + 1, false) > 0);
+	ASSERT_TRUE(subnet_root == NULL);
+	ASSERT_EQ(0, subnet_count);
+
+	tbg_rate_limit_shutdown();
+}
+
+TEST(incremental_sweep)
+{
+	char ip[INET6_ADDRSTRLEN];
+	uint32_t cap, left;
+	time_t cutoff;
+	int i, tick, n = RATE_TABLE_INITIAL * 4;
+
+	tbg_rate_limit_init(&test_config);
+	for (i = 0; i < n; i++) {
+		test_ip(ip, i);
+		ASSERT_TRUE(tbg_rate_limit_connect(ip));
+		tbg_rate_limit_disconnect(ip);
+	}
+	cutoff = tbg_clock_now() + 1;
+
+	/* One tick covers about 1/RATE_CLEANUP_INTERVAL of each stripe */
+	for (i = 0; i < RATE_TABLE_STRIPES; i++)
+		sweep_stripe(&ip_stripes[i], &ip_stripes[i].sweep_pos,
+		             RATE_CLEANUP_INTERVAL, cutoff, false);
+	left = table_count(NULL);
+	ASSERT_TRUE(left < (uint32_t)n && left > (uint32_t)n * 9 / 10);
+
+	/* A full interval of ticks empties and shrinks every stripe */
+	for (tick = 1; tick < RATE_CLEANUP_INTERVAL; tick++) {
+		for (i = 0; i < RATE_TABLE_STRIPES; i++)
+			sweep_stripe(&ip_stripes[i], &ip_stripes[i].sweep_pos,
+			             RATE_CLEANUP_INTERVAL, cutoff, false);
+	}
+	ASSERT_EQ(0, table_count(&cap));
+	ASSERT_EQ(RATE_TABLE_INITIAL, cap);
+	tbg_rate_limit_shutdown();
+
+	/* Same for the trie */
+	tbg_rate_limit_init(&subnet_config);
+	for (i = 0; i < 3000; i++) {
+		scattered_ip(ip, i);
+		ASSERT_TRUE(tbg_rate_limit_connect(ip));
+		tbg_rate_limit_disconnect(ip);
+	}
+	cutoff = tbg_clock_now() + 1;
+	subnet_sweep(cutoff, subnet_sweep_budget());
+	ASSERT_EQ(4500 - (4500 / RATE_CLEANUP_INTERVAL + 1), subnet_tracked);
+	ASSERT_EQ(subnet_tracked, trie_check(subnet_root, -1));
+	for (tick = 1; tick < RATE_CLEANUP_INTERVAL; tick++)
+		subnet_sweep(cutoff, subnet_sweep_budget());
+	ASSERT_EQ(0, subnet_tracked);
+	ASSERT_TRUE(subnet_root == NULL);
+	ASSERT_EQ(0, subnet_count);
+
+	tbg_rate_limit_shutdown();
+}
+
+TEST(sketch_never_underestimates)
+{
+	struct in6_addr key;
+	char ip[INET6_ADDRSTRLEN];
+	int i;
+
+	tbg_rate_limit_init(&test_config);
+
+	/* Far more keys than sketch columns, so rows collide */
+	for (i = 0; i < RATE_SKETCH_WIDTH * 2; i++) {
+		test_ip(ip, i);
+		tbg_rate_limit_key_from_str(ip, &key);
+		sketch_add(&key);
+		if (i % 7 == 0)
+			sketch_add(&key);
+	}
+	for (i = 0; i < RATE_SKETCH_WIDTH * 2; i++) {
+		test_ip(ip, i);
+		tbg_rate_limit_key_from_str(ip, &key);
+		ASSERT_TRUE(sketch_estimate(&key) >= (i % 7 == 0 ? 2u : 1u));
+	}
+
+	tbg_rate_limit_key_from_str("198.51.100.1", &key);
+	for (i = 0; i < 1000; i++)
+		sketch_add(&key);
+	ASSERT_TRUE(sketch_estimate(&key) >= 1000);
+	ASSERT_TRUE(sketch_estimate(&key) < 1100);
+
+	/* Decay halves the sketch and the heap alike */
+	sketch_decay();
+	ASSERT_TRUE(sketch_estimate(&key) >= 500);
+	ASSERT_TRUE(sketch_estimate(&key) < 550);
+
+	tbg_rate_limit_shutdown();
+	ASSERT_EQ(0, sketch_estimate(&key));
+}
+
+TEST(sketch_caps_table)
+{
+	rate_limit_config_t config = test_config;
+	char ip[INET6_ADDRSTRLEN];
+	int i, n = RATE_TABLE_STRIPES * 64;
+
+	/* 8 entries per stripe, gated from 4 */
+	config.max_tracked_ips = RATE_TABLE_STRIPES * 8;
+	tbg_rate_limit_init(&config);
+
+	/* A spray of one-off sources is admitted without filling the table */
+	for (i = 0; i < n; i++) {
+		test_ip(ip, i);
+		ASSERT_TRUE(tbg_rate_limit_connect(ip));
+	}
+	ASSERT_TRUE(table_count(NULL) <= (uint32_t)config.max_tracked_ips / 2);
+	ASSERT_EQ(n, tbg_rate_limit_global_connections());
+	for (i = 0; i < n; i++) {
+		test_ip(ip, i);
+		tbg_rate_limit_disconnect(ip);
+	}
+
+	/* A source that keeps coming back is promoted to heavy hitter and
+	 * gets an entry with exact limits */
+	for (i = 0; i < 3; i++) {
+		ASSERT_TRUE(tbg_rate_limit_connect("198.51.100.7"));
+		tbg_rate_limit_disconnect("198.51.100.7");
+	}
+	ASSERT_TRUE(table_has("198.51.100.7"));
+	for (i = 0; i < 3; i++)
+		ASSERT_TRUE(tbg_rate_limit_connect("198.51.100.7"));
+	ASSERT_FALSE(tbg_rate_limit_connect("198.51.100.7"));
+	ASSERT_TRUE(table_count(NULL) <= (uint32_t)config.max_tracked_ips);
+
+	tbg_rate_limit_shutdown();
+}
+
+TEST(heavy_hitters)
+{
+	rate_limit_hitter_t top[RATE_HEAVY_HITTERS];
+	struct in6_addr key;
+	char ip[INET6_ADDRSTRLEN];
+	int i, j, n;
+
+	tbg_rate_limit_init(&test_config);
+
+	/* Source i connects i + 1 times, for more sources than the heap
+	 * holds */
+	for (i = 0; i < RATE_HEAVY_HITTERS * 2; i++) {
+		test_ip(ip, i);
+		for (j = 0; j <= i; j++) {
+			tbg_rate_limit_connect(ip);
+			tbg_rate_limit_disconnect(ip);
+		}
+	}
+
+	n = tbg_rate_limit_heavy_hitters(top, RATE_HEAVY_HITTERS);
+	ASSERT_EQ(RATE_HEAVY_HITTERS, n);
+	test_ip(ip, RATE_HEAVY_HITTERS * 2 - 1);
+	tbg_rate_limit_key_from_str(ip, &key);
+	ASSERT_TRUE(key_eq(&key, &top[0].addr));
+	for (i = 1; i < n; i++)
+		ASSERT_TRUE(top[i - 1].connects >= top[i].connects);
+	ASSERT_TRUE(top[n - 1].connects > RATE_HEAVY_HITTERS);
+
+	ASSERT_EQ(3, tbg_rate_limit_heavy_hitters(top, 3));
+	ASSERT_EQ(0, tbg_rate_limit_heavy_hitters(NULL, 3));
+
+	tbg_rate_limit_shutdown();
+	ASSERT_EQ(0, tbg_rate_limit_heavy_hitters(top, 3));
+}
+
+TEST(rejections_aggregated)
+{
+	reject_stripe_t *rs;
+	struct in6_addr key;
+	char ip[INET6_ADDRSTRLEN];
+	uint32_t hash, untracked_before;
+	int i;
+
+	tbg_rate_limit_init(&test_config);
+
+	/* 5/min: fifteen rate rejections from one IP, tracked as one source */
+	for (i = 0; i < 20; i++) {
+		tbg_rate_limit_connect("198.51.100.7");
+		tbg_rate_limit_disconnect("198.51.100.7");
+	}
+	tbg_rate_limit_key_from_str("198.51.100.7", &key);
+	hash = key_hash(&key);
+	rs = &reject_stripes[(hash >> STRIPE_SHIFT) & (REJECT_STRIPES - 1)];
+	ASSERT_EQ(1, rs->count);
+	ASSERT_EQ(15, atomic_load(&reject_interval[ADMIT_IP_RATE]));
+	ASSERT_EQ(15, atomic_load(&reject_totals[ADMIT_IP_RATE]));
+	ASSERT_FALSE(reject_note(&key, hash, ADMIT_IP_RATE));
+
+	/* A flush starts the interval over; totals carry on */
+	reject_flush();
+	ASSERT_EQ(0, rs->count);
+	ASSERT_EQ(0, atomic_load(&reject_interval[ADMIT_IP_RATE]));
+	ASSERT_EQ(16, atomic_load(&reject_totals[ADMIT_IP_RATE]));
+	ASSERT_TRUE(reject_note(&key, hash, ADMIT_BANNED));
+	ASSERT_FALSE(reject_note(&key, hash, ADMIT_BANNED));
+
+	/* Per-source tracking is bounded; the rest only count */
+	untracked_before = atomic_load(&reject_untracked);
+	for (i = 0; i < RATE_REJECT_LOG_SOURCES * 2; i++) {
+		test_ip(ip, i);
+		tbg_rate_limit_key_from_str(ip, &key);
+		reject_note(&key, key_hash(&key), ADMIT_SKETCH_RATE);
+	}
+	for (i = 0; i < REJECT_STRIPES; i++)
+		ASSERT_TRUE(reject_stripes[i].count <= REJECT_MAX_LOAD);
+	ASSERT_TRUE(atomic_load(&reject_untracked) > untracked_before);
+	ASSERT_EQ((uint32_t)RATE_REJECT_LOG_SOURCES * 2,
+	          atomic_load(&reject_interval[ADMIT_SKETCH_RATE]));
+
+	tbg_rate_limit_shutdown();
+	ASSERT_EQ(0, atomic_load(&reject_totals[ADMIT_IP_RATE]));
+	ASSERT_EQ(0, reject_stripes[0].count);
+}
+
+TEST(state_persists_across_restart)
+{
+	rate_limit_config_t config = test_config;
+	state_header_t hdr;
+	FILE *fp;
+	int i;
+
+	snprintf(config.state_file, sizeof(config.state_file),
+	         "/tmp/test_rate_limit_%d.state", (int)getpid());
+	unlink(config.state_file);
+
+	tbg_rate_limit_init(&config);
+	tbg_rate_limit_softban("198.51.100.1");
+	ASSERT_TRUE(tbg_rate_limit_softban_prefix("203.0.113.0/24"));
+	/* .2 uses its whole bucket; .3 one of five tokens, so is not hot */
+	for (i = 0; i < 5; i++) {
+		ASSERT_TRUE(tbg_rate_limit_connect("198.51.100.2"));
+		tbg_rate_limit_disconnect("198.51.100.2");
+	}
+	ASSERT_TRUE(tbg_rate_limit_connect("198.51.100.3"));
+	tbg_rate_limit_disconnect("198.51.100.3");
+	tbg_rate_limit_shutdown();
+
+	fp = fopen(config.state_file, "rb");
+	ASSERT_TRUE(fp != NULL);
+	ASSERT_EQ(1, fread(&hdr, sizeof(hdr), 1, fp));
+	fclose(fp);
+	ASSERT_EQ(3, hdr.count);
+
+	/* The bans and the drained bucket come back; nothing else does */
+	tbg_rate_limit_init(&config);
+	ASSERT_EQ(2, table_count(NULL));
+	ASSERT_TRUE(tbg_rate_limit_is_banned("198.51.100.1"));
+	ASSERT_TRUE(tbg_rate_limit_is_banned("203.0.113.77"));
+	ASSERT_FALSE(tbg_rate_limit_is_banned("198.51.100.2"));
+	ASSERT_FALSE(tbg_rate_limit_connect("198.51.100.2"));
+	ASSERT_TRUE(tbg_rate_limit_connect("198.51.100.3"));
+	tbg_rate_limit_disconnect("198.51.100.3");
+	tbg_rate_limit_shutdown();
+
+	/* A damaged file is ignored */
+	fp = fopen(config.state_file, "r+b");
+	ASSERT_TRUE(fp != NULL);
+	fputs("garbage", fp);
+	fclose(fp);
+	tbg_rate_limit_init(&config);
+	ASSERT_EQ(0, table_count(NULL));
+	ASSERT_FALSE(tbg_rate_limit_is_banned("198.51.100.1"));
+	tbg_rate_limit_shutdown();
+
+	unlink(config.state_file);
+}
+
+TEST(ban_propagation)
+{
+	rate_limit_ban_t bans[8];
+	struct in6_addr key, first;
+	ip_rate_state_t *entry;
+	char ip[INET6_ADDRSTRLEN];
+	time_t now;
+	int i, n;
+
+	tbg_rate_limit_init(&test_config);
+	now = tbg_clock_now();
+
+	/* Local bans are queued for the relay link, oldest first */
+	tbg_rate_limit_softban("198.51.100.1");
+	ASSERT_TRUE(tbg_rate_limit_softban_prefix("203.0.113.0/24"));
+	n = tbg_rate_limit_take_bans(bans, 8);
+	ASSERT_EQ(2, n);
+	tbg_rate_limit_key_from_str("198.51.100.1", &key);
+	ASSERT_TRUE(key_eq(&key, &bans[0].addr));
+	ASSERT_EQ(128, bans[0].plen);
+	ASSERT_TRUE(bans[0].until >= now + 300);
+	ASSERT_EQ(96 + 24, bans[1].plen);
+	ASSERT_EQ(0, tbg_rate_limit_take_bans(bans, 8));
+
+	/* Remote bans apply, capped at the local duration, and do not echo */
+	tbg_rate_limit_key_from_str("198.51.100.2", &key);
+	ASSERT_TRUE(tbg_rate_limit_apply_ban(&key, 128, 100000));
+	ASSERT_TRUE(tbg_rate_limit_is_banned("198.51.100.2"));
+	entry = find_ip_entry(&stripe_for(key_hash(&key))->table, &key,
+	                      key_hash(&key));
+	ASSERT_TRUE(entry && entry->softban_until <= tbg_clock_now() + 300);
+	tbg_rate_limit_key_from_str("192.0.2.0", &key);
+	ASSERT_TRUE(tbg_rate_limit_apply_ban(&key, 96 + 24, 60));
+	ASSERT_TRUE(tbg_rate_limit_is_banned("192.0.2.200"));
+	ASSERT_EQ(0, tbg_rate_limit_take_bans(bans, 8));
+
+	/* A shorter remote ban leaves a longer one in place */
+	tbg_rate_limit_key_from_str("198.51.100.1", &key);
+	ASSERT_TRUE(tbg_rate_limit_apply_ban(&key, 128, 5));
+	entry = find_ip_entry(&stripe_for(key_hash(&key))->table, &key,
+	                      key_hash(&key));
+	ASSERT_TRUE(entry && entry->softban_until >= now + 300);
+
+	ASSERT_FALSE(tbg_rate_limit_apply_ban(&key, 0, 60));
+	ASSERT_FALSE(tbg_rate_limit_apply_ban(&key, 128, 0));
+	ASSERT_FALSE(tbg_rate_limit_apply_ban(NULL, 128, 60));
+
+	/* Only one address or an aggregation-level prefix is taken: nothing
+	 * wider, and no IPv6 prefix over the v4-mapped range */
+	ASSERT_FALSE(tbg_rate_limit_apply_ban(&key, 1, 60));
+	ASSERT_FALSE(tbg_rate_limit_apply_ban(&key, 96 + 16, 60));
+	memset(&key, 0, sizeof(key));
+	ASSERT_FALSE(tbg_rate_limit_apply_ban(&key, RATE_V6_HOST_PREFIX, 60));
+	ASSERT_FALSE(tbg_rate_limit_apply_ban(&key, RATE_SUBNET_V6_PREFIX, 60));
+	ASSERT_FALSE(tbg_rate_limit_is_banned("192.0.3.1"));
+	tbg_rate_limit_key_from_str("2001:db8:1::", &key);
+	ASSERT_FALSE(tbg_rate_limit_apply_ban(&key, 96 + RATE_SUBNET_V4_PREFIX, 60));
+	ASSERT_TRUE(tbg_rate_limit_apply_ban(&key, RATE_SUBNET_V6_PREFIX, 60));
+	ASSERT_TRUE(tbg_rate_limit_is_banned("2001:db8:1::5"));
+
+	/* A full outbox drops the oldest */
+	for (i = 0; i < RATE_BAN_OUTBOX + 5; i++) {
+		test_ip(ip, i);
+		tbg_rate_limit_key_from_str(ip, &key);
+		if (i == 5)
+			first = key;
+		ban_outbox_push(&key, 128, now + 300);
+	}
+	ASSERT_EQ(5, atomic_load(&ban_outbox_dropped));
+	ASSERT_EQ(1, tbg_rate_limit_take_bans(bans, 1));
+	ASSERT_TRUE(key_eq(&first, &bans[0].addr));
+
+	tbg_rate_limit_shutdown();
+	ASSERT_EQ(0, tbg_rate_limit_take_bans(bans, 8));
+}
+
+static int loader_calls;
+
+static bool fake_loader(rate_limit_config_t *config, void *ctx)
+{
+	loader_calls++;
+	*config = test_config;
+	config->max_connections_per_ip = *(int *)ctx;
+	return *(int *)ctx > 0;
+}
+
+TEST(config_set_and_reload)
+{
+	rate_limit_config_t config;
+	char path[512];
+	int i, max_per_ip = 7;
+
+	tbg_rate_limit_config_defaults(&config);
+	ASSERT_EQ(RATE_CONNECT_PER_MIN, config.connections_per_ip_per_minute);
+	ASSERT_TRUE(tbg_rate_limit_config_set(&config, "max_tracked_ips", 5000));
+	ASSERT_EQ(5000, config.max_tracked_ips);
+	ASSERT_TRUE(tbg_rate_limit_config_set(&config, "load_target_p99_us", 0));
+	ASSERT_EQ(0, config.load_target_p99_us);
+	ASSERT_FALSE(tbg_rate_limit_config_set(&config, "max_tracked_ips", -1));
+	ASSERT_FALSE(tbg_rate_limit_config_set(&config, "max_tracked_ips",
+	                                       (long long)INT_MAX + 1));
+	ASSERT_FALSE(tbg_rate_limit_config_set(&config, "whitelist", 1));
+	ASSERT_TRUE(tbg_rate_limit_config_set_str(&config, "state_file",
+	                                          "/tmp/rl.state"));
+	ASSERT_STR_EQ("/tmp/rl.state", config.state_file);
+	memset(path, 'a', sizeof(path) - 1);
+	path[sizeof(path) - 1] = '\0';
+	ASSERT_FALSE(tbg_rate_limit_config_set_str(&config, "state_file", path));
+	ASSERT_FALSE(tbg_rate_limit_config_set_str(&config, "max_tracked_ips",
+	                                           "1"));
+
+	/* 5/min: three connects leave two tokens */
+	tbg_rate_limit_init(&test_config);
+	for (i = 0; i < 3; i++) {
+		ASSERT_TRUE(tbg_rate_limit_connect("198.51.100.1"));
+		tbg_rate_limit_disconnect("198.51.100.1");
+	}
+
+	/* At 1/min the tracked IP's bucket shrinks to one token */
+	config = test_config;
+	config.connections_per_ip_per_minute = 1;
+	ASSERT_TRUE(tbg_rate_limit_reload(&config));
+	ASSERT_EQ(1, config_get()->connections_per_ip_per_minute);
+	ASSERT_TRUE(tbg_rate_limit_connect("198.51.100.1"));
+	tbg_rate_limit_disconnect("198.51.100.1");
+	ASSERT_FALSE(tbg_rate_limit_connect("198.51.100.1"));
+	ASSERT_FALSE(tbg_rate_limit_reload(NULL));
+
+	/* A requested reload runs the loader on the cleanup thread */
+	loader_calls = 0;
+	tbg_rate_limit_set_loader(fake_loader, &max_per_ip);
+	tbg_rate_limit_request_reload();
+	for (i = 0; i < 300 && config_get()->max_connections_per_ip != 7; i++)
+		usleep(10000);
+	ASSERT_EQ(7, config_get()->max_connections_per_ip);
+	ASSERT_EQ(1, loader_calls);
+
+	/* A failed load keeps the limits in force */
+	max_per_ip = 0;
+	tbg_rate_limit_request_reload();
+	for (i = 0; i < 300 && loader_calls < 2; i++)
+		usleep(10000);
+	ASSERT_EQ(2, loader_calls);
+	ASSERT_EQ(7, config_get()->max_connections_per_ip);
+
+	tbg_rate_limit_set_loader(NULL, NULL);
+	tbg_rate_limit_shutdown();
+	ASSERT_EQ(0, config_get()->max_connections_per_ip);
+}
+
+TEST(metrics_and_offenders)
+{
+	conn_rate_state_t conn;
+	char buf[8192], small[64];
+	int i, n;
+
+	tbg_rate_limit_init(&test_config);
+
+	/* 5/min: ten connects from one IP, five rejected */
+	for (i = 0; i < 10; i++) {
+		if (tbg_rate_limit_connect("198.51.100.1"))
+			tbg_rate_limit_disconnect("198.51.100.1");
+	}
+	tbg_rate_limit_connect("198.51.100.2");
+	tbg_rate_limit_softban("198.51.100.3");
+	ASSERT_TRUE(tbg_rate_limit_softban_prefix("203.0.113.0/24"));
+
+	tbg_rate_limit_conn_init(&conn);
+	for (i = 0; i < 4; i++)
+		tbg_rate_limit_check_conn(&conn, RATE_SUBSCRIBE, 0);
+
+	/* Soft-ban gauges are counted at the end of a cleanup pass */
+	for (i = 0; i < RATE_TABLE_STRIPES; i++)
+		sweep_stripe(&ip_stripes[i], &ip_stripes[i].sweep_pos, 1, 0, false);
+	subnet_sweep(0, subnet_tracked_count());
+
+	n = tbg_rate_limit_format_metrics(buf, sizeof(buf));
+	ASSERT_EQ((int)strlen(buf), n);
+	ASSERT_TRUE(strstr(buf, "tbg_rate_limit_connections 1\n") != NULL);
+	ASSERT_TRUE(strstr(buf, "tbg_rate_limit_tracked_ips 3\n") != NULL);
+	ASSERT_TRUE(strstr(buf, "tbg_rate_limit_softbans{scope=\"ip\"} 1\n") != NULL);
+	ASSERT_TRUE(strstr(buf, "tbg_rate_limit_softbans{scope=\"prefix\"} 1\n") != NULL);
+	ASSERT_TRUE(strstr(buf, "tbg_rate_limit_rejected_total{type=\"connect\"} 5\n") != NULL);
+	ASSERT_TRUE(strstr(buf, "tbg_rate_limit_rejected_total{type=\"subscribe\"} 1\n") != NULL);
+	ASSERT_TRUE(strstr(buf, "tbg_rate_limit_rejected_total{type=\"submit\"} 0\n") != NULL);
+	ASSERT_TRUE(strstr(buf, "tbg_rate_limit_connect_rejected_total{reason=\"ip_rate\"} 5\n") != NULL);
+
+	/* Heaviest first, with rejections, open connections and ban state */
+	n = tbg_rate_limit_format_offenders(buf, sizeof(buf), 2);
+	ASSERT_EQ((int)strlen(buf), n);
+	ASSERT_TRUE(strstr(buf, "\n198.51.100.1 10 5 0 no\n") != NULL);
+	ASSERT_TRUE(strstr(buf, "\n198.51.100.2 1 0 1 no\n") != NULL);
+	tbg_rate_limit_connect("203.0.113.9");
+	tbg_rate_limit_format_offenders(buf, sizeof(buf), 0);
+	ASSERT_TRUE(strstr(buf, "\n203.0.113.9 1 1 - yes\n") != NULL);
+
+	n = tbg_rate_limit_format_metrics(small, sizeof(small));
+	ASSERT_EQ(sizeof(small) - 1, n);
+	ASSERT_EQ(0, tbg_rate_limit_format_offenders(NULL, 100, 0));
+
+	tbg_rate_limit_shutdown();
+	tbg_rate_limit_format_metrics(buf, sizeof(buf));
+	ASSERT_TRUE(strstr(buf, "tbg_rate_limit_softbans{scope=\"ip\"} 0\n") != NULL);
+	ASSERT_TRUE(strstr(buf, "tbg_rate_limit_rejected_total{type=\"subscribe\"} 0\n") != NULL);
+}
+
+TEST(load_histogram_p99)
+{
+	uint64_t p99;
+	uint32_t n;
+	int i;
+
+	/* Bucket bounds tile the range without gaps */
+	for (i = 1; i < LOAD_HIST_BUCKETS - 8; i++)
+		ASSERT_EQ(i, load_bucket(load_bucket_max(i - 1) + 1));
+	ASSERT_EQ(0, load_take_p99(&n));
+	ASSERT_EQ(0, n);
+
+	for (i = 0; i < 990; i++)
+		tbg_rate_limit_note_latency(100);
+	for (i = 0; i < 10; i++)
+		tbg_rate_limit_note_latency(50000);
+	p99 = load_take_p99(&n);
+	ASSERT_TRUE(p99 >= 100 && p99 < 125);
+	ASSERT_EQ(1000, n);
+
+	for (i = 0; i < 980; i++)
+		tbg_rate_limit_note_latency(100);
+	for (i = 0; i < 20; i++)
+		tbg_rate_limit_note_latency(50000);
+	p99 = load_take_p99(&n);
+	ASSERT_TRUE(p99 >= 50000 && p99 < 62500);
+
+	/* Taking the p99 drains the histogram */
+	ASSERT_EQ(0, load_take_p99(&n));
+	ASSERT_EQ(0, n);
+}
+
+TEST(load_level_tightens_and_relaxes)
+{
+	rate_limit_config_t config = test_config;
+	conn_rate_state_t state, early;
+	int i;
+
+	config.load_target_p99_us = 1000;
+	config.load_max_queue_depth = 10;
+	tbg_rate_limit_init(&config);
+	tbg_rate_limit_conn_init(&early);
+
+	/* Too few samples to judge latency */
+	for (i = 0; i < RATE_LOAD_MIN_SAMPLES - 1; i++)
+		tbg_rate_limit_note_latency(5000);
+	load_evaluate();
+	ASSERT_EQ(0, tbg_rate_limit_load_level());
+
+	/* Slow shares: authorize costs two tokens out of five */
+	for (i = 0; i < RATE_LOAD_MIN_SAMPLES; i++)
+		tbg_rate_limit_note_latency(5000);
+	load_evaluate();
+	ASSERT_EQ(1, tbg_rate_limit_load_level());
+	ASSERT_TRUE(tbg_rate_limit_check_conn(&early, RATE_AUTHORIZE, RATE_COST_DEFAULT));
+	ASSERT_TRUE(tbg_rate_limit_check_conn(&early, RATE_AUTHORIZE, RATE_COST_DEFAULT));
+	ASSERT_FALSE(tbg_rate_limit_check_conn(&early, RATE_AUTHORIZE, RATE_COST_DEFAULT));
+
+	/* A new connection starts with half its buckets: two of five
+	 * authorize tokens, and one of three subscribe tokens, short of the
+	 * two a subscribe costs */
+	tbg_rate_limit_conn_init(&state);
+	ASSERT_FALSE(tbg_rate_limit_check_conn(&state, RATE_SUBSCRIBE, RATE_COST_DEFAULT));
+	ASSERT_TRUE(tbg_rate_limit_check_conn(&state, RATE_AUTHORIZE, RATE_COST_DEFAULT));
+	ASSERT_FALSE(tbg_rate_limit_check_conn(&state, RATE_AUTHORIZE, RATE_COST_DEFAULT));
+	ASSERT_TRUE(tbg_rate_limit_check_conn(&state, RATE_SUBMIT, RATE_COST_DEFAULT));
+
+	/* A queue spike counts even once it has drained */
+	for (i = 0; i < 20; i++)
+		tbg_rate_limit_note_queue(1);
+	for (i = 0; i < 20; i++)
+		tbg_rate_limit_note_queue(-1);
+	load_evaluate();
+	ASSERT_EQ(2, tbg_rate_limit_load_level());
+
+	/* Connects cost four tokens out of five */
+	ASSERT_TRUE(tbg_rate_limit_connect("203.0.113.9"));
+	ASSERT_FALSE(tbg_rate_limit_connect("203.0.113.9"));
+
+	/* Capped at the top level; a cost over the bucket takes it all */
+	for (i = 0; i < 5; i++) {
+		tbg_rate_limit_note_queue(11);
+		tbg_rate_limit_note_queue(-11);
+		load_evaluate();
+	}
+	ASSERT_EQ(RATE_LOAD_MAX_LEVEL, tbg_rate_limit_load_level());
+	bucket_init(&early.authorize_bucket, 5, 5);	/* Refilled */
+	ASSERT_TRUE(tbg_rate_limit_check_conn(&early, RATE_AUTHORIZE, RATE_COST_DEFAULT));
+	ASSERT_FALSE(tbg_rate_limit_check_conn(&early, RATE_AUTHORIZE, RATE_COST_DEFAULT));
+
+	/* ...and a new connection's first authorize waits for a refill */
+	tbg_rate_limit_conn_init(&state);
+	ASSERT_FALSE(tbg_rate_limit_check_conn(&state, RATE_AUTHORIZE, RATE_COST_DEFAULT));
+
+	/* Steps down one level per run of healthy checks; a blip between
+	 * the targets holds the level and restarts the run */
+	for (i = 0; i < RATE_LOAD_RELAX_WINDOWS - 1; i++)
+		load_evaluate();
+	tbg_rate_limit_note_queue(8);
+	tbg_rate_limit_note_queue(-8);
+	load_evaluate();
+	ASSERT_EQ(RATE_LOAD_MAX_LEVEL, tbg_rate_limit_load_level());
+	for (i = 0; i < RATE_LOAD_RELAX_WINDOWS; i++)
+		load_evaluate();
+	ASSERT_EQ(RATE_LOAD_MAX_LEVEL - 1, tbg_rate_limit_load_level());
+	for (i = 0; i < RATE_LOAD_RELAX_WINDOWS * (RATE_LOAD_MAX_LEVEL - 1); i++)
+		load_evaluate();
+	ASSERT_EQ(0, tbg_rate_limit_load_level());
+
+	tbg_rate_limit_note_latency(5000);
+	tbg_rate_limit_note_queue(1);
+	tbg_rate_limit_shutdown();
+	ASSERT_EQ(0, atomic_load(&load_queue));
+	ASSERT_EQ(0, atomic_load(&load_hist[load_bucket(5000)]));
+}
+
+int main(void)
+{
+	TEST_SUITE("Rate Limiter");
+
+	RUN_TEST(key_from_str_and_sockaddr);
+	RUN_TEST(connect_limits_per_ip);
+	RUN_TEST(softban);
+	RUN_TEST(table_grows_and_sweeps);
+	RUN_TEST(concurrent_connects);
+	RUN_TEST(memory_pressure_tightens_admission);
+	RUN_TEST(conn_buckets);
+	RUN_TEST(weighted_costs);
+	RUN_TEST(bucket_refills_sub_second);
+	RUN_TEST(bucket_concurrent_consume_is_exact);
+	RUN_TEST(subnet_limits_rotating_sources);
+	RUN_TEST(subnet_softban_escalates);
+	RUN_TEST(softban_prefix_longest_match);
+	RUN_TEST(subnet_trie_structure_and_sweep);
+	RUN_TEST(incremental_sweep);
+	RUN_TEST(sketch_never_underestimates);
+	RUN_TEST(sketch_caps_table);
+	RUN_TEST(heavy_hitters);
+	RUN_TEST(load_histogram_p99);
+	RUN_TEST(load_level_tightens_and_relaxes);
+	RUN_TEST(rejections_aggregated);
+	RUN_TEST(state_persists_across_restart);
+	RUN_TEST(ban_propagation);
+	RUN_TEST(config_set_and_reload);
+	RUN_TEST(metrics_and_offenders);
+
+	PRINT_RESULTS();
+}
@@ -0,0 +1,175 @@
+/*
+ * test_relay_softban.c — Unit tests for the relay link's soft-ban codec
+ * GPLv3 — Copyright (C) 2026 TheBitcoinGame Contributors
+ */
+
+#define _GNU_SOURCE
+#include "test_harness.h"
+
+/* The codec drives the real rate limiter, which brings the clock and the
+ * memory governor's level names along (see test_rate_limit.c) */
+#include "../src/rate_limit.c"
+#include "../src/tbg_clock.c"
+#include "../src/tbg_memgov.c"
+#include "../src/tbg_relay_softban.c"
+
+static void ban_for(rate_limit_ban_t *b, const char *ip, int plen, time_t until)
+{
+	memset(b, 0, sizeof(*b));
+	tbg_rate_limit_key_from_str(ip, &b->addr);
+	b->plen = plen;
+	b->until = until;
+}
+
+/* ─── Tests ─────────────────────────────────────────────────────── */
+
+TEST(encode_skips_expired)
+{
+	tbg_relay_softban_t wire[3];
+	rate_limit_ban_t bans[3];
+	time_t now = 1000000;
+
+	ban_for(&bans[0], "198.51.100.1", 128, now + 120);
+	ban_for(&bans[1], "198.51.100.2", 128, now);
+	ban_for(&bans[2], "203.0.113.0", 96 + 24, now + 5);
+
+	ASSERT_EQ(2 * TBG_RELAY_SOFTBAN_LEN,
+		  tbg_relay_encode_softbans(bans, 3, now, wire));
+	ASSERT_EQ(0, memcmp(wire[0].addr, &bans[0].addr, 16));
+	ASSERT_EQ(128, wire[0].plen);
+	ASSERT_EQ(120, ntohl(wire[0].seconds));
+	ASSERT_EQ(96 + 24, wire[1].plen);
+	ASSERT_EQ(5, ntohl(wire[1].seconds));
+	ASSERT_EQ(0, wire[1].reserved[0] | wire[1].reserved[1] | wire[1].reserved[2]);
+}
+
+TEST(round_trip)
+{
+	static tbg_relay_softban_t wire[TBG_RELAY_SOFTBAN_BATCH];
+	uint32_t len, rest;
+
+	tbg_rate_limit_init(NULL);
+
+	/* Bans made here come out of the outbox encoded */
+	tbg_rate_limit_softban("198.51.100.1");
+	ASSERT_TRUE(tbg_rate_limit_softban_prefix("203.0.113.0/24"));
+	ASSERT_EQ(2, tbg_relay_take_softbans(wire, &len));
+	ASSERT_EQ(2 * TBG_RELAY_SOFTBAN_LEN, len);
+	ASSERT_EQ(0, tbg_relay_take_softbans(wire, &rest));
+	ASSERT_EQ(0, rest);
+
+	/* ...and apply in another region */
+	tbg_rate_limit_shutdown();
+	tbg_rate_limit_init(NULL);
+	ASSERT_FALSE(tbg_rate_limit_is_banned("198.51.100.1"));
+	ASSERT_EQ(2, tbg_relay_apply_softbans((const char *)wire, len, "test"));
+	ASSERT_TRUE(tbg_rate_limit_is_banned("198.51.100.1"));
+	ASSERT_TRUE(tbg_rate_limit_is_banned("203.0.113.77"));
+	ASSERT_FALSE(tbg_rate_limit_is_banned("198.51.100.2"));
+
+	/* Applied bans are not sent back */
+	ASSERT_EQ(0, tbg_relay_take_softbans(wire, &rest));
+	tbg_rate_limit_shutdown();
+}
+
+TEST(batch_limit)
+{
+	static tbg_relay_softban_t wire[TBG_RELAY_SOFTBAN_BATCH];
+	char ip[32];
+	uint32_t len;
+	int i;
+
+	tbg_rate_limit_init(NULL);
+	/* One address per /24, so no subnet ban joins the queue */
+	for (i = 0; i < TBG_RELAY_SOFTBAN_BATCH + 10; i++) {
+		snprintf(ip, sizeof(ip), "10.%d.%d.1", i / 256, i % 256);
+		tbg_rate_limit_softban(ip);
+	}
+
+	ASSERT_EQ(TBG_RELAY_SOFTBAN_BATCH, tbg_relay_take_softbans(wire, &len));
+	ASSERT_EQ(TBG_RELAY_SOFTBAN_BATCH * TBG_RELAY_SOFTBAN_LEN, len);
+	ASSERT_EQ(10, tbg_relay_take_softbans(wire, &len));
+	ASSERT_EQ(0, tbg_relay_take_softbans(wire, &len));
+	tbg_rate_limit_shutdown();
+}
+
+TEST(unsent_batch_returned)
+{
+	static tbg_relay_softban_t wire[TBG_RELAY_SOFTBAN_BATCH];
+	struct in6_addr a, b, c;
+	char ip[32];
+	uint32_t len, rest;
+	int i;
+
+	tbg_rate_limit_init(NULL);
+	tbg_rate_limit_key_from_str("198.51.100.1", &a);
+	tbg_rate_limit_key_from_str("198.51.101.1", &b);
+	tbg_rate_limit_key_from_str("198.51.102.1", &c);
+
+	/* A batch that failed to send goes out next, ahead of newer bans */
+	tbg_rate_limit_softban("198.51.100.1");
+	tbg_rate_limit_softban("198.51.101.1");
+	ASSERT_EQ(2, tbg_relay_take_softbans(wire, &len));
+	tbg_rate_limit_softban("198.51.102.1");
+	tbg_relay_return_softbans(wire, len);
+	memset(wire, 0, sizeof(wire));
+	ASSERT_EQ(3, tbg_relay_take_softbans(wire, &len));
+	ASSERT_EQ(3 * TBG_RELAY_SOFTBAN_LEN, len);
+	ASSERT_EQ(0, memcmp(wire[0].addr, &a, 16));
+	ASSERT_EQ(0, memcmp(wire[1].addr, &b, 16));
+	ASSERT_EQ(0, memcmp(wire[2].addr, &c, 16));
+	ASSERT_TRUE(ntohl(wire[0].seconds) > 0);
+
+	/* With the outbox full, the returned batch is what is dropped */
+	for (i = 0; i < RATE_BAN_OUTBOX; i++) {
+		snprintf(ip, sizeof(ip), "10.%d.%d.1", i / 256, i % 256);
+		tbg_rate_limit_softban(ip);
+	}
+	ASSERT_EQ(0, atomic_load(&ban_outbox_dropped));
+	tbg_relay_return_softbans(wire, 2 * TBG_RELAY_SOFTBAN_LEN);
+	ASSERT_EQ(2, atomic_load(&ban_outbox_dropped));
+	for (i = 0; i < RATE_BAN_OUTBOX / TBG_RELAY_SOFTBAN_BATCH; i++)
+		ASSERT_EQ(TBG_RELAY_SOFTBAN_BATCH, tbg_relay_take_softbans(wire, &rest));
+	ASSERT_EQ(0, tbg_relay_take_softbans(wire, &rest));
+	tbg_rate_limit_shutdown();
+}
+
+TEST(malformed_rejected)
+{
+	static char buf[(TBG_RELAY_SOFTBAN_BATCH + 1) * TBG_RELAY_SOFTBAN_LEN];
+	tbg_relay_softban_t *ban = (tbg_relay_softban_t *)buf;
+
+	tbg_rate_limit_init(NULL);
+
+	tbg_rate_limit_key_from_str("198.51.100.1", (struct in6_addr *)ban->addr);
+	ban->plen = 128;
+	ban->seconds = htonl(60);
+
+	ASSERT_EQ(-1, tbg_relay_apply_softbans(NULL, TBG_RELAY_SOFTBAN_LEN, "test"));
+	ASSERT_EQ(-1, tbg_relay_apply_softbans(buf, 0, "test"));
+	ASSERT_EQ(-1, tbg_relay_apply_softbans(buf, TBG_RELAY_SOFTBAN_LEN - 1, "test"));
+	ASSERT_EQ(-1, tbg_relay_apply_softbans(buf, TBG_RELAY_SOFTBAN_LEN + 1, "test"));
+	ASSERT_EQ(-1, tbg_relay_apply_softbans(buf, sizeof(buf), "test"));
+	ASSERT_FALSE(tbg_rate_limit_is_banned("198.51.100.1"));
+
+	/* A well-formed batch still skips records the limiter refuses */
+	ban[1] = ban[0];
+	ban[1].plen = 1;
+	ASSERT_EQ(1, tbg_relay_apply_softbans(buf, 2 * TBG_RELAY_SOFTBAN_LEN, "test"));
+	ASSERT_TRUE(tbg_rate_limit_is_banned("198.51.100.1"));
+	ASSERT_FALSE(tbg_rate_limit_is_banned("198.51.101.1"));
+	tbg_rate_limit_shutdown();
+}
+
+int main(void)
+{
+	TEST_SUITE("Relay Soft-Ban Codec");
+
+	RUN_TEST(encode_skips_expired);
+	RUN_TEST(round_trip);
+	RUN_TEST(batch_limit);
+	RUN_TEST(unsent_batch_returned);
+	RUN_TEST(malformed_rejected);
+
+	PRINT_RESULTS();
+}